@@ -16,6 +16,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <utime.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <libdisk/util.h>
 
 /* read_exact, write_exact */
@@ -155,12 +158,339 @@ static const char kick20_bootable[] = {
     0x62, 0x72, 0x61, 0x72, 0x79, 0x00
 };
 
+/*
+ * Collection scan: identify the bootblocks of many images in one run.
+ * 
+ * Each signature is a byte string, either anchored at a given bootblock
+ * offset or allowed to appear anywhere in the code area. All signatures are
+ * hashed on their first SIG_WINDOW bytes, so one rolling-hash pass over a
+ * bootblock finds every candidate match, which is then confirmed in full.
+ */
+
+#define SIG_WINDOW 8
+#define SIG_ANYWHERE -1
+#define SIG_HASH_MUL 0x01000193u
+#define MAX_MATCHES 8
+
+struct sig {
+    char *name;
+    int offset;
+    unsigned int len;
+    uint8_t *bytes;
+    struct sig *hash_next;
+};
+
+static struct sig *sigs;
+static unsigned int nr_sigs, max_sigs;
+static struct sig *sig_hash[256];
+static uint32_t sig_hash_out; /* SIG_HASH_MUL^(SIG_WINDOW-1) */
+
+static uint32_t window_hash(const uint8_t *p)
+{
+    uint32_t h = 0;
+    unsigned int i;
+    for (i = 0; i < SIG_WINDOW; i++)
+        h = h * SIG_HASH_MUL + p[i];
+    return h;
+}
+
+static void add_sig(const char *name, int offset,
+                    const void *bytes, unsigned int len)
+{
+    struct sig *sig;
+
+    if (len < SIG_WINDOW)
+        errx(1, "Signature '%s' too short (%u bytes, minimum %u)",
+             name, len, SIG_WINDOW);
+    if ((offset != SIG_ANYWHERE) && ((offset < 12) || (offset+len > 1024)))
+        errx(1, "Signature '%s' lies outside the bootblock code area", name);
+
+    if (nr_sigs == max_sigs) {
+        max_sigs = max_sigs ? max_sigs * 2 : 16;
+        if ((sigs = realloc(sigs, max_sigs * sizeof(*sigs))) == NULL)
+            err(1, NULL);
+    }
+    sig = &sigs[nr_sigs++];
+    sig->name = strdup(name);
+    sig->offset = offset;
+    sig->len = len;
+    if ((sig->bytes = malloc(len)) == NULL)
+        err(1, NULL);
+    memcpy(sig->bytes, bytes, len);
+}
+
+/* Signature file: one '<offset|*> <hex bytes> <name>' per line. */
+static void load_sigs(const char *filename)
+{
+    char line[1024], *off, *hex, *name;
+    uint8_t bytes[1024];
+    unsigned int len, x;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        err(1, "%s", filename);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        off = strtok(line, " \t\r\n");
+        if ((off == NULL) || (*off == '#'))
+            continue;
+        hex = strtok(NULL, " \t\r\n");
+        name = strtok(NULL, "\r\n");
+        if ((hex == NULL) || (name == NULL))
+            errx(1, "%s: malformed signature '%s'", filename, off);
+        while (isspace((unsigned char)*name))
+            name++;
+        for (len = 0; (len < sizeof(bytes)) && isxdigit((unsigned char)hex[0])
+                 && isxdigit((unsigned char)hex[1]); hex += 2) {
+            sscanf(hex, "%2x", &x);
+            bytes[len++] = x;
+        }
+        if (*hex != '\0')
+            errx(1, "%s: bad hex string for '%s'", filename, name);
+        add_sig(name, !strcmp(off, "*") ? SIG_ANYWHERE : strtol(off, NULL, 0),
+                bytes, len);
+    }
+    fclose(fp);
+}
+
+static void init_sigs(void)
+{
+    struct sig *sig;
+    unsigned int i;
+
+    sig_hash_out = 1;
+    for (i = 1; i < SIG_WINDOW; i++)
+        sig_hash_out *= SIG_HASH_MUL;
+
+    /* sigs[] is complete, so chain pointers into it are now stable. Chain
+     * in reverse so that each bucket lists signatures in table order. */
+    for (i = nr_sigs; i-- != 0; ) {
+        sig = &sigs[i];
+        sig->hash_next = sig_hash[(uint8_t)window_hash(sig->bytes)];
+        sig_hash[(uint8_t)window_hash(sig->bytes)] = sig;
+    }
+}
+
+/* Returns the number of matching signatures, up to MAX_MATCHES. */
+static unsigned int match_sigs(const uint8_t *bb, struct sig **match)
+{
+    struct sig *sig;
+    unsigned int pos, i, nr = 0;
+    uint32_t h = window_hash(&bb[12]);
+
+    for (pos = 12; pos + SIG_WINDOW <= 1024; pos++) {
+        if (pos != 12)
+            h = (h - bb[pos-1] * sig_hash_out) * SIG_HASH_MUL
+                + bb[pos+SIG_WINDOW-1];
+        for (sig = sig_hash[(uint8_t)h]; sig != NULL; sig = sig->hash_next) {
+            if (((sig->offset != SIG_ANYWHERE) && (sig->offset != pos)) ||
+                (pos + sig->len > 1024) ||
+                memcmp(&bb[pos], sig->bytes, sig->len))
+                continue;
+            /* Report each signature once, at its first occurrence. */
+            for (i = 0; (i < nr) && (match[i] != sig); i++)
+                continue;
+            if ((i == nr) && (nr < MAX_MATCHES))
+                match[nr++] = sig;
+        }
+    }
+
+    return nr;
+}
+
+struct scan_job {
+    char *filename;
+    enum { scan_unreadable, scan_ndos, scan_dos } type;
+    uint8_t flags;
+    bool_t bootable;
+    uint32_t fingerprint; /* crc32 of the code area */
+    unsigned int nr_matches;
+    struct sig *match[MAX_MATCHES];
+    bool_t lamer;
+};
+
+struct scan {
+    struct scan_job *job;
+    unsigned int nr_jobs, max_jobs, next_job;
+    pthread_mutex_t lock;
+};
+
+static void add_scan_job(struct scan *scan, const char *filename)
+{
+    if (scan->nr_jobs == scan->max_jobs) {
+        scan->max_jobs = scan->max_jobs ? scan->max_jobs * 2 : 64;
+        scan->job = realloc(scan->job, scan->max_jobs * sizeof(*scan->job));
+        if (scan->job == NULL)
+            err(1, NULL);
+    }
+    memset(&scan->job[scan->nr_jobs], 0, sizeof(scan->job[0]));
+    scan->job[scan->nr_jobs++].filename = strdup(filename);
+}
+
+static void add_scan_dir(struct scan *scan, const char *dirname)
+{
+    struct dirent *ent;
+    struct stat st;
+    char *path;
+    DIR *dir;
+
+    if ((dir = opendir(dirname)) == NULL)
+        err(1, "%s", dirname);
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        if ((path = malloc(strlen(dirname) + strlen(ent->d_name) + 2)) == NULL)
+            err(1, NULL);
+        sprintf(path, "%s/%s", dirname, ent->d_name);
+        if (stat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                add_scan_dir(scan, path);
+            else if (S_ISREG(st.st_mode) && (st.st_size >= 1024))
+                add_scan_job(scan, path);
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+static void add_scan_list(struct scan *scan, const char *filename)
+{
+    char line[1024], *p;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        err(1, "%s", filename);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strtok(line, "\r\n")) == NULL || (*p == '#'))
+            continue;
+        add_scan_job(scan, p);
+    }
+    fclose(fp);
+}
+
+static void scan_one(struct scan_job *job)
+{
+    uint8_t bb[1024];
+    int fd;
+
+    if ((fd = file_open(job->filename, O_RDONLY)) == -1)
+        return;
+    read_exact(fd, bb, sizeof(bb));
+    close(fd);
+
+    job->type = strncmp((char *)bb, "DOS", 3) ? scan_ndos : scan_dos;
+    job->flags = bb[3];
+    job->fingerprint = crc32(&bb[12], 1024-12);
+    if (!(job->bootable = (checksum(bb) == 0)))
+        return;
+    job->nr_matches = match_sigs(bb, job->match);
+    job->lamer = !test_lamer((char *)bb);
+}
+
+static void *scan_worker(void *_scan)
+{
+    struct scan *scan = _scan;
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&scan->lock);
+        i = scan->next_job++;
+        pthread_mutex_unlock(&scan->lock);
+        if (i >= scan->nr_jobs)
+            break;
+        scan_one(&scan->job[i]);
+    }
+
+    return NULL;
+}
+
+static void run_scan(const char *source, const char *sigs_filename,
+                     unsigned int nr_threads)
+{
+    struct scan scan = { 0 };
+    struct scan_job *job;
+    pthread_t *threads;
+    struct stat st;
+    unsigned int i, j;
+
+    add_sig("Kickstart 1.3 bootblock", 12,
+            kick13_bootable, sizeof(kick13_bootable));
+    add_sig("Kickstart 2.0 bootblock", 12,
+            kick20_bootable, sizeof(kick20_bootable));
+    if (sigs_filename != NULL)
+        load_sigs(sigs_filename);
+    init_sigs();
+
+    if (stat(source, &st) != 0)
+        err(1, "%s", source);
+    if (S_ISDIR(st.st_mode))
+        add_scan_dir(&scan, source);
+    else
+        add_scan_list(&scan, source);
+
+    pthread_mutex_init(&scan.lock, NULL);
+    nr_threads = max_t(unsigned int, 1, min_t(unsigned int, nr_threads,
+                                              scan.nr_jobs));
+    if ((threads = malloc(nr_threads * sizeof(*threads))) == NULL)
+        err(1, NULL);
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, scan_worker, &scan) != 0)
+            errx(1, "Failed to create worker thread");
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < scan.nr_jobs; i++) {
+        job = &scan.job[i];
+        printf("%s: ", job->filename);
+        if (job->type == scan_unreadable) {
+            printf("** Unreadable\n");
+            continue;
+        }
+        if (job->type == scan_ndos)
+            printf("NDOS ");
+        else
+            printf("%cFS ", (job->flags & 1) ? 'F' : 'O');
+        printf("%08x ", job->fingerprint);
+        if (!job->bootable)
+            printf("Not bootable");
+        for (j = 0; j < job->nr_matches; j++)
+            printf("%s%s", j ? ", " : "", job->match[j]->name);
+        if (job->lamer)
+            printf("%s** LAMER EXTERMINATOR VIRUS **", j ? ", " : "");
+        else if (job->bootable && !j)
+            printf("** Unrecognised bootable bootblock");
+        printf("\n");
+    }
+}
+
 int main(int argc, char **argv)
 {
     int fd, fixup = 0;
     char bb[1024];
     uint32_t rootblock, csum;
 
+    if ((argc >= 2) && !strncmp(argv[1], "--scan=", 7)) {
+        const char *sigs_filename = NULL;
+        unsigned int i, nr_threads = 0;
+        for (i = 2; i < argc; i++) {
+            if (!strncmp(argv[i], "--sigs=", 7))
+                sigs_filename = argv[i] + 7;
+            else if (!strncmp(argv[i], "--jobs=", 7)) {
+                char *end;
+                long n = strtol(argv[i] + 7, &end, 0);
+                if ((end == argv[i] + 7) || (*end != '\0')
+                    || (n < 1) || (n > 256))
+                    errx(1, "--jobs: expected a thread count from 1 to 256");
+                nr_threads = n;
+            } else
+                goto usage;
+        }
+        if (nr_threads == 0)
+            nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        run_scan(argv[1] + 7, sigs_filename, nr_threads);
+        return 0;
+    }
+
     if (argc == 3) {
         if (!strcmp(argv[2], "-w"))
             fixup = 1;
@@ -178,10 +508,16 @@ int main(int argc, char **argv)
     if (argc != 2) {
     usage:
         errx(1, "Usage: adfbb <filename> [-w] [-f] [-{g,r}<new block>]\n"
+             "       adfbb --scan=<dir|list_file> [--sigs=<file>] "
+             "[--jobs=<n>]\n"
              " -w: Overwrite bootblock with Kick 1.3 block\n"
              " -f: Fix up bootblock checksum\n"
              " -r: New raw file to decode and poke\n"
-             " -g: New Amiga hunk file to decode and poke");
+             " -g: New Amiga hunk file to decode and poke\n"
+             " --scan: Identify bootblocks of all images in a directory tree,\n"
+             "         or listed one per line in a file\n"
+             " --sigs: Extra signatures, one '<offset|*> <hex> <name>' "
+             "per line");
     }
 
     fd = file_open(argv[1], fixup ? O_RDWR : O_RDONLY);
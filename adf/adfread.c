@@ -18,6 +18,10 @@
 #include <time.h>
 #include <utime.h>
 #include <ctype.h>
+#include <pthread.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 #include <libdisk/util.h>
 
 /* Physical characteristics of an AmigaDOS DS/DD floppy disk. */
@@ -110,34 +114,59 @@ struct ffs_fileheader {
 
 static int is_ffs, is_readonly;
 
+/* The whole image, mapped (or read) into memory. Blocks are accessed in 
+ * place and never copied. */
+static uint8_t *image;
+
+/* Files and directories found by the directory walk. File contents, then 
+ * directory timestamps, are written out once the walk is complete. */
+struct entry {
+    char *path;
+    struct ffs_fileheader *file; /* NULL for a directory */
+    time_t time;
+};
+static struct entry *entries;
+static unsigned int nr_entries, max_entries, next_entry;
+static pthread_mutex_t entry_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* read_exact, write_exact */
 #include "../libdisk/util.c"
 
-static void *get_block(int fd, unsigned int block)
+static void map_image(int fd)
 {
-    off_t off;
-    void *dat;
-
-    if (block >= BLOCKS_PER_DISK)
-        errx(1, "Block index %u out of range", block);
-
-    dat = malloc(BYTES_PER_BLOCK);
-    if (dat == NULL)
+#if !defined(__MINGW32__)
+    image = mmap(NULL, BYTES_PER_DISK, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
         err(1, NULL);
-
-    off = lseek(fd, block * BYTES_PER_BLOCK, SEEK_SET);
-    if (off < 0)
+#else
+    if ((image = malloc(BYTES_PER_DISK)) == NULL)
         err(1, NULL);
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        err(1, NULL);
+    read_exact(fd, image, BYTES_PER_DISK);
+#endif
+}
 
-    read_exact(fd, dat, BYTES_PER_BLOCK);
-
-    return dat;
+static void *get_block(unsigned int block)
+{
+    if (block >= BLOCKS_PER_DISK)
+        errx(1, "Block index %u out of range", block);
+    return &image[block * BYTES_PER_BLOCK];
 }
 
-static void put_block(void *dat)
+static void add_entry(char *path, struct ffs_fileheader *file,
+                      time_t time)
 {
-    memset(dat, 0xAA, BYTES_PER_BLOCK);
-    free(dat);
+    if (nr_entries == max_entries) {
+        max_entries = max_entries ? max_entries * 2 : 64;
+        entries = realloc(entries, max_entries * sizeof(*entries));
+        if (entries == NULL)
+            err(1, NULL);
+    }
+    entries[nr_entries].path = path;
+    entries[nr_entries].file = file;
+    entries[nr_entries].time = time;
+    nr_entries++;
 }
 
 static void checksum_block(void *dat)
@@ -184,34 +213,43 @@ static void set_times(const char *path, time_t time)
     (void)utime(path, &utimbuf);
 }
 
-static void handle_file(int fd, char *path, struct ffs_fileheader *file)
+static void handle_file(char *path, struct ffs_fileheader *file)
 {
-    int file_fd;
-    unsigned int todo, nxtblk, data_per_block;
-    time_t time = time_from_datestamp(&file->datestamp);
-
     printf(" %-54s %6u %s\n",
            path,
            be32toh(file->file_size),
            format_datestamp(&file->datestamp));
 
-    if (is_readonly)
+    if (is_readonly) {
+        free(path);
         return;
+    }
 
-    file_fd = file_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-    if (file_fd == -1)
-        err(1, "%s", path);
+    add_entry(path, file, time_from_datestamp(&file->datestamp));
+}
+
+static void extract_file(struct entry *ent)
+{
+    struct ffs_fileheader *file = ent->file;
+    int file_fd;
+    unsigned int todo, nxtblk, data_per_block;
+    char *buf, *p;
 
     data_per_block = is_ffs ? BYTES_PER_BLOCK : BYTES_PER_BLOCK-24;
 
+    /* Gather the whole file so that it is written out in one go. A file
+     * cannot be bigger than the image's data blocks. */
     todo = be32toh(file->file_size);
+    if (todo > (BLOCKS_PER_DISK * data_per_block))
+        errx(1, "%s: Bad file size %u", ent->path, todo);
+    if ((p = buf = malloc(todo ?: 1)) == NULL)
+        err(1, NULL);
     for (nxtblk = 0; todo != 0; nxtblk++) {
         unsigned int idx, this_todo;
         char *dat;
         if (nxtblk == HASH_SIZE) {
             idx = be32toh(file->extension);
-            put_block(file);
-            file = get_block(fd, idx);
+            file = get_block(idx);
             checksum_block(file);
             if ((be32toh(file->type) != T_LIST) ||
                 (be32toh(file->subtype) != ST_FILE))
@@ -219,23 +257,72 @@ static void handle_file(int fd, char *path, struct ffs_fileheader *file)
             nxtblk = 0;
         }
         idx = be32toh(file->data[HASH_SIZE-nxtblk-1]);
-        dat = get_block(fd, idx);
+        dat = get_block(idx);
         if (!is_ffs)
             checksum_block(dat);
         this_todo = (todo > data_per_block) ? data_per_block : todo;
-        write_exact(file_fd, &dat[is_ffs?0:24], this_todo);
-        put_block(dat);
+        memcpy(p, &dat[is_ffs?0:24], this_todo);
+        p += this_todo;
         todo -= this_todo;
     }
 
+    file_fd = file_open(ent->path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (file_fd == -1)
+        err(1, "%s", ent->path);
+    write_exact(file_fd, buf, p - buf);
     close(file_fd);
-    set_times(path, time);
+    set_times(ent->path, ent->time);
 
-    put_block(file);
-    free(path);
+    free(buf);
 }
 
-static void handle_dir(int fd, char *prefix, struct ffs_dir *dir)
+static void *extract_worker(void *unused)
+{
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&entry_lock);
+        i = next_entry++;
+        pthread_mutex_unlock(&entry_lock);
+        if (i >= nr_entries)
+            break;
+        if (entries[i].file != NULL)
+            extract_file(&entries[i]);
+    }
+
+    return NULL;
+}
+
+static void extract_all(unsigned int nr_threads)
+{
+    pthread_t *threads;
+    unsigned int i;
+
+    nr_threads = min_t(unsigned int, nr_threads, nr_entries);
+    if (nr_threads <= 1) {
+        extract_worker(NULL);
+    } else {
+        if ((threads = malloc(nr_threads * sizeof(*threads))) == NULL)
+            err(1, NULL);
+        for (i = 0; i < nr_threads; i++)
+            if (pthread_create(&threads[i], NULL, extract_worker, NULL) != 0)
+                errx(1, "Failed to create worker thread");
+        for (i = 0; i < nr_threads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    }
+
+    /* Directory timestamps last, as creating files within them updates 
+     * their modification times. */
+    for (i = 0; i < nr_entries; i++) {
+        if (entries[i].file == NULL)
+            set_times(entries[i].path, entries[i].time);
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+static void handle_dir(char *prefix, struct ffs_dir *dir)
 {
     uint32_t idx;
     unsigned int i;
@@ -252,7 +339,7 @@ static void handle_dir(int fd, char *prefix, struct ffs_dir *dir)
     for (i = 0; i < HASH_SIZE; i++) {
         idx = be32toh(dir->hash[i]);
         while (idx != 0) {
-            file = get_block(fd, idx);
+            file = get_block(idx);
             if (be32toh(file->type) != T_HEADER)
                 errx(1, "Not a header block (type %08x)", be32toh(file->type));
             checksum_block(file);
@@ -267,10 +354,10 @@ static void handle_dir(int fd, char *prefix, struct ffs_dir *dir)
 
             switch ((int)be32toh(file->subtype)) {
             case ST_USERDIR:
-                handle_dir(fd, path, (struct ffs_dir *)file);
+                handle_dir(path, (struct ffs_dir *)file);
                 break;
             case ST_FILE:
-                handle_file(fd, path, file);
+                handle_file(path, file);
                 break;
             default:
                 errx(1, "Unrecognised subtype %08x", be32toh(dir->subtype));
@@ -278,11 +365,10 @@ static void handle_dir(int fd, char *prefix, struct ffs_dir *dir)
         }
     }
 
-    if (!is_readonly)
-        set_times(prefix, time_from_datestamp(&dir->datestamp));
-
-    put_block(dir);
-    free(prefix);
+    if (is_readonly)
+        free(prefix);
+    else
+        add_entry(prefix, NULL, time_from_datestamp(&dir->datestamp));
 }
 
 int main(int argc, char **argv)
@@ -292,13 +378,22 @@ int main(int argc, char **argv)
     struct ffs_root_block *root_block;
     char *boot_block, *dest_dir = ".", *tmp;
     const char *vol;
+    unsigned int nr_threads = 1;
+
+    if ((argc >= 2) && !strncmp(argv[1], "--jobs=", 7)) {
+        long n = strtol(argv[1] + 7, &tmp, 0);
+        if ((tmp == argv[1] + 7) || (*tmp != '\0') || (n < 1) || (n > 256))
+            errx(1, "--jobs: expected a thread count from 1 to 256");
+        nr_threads = n;
+        argc--; argv++;
+    }
 
     if (argc == 3)
         dest_dir = argv[2];
     else if (argc == 2)
         is_readonly = 1;
     else
-        errx(1, "Usage: adfread <filename> [<dest_dir>]");
+        errx(1, "Usage: adfread [--jobs=<n>] <filename> [<dest_dir>]");
 
     fd = file_open(argv[1], O_RDONLY);
     if (fd == -1)
@@ -311,13 +406,15 @@ int main(int argc, char **argv)
         errx(1, "Bad file size %ld bytes (expected %ld bytes)",
              (long)sz, (long)BYTES_PER_DISK);
 
-    boot_block = get_block(fd, 0);
+    map_image(fd);
+    close(fd);
+
+    boot_block = get_block(0);
     if (strncmp(boot_block, "DOS", 3))
         errx(1, "Bad Amiga bootblock");
     is_ffs = boot_block[3] & 1;
-    put_block(boot_block);
 
-    root_block = get_block(fd, BLOCKS_PER_DISK/2);
+    root_block = get_block(BLOCKS_PER_DISK/2);
     checksum_block(root_block);
     if ((be32toh(root_block->type) != T_HEADER) ||
         (be32toh(root_block->subtype) != ST_ROOT) ||
@@ -339,7 +436,11 @@ int main(int argc, char **argv)
     printf("Last altered:\t%s\n",
            format_datestamp(&root_block->disk_altered_datestamp));
 
-    handle_dir(fd, dest_dir, (struct ffs_dir *)root_block);
+    handle_dir(dest_dir, (struct ffs_dir *)root_block);
+
+    /* Listing is complete: flush it before the (possibly slow) extraction. */
+    fflush(stdout);
+    extract_all(nr_threads);
 
     return 0;
 }
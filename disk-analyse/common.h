@@ -1,6 +1,8 @@
 #ifndef __MFMPARSE_COMMON_H__
 #define __MFMPARSE_COMMON_H__
 
+#define NR_TRACKS 200
+
 struct format_list {
     uint16_t nr, max, pos;
     uint16_t ent[1];
@@ -8,6 +10,30 @@ struct format_list {
 
 extern struct format_list **parse_config(char *config, char *specifier);
 
+/* A title's entry in the fingerprint index: the CRC32 of its AmigaDOS boot
+ * block (0 if none), and the most common sync word and length of a few of
+ * its tracks which do not decode with the default format list. */
+#define FP_MAX_TRACKS 8
+#define DEF_FP "fingerprints"
+struct fingerprint {
+    char title[128];
+    uint32_t boot_crc;
+    unsigned int nr_tracks;
+    struct fp_track {
+        uint16_t tracknr, sync;
+        uint32_t nr_sync, bitlen;
+    } track[FP_MAX_TRACKS];
+};
+
+extern struct fingerprint *parse_fingerprints(char *index, unsigned int *nr);
+
+struct disk;
+struct stream;
+extern char *identify_title(struct disk *d, struct stream *s, char *index);
+extern void learn_title(
+    struct disk *d, struct stream *s, struct format_list **formats,
+    struct format_list **defaults, char *title, char *index);
+
 extern int quiet, verbose;
 
 #endif /* __MFMPARSE_COMMON_H__ */
@@ -17,8 +17,6 @@
 
 #include "common.h"
 
-#define NR_TRACKS 200
-
 #define DEF_DIR PREFIX "/share/disk-analyse"
 #define DEF_FIL "formats"
 
@@ -80,6 +78,11 @@ retry:
         t->u.num.start = c - '0';
         while (isdigit(c = mygetc()))
             t->u.num.start = t->u.num.start * 10 + c - '0';
+        if ((t->u.num.start == 0) && (c == 'x')) { /* hex, no range */
+            while (isxdigit(c = mygetc()))
+                t->u.num.start = t->u.num.start * 16
+                    + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+        }
         t->u.num.end = t->u.num.start;
         t->u.num.step = 1;
         if (c == '-') {
@@ -333,6 +336,77 @@ found:
     return formats;
 }
 
+struct fingerprint *parse_fingerprints(char *index, unsigned int *nr)
+{
+    struct fingerprint *fp = NULL, *new;
+    unsigned int max = 0;
+    struct token t;
+
+    *nr = 0;
+
+    if ((fi = open_file(index ? : DEF_FP)) == NULL) {
+        /* The default index is optional. */
+        if (index != NULL)
+            errx(1, "could not open fingerprint index \"%s\"", index);
+        return NULL;
+    }
+
+    for (;;) {
+        parse_token(&t);
+        if ((t.type == EOL) && (t.u.ch == EOF))
+            break;
+        if (t.type == STR) {
+            /* "Title" <boot-crc> */
+            if (*nr == max) {
+                max = max ? max*2 : 16;
+                new = memalloc(max * sizeof(*new));
+                if (fp != NULL) {
+                    memcpy(new, fp, *nr * sizeof(*new));
+                    memfree(fp);
+                }
+                fp = new;
+            }
+            new = &fp[(*nr)++];
+            strcpy(new->title, t.u.str);
+            parse_token(&t);
+            if (t.type != NUM)
+                parse_err("expected boot block CRC after title");
+            new->boot_crc = t.u.num.start;
+        } else if (t.type == NUM) {
+            /* <track> <sync-word> <nr-syncs> <bitcells> */
+            struct fp_track *trk;
+            uint32_t v[4];
+            unsigned int i;
+            if (*nr == 0)
+                parse_err("track fingerprint outside of a title");
+            new = &fp[*nr-1];
+            if (new->nr_tracks == FP_MAX_TRACKS)
+                parse_err("too many tracks for \"%s\"", new->title);
+            for (i = 0; i < 4; i++) {
+                if (i)
+                    parse_token(&t);
+                if ((t.type != NUM) || (t.u.num.start != t.u.num.end))
+                    parse_err("expected <track> <sync> <nr-syncs> <bitcells>");
+                v[i] = t.u.num.start;
+            }
+            if (v[0] >= NR_TRACKS)
+                parse_err("bad track %u", v[0]);
+            trk = &new->track[new->nr_tracks++];
+            trk->tracknr = v[0];
+            trk->sync = v[1];
+            trk->nr_sync = v[2];
+            trk->bitlen = v[3];
+        }
+        while (t.type != EOL)
+            parse_token(&t);
+    }
+
+    close_file(fi);
+    fi = NULL;
+
+    return fp;
+}
+
 /*
  * Local variables:
  * mode: C
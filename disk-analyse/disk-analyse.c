@@ -9,9 +9,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
@@ -27,11 +29,13 @@
 int quiet, verbose;
 static unsigned int start_cyl, disk_flags;
 static int index_align, clear_bad_sectors, single_sided = -1, end_cyl = -1;
-static int double_step = 0;
+static int double_step = 0, learn;
 static unsigned int drive_rpm = 300, data_rpm = 300;
 static int pll_period_adj_pct = -1, pll_phase_adj_pct = -1;
+static int max_bits, max_revs, max_nosync_revs;
+static unsigned int pll_sweep_jobs, rev_threads;
 static struct format_list **format_lists;
-static char *in, *out;
+static char *in, *out, *config, *format, *fp_index;
 
 /* Iteration start/step for single- and double-sided modes. */
 #define _TRACK_START ((single_sided == 1) ? 1 : 0)
@@ -57,6 +61,16 @@ static void usage(int rc)
     printf("  -p, --pll-period-adj=PCT (PCT=0..100) PLL period adjustment\n");
     printf("  -P, --pll-phase-adj=PCT (PCT=0..100) PLL phase adjustment\n");
     printf("                      Amount observed flux affects PLL\n");
+    printf("  -b, --max-bits=N    Max bitcells decoded per format attempt\n");
+    printf("  -R, --max-revs=N    Max revolutions decoded per format attempt\n");
+    printf("  -n, --nosync-revs=N Abandon a format attempt after N revolutions\n");
+    printf("                      without a sync mark (AmigaDOS/IBM formats)\n");
+    printf("  -x, --pll-sweep[=JOBS] Retry tracks with bad sectors across a\n");
+    printf("                      range of PLL settings, in JOBS processes\n");
+    printf("                      [default: one per online CPU]\n");
+    printf("  -t, --rev-threads[=N] Decode each revolution of a flux dump\n");
+    printf("                      on its own thread, N threads at most\n");
+    printf("                      [default: one per online CPU]\n");
     printf("  -r, --rpm=DRIVE[:DATA] RPM of drive that created the input,\n");
     printf("                         Original recording RPM of data [300]\n");
     printf("  -D, --double-step   Double Step\n");
@@ -66,6 +80,9 @@ static void usage(int rc)
     printf("  -k, --kryoflux-hack Fill empty tracks with prev track's data\n");
     printf("  -f, --format=FORMAT Name of format descriptor in config file\n");
     printf("  -c, --config=FILE   Config file to parse for format info\n");
+    printf("  -I, --index=FILE    Fingerprint index used to identify the\n");
+    printf("                      title of a flux dump when no -f is given\n");
+    printf("  -L, --learn         Add the -f title's fingerprint to the index\n");
     printf("Supported file formats (suffix => type):\n");
     printf("  .adf  => ADF\n");
     printf("  .eadf => Extended-ADF\n");
@@ -178,6 +195,160 @@ static void dump_track_list(struct disk *d)
     printf("%u.%u: %s\n", TRACK_ARG(i-TRACK_STEP), prev_name);
 }
 
+static void report_limits(struct stream *s)
+{
+    unsigned int nr = s->nr_bits_aborts + s->nr_revs_aborts
+        + s->nr_nosync_aborts;
+
+    if (!nr)
+        return;
+
+    printf("** Decode limits cut short %u format attempt%s "
+           "(bitcells: %u, revolutions: %u, no sync: %u)\n",
+           nr, (nr > 1) ? "s" : "", s->nr_bits_aborts,
+           s->nr_revs_aborts, s->nr_nosync_aborts);
+}
+
+/* PLL settings tried by --pll-sweep, in order of preference. */
+static const int sweep_period_adj[] = { 5, 1, 10, 20 };
+static const int sweep_phase_adj[] = { 60, 30, 90 };
+static const int sweep_centre_adj[] = { 0, -3, 3 };
+#define NR_SWEEP (ARRAY_SIZE(sweep_period_adj) * ARRAY_SIZE(sweep_phase_adj) \
+                  * ARRAY_SIZE(sweep_centre_adj))
+
+struct pll_setting {
+    int period_adj, phase_adj, centre_adj;
+};
+
+static void get_pll_setting(struct stream *s, struct pll_setting *p)
+{
+    p->period_adj = s->pll_period_adj_pct;
+    p->phase_adj = s->pll_phase_adj_pct;
+    p->centre_adj = s->pll_centre_adj_pct;
+}
+
+static void set_pll_setting(struct stream *s, const struct pll_setting *p)
+{
+    s->pll_period_adj_pct = p->period_adj;
+    s->pll_phase_adj_pct = p->phase_adj;
+    s->pll_centre_adj_pct = p->centre_adj;
+}
+
+static void sweep_setting(unsigned int i, struct pll_setting *p)
+{
+    p->centre_adj = sweep_centre_adj[i % ARRAY_SIZE(sweep_centre_adj)];
+    i /= ARRAY_SIZE(sweep_centre_adj);
+    p->phase_adj = sweep_phase_adj[i % ARRAY_SIZE(sweep_phase_adj)];
+    i /= ARRAY_SIZE(sweep_phase_adj);
+    p->period_adj = sweep_period_adj[i];
+}
+
+static unsigned int nr_valid_sectors(struct track_info *ti)
+{
+    unsigned int i, nr = 0;
+    for (i = 0; i < ti->nr_sectors; i++)
+        if (is_valid_sector(ti, i))
+            nr++;
+    return nr;
+}
+
+/* Worker process: decode the track with every JOBSth sweep setting, starting
+ * at the given one, and report the number of valid sectors for each. */
+static void sweep_worker(
+    struct disk *d, struct stream *s, unsigned int tracknr,
+    unsigned int type, unsigned int first, unsigned int jobs, int fd)
+{
+    struct track_info *ti = &disk_get_info(d)->track[tracknr];
+    struct pll_setting p;
+    uint16_t rec[2];
+    int null;
+
+    /* Handlers' warnings would be repeated for every setting we try. */
+    if ((null = open("/dev/null", O_WRONLY)) >= 0) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+
+    for (rec[0] = first; rec[0] < NR_SWEEP; rec[0] += jobs) {
+        sweep_setting(rec[0], &p);
+        set_pll_setting(s, &p);
+        rec[1] = (track_write_raw_from_stream(d, tracknr, type, s) == 0)
+            ? nr_valid_sectors(ti) : 0;
+        if (write(fd, rec, sizeof(rec)) != sizeof(rec))
+            break;
+    }
+
+    _exit(0);
+}
+
+/* Retry a track which decoded with bad sectors, across the grid of sweep 
+ * settings. Each setting decodes the flux already cached by the stream in a
+ * forked worker; the best result is then decoded again for real. */
+static void pll_sweep_track(
+    struct disk *d, struct stream *s, unsigned int tracknr, unsigned int type)
+{
+    struct track_info *ti = &disk_get_info(d)->track[tracknr];
+    struct pll_setting orig, p;
+    unsigned int i, jobs, nr_secs = ti->nr_sectors;
+    unsigned int best = NR_SWEEP, best_score = nr_valid_sectors(ti);
+    uint16_t rec[2], score[NR_SWEEP];
+    int fds[2], pipes[NR_SWEEP];
+    pid_t pid;
+
+    if (best_score == nr_secs)
+        return;
+
+    get_pll_setting(s, &orig);
+    jobs = min_t(unsigned int, pll_sweep_jobs, NR_SWEEP);
+    memset(score, 0, sizeof(score));
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < jobs; i++) {
+        if (pipe(fds) < 0)
+            err(1, "pipe");
+        if ((pid = fork()) < 0)
+            err(1, "fork");
+        if (pid == 0) {
+            close(fds[0]);
+            sweep_worker(d, s, tracknr, type, i, jobs, fds[1]);
+        }
+        close(fds[1]);
+        pipes[i] = fds[0];
+    }
+
+    for (i = 0; i < jobs; i++) {
+        while (read(pipes[i], rec, sizeof(rec)) == sizeof(rec))
+            if (rec[0] < NR_SWEEP)
+                score[rec[0]] = rec[1];
+        close(pipes[i]);
+    }
+    while (wait(NULL) > 0)
+        continue;
+
+    for (i = 0; i < NR_SWEEP; i++) {
+        if (score[i] > best_score) {
+            best = i;
+            best_score = score[i];
+        }
+    }
+
+    if (best != NR_SWEEP) {
+        sweep_setting(best, &p);
+        set_pll_setting(s, &p);
+        track_write_raw_from_stream(d, tracknr, type, s);
+        printf("T%u.%u: PLL sweep recovered %u/%u sectors "
+               "(period_adj=%d%% phase_adj=%d%% centre_adj=%+d%%)\n",
+               TRACK_ARG(tracknr), nr_valid_sectors(ti), nr_secs,
+               p.period_adj, p.phase_adj, p.centre_adj);
+    } else if (verbose) {
+        printf("T%u.%u: PLL sweep found no improvement\n",
+               TRACK_ARG(tracknr));
+    }
+
+    set_pll_setting(s, &orig);
+}
+
 static void probe_stream(void)
 {
     struct stream *s;
@@ -197,6 +368,10 @@ static void probe_stream(void)
     if (verbose)
         printf("PLL Parameters: period_adj=%d%% phase_adj=%d%%\n",
                s->pll_period_adj_pct, s->pll_phase_adj_pct);
+    s->max_bits = max_bits;
+    s->max_revs = max_revs;
+    s->max_nosync_revs = max_nosync_revs;
+    s->rev_threads = rev_threads;
 
     if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
@@ -235,6 +410,8 @@ static void probe_stream(void)
         printf("\n");
     }
 
+    report_limits(s);
+
     disk_close(d);
     stream_close(s);
 }
@@ -258,11 +435,21 @@ static void handle_stream(void)
     if (verbose)
         printf("PLL Parameters: period_adj=%d%% phase_adj=%d%%\n",
                s->pll_period_adj_pct, s->pll_phase_adj_pct);
+    s->max_bits = max_bits;
+    s->max_revs = max_revs;
+    s->max_nosync_revs = max_nosync_revs;
+    s->rev_threads = rev_threads;
 
     if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
     di = disk_get_info(d);
 
+    if (format_lists == NULL) {
+        char *title = format ? NULL : identify_title(d, s, fp_index);
+        format_lists = parse_config(config, format ? : title);
+        memfree(title);
+    }
+
     for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
         struct format_list *list = format_lists[i];
         unsigned int j;
@@ -270,8 +457,11 @@ static void handle_stream(void)
             continue;
         for (j = 0; j < list->nr; j++) {
             if (track_write_raw_from_stream(
-                    d, i, list->ent[list->pos], s) == 0)
+                    d, i, list->ent[list->pos], s) == 0) {
+                if (pll_sweep_jobs)
+                    pll_sweep_track(d, s, i, list->ent[list->pos]);
                 break;
+            }
             if (++list->pos >= list->nr)
                 list->pos = 0;
         }
@@ -318,6 +508,14 @@ static void handle_stream(void)
         fprintf(stderr,"** WARNING: %u track%s damaged or unidentified!\n",
                 unidentified, (unidentified > 1) ? "s are" : " is");
 
+    if (learn && unidentified)
+        warnx("Not learning a fingerprint from a damaged dump");
+    else if (learn)
+        learn_title(d, s, format_lists, parse_config(config, NULL),
+                    format, fp_index);
+
+    report_limits(s);
+
     disk_close(d);
     stream_close(s);
 }
@@ -381,12 +579,21 @@ static void handle_img(void)
     track_free_sector_buffer(sectors);
 }
 
+/* Decode limit: a non-negative integer (0 = unlimited), else -1. */
+static int parse_limit(const char *arg)
+{
+    char *p;
+    long x = strtol(arg, &p, 0);
+    return ((*arg == '\0') || (*p != '\0') || (x < 0) || (x > INT_MAX))
+        ? -1 : x;
+}
+
 int main(int argc, char **argv)
 {
-    char in_suffix[8], out_suffix[8], *config = NULL, *format = NULL;
+    char in_suffix[8], out_suffix[8];
     int ch;
 
-    const static char sopts[] = "hqviCp:P:r:s:e:S::Dkf:c:";
+    const static char sopts[] = "hqviCp:P:b:R:n:x::t::r:s:e:S::Dkf:c:I:L";
     const static struct option lopts[] = {
         { "help", 0, NULL, 'h' },
         { "quiet", 0, NULL, 'q' },
@@ -395,6 +602,11 @@ int main(int argc, char **argv)
         { "clear-bad-sectors", 0, NULL, 'C' },
         { "pll-period-adj", 1, NULL, 'p' },
         { "pll-phase-adj", 1, NULL, 'P' },
+        { "max-bits", 1, NULL, 'b' },
+        { "max-revs", 1, NULL, 'R' },
+        { "nosync-revs", 1, NULL, 'n' },
+        { "pll-sweep", 2, NULL, 'x' },
+        { "rev-threads", 2, NULL, 't' },
         { "rpm", 1, NULL, 'r' },
         { "start-cyl", 1, NULL, 's' },
         { "end-cyl", 1, NULL, 'e' },
@@ -403,6 +615,8 @@ int main(int argc, char **argv)
         { "kryoflux-hack", 0, NULL, 'k' },
         { "format", 1, NULL, 'f' },
         { "config",  1, NULL, 'c' },
+        { "index", 1, NULL, 'I' },
+        { "learn", 0, NULL, 'L' },
         { 0, 0, 0, 0}
     };
 
@@ -437,6 +651,42 @@ int main(int argc, char **argv)
                 usage(1);
             }
             break;
+        case 'b':
+            if ((max_bits = parse_limit(optarg)) < 0) {
+                warnx("Bad --max-bits value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 'R':
+            if (((max_revs = parse_limit(optarg)) < 0) || (max_revs == 1)) {
+                warnx("Bad --max-revs value '%s' (minimum 2)", optarg);
+                usage(1);
+            }
+            break;
+        case 'n':
+            if ((max_nosync_revs = parse_limit(optarg)) < 0) {
+                warnx("Bad --nosync-revs value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 'x':
+            pll_sweep_jobs = optarg ? atoi(optarg)
+                : max_t(long, sysconf(_SC_NPROCESSORS_ONLN), 1);
+            if (pll_sweep_jobs == 0) {
+                warnx("Bad --pll-sweep value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 't': {
+            int nr = optarg ? parse_limit(optarg)
+                : max_t(long, sysconf(_SC_NPROCESSORS_ONLN), 1);
+            if (nr < 1) {
+                warnx("Bad --rev-threads value '%s'", optarg);
+                usage(1);
+            }
+            rev_threads = nr;
+            break;
+        }
         case 'r': {
             char *p;
             drive_rpm = strtol(optarg, &p, 10);
@@ -473,6 +723,12 @@ int main(int argc, char **argv)
         case 'c':
             config = optarg;
             break;
+        case 'I':
+            fp_index = optarg;
+            break;
+        case 'L':
+            learn = 1;
+            break;
         default:
             usage(1);
             break;
@@ -488,6 +744,11 @@ int main(int argc, char **argv)
     filename_extension(in, in_suffix, sizeof(in_suffix));
     filename_extension(out, out_suffix, sizeof(out_suffix));
 
+    if (learn && (!format || !strncmp(format, "probe_", 6))) {
+        warnx("--learn requires a title to be named with -f");
+        usage(1);
+    }
+
     /* Pick a sane default format for certain sector image formats. */
     if (!format) {
         if (!strcmp(in_suffix, "imd") || !strcmp(out_suffix, "imd"))
@@ -505,12 +766,14 @@ int main(int argc, char **argv)
 
     } else {
 
-        format_lists = parse_config(config, format);
-
-        if (!strcmp(in_suffix, "img") || !strcmp(in_suffix, "st"))
+        /* A stream's format lists are parsed once it is open, in case the
+         * title must first be identified from its fingerprints. */
+        if (!strcmp(in_suffix, "img") || !strcmp(in_suffix, "st")) {
+            format_lists = parse_config(config, format);
             handle_img();
-        else
+        } else {
             handle_stream();
+        }
 
     }
 
@@ -0,0 +1,261 @@
+/*
+ * disk-analyse/identify.c
+ *
+ * Identify the title on a flux dump from a few cheap measurements, so that
+ * its format list can be selected without probing every track format.
+ * Titles are fingerprinted from known-good reference dumps (--learn):
+ *  - CRC32 of the AmigaDOS boot block;
+ *  - Most common sync word on tracks which the default list cannot decode;
+ *  - Length of those same tracks.
+ * Identification then needs one AmigaDOS decode of track 0, plus a single
+ * revolution of each fingerprinted track.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libdisk/stream.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+/* A sync word must occur this often per revolution to be recorded. */
+#define MIN_SYNCS 4
+
+/* Track lengths of two dumps of a title may differ by 1/LEN_TOLERANCE. */
+#define LEN_TOLERANCE 50
+
+/* Does an MFM word contain a missing clock bit, as sync marks do? Clock bit
+ * 15 is not checked, as one of its neighbouring data bits is not known. */
+static bool_t mfm_clock_violation(uint16_t w)
+{
+    uint16_t data = w & 0x5555;
+    uint16_t expect = ~((data << 1) | (data >> 1)) & 0x2aaa;
+    return (w & 0x2aaa) != expect;
+}
+
+/* Histogram the sync words in the first revolution of a track, clocked at
+ * double density. Data words, read out of phase, can break the clocking
+ * rules too: but a sync mark breaks them in both phases. So do the windows
+ * a few bits either side of a mark, and those are not counted. A mark is
+ * taken to start at the last such window which follows an 0xaaaa gap
+ * (MFM zeroes, in phase), and a run of marks continues at 16-bit intervals
+ * from there. Returns the revolution's length in bitcells, or 0. */
+static uint32_t scan_track(
+    struct stream *s, unsigned int tracknr, uint32_t *hist)
+{
+    uint32_t prev, mark_bc = 0, next_bc = ~0u;
+    uint16_t mark = 0;
+    bool_t sync;
+
+    memset(hist, 0, 65536 * sizeof(*hist));
+
+    stream_set_density(s, (2000u * (100 + s->pll_centre_adj_pct)) / 100);
+    if (stream_select_track(s, tracknr) != 0)
+        return 0;
+    stream_reset(s);
+    if (s->nr_index != 1)
+        return 0;
+
+    for (;;) {
+        if (stream_next_bit(s) == -1)
+            return 0;
+        if (s->nr_index != 1)
+            break;
+        sync = (mfm_clock_violation(s->word)
+                && mfm_clock_violation(s->word >> 1));
+        prev = s->word >> 16;
+        if ((prev == 0xaaaa) || (prev == 0x5555)) {
+            /* Still in the gap: remember the latest candidate mark. */
+            if (sync && (prev == 0xaaaa)) {
+                mark = (uint16_t)s->word;
+                mark_bc = s->index_offset_bc;
+            }
+            continue;
+        }
+        if (mark_bc != 0) {
+            hist[mark]++;
+            next_bc = mark_bc + 16;
+            mark_bc = 0;
+        }
+        if (sync && (s->index_offset_bc == next_bc)) {
+            hist[(uint16_t)s->word]++;
+            next_bc += 16;
+        }
+    }
+
+    /* track_len_bc now measures the revolution just scanned. */
+    return s->track_len_bc;
+}
+
+/* CRC32 of the boot block, if track 0 decoded as standard AmigaDOS. Its
+ * track data is then the sector data, in sector order. */
+static uint32_t boot_crc(struct disk *d)
+{
+    struct track_info *ti = &disk_get_info(d)->track[0];
+
+    if ((ti->type != TRKTYP_amigados) || (ti->len < 1024)
+        || !is_valid_sector(ti, 0) || !is_valid_sector(ti, 1))
+        return 0;
+
+    return crc32(ti->dat, 1024);
+}
+
+static bool_t track_matches(
+    const struct fp_track *trk, const uint32_t *hist, uint32_t bitlen)
+{
+    uint32_t tol = trk->bitlen / LEN_TOLERANCE;
+
+    if (((bitlen + tol) < trk->bitlen) || (bitlen > (trk->bitlen + tol)))
+        return 0;
+
+    /* A damaged sector or two may lose a few sync words. */
+    return ((trk->sync == 0)
+            || (((hist[trk->sync] * 4) >= (trk->nr_sync * 3))
+                && ((hist[trk->sync] * 3) <= (trk->nr_sync * 4))));
+}
+
+static bool_t list_has(struct format_list *list, unsigned int type)
+{
+    unsigned int i;
+    if (list != NULL)
+        for (i = 0; i < list->nr; i++)
+            if (list->ent[i] == type)
+                return 1;
+    return 0;
+}
+
+char *identify_title(struct disk *d, struct stream *s, char *index)
+{
+    struct fingerprint *fp;
+    unsigned int i, j, t, nr, score, best = 0, best_score = 0;
+    uint32_t *hist, bitlen, crc;
+    bool_t *miss, wanted;
+    char *title = NULL;
+
+    if ((fp = parse_fingerprints(index, &nr)) == NULL)
+        return NULL;
+
+    miss = memalloc(nr * sizeof(*miss));
+    hist = memalloc(65536 * sizeof(*hist));
+
+    /* Borrow track 0 of the output disk to decode the boot block. */
+    crc = (track_write_raw_from_stream(d, 0, TRKTYP_amigados, s) == 0)
+        ? boot_crc(d) : 0;
+    track_mark_unformatted(d, 0);
+    for (i = 0; i < nr; i++)
+        if (fp[i].boot_crc && (fp[i].boot_crc != crc))
+            miss[i] = 1;
+
+    /* Scan each track once, and only while a candidate title needs it. */
+    for (t = 0; t < NR_TRACKS; t++) {
+        wanted = 0;
+        for (i = 0; (i < nr) && !wanted; i++)
+            for (j = 0; (j < fp[i].nr_tracks) && !miss[i]; j++)
+                if (fp[i].track[j].tracknr == t)
+                    wanted = 1;
+        if (!wanted)
+            continue;
+        bitlen = scan_track(s, t, hist);
+        for (i = 0; i < nr; i++)
+            for (j = 0; (j < fp[i].nr_tracks) && !miss[i]; j++)
+                if ((fp[i].track[j].tracknr == t)
+                    && !track_matches(&fp[i].track[j], hist, bitlen))
+                    miss[i] = 1;
+    }
+
+    /* The title which matched on the most features wins. */
+    for (i = 0; i < nr; i++) {
+        if (miss[i])
+            continue;
+        score = fp[i].nr_tracks + !!fp[i].boot_crc;
+        if (verbose)
+            printf("Fingerprint \"%s\" matches on %u features\n",
+                   fp[i].title, score);
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    if (best_score != 0) {
+        title = memalloc(strlen(fp[best].title) + 1);
+        strcpy(title, fp[best].title);
+        if (!quiet)
+            printf("Identified title \"%s\"\n", title);
+    }
+
+    memfree(hist);
+    memfree(miss);
+    memfree(fp);
+
+    return title;
+}
+
+void learn_title(
+    struct disk *d, struct stream *s, struct format_list **formats,
+    struct format_list **defaults, char *title, char *index)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct fingerprint fp;
+    unsigned int i, w, nr = 0, cand[NR_TRACKS];
+    uint32_t *hist;
+    FILE *f;
+
+    /* Fingerprint tracks which the title's own format list decoded, but
+     * which the default list would not have. */
+    for (i = 0; (i < di->nr_tracks) && (i < NR_TRACKS); i++) {
+        unsigned int type = di->track[i].type;
+        if (list_has(formats[i], type) && !list_has(defaults[i], type))
+            cand[nr++] = i;
+    }
+
+    if (nr == 0) {
+        warnx("\"%s\" decodes with the default format list: "
+              "no fingerprint learned", title);
+        return;
+    }
+
+    memset(&fp, 0, sizeof(fp));
+    fp.boot_crc = boot_crc(d);
+    fp.nr_tracks = min_t(unsigned int, nr, FP_MAX_TRACKS);
+
+    hist = memalloc(65536 * sizeof(*hist));
+    for (i = 0; i < fp.nr_tracks; i++) {
+        struct fp_track *trk = &fp.track[i];
+        trk->tracknr = cand[(i * nr) / fp.nr_tracks];
+        trk->bitlen = scan_track(s, trk->tracknr, hist);
+        for (w = 0; w < 65536; w++) {
+            if (hist[w] > trk->nr_sync) {
+                trk->sync = w;
+                trk->nr_sync = hist[w];
+            }
+        }
+        if (trk->nr_sync < MIN_SYNCS)
+            trk->sync = trk->nr_sync = 0;
+    }
+    memfree(hist);
+
+    if ((f = fopen(index ? : DEF_FP, "a")) == NULL)
+        err(1, "%s", index ? : DEF_FP);
+    fprintf(f, "\n\"%s\" 0x%08x\n", title, fp.boot_crc);
+    for (i = 0; i < fp.nr_tracks; i++)
+        fprintf(f, "    %u 0x%04x %u %u\n", fp.track[i].tracknr,
+                fp.track[i].sync, fp.track[i].nr_sync, fp.track[i].bitlen);
+    fclose(f);
+
+    if (!quiet)
+        printf("Learned fingerprint for \"%s\" (%u tracks)\n",
+               title, fp.nr_tracks);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -15,6 +15,7 @@
 
 #include <libdisk/util.h>
 #include <private/disk.h>
+#include <private/stream.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -223,6 +224,23 @@ static void dsk_close(struct disk *d)
     }
 }
 
+/* Can the flux on the current track be bitcells of @ns_per_cell? FM places
+ * flux at 1 or 2 cells; MFM at 2 cells or more. An unknown estimate matches
+ * everything. */
+static bool_t density_is_plausible(
+    struct stream *s, unsigned int ns_per_cell)
+{
+    unsigned int flux_ns = s->est_flux_ns;
+
+    if (flux_ns == 0)
+        return 1;
+    if ((flux_ns >= (ns_per_cell*3)/2) && (flux_ns <= (ns_per_cell*5)/2))
+        return 1;
+    return (!s->est_mfm
+            && (flux_ns >= (ns_per_cell*3)/4)
+            && (flux_ns <= (ns_per_cell*5)/4));
+}
+
 int dsk_write_raw(
     struct disk *d, unsigned int tracknr, enum track_type type,
     struct stream *s)
@@ -241,12 +259,18 @@ int dsk_write_raw(
     case trkden_extra: ns_per_cell = 500u; break;
     default: BUG();
     }
-    stream_set_density(s, ns_per_cell);
+    stream_set_density(s, (ns_per_cell * (100 + s->pll_centre_adj_pct)) / 100);
     default_len = (DEFAULT_BITS_PER_TRACK(d) * 2000u) / ns_per_cell;
     ti->total_bits = default_len;
 
-    if (stream_select_track(s, tracknr) == 0)
+    /* Don't waste a full decode on a handler whose bitcell timing cannot
+     * match the flux on this track. Unformatted tracks have no estimate. */
+    if ((stream_select_track(s, tracknr) == 0)
+        && density_is_plausible(s, ns_per_cell)) {
+        stream_begin_attempt(s, handlers[type]->notes_sync);
         ti->dat = handlers[type]->write_raw(d, tracknr, s);
+        stream_end_attempt(s);
+    }
 
     if (ti->dat == NULL) {
         track_mark_unformatted(d, tracknr);
@@ -254,8 +278,8 @@ int dsk_write_raw(
         return -1;
     }
 
-    stream_reset(s);
-    stream_next_index(s);
+    /* Measure the first full revolution, from a checkpoint if possible. */
+    stream_seek(s, 2, 0);
 
     if (ti->total_bits == 0) {
         ti->total_bits = s->track_len_bc ? : default_len;
@@ -75,39 +75,200 @@ static void hfe_init(struct disk *d)
 }
 
 /* HFE dat bit order is LSB first. Switch to/from MSB first.  */
+static uint8_t bit_reverse_tab[256];
+static void __initcall bit_reverse_tab_init(void)
+{
+    unsigned int i, k;
+    for (i = 0; i < 256; i++)
+        for (k = 0; k < 8; k++)
+            if (i & (1u << k))
+                bit_reverse_tab[i] |= 0x80 >> k;
+}
+
 static void bit_reverse(uint8_t *block, unsigned int len)
 {
     while (len--) {
-        uint8_t x = *block, y, k;
-        for (k = y = 0; k < 8; k++) {
-            y <<= 1;
-            y |= x&1;
-            x >>= 1;
-        }
-        *block++ = y;
+        *block = bit_reverse_tab[*block];
+        block++;
     }
 }
 
+/* Extract @nr (<= 24) bits from MSB-first bitstream @p at bit offset @off. */
+static uint32_t bits_get(const uint8_t *p, unsigned int off, unsigned int nr)
+{
+    unsigned int i, bytes;
+    uint32_t x = 0;
+
+    p += off / 8;
+    off &= 7;
+    bytes = (off + nr + 7) / 8;
+    for (i = 0; i < bytes; i++)
+        x = (x << 8) | p[i];
+    return (x >> (bytes*8 - off - nr)) & ((1u << nr) - 1);
+}
+
+/* OR @nr (<= 24) bits of @x into MSB-first bitstream @p at bit offset @off. */
+static void bits_or(uint8_t *p, unsigned int off, uint32_t x, unsigned int nr)
+{
+    unsigned int i, bytes;
+
+    p += off / 8;
+    off &= 7;
+    bytes = (off + nr + 7) / 8;
+    x <<= bytes*8 - off - nr;
+    for (i = bytes; i--; x >>= 8)
+        p[i] |= (uint8_t)x;
+}
+
+/* Copy bits into a zero-initialised destination, up to 24 bits at a time, or
+ * by memcpy when source and destination are both byte aligned. */
 static void bit_copy(void *dst, unsigned int dst_off,
                      void *src, unsigned int src_off,
                      unsigned int nr)
 {
     uint8_t *s = src, *d = dst;
-    unsigned int i;
-    for (i = 0; i < nr; i++) {
-        uint8_t x = (s[src_off/8] >> (7-(src_off&7))) & 1;
-        d[dst_off/8] |= x << (7-(dst_off&7));
-        src_off++; dst_off++;
+    unsigned int n;
+
+    if (!(src_off & 7) && !(dst_off & 7)) {
+        memcpy(&d[dst_off/8], &s[src_off/8], nr/8);
+        n = nr & ~7;
+        src_off += n; dst_off += n; nr -= n;
+    }
+
+    while (nr) {
+        n = min_t(unsigned int, nr, 24);
+        bits_or(d, dst_off, bits_get(s, src_off, n), n);
+        src_off += n; dst_off += n; nr -= n;
+    }
+}
+
+/* Per-image state: tracks are decoded a cylinder at a time, on demand. */
+struct hfe_dat {
+    bool_t v3;
+    struct track_header thdr[256];
+};
+
+static void hfe_load_track(struct disk *d, unsigned int tracknr)
+{
+    struct hfe_dat *hfe = d->container_dat;
+    unsigned int i = tracknr / 2, j, len;
+    struct track_header *thdr = &hfe->thdr[i];
+    uint8_t *tbuf, *raw_dat[2];
+    bool_t v3 = hfe->v3;
+
+    /* Read into track buffer, padded up to 512-byte boundary. */
+    len = (thdr->len + 0x1ff) & ~0x1ff;
+    tbuf = memalloc(len);
+    lseek(d->fd, thdr->offset*512, SEEK_SET);
+    read_exact(d->fd, tbuf, len);
+    bit_reverse(tbuf, len);
+
+    /* Allocate track buffers and demux the data. */
+    raw_dat[0] = memalloc(len/2);
+    raw_dat[1] = memalloc(len/2);
+    for (j = 0; j < len; j += 512) {
+        memcpy(&raw_dat[0][j/2], &tbuf[j+  0], 256);
+        memcpy(&raw_dat[1][j/2], &tbuf[j+256], 256);
+    }
+    if (v3) {
+        /* HFEv3: process opcodes in the input byte stream. */
+        for (j = 0; j < 2; j++) {
+            uint8_t *new_dat, br = 0, *brs;
+            unsigned int inb = 0, outb = 0, opc, index_bc = 0, len_bc;
+            unsigned int rand = 0;
+            if (!d->track_pending[i*2+j]) {
+                memfree(raw_dat[j]);
+                continue;
+            }
+            new_dat = memalloc(len/2);
+            brs = memalloc(len/2+1);
+            while (inb/8 < len/2) {
+                brs[outb/8] = br;
+                BUG_ON(inb & 7);
+                opc = raw_dat[j][inb/8]; 
+                if ((opc & 0xf0) == 0xf0) {
+                    switch (opc & 0x0f) {
+                    case OP_nop:
+                        inb += 8;
+                        break;
+                    case OP_index:
+                        inb += 8;
+                        index_bc = outb;
+                        break;
+                    case OP_bitrate:
+                        br = raw_dat[j][inb/8+1];
+                        inb += 2*8;
+                        break;
+                    case OP_skip: {
+                        uint8_t skip = raw_dat[j][inb/8+1];
+                        inb += 2*8 + skip;
+                        BUG_ON(skip > 8);
+                        bit_copy(new_dat, outb, raw_dat[j], inb, 8-skip);
+                        inb += 8-skip; outb += 8-skip;
+                        break;
+                    }
+                    case OP_rand: {
+                        rand++;
+                        inb += 8; outb += 8;
+                        break;
+                    }
+                    default:
+                        fprintf(stderr,
+                                "Unknown HFEv3 opcode %02x\n", opc);
+                        BUG();
+                    }
+                } else {
+                    bit_copy(new_dat, outb, raw_dat[j], inb, 8);
+                    inb += 8; outb += 8;
+                }
+            }
+            /* Rotate track so index pulse is at bit 0. */
+            brs[outb/8] = br;
+            len_bc = outb;
+            memset(raw_dat[j], 0, len/2);
+            bit_copy(raw_dat[j], 0, new_dat, index_bc, len_bc-index_bc);
+            bit_copy(raw_dat[j], len_bc-index_bc, new_dat, 0, index_bc); 
+            memfree(new_dat);
+            /* Set up the track. */
+            setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
+                                    len_bc, raw_dat[j]);
+            /* HACK: Poke the non-uniform speed values. */
+            {
+                uint16_t *s = (uint16_t *)d->di->track[i*2+j].dat;
+                unsigned int k, av_br, cur_br;
+                av_br = (7200000 + len_bc/2) / len_bc;
+                for (k = 0; k < (outb+7)/8; k++) {
+                    cur_br = brs[(k+index_bc/8) % ((outb+7)/8)];
+                    s[k] = cur_br ? (cur_br*SPEED_AVG + av_br/2) / av_br
+                        : SPEED_AVG;
+                }
+            }
+            memfree(raw_dat[j]);
+            memfree(brs);
+            if (rand != 0)
+                fprintf(stderr, "T%d.%d: HFEv3: WARNING: %d unsupported "
+                        "random bytes\n", i, j, rand);
+        }
+    } else {
+        /* Original HFE */
+        for (j = 0; j < 2; j++) {
+            if (d->track_pending[i*2+j])
+                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
+                                        thdr->len*4, raw_dat[j]);
+            memfree(raw_dat[j]);
+        }
     }
+
+    memfree(tbuf);
+    d->track_pending[i*2] = d->track_pending[i*2+1] = 0;
 }
 
 static struct container *hfe_open(struct disk *d)
 {
     struct disk_header dhdr;
-    struct track_header thdr;
     struct disk_info *di;
-    unsigned int i, j, len;
-    uint8_t *tbuf, *raw_dat[2];
+    struct hfe_dat *hfe;
+    unsigned int i;
     bool_t v3 = 0;
 
     lseek(d->fd, 0, SEEK_SET);
@@ -123,155 +284,90 @@ static struct container *hfe_open(struct disk *d)
 
     dhdr.track_list_offset = le16toh(dhdr.track_list_offset);
 
+    /* Only the track list is read now. Track data is loaded on first use. */
+    hfe = memalloc(sizeof(*hfe));
+    hfe->v3 = v3;
+    lseek(d->fd, dhdr.track_list_offset*512, SEEK_SET);
+    read_exact(d->fd, hfe->thdr, dhdr.nr_tracks * 4);
+    for (i = 0; i < dhdr.nr_tracks; i++) {
+        hfe->thdr[i].offset = le16toh(hfe->thdr[i].offset);
+        hfe->thdr[i].len = le16toh(hfe->thdr[i].len);
+    }
+
     d->di = di = memalloc(sizeof(*di));
     di->nr_tracks = dhdr.nr_tracks * 2;
     di->track = memalloc(di->nr_tracks * sizeof(struct track_info));
-
-    for (i = 0; i < dhdr.nr_tracks; i++) {
-        lseek(d->fd, dhdr.track_list_offset*512 + i*4, SEEK_SET);
-        read_exact(d->fd, &thdr, 4);
-        thdr.offset = le16toh(thdr.offset);
-        thdr.len = le16toh(thdr.len);
-
-        /* Read into track buffer, padded up to 512-byte boundary. */
-        len = (thdr.len + 0x1ff) & ~0x1ff;
-        tbuf = memalloc(len);
-        lseek(d->fd, thdr.offset*512, SEEK_SET);
-        read_exact(d->fd, tbuf, len);
-        bit_reverse(tbuf, len);
-
-        /* Allocate track buffers and demux the data. */
-        raw_dat[0] = memalloc(len/2);
-        raw_dat[1] = memalloc(len/2);
-        for (j = 0; j < len; j += 512) {
-            memcpy(&raw_dat[0][j/2], &tbuf[j+  0], 256);
-            memcpy(&raw_dat[1][j/2], &tbuf[j+256], 256);
-        }
-        if (v3) {
-            /* HFEv3: process opcodes in the input byte stream. */
-            for (j = 0; j < 2; j++) {
-                uint8_t *new_dat = memalloc(len/2);
-                uint8_t br = 0, *brs = memalloc(len/2+1);
-                unsigned int inb = 0, outb = 0, opc, index_bc = 0, len_bc;
-                unsigned int rand = 0;
-                while (inb/8 < len/2) {
-                    brs[outb/8] = br;
-                    BUG_ON(inb & 7);
-                    opc = raw_dat[j][inb/8]; 
-                    if ((opc & 0xf0) == 0xf0) {
-                        switch (opc & 0x0f) {
-                        case OP_nop:
-                            inb += 8;
-                            break;
-                        case OP_index:
-                            inb += 8;
-                            index_bc = outb;
-                            break;
-                        case OP_bitrate:
-                            br = raw_dat[j][inb/8+1];
-                            inb += 2*8;
-                            break;
-                        case OP_skip: {
-                            uint8_t skip = raw_dat[j][inb/8+1];
-                            inb += 2*8 + skip;
-                            BUG_ON(skip > 8);
-                            bit_copy(new_dat, outb, raw_dat[j], inb, 8-skip);
-                            inb += 8-skip; outb += 8-skip;
-                            break;
-                        }
-                        case OP_rand: {
-                            rand++;
-                            inb += 8; outb += 8;
-                            break;
-                        }
-                        default:
-                            fprintf(stderr,
-                                    "Unknown HFEv3 opcode %02x\n", opc);
-                            BUG();
-                        }
-                    } else {
-                        bit_copy(new_dat, outb, raw_dat[j], inb, 8);
-                        inb += 8; outb += 8;
-                    }
-                }
-                /* Rotate track so index pulse is at bit 0. */
-                brs[outb/8] = br;
-                len_bc = outb;
-                memset(raw_dat[j], 0, len/2);
-                bit_copy(raw_dat[j], 0, new_dat, index_bc, len_bc-index_bc);
-                bit_copy(raw_dat[j], len_bc-index_bc, new_dat, 0, index_bc); 
-                memfree(new_dat);
-                /* Set up the track. */
-                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
-                                        len_bc, raw_dat[j]);
-                /* HACK: Poke the non-uniform speed values. */
-                {
-                    uint16_t *s = (uint16_t *)d->di->track[i*2+j].dat;
-                    unsigned int k, av_br, cur_br;
-                    av_br = (7200000 + len_bc/2) / len_bc;
-                    for (k = 0; k < (outb+7)/8; k++) {
-                        cur_br = brs[(k+index_bc/8) % ((outb+7)/8)];
-                        s[k] = cur_br ? (cur_br*SPEED_AVG + av_br/2) / av_br
-                            : SPEED_AVG;
-                    }
-                }
-                memfree(raw_dat[j]);
-                memfree(brs);
-                if (rand != 0)
-                    fprintf(stderr, "T%d.%d: HFEv3: WARNING: %d unsupported "
-                            "random bytes\n", i, j, rand);
-            }
-        } else {
-            /* Original HFE */
-            for (j = 0; j < 2; j++) {
-                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
-                                        thdr.len*4, raw_dat[j]);
-                memfree(raw_dat[j]);
-            }
-        }
-
-        memfree(tbuf);
-    }
+    d->container_dat = hfe;
+    d->track_pending = memalloc(di->nr_tracks);
+    memset(d->track_pending, 1, di->nr_tracks);
 
     return &container_hfe;
 }
 
+/* Write one side of a cylinder: @len bytes into every other 256-byte half
+ * of @dst's 512-byte blocks, in HFE (LSB-first) bit order. @lin is scratch
+ * space of @len bytes for the linear bitstream. */
 static void write_bits(
     struct track_raw *raw,
     uint8_t *dst,
+    uint8_t *lin,
     unsigned int len)
 {
-    unsigned int i, bit;
-    uint8_t x;
+    unsigned int i, bit, nr, nr_bits = len*8, bitlen = raw->bitlen;
 
     /* Rotate the track so gap is at index. */
     bit = raw->write_splice_bc;
     if (bit > raw->data_start_bc)
         bit = 0; /* don't mess with an already-aligned track */
 
-    i = x = 0;
-    while (i < len*8) {
-        /* Consume a bit. */
-        x <<= 1;
-        x |= !!(raw->bits[bit>>3] & (0x80 >> (bit & 7)));
-        /* Deal with byte and block boundaries. */
-        if (!(++i & 7)) {
-            *dst++ = x;
-            /* Only half of each 512-byte block belongs to this track. */
-            if (!(i & (256*8-1)))
-                dst += 256;
-        }
-        /* Deal with wrap. */
-        if (++bit >= raw->bitlen)
-            bit = 0;
-        /* If we consumed all bits then repeat last 16 bits as extra gap. */
-        if ((i >= raw->bitlen) && !((i - raw->bitlen) & 15)) {
-            int new_bit = (int)bit - 16;
-            bit = (new_bit < 0) ? new_bit + raw->bitlen : new_bit;
-        }
+    memset(lin, 0, len);
+    nr = min(bitlen - bit, nr_bits);
+    bit_copy(lin, 0, raw->bits, bit, nr);
+    bit_copy(lin, nr, raw->bits, 0, min(bit, nr_bits - nr));
+
+    /* If we consumed all bits then repeat last 16 bits as extra gap. Each
+     * copy doubles the run of pattern available to copy from. */
+    for (i = bitlen; i < nr_bits; i += nr) {
+        nr = min((i - (bitlen - 16)) & ~15u, nr_bits - i);
+        bit_copy(lin, i, lin, bitlen - 16, nr);
+    }
+
+    /* Only half of each 512-byte block belongs to this track. */
+    for (i = 0; i < len; i++)
+        dst[(i & ~255u) * 2 + (i & 255)] = bit_reverse_tab[lin[i]];
+}
+
+/* Read a track for HFE export. */
+static void read_track(struct disk *d, struct track_raw *raw,
+                       unsigned int tracknr)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    unsigned int i;
+
+    track_read_raw(raw, tracknr);
+
+    /* Unformatted tracks are random density, so skip speed check. 
+     * Also they are random length so do not share the track buffer 
+     * well with their neighbouring track on the same cylinder. Truncate 
+     * the random data to a default length. */
+    if (ti->type == TRKTYP_unformatted) {
+        raw->bitlen = min(raw->bitlen, DEFAULT_BITS_PER_TRACK(d));
+        return;
+    }
+
+    /* HFE tracks are uniform density. */
+    for (i = 0; i < raw->bitlen; i++) {
+        if (raw->speed[i] == 1000)
+            continue;
+        fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
+                "correctly written to an HFE file\n",
+                tracknr/2, tracknr&1);
+        break;
     }
 }
 
+/* Tracks are generated and written a cylinder at a time, and the track LUT
+ * is filled in at the end, once all track lengths are known. */
 static void hfe_close(struct disk *d)
 {
     union {
@@ -280,37 +376,17 @@ static void hfe_close(struct disk *d)
         struct track_header thdr[128];
     } block;
     struct disk_info *di = d->di;
-    struct track_header *thdr;
-    struct track_raw *_raw[di->nr_tracks], **raw = _raw;
-    unsigned int i, j, off, bitlen, bytelen, len;
+    struct track_raw *raw[2];
+    unsigned int i, off, bitlen, bytelen, len;
     bool_t is_st, is_amiga;
-    uint8_t *tbuf;
+    uint8_t *tbuf, *lin;
+
+    /* Tracks not yet loaded are about to be truncated away. */
+    disk_load_all_tracks(d);
 
     is_st = di->nr_tracks && (di->track[0].type == TRKTYP_atari_st_720kb);
     is_amiga = di->nr_tracks && (di->track[0].type == TRKTYP_amigados);
 
-    for (i = 0; i < di->nr_tracks; i++) {
-        raw[i] = track_alloc_raw_buffer(d);
-        track_read_raw(raw[i], i);
-        /* Unformatted tracks are random density, so skip speed check. 
-         * Also they are random length so do not share the track buffer 
-         * well with their neighbouring track on the same cylinder. Truncate 
-         * the random data to a default length. */
-        if (di->track[i].type == TRKTYP_unformatted) {
-            raw[i]->bitlen = min(raw[i]->bitlen, DEFAULT_BITS_PER_TRACK(d));
-            continue;
-        }
-        /* HFE tracks are uniform density. */
-        for (j = 0; j < raw[i]->bitlen; j++) {
-            if (raw[i]->speed[j] == 1000)
-                continue;
-            fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
-                    "correctly written to an HFE file\n",
-                    i/2, i&1);
-            break;
-        }
-    }
-
     lseek(d->fd, 0, SEEK_SET);
     if (ftruncate(d->fd, 0) < 0)
         err(1, NULL);
@@ -333,44 +409,47 @@ static void hfe_close(struct disk *d)
     };
     write_exact(d->fd, block.x, 512);
 
-    /* Block 1: Track LUT. */
+    /* Block 1: Track LUT. Reserved now, written last. */
     memset(block.x, 0xff, 512);
-    thdr = block.thdr;
-    off = 2;
-    for (i = 0; i < di->nr_tracks/2; i++) {
-        bitlen = max(raw[i*2]->bitlen, raw[i*2+1]->bitlen);
-        bytelen = ((bitlen + 7) / 8) * 2;
-        thdr->offset = htole16(off);
-        thdr->len = htole16(bytelen);
-        off += (bytelen + 0x1ff) >> 9;
-        thdr++;
-    }
     write_exact(d->fd, block.x, 512);
 
+    off = 2;
     for (i = 0; i < di->nr_tracks/2; i++) {
+        /* Fresh buffers per track: each starts from the initial PRNG seed. */
+        raw[0] = track_alloc_raw_buffer(d);
+        raw[1] = track_alloc_raw_buffer(d);
+        read_track(d, raw[0], i*2);
+        read_track(d, raw[1], i*2+1);
+
         bitlen = max(raw[0]->bitlen, raw[1]->bitlen);
         bytelen = ((bitlen + 7) / 8) * 2;
         len = (bytelen + 0x1ff) & ~0x1ff;
-        tbuf = memalloc(len);
-
-        write_bits(raw[0], &tbuf[0], len/2);
-        write_bits(raw[1], &tbuf[256], len/2);
+        block.thdr[i].offset = htole16(off);
+        block.thdr[i].len = htole16(bytelen);
+        off += len >> 9;
 
-        bit_reverse(tbuf, len);
+        tbuf = memalloc(len);
+        lin = memalloc(len/2);
+        write_bits(raw[0], &tbuf[0], lin, len/2);
+        write_bits(raw[1], &tbuf[256], lin, len/2);
         write_exact(d->fd, tbuf, len);
+        memfree(lin);
         memfree(tbuf);
 
         track_free_raw_buffer(raw[0]);
         track_free_raw_buffer(raw[1]);
-        raw += 2;
     }
+
+    lseek(d->fd, 512, SEEK_SET);
+    write_exact(d->fd, block.x, 512);
 }
 
 struct container container_hfe = {
     .init = hfe_init,
     .open = hfe_open,
     .close = hfe_close,
-    .write_raw = dsk_write_raw
+    .write_raw = dsk_write_raw,
+    .load_track = hfe_load_track
 };
 
 /*
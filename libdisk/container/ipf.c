@@ -121,13 +121,17 @@ struct ipf_block {
 /* Data stream chunk codes. */
 enum chkcode { chkEnd=0, chkSync, chkData, chkGap, chkRaw, chkFlaky };
 
+/* Chunk payloads are staged separately and copied into the track data area,
+ * behind their header, as each chunk completes. */
 struct ipf_tbuf {
     struct tbuf tbuf;
     uint8_t *dat;
-    unsigned int len, bits;
+    unsigned int len;
+    uint8_t *chunk;
+    unsigned int chunklen, bits;
     unsigned int decoded_bits;
     unsigned int blockstart;
-    unsigned int chunkstart, chunktype;
+    unsigned int chunktype;
     unsigned int nr_blks, nr_sync;
     uint32_t encoder;
     bool_t need_sps_encoder;
@@ -141,38 +145,39 @@ struct ipf_tbuf {
 static void ipf_tbuf_finish_chunk(
     struct ipf_tbuf *ibuf, unsigned int new_chunktype)
 {
-    unsigned int chunklen, cntlen, i, j;
+    unsigned int chunklen, cntlen, i;
 
-    chunklen = ibuf->len - ibuf->chunkstart;
+    chunklen = ibuf->chunklen;
     if (ibuf->encoder == ENC_SPS)
         chunklen = chunklen*8 + ibuf->bits;
     else if (ibuf->bits != 0)
         ibuf->need_sps_encoder = 1;
 
     if (ibuf->bits != 0) {
-        ibuf->len++;
+        ibuf->chunklen++;
         ibuf->bits = 0;
     }
 
     if (chunklen == 0)
         goto out;
 
-    if (ibuf->chunktype == chkFlaky)
-        ibuf->len = ibuf->chunkstart;
-
     for (i = chunklen, cntlen = 0; i > 0; i >>= 8)
         cntlen++;
-    memmove(&ibuf->dat[ibuf->chunkstart + 1 + cntlen],
-            &ibuf->dat[ibuf->chunkstart], ibuf->len - ibuf->chunkstart);
-    ibuf->dat[ibuf->chunkstart] = ibuf->chunktype | (cntlen << 5);
-    for (i = chunklen, j = 0; i > 0; i >>= 8, j++)
-        ibuf->dat[ibuf->chunkstart + cntlen - j] = (uint8_t)i;
-    ibuf->len += 1 + cntlen;
+    BUG_ON(ibuf->len + 1 + cntlen + ibuf->chunklen + 1 > MAX_DATA_PER_TRACK);
+    ibuf->dat[ibuf->len++] = ibuf->chunktype | (cntlen << 5);
+    for (i = cntlen; i-- != 0; )
+        ibuf->dat[ibuf->len++] = (uint8_t)(chunklen >> (i*8));
+    if (ibuf->chunktype != chkFlaky) {
+        memcpy(&ibuf->dat[ibuf->len], ibuf->chunk, ibuf->chunklen);
+        ibuf->len += ibuf->chunklen;
+    }
 
     if ((new_chunktype == chkEnd) ||
         ((new_chunktype == chkSync) && ibuf->nr_sync++ &&
          !ibuf->tbuf.disable_auto_sector_split)) {
-        struct ipf_block *blk = &ibuf->blk[ibuf->nr_blks++];
+        struct ipf_block *blk;
+        BUG_ON(ibuf->nr_blks >= MAX_BLOCKS_PER_TRACK);
+        blk = &ibuf->blk[ibuf->nr_blks++];
         blk->blockbits = ibuf->decoded_bits;
         blk->enctype = 1; /* MFM */
         blk->dataoffset = ibuf->blockstart;
@@ -191,16 +196,17 @@ static void ipf_tbuf_finish_chunk(
     }
 
 out:
-    ibuf->chunkstart = ibuf->len;
+    memset(ibuf->chunk, 0, ibuf->chunklen);
+    ibuf->chunklen = 0;
     ibuf->chunktype = new_chunktype;
 }
 
-static void ipf_tbuf_bit(
+static void ipf_tbuf_bits(
     struct tbuf *tbuf, uint16_t speed,
-    enum bitcell_encoding enc, uint8_t dat)
+    enum bitcell_encoding enc, unsigned int bits, uint32_t x)
 {
     struct ipf_tbuf *ibuf = container_of(tbuf, struct ipf_tbuf, tbuf);
-    unsigned int chunktype = (enc == bc_raw) ? chkSync : chkData;
+    unsigned int n, chunktype = (enc == bc_raw) ? chkSync : chkData;
 
     if (speed != SPEED_AVG)
         ibuf->is_var_density = 1;
@@ -208,14 +214,29 @@ static void ipf_tbuf_bit(
     if (chunktype != ibuf->chunktype)
         ipf_tbuf_finish_chunk(ibuf, chunktype);
 
-    ibuf->dat[ibuf->len] |= dat << (7 - ibuf->bits);
-    ibuf->decoded_bits += (enc == bc_raw) ? 1 : 2;
-    if (++ibuf->bits == 8) {
-        ibuf->bits = 0;
-        ibuf->len++;
+    ibuf->decoded_bits += (enc == bc_raw) ? bits : 2*bits;
+
+    /* Pack into the chunk payload, filling the partial byte first. */
+    BUG_ON(ibuf->chunklen + 5 > MAX_DATA_PER_TRACK);
+    while (bits != 0) {
+        n = min(bits, 8 - ibuf->bits);
+        bits -= n;
+        ibuf->chunk[ibuf->chunklen] |=
+            ((x >> bits) & ((1u << n) - 1)) << (8 - ibuf->bits - n);
+        if ((ibuf->bits += n) == 8) {
+            ibuf->bits = 0;
+            ibuf->chunklen++;
+        }
     }
 }
 
+static void ipf_tbuf_bit(
+    struct tbuf *tbuf, uint16_t speed,
+    enum bitcell_encoding enc, uint8_t dat)
+{
+    ipf_tbuf_bits(tbuf, speed, enc, 1, dat);
+}
+
 static void ipf_tbuf_gap(
     struct tbuf *tbuf, uint16_t speed, unsigned int bits)
 {
@@ -240,9 +261,10 @@ static void ipf_tbuf_weak(
 {
     struct ipf_tbuf *ibuf = container_of(tbuf, struct ipf_tbuf, tbuf);
 
+    /* Flaky chunks carry only a length: the payload is never copied out. */
     ipf_tbuf_finish_chunk(ibuf, chkFlaky);
     ibuf->decoded_bits += 2*bits;
-    ibuf->len += bits/8;
+    ibuf->chunklen += bits/8;
     ibuf->bits = bits&7;
 }
 
@@ -279,14 +301,15 @@ static bool_t __ipf_close(struct disk *d, uint32_t encoder)
     time_t t;
     struct tm tm;
     struct ipf_info info;
-    struct ipf_img *_img, *img;
-    struct ipf_block *_blk, *blk;
-    struct ipf_data *_idata, *idata;
-    uint8_t *_dat, *dat;
+    struct ipf_img *img;
+    struct ipf_block *blk;
+    struct ipf_data idata;
+    uint8_t *dat, *chunk;
     struct disk_info *di = d->di;
     struct track_info *ti;
     struct ipf_tbuf ibuf;
     unsigned int i, j;
+    off_t imge_off;
 
     lseek(d->fd, 0, SEEK_SET);
     if (ftruncate(d->fd, 0) < 0)
@@ -311,10 +334,18 @@ static bool_t __ipf_close(struct disk *d, uint32_t encoder)
     info.platform[0] = 1; /* Amiga */
     ipf_write_chunk(d, "INFO", &info, sizeof(info));
 
-    _img = img = memalloc(di->nr_tracks * sizeof(*img));
-    _idata = idata = memalloc(di->nr_tracks * sizeof(*idata));
-    _blk = blk = memalloc(di->nr_tracks * MAX_BLOCKS_PER_TRACK * sizeof(*blk));
-    _dat = dat = memalloc(di->nr_tracks * MAX_DATA_PER_TRACK);
+    /* The IMGE chunks are written back-to-back ahead of all DATA chunks. They
+     * are fixed size, so leave space for them and stream out each track's 
+     * DATA as soon as it is encoded. Only one track's data is held at once. */
+    imge_off = lseek(d->fd, 0, SEEK_CUR);
+    lseek(d->fd, di->nr_tracks * (sizeof(struct ipf_header) + sizeof(*img)),
+          SEEK_CUR);
+
+    img = memalloc(di->nr_tracks * sizeof(*img));
+    blk = memalloc(MAX_BLOCKS_PER_TRACK * sizeof(*blk));
+    dat = memalloc(MAX_DATA_PER_TRACK);
+    chunk = memalloc(MAX_DATA_PER_TRACK);
+    memset(&idata, 0, sizeof(idata));
 
     for (i = 0; i < di->nr_tracks; i++) {
         ti = &di->track[i];
@@ -324,54 +355,53 @@ static bool_t __ipf_close(struct disk *d, uint32_t encoder)
 
         if (((int)ti->total_bits < 0) && (i != 0) && d->kryoflux_hack) {
             /* Fill empty track from previous track. Fixes writeback to floppy
-             * using DTC, which ignore single-sided and max-cyl parameters. */
-            memcpy(img, img-1, sizeof(*img));
-            memcpy(idata, idata-1, sizeof(*idata));
-            ibuf.len = idata->size - img->blkcnt * sizeof(*blk);
-            memcpy(dat, dat - ibuf.len, ibuf.len * sizeof(*dat));
-            memcpy(blk, blk - img->blkcnt, img->blkcnt * sizeof(*blk));
+             * using DTC, which ignore single-sided and max-cyl parameters.
+             * The previous track's DATA is still in idata, blk and dat. */
+            memcpy(&img[i], &img[i-1], sizeof(*img));
+        } else {
+            memset(&idata, 0, sizeof(idata));
         }
 
-        img->cyl = i / 2;
-        img->head = i & 1;
-        img->sigtype = 1; /* 2us bitcell */
-        idata->dat_chunk = img->dat_chunk = i + 1;
+        img[i].cyl = i / 2;
+        img[i].head = i & 1;
+        img[i].sigtype = 1; /* 2us bitcell */
+        idata.dat_chunk = img[i].dat_chunk = i + 1;
 
         if ((int)ti->total_bits < 0) {
             /* Unformatted tracks are handled by the IPF decoder library. */
-            img->dentype = img->dentype ?: denNoise;
+            img[i].dentype = img[i].dentype ?: denNoise;
         } else {
             /* Basic track metadata. */
-            img->dentype = 
+            img[i].dentype = 
                 track_is_copylock(ti) ? denCopylock :
                 (ti->type == TRKTYP_speedlock) ? denSpeedlock :
                 denUniform;
-            img->startbit = ti->data_bitoff - PREPEND_BITS;
-            if ((int)img->startbit < 0)
-                img->startbit += ti->total_bits;
-            img->startpos = floor_bits_to_bytes(img->startbit);
-            img->trkbits = ti->total_bits;
-            img->trksize = ceil_bits_to_bytes(img->trkbits);
+            img[i].startbit = ti->data_bitoff - PREPEND_BITS;
+            if ((int)img[i].startbit < 0)
+                img[i].startbit += ti->total_bits;
+            img[i].startpos = floor_bits_to_bytes(img[i].startbit);
+            img[i].trkbits = ti->total_bits;
+            img[i].trksize = ceil_bits_to_bytes(img[i].trkbits);
 
             /* Go get the encoded track data. */
+            memset(blk, 0, MAX_BLOCKS_PER_TRACK * sizeof(*blk));
             ibuf.tbuf.prng_seed = TBUF_PRNG_INIT;
             ibuf.tbuf.bit = ipf_tbuf_bit;
+            ibuf.tbuf.bits = ipf_tbuf_bits;
             ibuf.tbuf.gap = ipf_tbuf_gap;
             ibuf.tbuf.weak = ipf_tbuf_weak;
             ibuf.dat = dat;
+            ibuf.chunk = chunk;
             ibuf.blk = blk;
             ibuf.chunktype = chkGap;
             ibuf.decoded_bits = PREPEND_BITS;
-            ibuf.len = ibuf.decoded_bits / 16;
+            ibuf.chunklen = ibuf.decoded_bits / 16;
             ibuf.bits = (ibuf.decoded_bits / 2) & 7;
             handlers[ti->type]->read_raw(d, i, &ibuf.tbuf);
 
             ipf_tbuf_finish_chunk(&ibuf, chkEnd);
 
-            BUG_ON(ibuf.nr_blks > MAX_BLOCKS_PER_TRACK);
-            BUG_ON(ibuf.len > MAX_DATA_PER_TRACK);
-
-            if (ibuf.is_var_density && img->dentype == denUniform)
+            if (ibuf.is_var_density && img[i].dentype == denUniform)
                 trk_warn(ti, i, "IPF: unsupported variable density!");
 
             if (ibuf.need_sps_encoder) {
@@ -382,59 +412,49 @@ static bool_t __ipf_close(struct disk *d, uint32_t encoder)
 
             /* Sum the per-block data & gap sizes. */
             for (j = 0; j < ibuf.nr_blks; j++) {
-                img->databits += blk[j].blockbits;
-                img->gapbits += blk[j].gapbits;
+                img[i].databits += blk[j].blockbits;
+                img[i].gapbits += blk[j].gapbits;
                 blk[j].dataoffset += ibuf.nr_blks * sizeof(*blk);
             }
 
             /* Track gap is appended to final block. */
-            blk[j-1].gapbits += img->trkbits - img->databits - img->gapbits;
+            blk[j-1].gapbits += img[i].trkbits - img[i].databits
+                - img[i].gapbits;
             if (encoder == ENC_CAPS)
                 blk[j-1].u.caps.gapsize = ceil_bits_to_bytes(blk[j-1].gapbits);
 
             /* Finish the IMGE chunk. */
-            img->gapbits = img->trkbits - img->databits;
-            img->blkcnt = ibuf.nr_blks;
+            img[i].gapbits = img[i].trkbits - img[i].databits;
+            img[i].blkcnt = ibuf.nr_blks;
             if (ibuf.tbuf.raw.has_weak_bits)
-                img->flags |= IMGF_FLAKEY;
+                img[i].flags |= IMGF_FLAKEY;
 
             /* Convert endianness of all block descriptors. */
-            for (j = 0; j < img->blkcnt * sizeof(*blk) / 4; j++)
+            for (j = 0; j < img[i].blkcnt * sizeof(*blk) / 4; j++)
                 ((uint32_t *)blk)[j] = htobe32(((uint32_t *)blk)[j]);
 
             /* Finally, compute DATA CRC. */
-            idata->size = ibuf.len + ibuf.nr_blks * sizeof(*blk);
-            idata->bsize = idata->size * 8;
-            idata->dcrc = crc32(blk, ibuf.nr_blks * sizeof(*blk));
-            idata->dcrc = crc32_add(dat, ibuf.len, idata->dcrc);
+            idata.size = ibuf.len + ibuf.nr_blks * sizeof(*blk);
+            idata.bsize = idata.size * 8;
+            idata.dcrc = crc32(blk, ibuf.nr_blks * sizeof(*blk));
+            idata.dcrc = crc32_add(dat, ibuf.len, idata.dcrc);
         }
 
-        /* We write the IMGE chunks back-to-back; defer DATA until after. */
-        ipf_write_chunk(d, "IMGE", img, sizeof(*img));
-
-        dat += ibuf.len;
-        blk += img->blkcnt;
-        idata++; img++;
+        ipf_write_chunk(d, "DATA", &idata, sizeof(idata));
+        write_exact(d->fd, blk, img[i].blkcnt * sizeof(*blk));
+        write_exact(d->fd, dat, idata.size - img[i].blkcnt * sizeof(*blk));
     }
 
-    idata = _idata;
-    img = _img;
-    blk = _blk;
-    dat = _dat;
-    for (i = 0; i < di->nr_tracks; i++) {
-        ipf_write_chunk(d, "DATA", idata, sizeof(*idata));
-        write_exact(d->fd, blk, img->blkcnt * sizeof(*blk));
-        write_exact(d->fd, dat, idata->size - img->blkcnt * sizeof(*blk));
-        dat += idata->size - img->blkcnt * sizeof(*blk);
-        blk += img->blkcnt;
-        idata++; img++;
-    }
+    /* Go back and fill in the IMGE chunks. */
+    lseek(d->fd, imge_off, SEEK_SET);
+    for (i = 0; i < di->nr_tracks; i++)
+        ipf_write_chunk(d, "IMGE", &img[i], sizeof(*img));
 
 out:
-    memfree(_img);
-    memfree(_idata);
-    memfree(_blk);
-    memfree(_dat);
+    memfree(img);
+    memfree(blk);
+    memfree(dat);
+    memfree(chunk);
     return i == di->nr_tracks; /* success? */
 }
 
@@ -9,6 +9,7 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -144,15 +145,46 @@ void disk_close(struct disk *d)
         memfree(di->track[i].dat);
     memfree(di->track);
     memfree(di);
+    memfree(d->track_pending);
+    memfree(d->container_dat);
     close(d->fd);
     memfree(d);
 }
 
 struct disk_info *disk_get_info(struct disk *d)
 {
+    /* Callers may inspect any track, so nothing can remain pending. */
+    disk_load_all_tracks(d);
     return d->di;
 }
 
+struct track_info *disk_track_info(struct disk *d, unsigned int tracknr)
+{
+    if (d->track_pending && d->track_pending[tracknr]) {
+        d->container->load_track(d, tracknr);
+        BUG_ON(d->track_pending[tracknr]);
+    }
+    return &d->di->track[tracknr];
+}
+
+void disk_load_all_tracks(struct disk *d)
+{
+    unsigned int i;
+
+    if (!d->track_pending)
+        return;
+
+    for (i = 0; i < d->di->nr_tracks; i++)
+        (void)disk_track_info(d, i);
+}
+
+/* A track is being overwritten: it must not be loaded from the container. */
+static void track_clear_pending(struct disk *d, unsigned int tracknr)
+{
+    if (d->track_pending)
+        d->track_pending[tracknr] = 0;
+}
+
 struct track_raw *track_alloc_raw_buffer(struct disk *d)
 {
     struct tbuf *tbuf = memalloc(sizeof(*tbuf));
@@ -188,7 +220,7 @@ void track_read_raw(struct track_raw *track_raw, unsigned int tracknr)
 
     if (tracknr >= di->nr_tracks)
         return;
-    ti = &di->track[tracknr];
+    ti = disk_track_info(d, tracknr);
 
     if ((int32_t)ti->total_bits > 0)
         tbuf_init(tbuf, ti->data_bitoff, ti->total_bits);
@@ -218,6 +250,7 @@ int track_write_raw_from_stream(
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
 
+    track_clear_pending(d, tracknr);
     memfree(ti->dat);
     ti->dat = NULL;
 
@@ -263,7 +296,7 @@ int track_read_sectors(
 
     if (tracknr >= di->nr_tracks)
         return -1;
-    ti = &di->track[tracknr];
+    ti = disk_track_info(d, tracknr);
 
     thnd = handlers[ti->type];
     if (thnd->read_sectors == NULL)
@@ -288,6 +321,7 @@ int track_write_sectors(
         return -1;
     ti = &di->track[tracknr];
 
+    track_clear_pending(d, tracknr);
     memfree(ti->dat);
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, type);
@@ -323,6 +357,7 @@ void track_mark_unformatted(
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
 
+    track_clear_pending(d, tracknr);
     memfree(ti->dat);
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, TRKTYP_unformatted);
@@ -401,7 +436,7 @@ void track_get_format_name(
         return;
     }
 
-    ti = &di->track[tracknr];
+    ti = disk_track_info(d, tracknr);
     thnd = handlers[ti->type];
 
     if (thnd->get_name)
@@ -455,6 +490,118 @@ void init_track_info(struct track_info *ti, enum track_type type)
     ti->len = ti->bytes_per_sector * ti->nr_sectors;
 }
 
+/* How far a sync may drift between revolutions, in bitcells. The first
+ * revolution's length is not measured until it ends: go by the nominal
+ * rotation period until then. */
+static int harvest_slop(struct stream *s)
+{
+    uint32_t len = s->track_len_bc;
+    if (s->nr_index < 2)
+        len = track_nsecs_from_rpm(s->data_rpm) / s->clock_centre;
+    return len / 64;
+}
+
+void sector_harvest_init(
+    struct sector_harvest *h, struct track_info *ti, struct stream *s)
+{
+    memset(h, 0, sizeof(*h));
+    h->ti = ti;
+    h->scan_index = s->nr_index;
+    h->scan_until = ~0u;
+}
+
+void sector_harvest_note(
+    struct sector_harvest *h, struct stream *s, int offset, int sec)
+{
+    unsigned int i;
+
+    stream_note_sync(s);
+
+    if ((sec < 0) || (sec >= h->ti->nr_sectors))
+        sec = -1;
+
+    for (i = 0; i < h->nr_syncs; i++) {
+        if (abs(offset - h->sync[i].offset) < harvest_slop(s)) {
+            if (h->sync[i].sec < 0)
+                h->sync[i].sec = sec;
+            return;
+        }
+    }
+
+    if (h->nr_syncs == ARRAY_SIZE(h->sync)) {
+        h->overflow = 1;
+        return;
+    }
+
+    h->sync[h->nr_syncs].offset = offset;
+    h->sync[h->nr_syncs].sec = sec;
+    h->nr_syncs++;
+}
+
+static bool_t harvest_is_target(struct sector_harvest *h, unsigned int i)
+{
+    return (h->sync[i].sec < 0) || !is_valid_sector(h->ti, h->sync[i].sec);
+}
+
+/* Can every invalid sector be reached via a sync we have already seen? */
+static bool_t harvest_can_skip(struct sector_harvest *h)
+{
+    unsigned int i, sec, nr_unkeyed = 0, nr_missing = 0;
+
+    if (h->overflow)
+        return 0;
+
+    for (i = 0; i < h->nr_syncs; i++)
+        if (h->sync[i].sec < 0)
+            nr_unkeyed++;
+
+    for (sec = 0; sec < h->ti->nr_sectors; sec++) {
+        if (is_valid_sector(h->ti, sec))
+            continue;
+        for (i = 0; i < h->nr_syncs; i++)
+            if (h->sync[i].sec == sec)
+                break;
+        if (i == h->nr_syncs)
+            nr_missing++;
+    }
+
+    return nr_missing <= nr_unkeyed;
+}
+
+int sector_harvest_next_bit(struct sector_harvest *h, struct stream *s)
+{
+    int i, pos, start, target, slop;
+
+    if ((s->nr_index == h->scan_index) && (s->index_offset_bc < h->scan_until))
+        return stream_next_bit(s);
+
+    /* Scan in full until we know where every invalid sector lies. */
+    h->scan_index = s->nr_index;
+    h->scan_until = ~0u;
+    if (!harvest_can_skip(h))
+        return stream_next_bit(s);
+
+    /* Find the window around the next sync of interest. If we are already 
+     * within it, scan every bitcell to its end. */
+    pos = s->index_offset_bc;
+    slop = harvest_slop(s);
+    target = INT_MAX;
+    for (i = 0; i < h->nr_syncs; i++) {
+        if (!harvest_is_target(h, i))
+            continue;
+        start = h->sync[i].offset - slop;
+        if ((start <= pos) && (pos < (h->sync[i].offset + slop))) {
+            h->scan_until = h->sync[i].offset + slop;
+            return stream_next_bit(s);
+        }
+        if ((start > pos) && (start < target))
+            target = start;
+    }
+
+    /* Fast-forward to the window, or to the index if none lies ahead. */
+    return stream_skip_to(s, (target == INT_MAX) ? ~0u : target);
+}
+
 static void change_bit(uint8_t *map, unsigned int bit, bool_t on)
 {
     if (on)
@@ -494,6 +641,7 @@ void tbuf_init(struct tbuf *tbuf, uint32_t bitstart, uint32_t bitlen)
     tbuf->crc16_ccitt = 0;
     tbuf->disable_auto_sector_split = 0;
     tbuf->bit = tbuf_bit;
+    tbuf->bits = NULL;
     tbuf->gap = NULL;
     tbuf->weak = NULL;
 
@@ -570,12 +718,27 @@ void tbuf_bits(struct tbuf *tbuf, uint16_t speed,
         enc = bc_mfm;
     }
 
-    for (i = bits-1; i >= 0; i--) {
-        uint8_t b = (x >> i) & 1;
-        if ((enc != bc_raw) || !(i & 1))
-            tbuf->crc16_ccitt = crc16_ccitt_bit(b, tbuf->crc16_ccitt);
-        tbuf->bit(tbuf, speed, enc, b);
+    if ((enc != bc_raw) && !(bits & 7)) {
+        /* Whole bytes: update the CRC a byte at a time. */
+        uint8_t b[4];
+        for (i = 0; i < bits/8; i++)
+            b[i] = x >> (bits - 8*(i+1));
+        tbuf->crc16_ccitt = crc16_ccitt(b, bits/8, tbuf->crc16_ccitt);
+    } else {
+        for (i = bits-1; i >= 0; i--)
+            if ((enc != bc_raw) || !(i & 1))
+                tbuf->crc16_ccitt = crc16_ccitt_bit(
+                    (x >> i) & 1, tbuf->crc16_ccitt);
     }
+
+    if (tbuf->bits != NULL) {
+        if (bits != 0)
+            tbuf->bits(tbuf, speed, enc, bits, x);
+        return;
+    }
+
+    for (i = bits-1; i >= 0; i--)
+        tbuf->bit(tbuf, speed, enc, (x >> i) & 1);
 }
 
 void tbuf_bytes(struct tbuf *tbuf, uint16_t speed,
@@ -592,8 +755,13 @@ void tbuf_bytes(struct tbuf *tbuf, uint16_t speed,
         enc = bc_mfm_even;
     }
 
+    /* Pass data down a longword at a time. */
     p = (uint8_t *)data;
-    for (i = 0; i < bytes; i++)
+    for (i = 0; i + 4 <= bytes; i += 4)
+        tbuf_bits(tbuf, speed, enc, 32,
+                  ((uint32_t)p[i] << 24) | (p[i+1] << 16) |
+                  (p[i+2] << 8) | p[i+3]);
+    for (; i < bytes; i++)
         tbuf_bits(tbuf, speed, enc, 8, p[i]);
 }
 
@@ -87,6 +87,7 @@ static void *ados_write_raw(
     unsigned int least_block = 0;
     uint64_t lat, latency[ti->nr_sectors];
     const struct ados_info *info = handlers[ti->type]->extra_data;
+    struct sector_harvest harvest;
 
     block = memalloc(EXT_SEC * ti->nr_sectors);
     for (i = 0; i < ti->nr_sectors; i++) {
@@ -95,7 +96,9 @@ static void *ados_write_raw(
             memcpy(&ext->dat[j*16], "-=[BAD SECTOR]=-", 16);
     }
 
-    while ((stream_next_bit(s) != -1) &&
+    sector_harvest_init(&harvest, ti, s);
+
+    while ((sector_harvest_next_bit(&harvest, s) != -1) &&
            (nr_valid_blocks != ti->nr_sectors)) {
 
         struct ados_hdr ados_hdr;
@@ -129,8 +132,12 @@ static void *ados_write_raw(
 
         ados_hdr.hdr_checksum = be32toh(ados_hdr.hdr_checksum);
         ados_hdr.dat_checksum = be32toh(ados_hdr.dat_checksum);
-        if ((amigados_checksum(&ados_hdr, 20) != ados_hdr.hdr_checksum) ||
-            (amigados_checksum(dat, STD_SEC) != ados_hdr.dat_checksum))
+        if (amigados_checksum(&ados_hdr, 20) != ados_hdr.hdr_checksum) {
+            sector_harvest_note(&harvest, s, idx_off, -1);
+            continue;
+        }
+        sector_harvest_note(&harvest, s, idx_off, ados_hdr.sector);
+        if (amigados_checksum(dat, STD_SEC) != ados_hdr.dat_checksum)
             continue;
 
         if ((ados_hdr.sector >= ti->nr_sectors) ||
@@ -322,6 +329,7 @@ struct track_handler amigados_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors
 };
@@ -330,6 +338,7 @@ struct track_handler amigados_varrate_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw
 };
 
@@ -337,6 +346,7 @@ struct track_handler amigados_extended_handler = {
     .bytes_per_sector = EXT_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .get_name = ados_get_name
 };
@@ -345,6 +355,7 @@ struct track_handler amigados_448a_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -356,6 +367,7 @@ struct track_handler amigados_8912_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -367,6 +379,7 @@ struct track_handler amigados_4251_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -378,6 +391,7 @@ struct track_handler amigados_2149_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -390,6 +404,7 @@ struct track_handler amigados_2959_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -401,6 +416,7 @@ struct track_handler amigados_8524_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -412,6 +428,7 @@ struct track_handler amigados_2429_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -423,6 +440,7 @@ struct track_handler amigados_4428_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -434,6 +452,7 @@ struct track_handler amigados_4429_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -445,6 +464,7 @@ struct track_handler amigados_2849_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -456,6 +476,7 @@ struct track_handler amigados_4292_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -467,6 +488,7 @@ struct track_handler amigados_5429_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .notes_sync = 1,
     .read_raw = ados_read_raw,
     .read_sectors = ados_read_sectors,
     .extra_data = & (struct ados_info) {
@@ -524,40 +546,48 @@ static void *ados_longtrack_write_raw(
 struct track_handler amigados_long_102200_handler = {
     .bytes_per_sector = 102200,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_long_103300_handler = {
     .bytes_per_sector = 103300,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_long_104400_handler = {
     .bytes_per_sector = 104400,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_long_105500_handler = {
     .bytes_per_sector = 105500,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_long_106600_handler = {
     .bytes_per_sector = 106600,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_long_108800_handler = {
     .bytes_per_sector = 108800,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_long_111000_handler = {
     .bytes_per_sector = 111000,
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 struct track_handler amigados_unknown_length_handler = {
     .write_raw = ados_longtrack_write_raw,
+    .notes_sync = 1,
 };
 
 /*
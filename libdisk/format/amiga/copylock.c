@@ -84,18 +84,81 @@ static uint32_t lfsr_next(uint32_t x)
     return ((x << 1) & ((1u << 23) - 1)) | (((x >> 22) ^ x) & 1);
 }
 
-static uint32_t lfsr_backward(uint32_t x, unsigned int delta)
+/* The LFSR is linear over GF(2), so a jump of 2^k steps in either direction
+ * is a fixed 23x23 bit matrix. We keep every such matrix for k=0..31, sliced
+ * into nibble lookup tables, so that any jump costs at most six lookups per
+ * set bit of the distance. lfsr_next8_tab[] holds the eight feedback bits
+ * shifted in by a byte-sized forward step, indexed by the state's top byte. */
+#define LFSR_NIBBLES 6
+static uint32_t lfsr_jump_tab[2][32][LFSR_NIBBLES][16];
+static uint8_t lfsr_next8_tab[256];
+
+static uint32_t lfsr_mul(uint32_t (*tab)[16], uint32_t x)
+{
+    unsigned int i;
+    uint32_t y = 0;
+    for (i = 0; i < LFSR_NIBBLES; i++)
+        y ^= tab[i][(x >> (i*4)) & 15];
+    return y;
+}
+
+static void __initcall lfsr_tab_init(void)
+{
+    uint32_t col[23];
+    unsigned int dir, k, i, v, b;
+
+    for (dir = 0; dir < 2; dir++) {
+        for (i = 0; i < 23; i++)
+            col[i] = dir ? lfsr_prev(1u << i) : lfsr_next(1u << i);
+        for (k = 0; k < 32; k++) {
+            uint32_t (*tab)[16] = lfsr_jump_tab[dir][k];
+            for (i = 0; i < LFSR_NIBBLES; i++) {
+                for (v = 0; v < 16; v++) {
+                    tab[i][v] = 0;
+                    for (b = 0; b < 4; b++)
+                        if ((v & (1u << b)) && ((i*4+b) < 23))
+                            tab[i][v] ^= col[i*4+b];
+                }
+            }
+            /* Square the matrix for the next power of two. */
+            for (i = 0; i < 23; i++)
+                col[i] = lfsr_mul(tab, col[i]);
+        }
+    }
+
+    for (v = 0; v < 256; v++) {
+        uint32_t x = v << 15;
+        for (i = 0; i < 8; i++)
+            x = lfsr_next(x);
+        lfsr_next8_tab[v] = (uint8_t)x;
+    }
+}
+
+static uint32_t lfsr_jump(unsigned int dir, uint32_t x, unsigned int delta)
 {
-    while (delta--)
-        x = lfsr_prev(x);
+    unsigned int k;
+    for (k = 0; delta != 0; k++, delta >>= 1)
+        if (delta & 1)
+            x = lfsr_mul(lfsr_jump_tab[dir][k], x);
     return x;
 }
 
+static uint32_t lfsr_backward(uint32_t x, unsigned int delta)
+{
+    return lfsr_jump(1, x, delta);
+}
+
 static uint32_t lfsr_forward(uint32_t x, unsigned int delta)
 {
-    while (delta--)
-        x = lfsr_next(x);
-    return x;
+    return lfsr_jump(0, x, delta);
+}
+
+/* Step forward eight bits at once. Bit 0 feeds back into all eight new bits
+ * (as the running xor), and the top byte's contribution is tabulated. */
+static uint32_t lfsr_next8(uint32_t x)
+{
+    return ((x << 8) & ((1u << 23) - 1))
+        ^ lfsr_next8_tab[x >> 15] ^ ((x & 1) ? 0xff : 0);
 }
 
 static uint8_t lfsr_byte(uint32_t x)
@@ -103,39 +166,51 @@ static uint8_t lfsr_byte(uint32_t x)
     return (uint8_t)(x >> 15);
 }
 
+/* Generate @nr data bytes from LFSR state @x; returns the following state.
+ * The 23-bit state holds the next 16 bytes' worth of overlapping windows, so
+ * we emit eight bytes per byte-sized step. */
+static uint32_t lfsr_gen(uint32_t x, uint8_t *dat, unsigned int nr)
+{
+    unsigned int i;
+
+    while (nr >= 8) {
+        for (i = 0; i < 8; i++)
+            *dat++ = (uint8_t)(x >> (15 - i));
+        x = lfsr_next8(x);
+        nr -= 8;
+    }
+
+    while (nr--) {
+        *dat++ = lfsr_byte(x);
+        x = lfsr_next(x);
+    }
+
+    return x;
+}
+
 /* Take LFSR state from start of one sector, to another. */
 static uint32_t lfsr_seek(
     struct copylock_info *info, uint32_t x,
     unsigned int from, unsigned int to)
 {
-    unsigned int sz;
-
-    while (from != to) {
-        if (from > to)
-            from--;
-        sz = 512;
-        if (from == 6)
-            sz -= sizeof(sec6_sig);
-        if (!info->sec6_lfsr_skips_sig && (from == 5))
-            sz += sizeof(sec6_sig);
-        while (sz--)
-            x = (from < to) ? lfsr_next(x) : lfsr_prev(x);
-        if (from < to)
-            from++;
+    unsigned int sec, delta = 0;
+
+    for (sec = min(from, to); sec < max(from, to); sec++) {
+        delta += 512;
+        if (sec == 6)
+            delta -= sizeof(sec6_sig);
+        if (!info->sec6_lfsr_skips_sig && (sec == 5))
+            delta += sizeof(sec6_sig);
     }
 
-    return x;
+    return (from < to) ? lfsr_forward(x, delta) : lfsr_backward(x, delta);
 }
 
 static bool_t lfsr_check(uint32_t lfsr, const uint8_t *dat, unsigned int nr)
 {
-    while (nr) {
-        if (*dat++ != lfsr_byte(lfsr))
-            break;
-        lfsr = lfsr_next(lfsr);
-        nr--;
-    }
-    return nr == 0;
+    uint8_t gen[512];
+    lfsr_gen(lfsr, gen, nr);
+    return !memcmp(gen, dat, nr);
 }
 
 /* Does sector-map validity have a discontiguity at specified sector? */
@@ -343,7 +418,8 @@ static void copylock_read_raw(
     struct track_info *ti = &d->di->track[tracknr];
     struct copylock_info *info = (struct copylock_info *)ti->dat;
     uint32_t lfsr, lfsr_seed = be32toh(info->lfsr_seed);
-    unsigned int i, j, sec = 0;
+    uint8_t dat[512];
+    unsigned int i, sec = 0;
     uint16_t speed = SPEED_AVG;
 
     tbuf_disable_auto_sector_split(tbuf);
@@ -364,21 +440,20 @@ static void copylock_read_raw(
         tbuf_bits(tbuf, speed, bc_mfm, 8, sec);
         /* Data */
         lfsr = lfsr_seek(info, lfsr_seed, 0, sec);
-        for (i = 0; i < 512; i++) {
-            if ((sec == 6) && (i == 0)) {
-                for (i = 0; i < sizeof(sec6_sig); i++)
-                    tbuf_bits(tbuf, speed, bc_mfm, 8, sec6_sig[i]);
-                if (info->ext_sig_id) {
-                    struct copylock_extended_signature *sig
-                        = &ext_sig[info->ext_sig_id-1];
-                    for (j = 0; j < 8; j++)
-                        tbuf_bits(tbuf, speed, bc_mfm, 8, sig->sig_bytes[j]);
-                    lfsr = lfsr_forward(lfsr, 8);
-                }
+        i = 0;
+        if (sec == 6) {
+            tbuf_bytes(tbuf, speed, bc_mfm, sizeof(sec6_sig),
+                       (void *)sec6_sig);
+            if (info->ext_sig_id) {
+                struct copylock_extended_signature *sig
+                    = &ext_sig[info->ext_sig_id-1];
+                tbuf_bytes(tbuf, speed, bc_mfm, 8, sig->sig_bytes);
+                lfsr = lfsr_forward(lfsr, 8);
             }
-            tbuf_bits(tbuf, speed, bc_mfm, 8, lfsr_byte(lfsr));
-            lfsr = lfsr_next(lfsr);
+            i = sizeof(sec6_sig);
         }
+        lfsr_gen(lfsr, dat, 512-i);
+        tbuf_bytes(tbuf, speed, bc_mfm, 512-i, dat);
         /* Footer */
         tbuf_bits(tbuf, speed, bc_mfm, 8, 0);
 
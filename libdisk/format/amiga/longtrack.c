@@ -14,12 +14,9 @@
 
 static int check_sequence(struct stream *s, unsigned int nr, uint8_t byte)
 {
-    while (--nr) {
-        stream_next_bits(s, 16);
-        if ((uint8_t)mfm_decode_word(s->word) != byte)
-            break;
-    }
-    return !nr;
+    uint16_t pattern = mfm_encode_word(byte) & 0x5555;
+    nr--;
+    return stream_next_run(s, pattern, 0x5555, nr) == nr;
 }
 
 static int check_length(struct stream *s, unsigned int min_bits)
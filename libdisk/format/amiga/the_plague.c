@@ -197,12 +197,8 @@ struct track_handler the_plague_b_handler = {
 
 static int check_sequence(struct stream *s, unsigned int nr, uint16_t word)
 {
-    while (--nr) {
-        stream_next_bits(s, 16);
-        if ((uint16_t)(s->word) != word)
-            break;
-    }
-    return !nr;
+    nr--;
+    return stream_next_run(s, word, 0xffff, nr) == nr;
 }
 
 static int check_length(struct stream *s, unsigned int min_bits)
@@ -267,12 +267,9 @@ struct track_handler visionary_design_a_handler = {
 
 static int check_sequence(struct stream *s, unsigned int nr, uint8_t byte)
 {
-    while (--nr) {
-        stream_next_bits(s, 16);
-        if ((uint8_t)mfm_decode_word(s->word) != byte)
-            break;
-    }
-    return !nr;
+    uint16_t pattern = mfm_encode_word(byte) & 0x5555;
+    nr--;
+    return stream_next_run(s, pattern, 0x5555, nr) == nr;
 }
 
 static void *vortex_b_write_raw(
@@ -38,6 +38,12 @@ struct ibm_psector {
      || ((type) == TRKTYP_ibm_fm_dd)                \
      || ((type) == TRKTYP_ibm_fm_sd_recovery) )
 
+#define type_is_dec(type)                           \
+    (((type) == TRKTYP_dec_rx01)                    \
+     || ((type) == TRKTYP_dec_rx02)                 \
+     || ((type) == TRKTYP_dec_rx01_525)             \
+     || ((type) == TRKTYP_dec_rx02_525) )
+
 /* Defined all TRS80 track types that attemt data recovery */
 static bool_t is_recovery_type(int type)
 {
@@ -130,6 +136,7 @@ int ibm_scan_mark(struct stream *s, unsigned int max_scan, uint8_t *pmark)
         if (idx_off < 0)
             idx_off += s->track_len_bc;
         *pmark = (uint8_t)mfm_decode_word(s->word);
+        stream_note_sync(s);
         break;
     } while ((stream_next_bit(s) != -1) && --max_scan);
 
@@ -206,171 +213,225 @@ static int choose_post_data_gap(
     return post_data_gap;
 }
 
-static void *ibm_mfm_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+/* The nearest preceding track (the other side of this cylinder, or this
+ * side of the previous one) of the same type, or NULL if there is none to
+ * go by. */
+static struct track_info *ibm_prev_track(struct disk *d, unsigned int tracknr)
 {
-    struct track_info *ti = &d->di->track[tracknr];
-    struct ibm_psector *ibm_secs, *new_sec, *cur_sec, *next_sec, **pprev_sec;
-    struct ibm_track *ibm_track = NULL;
-    unsigned int dat_bytes = 0, gap_bits, nr_blocks = 0;
-    unsigned int sec_sz;
-    bool_t iam = 0;
+    struct track_info *ti = &d->di->track[tracknr], *prev;
+    unsigned int t;
 
-    /* IAM */
-    while (!iam && (stream_next_bit(s) != -1)) {
-        if (s->word != 0x52245224)
+    for (t = tracknr; (t-- > 0) && ((t + 2) >= tracknr); ) {
+        prev = &d->di->track[t];
+        if ((prev->type == ti->type) && (prev->nr_sectors != 0))
+            return prev;
+    }
+
+    return NULL;
+}
+
+/* Do the decoded sectors match those of the previous track, in number and
+ * in the presence of an IAM, with IDs that form a contiguous run? A run can
+ * look complete yet lack its first or last sector, so with nothing to check
+ * it against we must assume that a sector may yet be found on a later
+ * revolution. */
+static bool_t ibm_secs_complete(
+    struct ibm_psector *ibm_secs, bool_t has_iam, struct track_info *prev)
+{
+    struct ibm_psector *sec;
+    uint8_t seen[256/8];
+    unsigned int i, nr = 0, nr_ids = 0, min = 255, max = 0;
+
+    if ((prev == NULL)
+        || (!has_iam && ((struct ibm_track *)prev->dat)->has_iam))
+        return 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (sec = ibm_secs; sec; sec = sec->next) {
+        nr++;
+        i = sec->s.idam.sec;
+        if (seen[i/8] & (1u << (i&7)))
             continue;
-        if (stream_next_bits(s, 32) == -1)
-            break;
-        iam = (s->word == 0x52245552);
+        seen[i/8] |= 1u << (i&7);
+        min = min_t(unsigned int, min, i);
+        max = max_t(unsigned int, max, i);
+        nr_ids++;
     }
 
-    stream_reset(s);
+    return (nr == prev->nr_sectors) && (nr_ids == (max - min + 1));
+}
 
-    ibm_secs = NULL;
+static void *ibm_write_raw(
+    struct disk *d, unsigned int tracknr, struct stream *s, bool_t is_fm)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    struct ibm_psector *ibm_secs, *new_sec, *cur_sec, *next_sec, **pprev_sec;
+    struct ibm_track *ibm_track = NULL;
+    struct ibm_track_map map;
+    struct ibm_mark_ent *ent;
+    unsigned int dat_bytes = 0, gap_bits, nr_blocks = 0;
+    unsigned int i, sec_sz, nr_clean = 0;
+    struct track_info *prev = ibm_prev_track(d, tracknr);
+    bool_t clean;
+    int rc;
 
-    while (stream_next_bit(s) != -1) {
+    ibm_map_init(&map, is_fm, ((ti->type == TRKTYP_dec_rx02)
+                               || (ti->type == TRKTYP_dec_rx02_525)));
 
-        int idx_off, dam_idx_off;
-        uint8_t mark, dat[2*16384];
-        uint16_t crc;
-        struct ibm_idam idam;
+    ibm_secs = NULL;
 
-        /* IDAM */
-        if ((idx_off = ibm_scan_idam(s, &idam)) < 0)
-            continue;
+    do {
 
-    redo_idam:
-        /* If the IDAM CRC is bad we cannot trust the sector data: we always 
-         * skip the sector data in this case. CRC errors can also happen from
-         * cross-talk (40-track disk read as 80-track). */
-        if (idam.crc) {
+        /* Index every IDAM in the next revolution. A revolution is clean if 
+         * it decodes without error and finds no sector we did not already 
+         * have. A sector can be missing from early revolutions yet be found
+         * on later ones, so we stop early only after two clean revolutions
+         * in a row, and then only if we hold the sectors (and IAM) that the
+         * previous track did, with no ID missing from the run: otherwise
+         * every revolution in the stream is scanned. */
+        rc = ibm_map_revolution(s, &map);
+        clean = (map.nr != 0);
+
+        for (i = 0; i < map.nr; i++) {
+
+            int idx_off;
+            uint16_t crc;
+            struct ibm_idam idam;
+
+            ent = &map.ent[i];
+            idx_off = ent->offset;
+            idam = ent->idam;
+
+            /* If the IDAM CRC is bad we cannot trust the sector data: we 
+             * always skip the sector data in this case. CRC errors can also 
+             * happen from cross-talk (40-track disk read as 80-track). */
+            if (idam.crc) {
 #if CRC_DEBUG
-            /* Warn if we are recovering */
-            if (is_recovery_type(ti->type)) {
-                trk_warn(ti, tracknr, "IDAM CRC cyl:%2d, head:%2d, sec:%2d, "
-                         "no:%2d, crc:%04x, offset:%5d",
-                         idam.cyl, idam.head, idam.sec,
-                         idam.no, idam.crc, idx_off);
-            }
+                /* Warn if we are recovering */
+                if (is_recovery_type(ti->type)) {
+                    trk_warn(ti, tracknr, "IDAM CRC cyl:%2d, head:%2d, "
+                             "sec:%2d, no:%2d, crc:%04x, offset:%5d",
+                             idam.cyl, idam.head, idam.sec,
+                             idam.no, idam.crc, idx_off);
+                }
 #endif
-            /* TODO: try to reconstruct the correct idam ... */
-            continue;
-        }
-
-        if (idam.no > 7) {
-            trk_warn(ti, tracknr, "Unexpected IDAM no=%02x", idam.no);
-            continue;
-        }
+                /* TODO: try to reconstruct the correct idam ... */
+                clean = 0;
+                continue;
+            }
 
-        sec_sz = 128 << idam.no;
+            if (idam.no > 7) {
+                trk_warn(ti, tracknr, "Unexpected IDAM no=%02x", idam.no);
+                clean = 0;
+                continue;
+            }
 
-        /* DAM/DDAM */
-        if ((dam_idx_off = ibm_scan_mark(s, 1000, &mark)) < 0)
-            continue;
-        if (mark == IBM_MARK_IDAM) {
-            struct ibm_idam _idam;
-            if (_ibm_scan_idam(s, &_idam) == 0) {
-                idx_off = dam_idx_off;
-                idam = _idam;
-                goto redo_idam;
+            /* No DAM/DDAM, or truncated sector data. */
+            if (ent->dat == NULL) {
+                clean = 0;
+                continue;
             }
-        }
 
-        if ((stream_next_bytes(s, dat, 2*sec_sz) == -1) ||
-            (stream_next_bits(s, 32) == -1))
-            continue;
+            sec_sz = 128 << idam.no;
 
-        /* Skip bad data CRC unless we are doing data recovery. */
-        crc = s->crc16_ccitt;
-        if (crc && !is_recovery_type(ti->type))
-            continue;
+            /* Skip bad data CRC unless we are doing data recovery. */
+            crc = ent->crc;
+            if (crc)
+                clean = 0;
+            if (crc && !is_recovery_type(ti->type))
+                continue;
 
-        /* Find correct place for this sector in our linked list of sectors 
-         * that we have decoded so far. */
-        pprev_sec = &ibm_secs;
-        cur_sec = *pprev_sec;
-        while (cur_sec && ((idx_off - cur_sec->offset) >= 1000)) {
-            pprev_sec = &cur_sec->next;
+            /* Find correct place for this sector in our linked list of 
+             * sectors that we have decoded so far. */
+            pprev_sec = &ibm_secs;
             cur_sec = *pprev_sec;
-        }
+            while (cur_sec && ((idx_off - cur_sec->offset) >= 1000)) {
+                pprev_sec = &cur_sec->next;
+                cur_sec = *pprev_sec;
+            }
 
-        /* If this sector's start is within 1000 bits of one we already decoded
-         * then it is the same sector: we decoded it already on an earlier 
-         * revolution and can skip it this time round. */
-        if (cur_sec && (abs(idx_off - cur_sec->offset) < 1000)) {
-
-            /* Is this really the same sector? Check IDAM contents. */
-            if ((idam.cyl == cur_sec->s.idam.cyl) &&
-                (idam.head == cur_sec->s.idam.head) && 
-                (idam.sec == cur_sec->s.idam.sec) &&
-                (idam.no == cur_sec->s.idam.no)) {
-
-                /* If we now have a good CRC and the saved sector has a bad CRC
-                 * we should try converting it again.
-                 *
-                 * TODO:
-                 *  1 if we only have bad crcs on all reads we might try to
-                 *    median combine all of the bits into a new one
-                 *  2 reconstruct missing idam values if we have a data
-                 *    sector */
-                if (!crc && cur_sec->s.crc) {
+            /* If this sector's start is within 1000 bits of one we already 
+             * decoded then it is the same sector: we decoded it already on an 
+             * earlier revolution and can skip it this time round. */
+            if (cur_sec && (abs(idx_off - cur_sec->offset) < 1000)) {
+
+                /* Is this really the same sector? Check IDAM contents. */
+                if ((idam.cyl == cur_sec->s.idam.cyl) &&
+                    (idam.head == cur_sec->s.idam.head) && 
+                    (idam.sec == cur_sec->s.idam.sec) &&
+                    (idam.no == cur_sec->s.idam.no)) {
+
+                    /* If we now have a good CRC and the saved sector has a 
+                     * bad CRC we should try converting it again.
+                     *
+                     * TODO:
+                     *  1 if we only have bad crcs on all reads we might try
+                     *    to median combine all of the bits into a new one
+                     *  2 reconstruct missing idam values if we have a data
+                     *    sector */
+                    if (!crc && cur_sec->s.crc) {
 #ifdef CRC_DEBUG
-                    trk_warn(ti, tracknr, "FIXED CRC cyl:%2d, head:%2d, "
-                             "sec:%2d, no:%2d, size:%4x, offset:%5d",
-                             idam.cyl, idam.head, idam.sec, idam.no,
-                             sec_sz, idx_off);
+                        trk_warn(ti, tracknr, "FIXED CRC cyl:%2d, head:%2d, "
+                                 "sec:%2d, no:%2d, size:%4x, offset:%5d",
+                                 idam.cyl, idam.head, idam.sec, idam.no,
+                                 sec_sz, idx_off);
 #endif
 
-                    /* Replace the previous bad sector header/data. */
-                    cur_sec->offset = idx_off;
-                    cur_sec->end_offset = s->index_offset_bc;
-                    cur_sec->s.crc = crc;
-                    cur_sec->s.mark = mark;
-                    mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
-                    memcpy(&cur_sec->s.dat[0], dat, sec_sz);
-                    memcpy(&cur_sec->s.idam, &idam, sizeof(idam));
-                }
+                        /* Replace the previous bad sector header/data. */
+                        cur_sec->offset = idx_off;
+                        cur_sec->end_offset = ent->end_offset;
+                        cur_sec->s.crc = crc;
+                        cur_sec->s.mark = ent->mark;
+                        memcpy(&cur_sec->s.dat[0], ent->dat, sec_sz);
+                        memcpy(&cur_sec->s.idam, &idam, sizeof(idam));
+                    }
 
-            } else {
+                } else {
 
-                /* This code should NEVER trigger */
-                trk_warn(ti, tracknr, "IDAM  WARN"
-                         " [cyl:%2d, head:%2d, sec:%2d, no:%2d, "
-                         "crc:%04x, offset:%5d] != [cyl:%2d, head:%2d, "
-                         "sec:%2d, no:%2d, crc:%04x, offset:%5d]",
-                         idam.cyl, idam.head, idam.sec, idam.no,
-                         crc, idx_off,
-                         cur_sec->s.idam.cyl, cur_sec->s.idam.head,
-                         cur_sec->s.idam.sec, cur_sec->s.idam.no,
-                         cur_sec->s.idam.crc, cur_sec->offset);
+                    /* This code should NEVER trigger */
+                    trk_warn(ti, tracknr, "IDAM  WARN"
+                             " [cyl:%2d, head:%2d, sec:%2d, no:%2d, "
+                             "crc:%04x, offset:%5d] != [cyl:%2d, head:%2d, "
+                             "sec:%2d, no:%2d, crc:%04x, offset:%5d]",
+                             idam.cyl, idam.head, idam.sec, idam.no,
+                             crc, idx_off,
+                             cur_sec->s.idam.cyl, cur_sec->s.idam.head,
+                             cur_sec->s.idam.sec, cur_sec->s.idam.no,
+                             cur_sec->s.idam.crc, cur_sec->offset);
+                    clean = 0;
 
-            }
+                }
 
-            continue;
-        }
+                continue;
+            }
 
 #ifdef CRC_DEBUG
-        if (crc) {
-            trk_warn(ti, tracknr, "DATA  CRC cyl:%2d, head:%2d, sec:%2d, "
-                     "no:%2d, crc:%04x, offset:%5d",
-                     idam.cyl, idam.head, idam.sec, idam.no, crc, idx_off);
-        }
+            if (crc) {
+                trk_warn(ti, tracknr, "DATA  CRC cyl:%2d, head:%2d, sec:%2d, "
+                         "no:%2d, crc:%04x, offset:%5d",
+                         idam.cyl, idam.head, idam.sec, idam.no, crc, idx_off);
+            }
 #endif
 
-        /* Add a new sector. */
-        mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
-        new_sec = memalloc(sizeof(*new_sec) + sec_sz);
-        new_sec->offset = idx_off;
-        new_sec->end_offset = s->index_offset_bc;
-        new_sec->s.crc = crc;
-        new_sec->s.mark = mark;
-        memcpy(&new_sec->s.dat[0], dat, sec_sz);
-        memcpy(&new_sec->s.idam, &idam, sizeof(idam));
-        /* Add the new sector to linked list */
-        new_sec->next = *pprev_sec;
-        *pprev_sec = new_sec;
-    }
+            /* Add a new sector. */
+            new_sec = memalloc(sizeof(*new_sec) + sec_sz);
+            new_sec->offset = idx_off;
+            new_sec->end_offset = ent->end_offset;
+            new_sec->s.crc = crc;
+            new_sec->s.mark = ent->mark;
+            memcpy(&new_sec->s.dat[0], ent->dat, sec_sz);
+            memcpy(&new_sec->s.idam, &idam, sizeof(idam));
+            /* Add the new sector to linked list */
+            new_sec->next = *pprev_sec;
+            *pprev_sec = new_sec;
+            clean = 0;
+        }
+
+        nr_clean = clean ? nr_clean + 1 : 0;
+
+    } while ((rc == 0)
+             && ((nr_clean < 2)
+                 || !ibm_secs_complete(ibm_secs, map.has_iam, prev)));
 
     gap_bits = ti->total_bits - s->track_len_bc;
     for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
@@ -384,7 +445,7 @@ static void *ibm_mfm_write_raw(
             trk_warn(ti, tracknr, "Overlapping sectors");
             goto out;
         }
-        distance -= 12*16; /* pre-sync header */
+        distance -= (is_fm ? 6 : 12) * 16; /* pre-sync header */
         gap_bits += distance;
         nr_blocks++;
         dat_bytes += sec_sz;
@@ -393,7 +454,7 @@ static void *ibm_mfm_write_raw(
     if (nr_blocks == 0)
         goto out;
 
-    ti->data_bitoff = 80 * 16;
+    ti->data_bitoff = (is_fm ? 40 : 80) * 16;
     ti->nr_sectors = nr_blocks;
     set_all_sectors_valid(ti);
 
@@ -401,9 +462,9 @@ static void *ibm_mfm_write_raw(
                          + nr_blocks * sizeof(struct ibm_sector)
                          + dat_bytes);
 
-    ibm_track->has_iam = iam ? 1 : 0;
-    ibm_track->post_data_gap = choose_post_data_gap(
-        ti, ibm_track, gap_bits, nr_blocks);
+    ibm_track->has_iam = map.has_iam ? 1 : 0;
+    ibm_track->post_data_gap = type_is_dec(ti->type) ? 27
+        : choose_post_data_gap(ti, ibm_track, gap_bits, nr_blocks);
 
     ti->len = sizeof(struct ibm_track);
     for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
@@ -419,9 +480,16 @@ out:
         memfree(cur_sec);
         cur_sec = next_sec;
     }
+    ibm_map_free(&map);
     return ibm_track;
 }
 
+static void *ibm_mfm_write_raw(
+    struct disk *d, unsigned int tracknr, struct stream *s)
+{
+    return ibm_write_raw(d, tracknr, s, 0);
+}
+
 static void ibm_mfm_read_raw(
     struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
 {
@@ -605,6 +673,7 @@ struct track_handler ibm_mfm_dd_handler = {
     .density = trkden_double,
     .get_name = ibm_get_name,
     .write_raw = ibm_mfm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_mfm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -613,6 +682,7 @@ struct track_handler ibm_mfm_hd_handler = {
     .density = trkden_high,
     .get_name = ibm_get_name,
     .write_raw = ibm_mfm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_mfm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -621,6 +691,7 @@ struct track_handler ibm_mfm_ed_handler = {
     .density = trkden_extra,
     .get_name = ibm_get_name,
     .write_raw = ibm_mfm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_mfm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -629,6 +700,7 @@ struct track_handler ibm_mfm_dd_recovery_handler = {
     .density = trkden_double,
     .get_name = ibm_get_name,
     .write_raw = ibm_mfm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_mfm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -682,33 +754,41 @@ static void *ibm_mfm_dd_longtrack_write_raw(
 struct track_handler ibm_mfm_dd_long_102200_handler = {
     .bytes_per_sector = 102200,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_long_103300_handler = {
     .bytes_per_sector = 103300,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_long_104400_handler = {
     .bytes_per_sector = 104400,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_long_105500_handler = {
     .bytes_per_sector = 105500,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_long_106600_handler = {
     .bytes_per_sector = 106600,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_long_108800_handler = {
     .bytes_per_sector = 108800,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_long_111000_handler = {
     .bytes_per_sector = 111000,
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 struct track_handler ibm_mfm_dd_unknown_length_handler = {
     .write_raw = ibm_mfm_dd_longtrack_write_raw,
+    .notes_sync = 1,
 };
 /**********************************
  * Single-density (IBM-FM) handlers
@@ -737,295 +817,216 @@ static int ibm_fm_scan_mark(
         *pmark = (uint8_t)mfm_decode_word(s->word);
         stream_start_crc(s);
         s->crc16_ccitt = crc16_ccitt(pmark, 1, 0xffff);
+        stream_note_sync(s);
         break;
     } while ((stream_next_bit(s) != -1) && --max_scan);
 
     return idx_off;
 }
 
-static int _ibm_fm_scan_idam(struct stream *s, struct ibm_idam *idam)
+/***********************************
+ * Track indexer
+ * 
+ * A single pass over each revolution records every IDAM, together with the
+ * data mark and sector data that follow it. The IAM is looked for during the
+ * same pass, so handlers need no separate pre-scan and stream reset.
+ */
+
+void ibm_map_init(struct ibm_track_map *map, bool_t is_fm, bool_t is_rx02)
 {
-    /* cyl,head */
-    if (stream_next_bits(s, 32) == -1)
-        goto fail;
-    idam->cyl = mfm_decode_word(s->word >> 16);
-    idam->head = mfm_decode_word(s->word);
+    memset(map, 0, sizeof(*map));
+    map->is_fm = is_fm;
+    map->is_rx02 = is_rx02;
+}
 
-    /* sec,no */
-    if (stream_next_bits(s, 32) == -1)
-        goto fail;
-    idam->sec = mfm_decode_word(s->word >> 16);
-    idam->no = mfm_decode_word(s->word);
+static void ibm_map_clear(struct ibm_track_map *map)
+{
+    unsigned int i;
 
-    /* crc */
-    if (stream_next_bits(s, 32) == -1)
-        goto fail;
+    for (i = 0; i < map->nr; i++)
+        memfree(map->ent[i].dat);
+    map->nr = 0;
+}
 
-    idam->crc = s->crc16_ccitt;
-    return 0;
-fail:
-    return -1;
+void ibm_map_free(struct ibm_track_map *map)
+{
+    ibm_map_clear(map);
+    memfree(map->ent);
+    map->ent = NULL;
+    map->max = 0;
 }
 
-static int ibm_fm_scan_idam(struct stream *s, struct ibm_idam *idam)
+static struct ibm_mark_ent *ibm_map_add(
+    struct ibm_track_map *map, int offset, struct ibm_idam *idam)
 {
-    uint8_t mark;
-    int idx_off;
+    struct ibm_mark_ent *ent;
+
+    if (map->nr == map->max) {
+        ent = map->ent;
+        map->max = map->max ? map->max * 2 : 32;
+        map->ent = memalloc(map->max * sizeof(*ent));
+        if (ent != NULL) {
+            memcpy(map->ent, ent, map->nr * sizeof(*ent));
+            memfree(ent);
+        }
+    }
 
-    idx_off = ibm_fm_scan_mark(s, ~0u, &mark);
-    if ((idx_off < 0) || (mark != IBM_MARK_IDAM))
-        goto fail;
+    ent = &map->ent[map->nr++];
+    memset(ent, 0, sizeof(*ent));
+    ent->offset = ent->end_offset = offset;
+    ent->idam = *idam;
+    return ent;
+}
 
-    if (_ibm_fm_scan_idam(s, idam) < 0)
-        goto fail;
+/* Match an address mark at the current stream position only. Unlike
+ * ibm_scan_mark(), nothing is consumed past a non-matching position, so the
+ * caller can test each bitcell for both sync and IAM. */
+static int ibm_map_mark(
+    struct stream *s, struct ibm_track_map *map, uint8_t *pmark)
+{
+    int idx_off;
 
+    if (map->is_fm) {
+        if (((s->word>>16) != 0xaaaa) ||
+            ((uint8_t)mfm_decode_word(s->word>>1) != IBM_FM_SYNC_CLK))
+            return -1;
+        return ibm_fm_scan_mark(s, 1, pmark);
+    }
+
+    if (s->word != 0x44894489)
+        return -1;
+    stream_start_crc(s);
+    if ((stream_next_bits(s, 16) == -1) || ((uint16_t)s->word != 0x4489))
+        return -1;
+    if (stream_next_bits(s, 16) == -1)
+        return -1;
+    idx_off = s->index_offset_bc - 63;
+    if (idx_off < 0)
+        idx_off += s->track_len_bc;
+    *pmark = (uint8_t)mfm_decode_word(s->word);
+    stream_note_sync(s);
     return idx_off;
-fail:
-    return -1;
 }
 
-static void *ibm_fm_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void ibm_map_read_data(
+    struct stream *s, struct ibm_track_map *map, struct ibm_mark_ent *ent)
 {
-    struct track_info *ti = &d->di->track[tracknr];
-    struct ibm_psector *ibm_secs, *new_sec, *cur_sec, *next_sec, **pprev_sec;
-    struct ibm_track *ibm_track = NULL;
-    unsigned int dat_bytes = 0, gap_bits, nr_blocks = 0;
-    unsigned int sec_sz;
-    bool_t iam = 0, is_dec = 0;
-
-    switch (ti->type) {
-    case TRKTYP_dec_rx01:
-    case TRKTYP_dec_rx02:
-    case TRKTYP_dec_rx01_525:
-    case TRKTYP_dec_rx02_525:
-        is_dec = 1;
+    unsigned int sec_sz = 128 << ent->idam.no;
+    uint8_t dat[2*16384];
+    uint16_t crc;
+
+    if (map->is_rx02
+        && ((ent->mark == DEC_RX02_MMFM_DAM_DAT)
+            || (ent->mark == DEC_RX02_MMFM_DDAM_DAT))) {
+        int i, rc;
+        uint16_t x = 1;
+        crc = s->crc16_ccitt;
+        ent->idam.no = 1;
+        sec_sz = 256;
+        stream_set_density(s, stream_get_density(s)/2);
+        stream_next_bit(s); /* Skip second half of last 2us bitcell? */
+        rc = stream_next_bytes(s, dat, 2*(sec_sz+2));
         stream_set_density(s, stream_get_density(s)*2);
-        break;
+        if (rc == -1)
+            return;
+        /* Undo RX02 modified MFM rule... */
+        for (i = 0; i < 2*(sec_sz+2); i++) {
+            x = (x << 8) | dat[i];
+            if (!(x & 0x1c0)) { dat[i-1] |= 1; x |= 0x40; }
+            if (!(x & 0x070)) x |= 0x50;
+            if (!(x & 0x01c)) x |= 0x14;
+            if (!(x & 0x007)) x |= 0x05;
+            dat[i] = x;
+        }
+        /* ...then extract data bits as usual. */
+        mfm_decode_bytes(bc_mfm, sec_sz+2, dat, dat);
+        crc = crc16_ccitt(dat, sec_sz+2, crc);
+    } else {
+        if ((stream_next_bytes(s, dat, 2*sec_sz) == -1) ||
+            (stream_next_bits(s, 32) == -1))
+            return;
+        crc = s->crc16_ccitt;
+        mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
     }
 
-    /* IAM */
-    while (!iam && (stream_next_bit(s) != -1))
-        iam = (s->word == (0xaaaa0000|IBM_FM_IAM_RAW));
-
-    stream_reset(s);
-
-    ibm_secs = NULL;
-
-    while (stream_next_bit(s) != -1) {
-
-        int idx_off, dam_idx_off;
-        uint8_t mark, dat[2*16384];
-        uint16_t crc;
-        struct ibm_idam idam;
+    ent->crc = crc;
+    ent->end_offset = s->index_offset_bc;
+    ent->dat = memalloc(sec_sz);
+    memcpy(ent->dat, dat, sec_sz);
+}
 
-        /* IDAM */
-        if ((idx_off = ibm_fm_scan_idam(s, &idam)) < 0)
-            continue;
+int ibm_map_revolution(struct stream *s, struct ibm_track_map *map)
+{
+    unsigned int nr_index = s->nr_index;
+    struct ibm_mark_ent *ent;
+    struct ibm_idam idam, _idam;
+    uint8_t mark;
+    int idx_off;
 
-    redo_idam:
-        /* If the IDAM CRC is bad we cannot trust the sector data: we always 
-         * skip the sector data in this case. CRC errors can also happen from
-         * cross-talk (40-track disk read as 80-track). */
-        if (idam.crc) {
-#if CRC_DEBUG
-            /* Warn if we are recovering */
-            if (is_recovery_type(ti->type)) {
-                trk_warn(ti, tracknr, "IDAM CRC cyl:%2d, head:%2d, sec:%2d, "
-                         "no:%2d, crc:%04x, offset:%5d",
-                         idam.cyl, idam.head, idam.sec,
-                         idam.no, idam.crc, idx_off);
-            }
-#endif
-            /* TODO: try to reconstruct the correct idam ... */
-            continue;
-        }
+    ibm_map_clear(map);
 
-        if (idam.no > 7) {
-            trk_warn(ti, tracknr, "Unexpected IDAM no=%02x", idam.no);
-            continue;
-        }
+    while (s->nr_index == nr_index) {
 
-        sec_sz = 128 << idam.no;
+        if ((map->harvest
+             ? sector_harvest_next_bit(map->harvest, s)
+             : stream_next_bit(s)) == -1)
+            return -1;
 
-        /* DAM/DDAM */
-        if ((dam_idx_off = ibm_fm_scan_mark(s, 1000, &mark)) < 0)
-            continue;
-        if (mark == IBM_MARK_IDAM) {
-            struct ibm_idam _idam;
-            if (_ibm_fm_scan_idam(s, &_idam) == 0) {
-                idx_off = dam_idx_off;
-                idam = _idam;
-                goto redo_idam;
-            }
-        }
-        if (((ti->type == TRKTYP_dec_rx02)
-             || (ti->type == TRKTYP_dec_rx02_525))
-            && ((mark == DEC_RX02_MMFM_DAM_DAT)
-                || (mark == DEC_RX02_MMFM_DDAM_DAT))) {
-            int i, rc;
-            uint16_t x = 1;
-            crc = s->crc16_ccitt;
-            idam.no = 1;
-            sec_sz = 256;
-            stream_set_density(s, stream_get_density(s)/2);
-            stream_next_bit(s); /* Skip second half of last 2us bitcell? */
-            rc = stream_next_bytes(s, dat, 2*(sec_sz+2));
-            stream_set_density(s, stream_get_density(s)*2);
-            if (rc == -1)
+        /* IAM */
+        if (!map->has_iam) {
+            if (map->is_fm) {
+                map->has_iam = (s->word == (0xaaaa0000|IBM_FM_IAM_RAW));
+            } else if (s->word == 0x52245224) {
+                if (stream_next_bits(s, 32) == -1)
+                    return -1;
+                map->has_iam = (s->word == 0x52245552);
                 continue;
-            /* Undo RX02 modified MFM rule... */
-            for (i = 0; i < 2*(sec_sz+2); i++) {
-                x = (x << 8) | dat[i];
-                if (!(x & 0x1c0)) { dat[i-1] |= 1; x |= 0x40; }
-                if (!(x & 0x070)) x |= 0x50;
-                if (!(x & 0x01c)) x |= 0x14;
-                if (!(x & 0x007)) x |= 0x05;
-                dat[i] = x;
             }
-            /* ...then extract data bits as usual. */
-            mfm_decode_bytes(bc_mfm, sec_sz+2, dat, dat);
-            crc = crc16_ccitt(dat, sec_sz+2, crc);
-        } else {
-            if (stream_next_bytes(s, dat, 2*sec_sz) == -1)
-                continue;
-            if (stream_next_bits(s, 32) == -1)
-                continue;
-            crc = s->crc16_ccitt;
-            mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
         }
 
-        /* Skip bad data CRC unless we are doing data recovery. */
-        if (crc && !is_recovery_type(ti->type))
+        /* IDAM */
+        if (((idx_off = ibm_map_mark(s, map, &mark)) < 0) ||
+            (mark != IBM_MARK_IDAM) ||
+            (_ibm_scan_idam(s, &idam) < 0))
             continue;
 
-        /* Find correct place for this sector in our linked list of sectors 
-         * that we have decoded so far. */
-        pprev_sec = &ibm_secs;
-        cur_sec = *pprev_sec;
-        while (cur_sec && ((idx_off - cur_sec->offset) >= 1000)) {
-            pprev_sec = &cur_sec->next;
-            cur_sec = *pprev_sec;
-        }
-
-        /* If this sector's start is within 1000 bits of one we already decoded
-         * then it is the same sector: we decoded it already on an earlier 
-         * revolution and can skip it this time round. */
-        if (cur_sec && (abs(idx_off - cur_sec->offset) < 1000)) {
-
-            /* Is this really the same sector? Check IDAM contents. */
-            if ((idam.cyl == cur_sec->s.idam.cyl) &&
-                (idam.head == cur_sec->s.idam.head) && 
-                (idam.sec == cur_sec->s.idam.sec) &&
-                (idam.no == cur_sec->s.idam.no)) {
-
-                /* If we now have a good CRC and the saved sector has a bad CRC
-                 * we should try converting it again. */
-                if (!crc && cur_sec->s.crc) {
-#ifdef CRC_DEBUG
-                    trk_warn(ti, tracknr, "FIXED CRC cyl:%2d, head:%2d, "
-                             "sec:%2d, no:%2d, size:%4x, offset:%5d",
-                             idam.cyl, idam.head, idam.sec, idam.no,
-                             sec_sz, idx_off);
-#endif
-
-                    /* Replace the previous bad sector header/data. */
-                    cur_sec->offset = idx_off;
-                    cur_sec->end_offset = s->index_offset_bc;
-                    cur_sec->s.crc = crc;
-                    cur_sec->s.mark = mark;
-                    memcpy(&cur_sec->s.dat[0], dat, sec_sz);
-                    memcpy(&cur_sec->s.idam, &idam, sizeof(idam));
-                }
-
-            } else {
-
-                /* This code should NEVER trigger */
-                trk_warn(ti, tracknr, "IDAM  WARN"
-                         " [cyl:%2d, head:%2d, sec:%2d, no:%2d, "
-                         "crc:%04x, offset:%5d] != [cyl:%2d, head:%2d, "
-                         "sec:%2d, no:%2d, crc:%04x, offset:%5d]",
-                         idam.cyl, idam.head, idam.sec, idam.no,
-                         crc, idx_off,
-                         cur_sec->s.idam.cyl, cur_sec->s.idam.head,
-                         cur_sec->s.idam.sec, cur_sec->s.idam.no,
-                         cur_sec->s.idam.crc, cur_sec->offset);
-
-            }
-
+    redo_idam:
+        ent = ibm_map_add(map, idx_off, &idam);
+        if (idam.crc || (idam.no > 7))
             continue;
-        }
 
-#ifdef CRC_DEBUG
-        if (crc) {
-            trk_warn(ti, tracknr, "DATA  CRC cyl:%2d, head:%2d, sec:%2d, "
-                     "no:%2d, crc:%04x, offset:%5d",
-                     idam.cyl, idam.head, idam.sec, idam.no, crc, idx_off);
+        /* DAM/DDAM */
+        mark = 0;
+        if ((idx_off = (map->is_fm
+                        ? ibm_fm_scan_mark(s, 1000, &mark)
+                        : ibm_scan_mark(s, 1000, &mark))) < 0)
+            continue;
+        if ((mark == IBM_MARK_IDAM) && (_ibm_scan_idam(s, &_idam) == 0)) {
+            idam = _idam;
+            goto redo_idam;
         }
-#endif
 
-        /* Add a new sector. */
-        new_sec = memalloc(sizeof(*new_sec) + sec_sz);
-        new_sec->offset = idx_off;
-        new_sec->end_offset = s->index_offset_bc;
-        new_sec->s.crc = crc;
-        new_sec->s.mark = mark;
-        memcpy(&new_sec->s.dat[0], dat, sec_sz);
-        memcpy(&new_sec->s.idam, &idam, sizeof(idam));
-        /* Add the new sector to linked list */
-        new_sec->next = *pprev_sec;
-        *pprev_sec = new_sec;
-    }
-
-    gap_bits = ti->total_bits - s->track_len_bc;
-    for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
-        int distance;
-        next_sec = cur_sec->next ?: ibm_secs;
-        distance = next_sec->offset - cur_sec->end_offset;
-        if (distance <= 0)
-            distance += s->track_len_bc;
-        sec_sz = 128 << cur_sec->s.idam.no;
-        if (distance < 0) {
-            trk_warn(ti, tracknr, "Overlapping sectors");
-            goto out;
-        }
-        distance -= 6 * 16; /* pre-sync header */
-        gap_bits += distance;
-        nr_blocks++;
-        dat_bytes += sec_sz;
+        ent->mark = mark;
+        ibm_map_read_data(s, map, ent);
     }
 
-    if (nr_blocks == 0)
-        goto out;
+    return 0;
+}
 
-    ti->data_bitoff = 40 * 16;
-    ti->nr_sectors = nr_blocks;
-    set_all_sectors_valid(ti);
+static void *ibm_fm_write_raw(
+    struct disk *d, unsigned int tracknr, struct stream *s)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    void *ibm_track;
 
-    ibm_track = memalloc(sizeof(struct ibm_track)
-                         + nr_blocks * sizeof(struct ibm_sector)
-                         + dat_bytes);
+    if (type_is_dec(ti->type))
+        stream_set_density(s, stream_get_density(s)*2);
 
-    ibm_track->has_iam = iam ? 1 : 0;
-    ibm_track->post_data_gap = is_dec ? 27
-        : choose_post_data_gap(ti, ibm_track, gap_bits, nr_blocks);
+    ibm_track = ibm_write_raw(d, tracknr, s, 1);
 
-    ti->len = sizeof(struct ibm_track);
-    for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
-        sec_sz = 128 << cur_sec->s.idam.no;
-        memcpy((char *)ibm_track + ti->len,
-               &cur_sec->s, sizeof(struct ibm_sector) + sec_sz);
-        ti->len += sizeof(struct ibm_sector) + sec_sz;
-    }
-
-out:
-    for (cur_sec = ibm_secs; cur_sec; ) {
-        next_sec = cur_sec->next;
-        memfree(cur_sec);
-        cur_sec = next_sec;
-    }
-    if (is_dec)
+    if (type_is_dec(ti->type))
         stream_set_density(s, stream_get_density(s)/2);
+
     return ibm_track;
 }
 
@@ -1219,6 +1220,7 @@ struct track_handler ibm_fm_sd_handler = {
     .density = trkden_single,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -1227,6 +1229,7 @@ struct track_handler ibm_fm_dd_handler = {
     .density = trkden_double,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -1235,6 +1238,7 @@ struct track_handler dec_rx01_handler = {
     .density = trkden_high,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors,
     .write_sectors = dec_write_sectors,
@@ -1246,6 +1250,7 @@ struct track_handler dec_rx02_handler = {
     .density = trkden_high,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors,
     .write_sectors = dec_write_sectors,
@@ -1260,6 +1265,7 @@ struct track_handler dec_rx01_525_handler = {
     .density = trkden_double,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors,
     .write_sectors = dec_write_sectors,
@@ -1271,6 +1277,7 @@ struct track_handler dec_rx02_525_handler = {
     .density = trkden_double,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors,
     .write_sectors = dec_write_sectors,
@@ -1282,6 +1289,7 @@ struct track_handler ibm_fm_sd_recovery_handler = {
     .density = trkden_single,
     .get_name = ibm_get_name,
     .write_raw = ibm_fm_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_fm_read_raw,
     .read_sectors = ibm_read_sectors
 };
@@ -14,90 +14,106 @@ struct ibm_extra_data {
     int sector_base;
 };
 
+/* Might this track have an IAM that we have not yet found? The nearest
+ * preceding track of the same type (the other side of this cylinder, or this
+ * side of the previous one) tells us whether to expect one. With no such
+ * track to go by, every revolution must be searched. */
+static bool_t ibm_img_iam_expected(struct disk *d, unsigned int tracknr)
+{
+    struct track_info *ti = &d->di->track[tracknr], *prev;
+    unsigned int t;
+
+    for (t = tracknr; (t-- > 0) && ((t + 2) >= tracknr); ) {
+        prev = &d->di->track[t];
+        if ((prev->type == ti->type) && (prev->len != 0))
+            return prev->dat[prev->len-1];
+    }
+
+    return 1;
+}
+
 static void *ibm_img_write_raw(
     struct disk *d, unsigned int tracknr, struct stream *s)
 {
     struct track_info *ti = &d->di->track[tracknr];
     struct ibm_extra_data *extra_data = handlers[ti->type]->extra_data;
     char *block = memalloc(ti->len + 1);
-    unsigned int nr_valid_blocks = 0;
-    bool_t iam = 0;
-
-    /* IAM */
-    while (!iam && (stream_next_bit(s) != -1)) {
-        if (s->word != 0x52245224)
-            continue;
-        if (stream_next_bits(s, 32) == -1)
-            break;
-        iam = (s->word == 0x52245552);
-    }
-
-    stream_reset(s);
-
-    while ((stream_next_bit(s) != -1) &&
-           (nr_valid_blocks != ti->nr_sectors)) {
-
-        int sec_sz;
-        uint8_t mark, dat[2*16384];
-        struct ibm_idam idam;
-
-        /* IDAM */
-        if (ibm_scan_idam(s, &idam) < 0)
-            continue;
-
-    redo_idam:
-        if (s->crc16_ccitt)
-            continue;
-        /* PCs start numbering sectors at 1, other platforms start at 0. Shift
-         * sector number as appropriate.  */
-        idam.sec -= extra_data->sector_base;
-
-        if ((idam.sec >= ti->nr_sectors) ||
-            (idam.cyl != cyl(tracknr)) ||
-            (idam.head != hd(tracknr)) ||
-            (idam.no > 7)) {
-            trk_warn(ti, tracknr, "Unexpected IDAM sec=%02x cyl=%02x hd=%02x "
-                     "no=%02x", idam.sec+extra_data->sector_base,
-                     idam.cyl, idam.head, idam.no);
-            continue;
+    struct ibm_track_map map;
+    struct sector_harvest harvest;
+    unsigned int i, nr_valid_blocks = 0;
+    bool_t want_iam = ibm_img_iam_expected(d, tracknr);
+    int rc;
+
+    ibm_map_init(&map, 0, 0);
+    sector_harvest_init(&harvest, ti, s);
+    map.harvest = &harvest;
+
+    do {
+
+        rc = ibm_map_revolution(s, &map);
+
+        for (i = 0; i < map.nr; i++) {
+
+            struct ibm_mark_ent *ent = &map.ent[i];
+            struct ibm_idam idam = ent->idam;
+            int sec_sz;
+
+            if (idam.crc) {
+                sector_harvest_note(&harvest, s, ent->offset, -1);
+                continue;
+            }
+            /* PCs start numbering sectors at 1, other platforms start at 0.
+             * Shift sector number as appropriate.  */
+            idam.sec -= extra_data->sector_base;
+
+            if ((idam.sec >= ti->nr_sectors) ||
+                (idam.cyl != cyl(tracknr)) ||
+                (idam.head != hd(tracknr)) ||
+                (idam.no > 7)) {
+                trk_warn(ti, tracknr, "Unexpected IDAM sec=%02x cyl=%02x "
+                         "hd=%02x no=%02x", idam.sec+extra_data->sector_base,
+                         idam.cyl, idam.head, idam.no);
+                continue;
+            }
+
+            /* Is sector size valid for this format? */
+            sec_sz = 128 << idam.no;
+            if (sec_sz != ti->bytes_per_sector) {
+                trk_warn(ti, tracknr, "Unexpected IDAM sector size sec=%02x "
+                         "cyl=%02x hd=%02x secsz=%d wanted=%d",
+                         idam.sec+extra_data->sector_base,
+                         idam.cyl, idam.head, sec_sz, ti->bytes_per_sector);
+                continue;
+            }
+
+            sector_harvest_note(&harvest, s, ent->offset, idam.sec);
+            if (is_valid_sector(ti, idam.sec))
+                continue;
+
+            /* DAM */
+            if ((ent->mark != IBM_MARK_DAM) || (ent->dat == NULL) || ent->crc)
+                continue;
+
+            memcpy(&block[idam.sec*sec_sz], ent->dat, sec_sz);
+            set_sector_valid(ti, idam.sec);
+            nr_valid_blocks++;
         }
 
-        /* Is sector size valid for this format? */
-        sec_sz = 128 << idam.no;
-        if (sec_sz != ti->bytes_per_sector) {
-            trk_warn(ti, tracknr, "Unexpected IDAM sector size sec=%02x "
-                     "cyl=%02x hd=%02x secsz=%d wanted=%d",
-                     idam.sec+extra_data->sector_base,
-                     idam.cyl, idam.head, sec_sz, ti->bytes_per_sector);
-            continue;
-        }
+        /* Only the IAM is still sought: the harvest would skip past it. */
+        if (nr_valid_blocks == ti->nr_sectors)
+            map.harvest = NULL;
 
-        if (is_valid_sector(ti, idam.sec))
-            continue;
+    } while ((rc == 0) && ((nr_valid_blocks != ti->nr_sectors)
+                           || (want_iam && !map.has_iam)));
 
-        /* DAM */
-        if (ibm_scan_mark(s, 1000, &mark) < 0)
-            continue;
-        if ((mark == IBM_MARK_IDAM) && (_ibm_scan_idam(s, &idam) == 0))
-            goto redo_idam;
-        if (mark != IBM_MARK_DAM)
-            continue;
-        if ((stream_next_bytes(s, dat, 2*sec_sz) == -1) ||
-            (stream_next_bits(s, 32) == -1) || s->crc16_ccitt)
-            continue;
-
-        mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
-        memcpy(&block[idam.sec*sec_sz], dat, sec_sz);
-        set_sector_valid(ti, idam.sec);
-        nr_valid_blocks++;
-    }
+    ibm_map_free(&map);
 
     if (nr_valid_blocks == 0) {
         memfree(block);
         return NULL;
     }
 
-    block[ti->len++] = iam;
+    block[ti->len++] = map.has_iam;
     ti->data_bitoff = 80*16; /* Gap 4A */
 
     return block;
@@ -206,6 +222,7 @@ struct track_handler ibm_pc_dd_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 9,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -220,6 +237,7 @@ struct track_handler ibm_pc_dd_10sec_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 10,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -234,6 +252,7 @@ struct track_handler ibm_pc_hd_5_25_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 15,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -247,6 +266,7 @@ struct track_handler ibm_pc_hd_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 18,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -260,6 +280,7 @@ struct track_handler ibm_pc_ed_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 36,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -274,6 +295,7 @@ struct track_handler siemens_isdx_hd_handler = {
     .bytes_per_sector = 256,
     .nr_sectors = 32,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -289,6 +311,7 @@ struct track_handler microsoft_dmf_hd_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 21,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -305,6 +328,7 @@ struct track_handler trace_traceback_hd_handler = {
     .bytes_per_sector = 2048,
     .nr_sectors = 1,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -322,6 +346,7 @@ struct track_handler acorn_adfs_s_m_l_handler = {
     .bytes_per_sector = 256,
     .nr_sectors = 16,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -336,6 +361,7 @@ struct track_handler acorn_adfs_d_e_handler = {
     .bytes_per_sector = 1024,
     .nr_sectors = 5,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -350,6 +376,7 @@ struct track_handler acorn_adfs_f_handler = {
     .bytes_per_sector = 1024,
     .nr_sectors = 10,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -368,6 +395,7 @@ struct track_handler atari_st_720kb_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 9,
     .write_raw = ibm_img_write_raw,
+    .notes_sync = 1,
     .read_raw = ibm_img_read_raw,
     .write_sectors = ibm_img_write_sectors,
     .read_sectors = ibm_img_read_sectors,
@@ -50,6 +50,9 @@ struct stream {
      * of that error delta is applied to the window period and phase. */
     int pll_period_adj_pct; /* 0 - 100 */
     int pll_phase_adj_pct;  /* 0 - 100 */
+    /* Signed percentage offset applied to each track format's nominal 
+     * bitcell period, to centre the PLL on a fast or slow recording. */
+    int pll_centre_adj_pct;
 
     /* Flux-based streams. */
     int flux;                /* Nanoseconds to next flux reversal */
@@ -57,8 +60,51 @@ struct stream {
     unsigned int clocked_zeros;
     int ns_to_index;         /* Distance to next index pulse */
 
+    /* Flux-based streams: Shortest common flux interval on the current track
+     * in nanoseconds, measured when the track is selected. Zero if there is no
+     * clear dominant interval (eg. unformatted). If est_mfm then the interval
+     * is known to span two bitcells. See stream_estimate_density(). */
+    unsigned int est_flux_ns;
+    bool_t est_mfm;
+    int est_tracknr; /* track which est_flux_ns describes, or -1 */
+
     uint32_t prng_seed;
     bool_t double_step;
+
+    /* Per-attempt decode limits, applied to each track handler in turn by
+     * the container. Zero means unlimited. A handler which exceeds a limit
+     * sees end-of-stream, exactly as when max_revolutions are exhausted. */
+    uint32_t max_bits;        /* bitcells read */
+    uint32_t max_revs;        /* revolutions read */
+    uint32_t max_nosync_revs; /* revolutions without a sync (see below) */
+
+    /* Number of handler attempts cut short by each of the above limits. */
+    uint32_t nr_bits_aborts, nr_revs_aborts, nr_nosync_aborts;
+
+    /* Limit-tracking state for the current attempt. max_nosync_revs applies
+     * only to handlers which report their sync marks (attempt_syncs). */
+    uint8_t attempt, attempt_abort, attempt_syncs;
+    uint32_t attempt_bits, sync_index, saved_max_revolutions;
+
+    /* PLL checkpoints taken on the current track, in stream order, and the
+     * PLL parameters they were taken with. See stream_seek(). ckpt_ok is set
+     * while the current pass is a clean decode from stream_reset(). */
+    struct stream_checkpoint *ckpt;
+    unsigned int nr_ckpt, max_ckpt;
+    int ckpt_clock_centre, ckpt_period_adj_pct, ckpt_phase_adj_pct;
+    bool_t ckpt_ok;
+
+    /* Revolution-parallel decode, if rev_threads is non-zero: the flux of a
+     * selected track is captured once, each revolution is clocked through
+     * its own PLL on one of rev_threads threads, and stream_reset() replays
+     * the resulting bitcells. Flux dumps only (KryoFlux, SCP, etc). */
+    unsigned int rev_threads;
+    struct flux_capture *cap;
+    int cap_tracknr;             /* track held in cap, or -1 */
+    uint32_t cap_idx, cap_event; /* next flux interval and index pulse */
+    struct rev_bitcells *rbc;    /* decode currently being replayed */
+    uint32_t rbc_pos;            /* bitcells read since stream_reset() */
+    uint8_t rbc_mode;
 };
 
 #pragma GCC visibility push(default)
@@ -66,16 +112,44 @@ struct stream *stream_open(
     const char *name, unsigned int drive_rpm, unsigned int data_rpm);
 struct stream *stream_soft_open(
     uint8_t *data, uint16_t *speed, uint32_t bitlen, unsigned int data_rpm);
+/* A single track captured by SuperCard Pro hardware: nr_revs revolutions of
+ * big-endian 25ns flux samples, back to back in flux[]. */
+struct stream *stream_scp_track_open(
+    unsigned int tracknr, unsigned int nr_revs, bool_t index_cued,
+    const uint32_t *rev_ticks, const uint32_t *rev_samples,
+    const uint16_t *flux, unsigned int drive_rpm, unsigned int data_rpm);
 void stream_close(struct stream *s);
 int stream_select_track(struct stream *s, unsigned int tracknr);
 void stream_reset(struct stream *s);
 void stream_next_index(struct stream *s);
 int stream_next_bit(struct stream *s);
 int stream_next_bits(struct stream *s, unsigned int bits);
+/* Fast-forward to the given bitcell offset in the current revolution, or to
+ * the next index pulse if that comes first. The data word and CRC are not
+ * maintained while skipping. Jumps via a checkpoint if an earlier pass over
+ * the track saved one on the way; otherwise the PLL is still clocked through
+ * every skipped bitcell, and only the MFM and CRC work is saved. Returns the
+ * last bit read, or -1. */
+int stream_skip_to(struct stream *s, uint32_t index_offset_bc);
+/* Move to the given bitcell offset within revolution @rev, numbered as
+ * s->nr_index (so the first full revolution after stream_reset() is 1).
+ * Resumes from the nearest checkpoint saved by an earlier pass over the
+ * track where possible, else decodes forward from stream_reset(). The data
+ * word is refilled on the way but the CRC is not maintained. Returns -1 if
+ * the stream ends first. */
+int stream_seek(struct stream *s, uint32_t rev, uint32_t index_offset_bc);
+/* Count successive 16-bit words for which (word & mask) == pattern. Reading
+ * stops after the first word that does not match, after max words, or at the
+ * end of the stream. The data word is maintained but the CRC is not. Each
+ * bitcell is still clocked through the PLL: only the MFM and CRC work is
+ * saved. An MFM-encoded byte run is matched on its data bits (mask 0x5555). */
+unsigned int stream_next_run(
+    struct stream *s, uint16_t pattern, uint16_t mask, unsigned int max);
 int stream_next_bytes(struct stream *s, void *p, unsigned int bytes);
 void stream_start_crc(struct stream *s);
 void stream_set_density(struct stream *s, unsigned int ns_per_cell);
 unsigned int stream_get_density(struct stream *s);
+unsigned int stream_estimate_density(struct stream *s);
 #pragma GCC visibility pop
 
 #endif /* __LIBDISK_STREAM_H__ */
@@ -27,6 +27,11 @@ struct disk {
     struct container *container;
     struct disk_info *di;
     struct disk_list_tag *tags;
+    /* Lazily-loading containers: per-track flag, non-zero if the track has
+     * not yet been loaded; and the container's own state. Both are freed
+     * by disk_close(). */
+    uint8_t *track_pending;
+    void *container_dat;
 };
 
 /* How to interpret data being appended to a track buffer. */
@@ -51,6 +56,10 @@ struct tbuf {
     bool_t disable_auto_sector_split;
     void (*bit)(struct tbuf *, uint16_t speed,
                 enum bitcell_encoding enc, uint8_t dat);
+    /* Optional: receive a run of up to 32 bits (MSB first) in one call.
+     * Encoding is always bc_raw or bc_mfm. */
+    void (*bits)(struct tbuf *, uint16_t speed,
+                 enum bitcell_encoding enc, unsigned int bits, uint32_t x);
     void (*gap)(struct tbuf *, uint16_t speed, unsigned int bits);
     void (*weak)(struct tbuf *, unsigned int bits);
 };
@@ -84,6 +93,8 @@ struct track_handler {
     enum track_density density;
     unsigned int bytes_per_sector;
     unsigned int nr_sectors;
+    /* Calls stream_note_sync() for each sync mark found: see --nosync-revs */
+    bool_t notes_sync;
     void (*get_name)(
         struct disk *, unsigned int tracknr, char *, size_t);
     void *(*write_raw)(
@@ -97,12 +108,35 @@ struct track_handler {
     void *extra_data;
 };
 
+/* Handlers with notes_sync set call this on finding each sync mark. */
+void stream_note_sync(struct stream *s);
+
 /* Array of supported raw-bitcell analysers/handlers. */
 extern const struct track_handler *handlers[];
 
 /* Set up a track with defaults for a given track format. */
 void init_track_info(struct track_info *ti, enum track_type type);
 
+/* Multi-revolution sector harvesting. The first revolution is scanned in 
+ * full, and the handler notes the offset of each sync it finds along with the
+ * sector number it carries (-1 if the header is unreadable). Later 
+ * revolutions then fast-forward from one still-invalid sector to the next, 
+ * rather than testing every bitcell for sync. */
+#define HARVEST_MAX_SYNCS 64
+struct sector_harvest {
+    struct track_info *ti;
+    uint32_t scan_index, scan_until; /* scan every bitcell within here */
+    bool_t overflow;
+    unsigned int nr_syncs;
+    struct { int offset, sec; } sync[HARVEST_MAX_SYNCS];
+};
+void sector_harvest_init(
+    struct sector_harvest *h, struct track_info *ti, struct stream *s);
+void sector_harvest_note(
+    struct sector_harvest *h, struct stream *s, int offset, int sec);
+/* Drop-in replacement for stream_next_bit() in a handler's sync scan. */
+int sector_harvest_next_bit(struct sector_harvest *h, struct stream *s);
+
 /* Container -- interface for a disk-image container format. */
 struct container {
     /* Create a brand new empty container. */
@@ -114,6 +148,9 @@ struct container {
     /* Analyse and write a raw stream to given track in container. */
     int (*write_raw)(struct disk *, unsigned int tracknr,
                      enum track_type, struct stream *);
+    /* Optional: Load a pending track (and any neighbours) on first access.
+     * Must clear track_pending[] for every track it fills in. */
+    void (*load_track)(struct disk *, unsigned int tracknr);
 };
 
 /* Supported container formats. */
@@ -127,6 +164,11 @@ extern struct container container_ipf;
 extern struct container container_scp;
 extern struct container container_jv3;
 
+/* Get a track's info, first loading it from a lazy container if need be. */
+struct track_info *disk_track_info(struct disk *d, unsigned int tracknr);
+/* Load every pending track from a lazy container. */
+void disk_load_all_tracks(struct disk *d);
+
 /* Helpers for container implementations: defaults for init() & write_raw(). */
 void _dsk_init(struct disk *d, unsigned int nr_tracks);
 void dsk_init(struct disk *d);
@@ -156,6 +198,28 @@ int _ibm_scan_idam(struct stream *s, struct ibm_idam *idam);
 int ibm_scan_idam(struct stream *s, struct ibm_idam *idam);
 int ibm_scan_dam(struct stream *s);
 
+/* IBM track indexer: a single pass over one revolution records every IDAM
+ * found, plus the DAM/DDAM and decoded data that follow it. */
+struct ibm_mark_ent {
+    int offset, end_offset; /* bitcell offsets from index */
+    struct ibm_idam idam;
+    uint8_t mark;           /* data mark following the IDAM, or 0 if none */
+    uint16_t crc;           /* data crc: 0 = good */
+    uint8_t *dat;           /* decoded data, or NULL if not read */
+};
+struct ibm_track_map {
+    bool_t is_fm, is_rx02, has_iam;
+    unsigned int nr, max;
+    struct ibm_mark_ent *ent;
+    struct sector_harvest *harvest; /* optional: scan only where needed */
+};
+void ibm_map_init(struct ibm_track_map *map, bool_t is_fm, bool_t is_rx02);
+/* Returns -1 if the stream ends before the revolution is complete. Entries
+ * from the previous revolution are discarded, but a partial final revolution
+ * is still recorded in the map. */
+int ibm_map_revolution(struct stream *s, struct ibm_track_map *map);
+void ibm_map_free(struct ibm_track_map *map);
+
 void setup_ibm_mfm_track(
     struct disk *d, unsigned int tracknr,
     enum track_type type, unsigned int nr_secs, unsigned int no,
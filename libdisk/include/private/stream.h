@@ -4,19 +4,73 @@
 #include <libdisk/stream.h>
 #include <private/util.h>
 
+/* Words of type-specific position state held in each stream checkpoint. */
+#define STREAM_POS_WORDS 6
+
 struct stream_type {
     struct stream *(*open)(const char *name, unsigned int data_rpm);
     void (*close)(struct stream *);
     int (*select_track)(struct stream *, unsigned int tracknr);
     void (*reset)(struct stream *);
     int (*next_flux)(struct stream *);
+    /* Optional: save and restore position within the current track, so that
+     * stream_seek() can resume from a checkpoint. */
+    void (*save_pos)(struct stream *, uint32_t *pos);
+    void (*restore_pos)(struct stream *, const uint32_t *pos);
     const char *suffix[];
 };
 
+/* PLL and position state at a point on the current track. */
+struct stream_checkpoint {
+    uint64_t latency;
+    uint32_t nr_index, index_offset_bc, index_offset_ns;
+    uint32_t track_len_bc, track_len_ns;
+    int ns_to_index, flux, clock;
+    unsigned int clocked_zeros;
+    uint32_t pos[STREAM_POS_WORDS];
+};
+
+/* Revolution-parallel decode: a track's flux intervals, and the interval
+ * within which each index pulse falls (ns into that interval). */
+struct flux_capture {
+    unsigned int nr, max;
+    int *flux;
+    unsigned int nr_index, max_index;
+    struct { uint32_t pos; int ns; } *index;
+    /* Most recent decodes, for differing PLL parameters. */
+    struct rev_bitcells *rbc[4];
+};
+
+/* Bitcells decoded from a flux capture, as from stream_reset(). */
+struct rev_bitcell {
+    uint32_t lat:30;  /* nanoseconds clocked by this bitcell */
+    uint32_t bit:1;
+    uint32_t index:1; /* index pulse falls within this bitcell */
+    int clock;        /* PLL clock after this bitcell */
+};
+struct rev_bitcells {
+    int clock_centre, period_adj_pct, phase_adj_pct;
+    uint32_t nr, max;
+    struct rev_bitcell *bc;
+    uint64_t ns; /* total latency */
+    /* Bitcell count and latency at the end of each index-pulse bitcell. */
+    unsigned int nr_index;
+    uint32_t *index_pos;
+    uint64_t *index_ns;
+    /* Revolutions are decoded as jobs, in batches, on demand. */
+    unsigned int nr_jobs, next_job;
+};
+
 void stream_setup(
     struct stream *s, const struct stream_type *st,
     unsigned int drive_rpm, unsigned int data_rpm);
 
+/* Apply, and then remove, the per-attempt decode limits around a single
+ * track handler's use of the stream. The no-sync limit is applied only if
+ * the handler calls stream_note_sync() for every sync mark it finds. */
+void stream_begin_attempt(struct stream *s, bool_t notes_sync);
+void stream_end_attempt(struct stream *s);
+
 #endif /* __PRIVATE_STREAM_H__ */
 
 /*
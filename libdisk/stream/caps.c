@@ -255,6 +255,18 @@ static void caps_reset(struct stream *s)
     cpss->ns_per_cell = track_nsecs_from_rpm(s->data_rpm) / cpss->bitlen;
 }
 
+static void caps_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct caps_stream *cpss = container_of(s, struct caps_stream, s);
+    pos[0] = cpss->pos;
+}
+
+static void caps_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct caps_stream *cpss = container_of(s, struct caps_stream, s);
+    cpss->pos = pos[0];
+}
+
 static int caps_next_flux(struct stream *s)
 {
     struct caps_stream *cpss = container_of(s, struct caps_stream, s);
@@ -283,6 +295,8 @@ struct stream_type caps = {
     .select_track = caps_select_track,
     .reset = caps_reset,
     .next_flux = caps_next_flux,
+    .save_pos = caps_save_pos,
+    .restore_pos = caps_restore_pos,
     .suffix = { "ipf", "ct", "ctr", "raw", NULL }
 };
 
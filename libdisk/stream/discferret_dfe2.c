@@ -177,6 +177,24 @@ static void dfe2_reset(struct stream *s)
     lseek(dfss->fd, 0, SEEK_SET);
 }
 
+static void dfe2_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
+
+    pos[0] = dfss->dat_idx;
+    pos[1] = dfss->stream_idx;
+    pos[2] = dfss->index_pos;
+}
+
+static void dfe2_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
+
+    dfss->dat_idx = pos[0];
+    dfss->stream_idx = pos[1];
+    dfss->index_pos = pos[2];
+}
+
 static int dfe2_next_flux(struct stream *s)
 {
     struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
@@ -236,6 +254,8 @@ struct stream_type discferret_dfe2 = {
     .select_track = dfe2_select_track,
     .reset = dfe2_reset,
     .next_flux = dfe2_next_flux,
+    .save_pos = dfe2_save_pos,
+    .restore_pos = dfe2_restore_pos,
     .suffix = { "dfi", NULL }
 
 };
@@ -82,6 +82,18 @@ static void di_reset(struct stream *s)
     dis->pos = 0;
 }
 
+static void di_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct di_stream *dis = container_of(s, struct di_stream, s);
+    pos[0] = dis->pos;
+}
+
+static void di_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct di_stream *dis = container_of(s, struct di_stream, s);
+    dis->pos = pos[0];
+}
+
 static int di_next_flux(struct stream *s)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
@@ -112,6 +124,8 @@ struct stream_type disk_image = {
     .select_track = di_select_track,
     .reset = di_reset,
     .next_flux = di_next_flux,
+    .save_pos = di_save_pos,
+    .restore_pos = di_restore_pos,
     .suffix = { "adf", "eadf", "dsk", "hfe", "imd", "img", NULL }
 };
 
@@ -97,6 +97,28 @@ static void dr_reset(struct stream *s)
     drs->avg_lat = 0;
 }
 
+static void dr_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct dr_stream *drs = container_of(s, struct dr_stream, s);
+
+    pos[0] = drs->dat_idx;
+    pos[1] = drs->b;
+    pos[2] = drs->bpos;
+    pos[3] = drs->byte_latency;
+    pos[4] = drs->avg_lat;
+}
+
+static void dr_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct dr_stream *drs = container_of(s, struct dr_stream, s);
+
+    drs->dat_idx = pos[0];
+    drs->b = pos[1];
+    drs->bpos = pos[2];
+    drs->byte_latency = pos[3];
+    drs->avg_lat = pos[4];
+}
+
 static int dr_next_flux(struct stream *s)
 {
     struct dr_stream *drs = container_of(s, struct dr_stream, s);
@@ -140,6 +162,8 @@ struct stream_type diskread = {
     .select_track = dr_select_track,
     .reset = dr_reset,
     .next_flux = dr_next_flux,
+    .save_pos = dr_save_pos,
+    .restore_pos = dr_restore_pos,
     .suffix = { "dat", NULL }
 };
 
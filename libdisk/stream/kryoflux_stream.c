@@ -173,6 +173,24 @@ static void kfs_reset(struct stream *s)
     kfss->idx_i = 0;
 }
 
+static void kfs_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+
+    pos[0] = kfss->dat_idx;
+    pos[1] = kfss->stream_idx;
+    pos[2] = kfss->idx_i;
+}
+
+static void kfs_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+
+    kfss->dat_idx = pos[0];
+    kfss->stream_idx = pos[1];
+    kfss->idx_i = pos[2];
+}
+
 static int kfs_next_flux(struct stream *s)
 {
     struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
@@ -259,6 +277,8 @@ struct stream_type kryoflux_stream = {
     .select_track = kfs_select_track,
     .reset = kfs_reset,
     .next_flux = kfs_next_flux,
+    .save_pos = kfs_save_pos,
+    .restore_pos = kfs_restore_pos,
     .suffix = { NULL }
 };
 
@@ -33,6 +33,18 @@ static void ss_reset(struct stream *s)
     ss->pos = 0;
 }
 
+static void ss_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct soft_stream *ss = container_of(s, struct soft_stream, s);
+    pos[0] = ss->pos;
+}
+
+static void ss_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct soft_stream *ss = container_of(s, struct soft_stream, s);
+    ss->pos = pos[0];
+}
+
 static int ss_next_flux(struct stream *s)
 {
     struct soft_stream *ss = container_of(s, struct soft_stream, s);
@@ -58,7 +70,9 @@ static struct stream_type stream_soft = {
     .close = ss_close,
     .select_track = ss_select_track,
     .reset = ss_reset,
-    .next_flux = ss_next_flux
+    .next_flux = ss_next_flux,
+    .save_pos = ss_save_pos,
+    .restore_pos = ss_restore_pos
 };
 
 struct stream *stream_soft_open(
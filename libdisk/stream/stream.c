@@ -7,6 +7,7 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +29,32 @@
 #define DEFAULT_PERIOD_ADJ_PCT  5
 #define DEFAULT_PHASE_ADJ_PCT  60
 
+/* Flux-interval histogram used for density estimation. */
+#define EST_BIN_NS     50
+#define EST_NR_BINS    400   /* 20us */
+#define EST_MIN_FLUX   1000  /* samples required for a confident estimate */
+#define EST_MAX_FLUX   4096  /* samples taken (at most one revolution) */
+#define EST_WINDOW_PCT 15    /* +/- 15% around each expected interval */
+
+/* Bitcells between PLL checkpoints (power of two). */
+#define CKPT_INTERVAL_BC 2048
+
+/* Revolution-parallel decode: flux intervals clocked through a fresh PLL
+ * ahead of each revolution's index pulse, and a limit on captured flux. */
+#define REV_WARMUP_FLUX 1000
+#define REV_MAX_FLUX    (8u<<20)
+
+/* Revolution-parallel decode: how bitcells are currently being read. */
+#define RBC_live    0 /* from the PLL */
+#define RBC_replay  1 /* from decoded bitcells */
+#define RBC_catchup 2 /* switch to the PLL at the current bitcell */
+
+/* Reasons for cutting short a track handler's decode attempt. */
+#define ABORT_none   0
+#define ABORT_bits   1
+#define ABORT_revs   2
+#define ABORT_nosync 3
+
 extern struct stream_type kryoflux_stream;
 extern struct stream_type diskread;
 extern struct stream_type disk_image;
@@ -46,6 +73,13 @@ const static struct stream_type *stream_type[] = {
 };
 
 static int flux_next_bit(struct stream *s);
+static unsigned int estimate_flux_period(struct stream *s);
+static void rev_capture(struct stream *s);
+static void rev_free(struct stream *s);
+static void rev_decode(struct stream *s);
+static int rev_decode_more(struct stream *s);
+static int rev_seek(struct stream *s, uint32_t rev, uint32_t index_offset_bc);
+static void rev_go_live(struct stream *s);
 
 void stream_setup(
     struct stream *s, const struct stream_type *st,
@@ -59,6 +93,8 @@ void stream_setup(
     s->pll_phase_adj_pct = DEFAULT_PHASE_ADJ_PCT;
     s->clock = s->clock_centre = CLOCK_CENTRE;
     s->prng_seed = 0xae659201u;
+    s->est_tracknr = -1;
+    s->cap_tracknr = -1;
 }
 
 struct stream *stream_open(
@@ -97,6 +133,8 @@ found:
 
 void stream_close(struct stream *s)
 {
+    memfree(s->ckpt);
+    rev_free(s);
     s->type->close(s);
 }
 
@@ -105,15 +143,47 @@ int stream_select_track(struct stream *s, unsigned int tracknr)
     int rc;
 
     s->max_revolutions = 0;
+    s->nr_ckpt = 0;
+    s->ckpt_ok = 0;
     rc = s->type->select_track(s, tracknr << s->double_step);
     if (rc)
         return rc;
     s->max_revolutions = max_t(uint32_t, s->max_revolutions, 4);
 
+    if (s->est_tracknr != tracknr) {
+        s->est_flux_ns = estimate_flux_period(s);
+        s->est_tracknr = tracknr;
+    }
+
+    /* Flux dumps may be captured for revolution-parallel decode. The capture
+     * is kept while the same track is reselected (eg. for each format). */
+    if (!s->rev_threads || (s->cap_tracknr != tracknr))
+        rev_free(s);
+    if (s->rev_threads && (s->cap == NULL)
+        && ((s->type == &kryoflux_stream) || (s->type == &diskread)
+            || (s->type == &discferret_dfe2) || (s->type == &supercard_scp))) {
+        rev_capture(s);
+        s->cap_tracknr = tracknr;
+    }
+
     stream_reset(s);
     return 0;
 }
 
+/* Discard checkpoints if the PLL has been reconfigured since they were
+ * taken: a fresh decode would no longer reproduce them. */
+static void ckpt_validate(struct stream *s)
+{
+    if ((s->ckpt_clock_centre != s->clock_centre)
+        || (s->ckpt_period_adj_pct != s->pll_period_adj_pct)
+        || (s->ckpt_phase_adj_pct != s->pll_phase_adj_pct)) {
+        s->nr_ckpt = 0;
+        s->ckpt_clock_centre = s->clock_centre;
+        s->ckpt_period_adj_pct = s->pll_period_adj_pct;
+        s->ckpt_phase_adj_pct = s->pll_phase_adj_pct;
+    }
+}
+
 static void _stream_reset(struct stream *s)
 {
     /* Flux-based streams */
@@ -121,7 +191,7 @@ static void _stream_reset(struct stream *s)
     s->clocked_zeros = 0;
 
     s->word = 0;
-    s->nr_index = 0;
+    s->nr_index = s->sync_index = 0;
     s->latency = 0;
     s->index_offset_bc
         = s->index_offset_ns
@@ -129,12 +199,24 @@ static void _stream_reset(struct stream *s)
         = s->track_len_ns
         = (1u<<31)-1; /* bad */
     s->ns_to_index = INT_MAX;
+    s->cap_idx = s->cap_event = 0;
+    s->rbc_pos = 0;
 
     s->type->reset(s);
 }
 
 void stream_reset(struct stream *s)
 {
+    s->ckpt_ok = 0;
+
+    /* Replay the captured track's revolution-parallel decode. */
+    if (s->cap != NULL) {
+        rev_decode(s);
+        _stream_reset(s);
+        s->rbc_mode = RBC_replay;
+        goto out;
+    }
+
     /* Reset the PLL clock, then allow 100 bit times for PLL lock. */
     s->clock = s->clock_centre;
     _stream_reset(s);
@@ -143,6 +225,11 @@ void stream_reset(struct stream *s)
     /* Now reset everything except the PLL clock. */
     _stream_reset(s);
 
+    /* This pass may be checkpointed. */
+    ckpt_validate(s);
+    s->ckpt_ok = (s->type->save_pos != NULL);
+
+out:
     if (s->nr_index == 0)
         stream_next_index(s);
 }
@@ -162,15 +249,150 @@ void stream_start_crc(struct stream *s)
     s->crc_bitoff = 0;
 }
 
-int stream_next_bit(struct stream *s)
+void stream_begin_attempt(struct stream *s, bool_t notes_sync)
+{
+    s->attempt = 1;
+    s->attempt_syncs = notes_sync;
+    s->attempt_abort = ABORT_none;
+    s->attempt_bits = 0;
+    s->saved_max_revolutions = s->max_revolutions;
+    if (s->max_revs && (s->max_revs < s->max_revolutions))
+        s->max_revolutions = s->max_revs;
+}
+
+void stream_note_sync(struct stream *s)
+{
+    s->sync_index = s->nr_index;
+}
+
+void stream_end_attempt(struct stream *s)
+{
+    switch (s->attempt_abort) {
+    case ABORT_bits: s->nr_bits_aborts++; break;
+    case ABORT_revs: s->nr_revs_aborts++; break;
+    case ABORT_nosync: s->nr_nosync_aborts++; break;
+    }
+    s->attempt = 0;
+    s->max_revolutions = s->saved_max_revolutions;
+}
+
+/* Check the per-attempt limits before reading a further bitcell. */
+static bool_t attempt_exhausted(struct stream *s)
+{
+    if (s->nr_index > s->max_revolutions) {
+        if (s->max_revolutions != s->saved_max_revolutions)
+            s->attempt_abort = ABORT_revs;
+        return 1;
+    }
+
+    if (s->max_bits && (++s->attempt_bits > s->max_bits)) {
+        s->attempt_abort = ABORT_bits;
+        return 1;
+    }
+
+    if (s->max_nosync_revs && s->attempt_syncs
+        && ((s->nr_index - s->sync_index) > s->max_nosync_revs)) {
+        s->attempt_abort = ABORT_nosync;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Is the stream position before bitcell @bc of revolution @rev? */
+static bool_t pos_before(
+    uint32_t nr_index, uint32_t index_offset_bc, uint32_t rev, uint32_t bc)
+{
+    return (nr_index < rev) || ((nr_index == rev) && (index_offset_bc < bc));
+}
+
+static void stream_checkpoint(struct stream *s)
+{
+    struct stream_checkpoint *ck;
+
+    /* Positions already covered by an earlier pass need no new checkpoint. */
+    if (s->nr_ckpt) {
+        ck = &s->ckpt[s->nr_ckpt-1];
+        if (!pos_before(ck->nr_index, ck->index_offset_bc,
+                        s->nr_index, s->index_offset_bc))
+            return;
+    }
+
+    if (s->nr_ckpt == s->max_ckpt) {
+        ck = s->ckpt;
+        s->max_ckpt = s->max_ckpt ? s->max_ckpt * 2 : 64;
+        s->ckpt = memalloc(s->max_ckpt * sizeof(*ck));
+        if (ck != NULL) {
+            memcpy(s->ckpt, ck, s->nr_ckpt * sizeof(*ck));
+            memfree(ck);
+        }
+    }
+
+    ck = &s->ckpt[s->nr_ckpt++];
+    ck->latency = s->latency;
+    ck->nr_index = s->nr_index;
+    ck->index_offset_bc = s->index_offset_bc;
+    ck->index_offset_ns = s->index_offset_ns;
+    ck->track_len_bc = s->track_len_bc;
+    ck->track_len_ns = s->track_len_ns;
+    ck->ns_to_index = s->ns_to_index;
+    ck->flux = s->flux;
+    ck->clock = s->clock;
+    ck->clocked_zeros = s->clocked_zeros;
+    s->type->save_pos(s, ck->pos);
+}
+
+static void stream_restore(struct stream *s, struct stream_checkpoint *ck)
+{
+    s->latency = ck->latency;
+    s->nr_index = ck->nr_index;
+    s->index_offset_bc = ck->index_offset_bc;
+    s->index_offset_ns = ck->index_offset_ns;
+    s->track_len_bc = ck->track_len_bc;
+    s->track_len_ns = ck->track_len_ns;
+    s->ns_to_index = ck->ns_to_index;
+    s->flux = ck->flux;
+    s->clock = ck->clock;
+    s->clocked_zeros = ck->clocked_zeros;
+    s->type->restore_pos(s, ck->pos);
+    s->word = 0;
+    s->ckpt_ok = 1;
+}
+
+/* Revolution-parallel decode: replay the next decoded bitcell. */
+static inline int rev_next_bit(struct stream *s)
+{
+    const struct rev_bitcell *bc;
+
+    if (s->rbc_mode == RBC_catchup) {
+        rev_go_live(s);
+        return flux_next_bit(s);
+    }
+
+    while (s->rbc_pos >= s->rbc->nr)
+        if (rev_decode_more(s) == -1)
+            return -1;
+    bc = &s->rbc->bc[s->rbc_pos];
+    s->latency += bc->lat;
+    s->clock = bc->clock;
+    s->ns_to_index = bc->index ? bc->lat : INT_MAX;
+    return bc->bit;
+}
+
+/* Clock out the next bitcell, without updating the data word or CRC. */
+static inline int _stream_next_bit(struct stream *s)
 {
     uint64_t lat = s->latency;
     int b;
-    if (s->nr_index > s->max_revolutions)
+    if (s->attempt) {
+        if (s->attempt_abort || attempt_exhausted(s))
+            return -1;
+    } else if (s->nr_index > s->max_revolutions)
         return -1;
     s->index_offset_bc++;
-    if ((b = flux_next_bit(s)) == -1)
+    if ((b = s->rbc_mode ? rev_next_bit(s) : flux_next_bit(s)) == -1)
         return -1;
+    s->rbc_pos++;
     lat = s->latency - lat;
     s->index_offset_ns += lat;
     s->ns_to_index -= lat;
@@ -181,6 +403,17 @@ int stream_next_bit(struct stream *s)
         s->index_offset_bc = s->index_offset_ns = 0;
         s->nr_index++;
     }
+    if (!(s->index_offset_bc & (CKPT_INTERVAL_BC-1))
+        && s->ckpt_ok && s->nr_index)
+        stream_checkpoint(s);
+    return b;
+}
+
+int stream_next_bit(struct stream *s)
+{
+    int b;
+    if ((b = _stream_next_bit(s)) == -1)
+        return -1;
     s->word = (s->word << 1) | b;
     if (++s->crc_bitoff == 16) {
         uint8_t b = mfm_decode_word(s->word);
@@ -190,6 +423,123 @@ int stream_next_bit(struct stream *s)
     return b;
 }
 
+/* Jump forward, within the current revolution, to the latest checkpoint at
+ * or before @index_offset_bc. Checkpoints exist only where an earlier pass
+ * over the track got to first. Only a clean pass may jump, as it would clock
+ * its way to the very same PLL state. The bitcells jumped over are charged
+ * to the current attempt. */
+static void skip_by_checkpoint(struct stream *s, uint32_t index_offset_bc)
+{
+    struct stream_checkpoint *ck;
+    uint32_t skipped;
+    int i;
+
+    if (!s->ckpt_ok || (s->rbc_mode != RBC_live))
+        return;
+
+    for (i = s->nr_ckpt - 1; i >= 0; i--) {
+        ck = &s->ckpt[i];
+        if (pos_before(ck->nr_index, ck->index_offset_bc,
+                       s->nr_index, s->index_offset_bc + CKPT_INTERVAL_BC))
+            return;
+        if ((ck->nr_index == s->nr_index)
+            && (ck->index_offset_bc <= index_offset_bc))
+            break;
+    }
+    if (i < 0)
+        return;
+
+    skipped = ck->index_offset_bc - s->index_offset_bc;
+    if (s->attempt && s->max_bits) {
+        if ((s->attempt_bits + skipped) >= s->max_bits)
+            return;
+        s->attempt_bits += skipped;
+    }
+
+    stream_restore(s, ck);
+}
+
+int stream_skip_to(struct stream *s, uint32_t index_offset_bc)
+{
+    uint32_t nr_index = s->nr_index;
+    int b;
+
+    skip_by_checkpoint(s, index_offset_bc);
+
+    do {
+        if ((b = _stream_next_bit(s)) == -1)
+            return -1;
+    } while ((s->nr_index == nr_index)
+             && (s->index_offset_bc < index_offset_bc));
+
+    /* The data word is stale: start it afresh from this bitcell. */
+    s->word = b;
+    return b;
+}
+
+int stream_seek(struct stream *s, uint32_t rev, uint32_t index_offset_bc)
+{
+    struct stream_checkpoint *ck = NULL;
+    int i;
+
+    if (s->rbc_mode == RBC_replay)
+        return rev_seek(s, rev, index_offset_bc);
+
+    ckpt_validate(s);
+
+    /* Latest checkpoint at least 32 bitcells short of the target, so that
+     * the data word is refilled on the way. */
+    for (i = s->nr_ckpt - 1; i >= 0; i--) {
+        if (pos_before(s->ckpt[i].nr_index, s->ckpt[i].index_offset_bc + 32,
+                       rev, index_offset_bc + 1)) {
+            ck = &s->ckpt[i];
+            break;
+        }
+    }
+
+    /* Continue the current pass if it is clean and no further back. */
+    if (s->ckpt_ok
+        && pos_before(s->nr_index, s->index_offset_bc, rev, index_offset_bc)
+        && ((ck == NULL)
+            || !pos_before(s->nr_index, s->index_offset_bc,
+                           ck->nr_index, ck->index_offset_bc)))
+        ck = NULL;
+    else if (ck != NULL)
+        stream_restore(s, ck);
+    else
+        stream_reset(s);
+
+    while (pos_before(s->nr_index, s->index_offset_bc, rev, index_offset_bc))
+        if (stream_next_bit(s) == -1)
+            return -1;
+
+    return 0;
+}
+
+unsigned int stream_next_run(
+    struct stream *s, uint16_t pattern, uint16_t mask, unsigned int max)
+{
+    uint32_t word = s->word;
+    unsigned int nr, i;
+    int b;
+
+    for (nr = 0; nr < max; nr++) {
+        for (i = 0; i < 16; i++) {
+            if ((b = _stream_next_bit(s)) == -1)
+                goto out;
+            word = (word << 1) | b;
+        }
+        if (((uint16_t)word & mask) != pattern) {
+            s->word = word;
+            return nr;
+        }
+    }
+
+out:
+    s->word = word;
+    return nr;
+}
+
 int stream_next_bits(struct stream *s, unsigned int bits)
 {
     unsigned int i;
@@ -220,16 +570,119 @@ unsigned int stream_get_density(struct stream *s)
 
 void stream_set_density(struct stream *s, unsigned int ns_per_cell)
 {
+    /* The current pass no longer matches a clean decode. */
+    s->ckpt_ok = 0;
+    if (s->rbc_mode == RBC_replay)
+        s->rbc_mode = RBC_catchup;
+
     /* Flux-based streams */
     s->clock = s->clock_centre = ns_per_cell;
 }
 
+/* Estimated bitcell period of the current track, in nanoseconds, or zero if
+ * unknown. Measured once per track by stream_select_track(). */
+unsigned int stream_estimate_density(struct stream *s)
+{
+    return s->est_mfm ? s->est_flux_ns/2 : s->est_flux_ns;
+}
+
+/* Sum of histogram entries within EST_WINDOW_PCT of @ns. */
+static unsigned int hist_window(
+    const unsigned int *hist, unsigned int ns, uint64_t *psum)
+{
+    unsigned int i, lo, hi, nr = 0;
+
+    lo = (ns * (100 - EST_WINDOW_PCT)) / (100 * EST_BIN_NS);
+    hi = (ns * (100 + EST_WINDOW_PCT)) / (100 * EST_BIN_NS);
+    for (i = lo; (i <= hi) && (i < EST_NR_BINS); i++) {
+        nr += hist[i];
+        if (psum)
+            *psum += (uint64_t)hist[i] * (i * EST_BIN_NS + EST_BIN_NS/2);
+    }
+
+    return nr;
+}
+
+static unsigned int estimate_flux_period(struct stream *s)
+{
+    unsigned int hist[EST_NR_BINS], i, peak, nr = 0, nr_peak, nr_mid, nr_good;
+    uint64_t sum = 0, total = 0, rev = track_nsecs_from_rpm(s->data_rpm);
+    unsigned int period;
+
+    memset(hist, 0, sizeof(hist));
+    s->est_mfm = 0;
+
+    /* Histogram raw flux intervals, bypassing the PLL. */
+    _stream_reset(s);
+    while ((total < rev) && (nr < EST_MAX_FLUX)) {
+        s->flux = 0;
+        if (s->type->next_flux(s) != 0)
+            break;
+        if (s->flux <= 0)
+            continue;
+        total += s->flux;
+        i = s->flux / EST_BIN_NS;
+        if (i < EST_NR_BINS) {
+            hist[i]++;
+            nr++;
+        }
+    }
+
+    if (nr < EST_MIN_FLUX)
+        return 0;
+
+    /* The shortest interval which occurs with any real frequency is the first
+     * bin to reach a quarter of the tallest bin. Climb to its local peak. */
+    for (i = peak = 0; i < EST_NR_BINS; i++)
+        if (hist[i] > hist[peak])
+            peak = i;
+    for (i = 0; hist[i] < hist[peak]/4; i++)
+        continue;
+    while ((i+1 < EST_NR_BINS) && (hist[i+1] >= hist[i]))
+        i++;
+
+    /* Refine to the mean interval within the peak window. */
+    nr_peak = hist_window(hist, i * EST_BIN_NS + EST_BIN_NS/2, &sum);
+    period = sum / nr_peak;
+
+    /* FM produces intervals of 1 and 2 periods; MFM of 1, 1.5 and 2. Anything
+     * else in quantity means this is not a cleanly-encoded track. */
+    nr_mid = hist_window(hist, (period*3)/2, NULL);
+    nr_good = nr_peak + nr_mid + hist_window(hist, period*2, NULL);
+    if ((nr_good * 4) < (nr * 3))
+        return 0;
+
+    /* A real population at 1.5 periods identifies MFM: the shortest interval
+     * is then two bitcells. Otherwise it may be one (FM) or two. */
+    s->est_mfm = (nr_mid * 10) >= nr;
+
+    return period;
+}
+
+/* Read the next flux interval from a track's capture. */
+static int cap_next_flux(struct stream *s)
+{
+    const struct flux_capture *cap = s->cap;
+
+    if (s->cap_idx >= cap->nr)
+        return -1;
+
+    while ((s->cap_event < cap->nr_index)
+           && (cap->index[s->cap_event].pos == s->cap_idx)) {
+        s->ns_to_index = s->flux + cap->index[s->cap_event].ns;
+        s->cap_event++;
+    }
+
+    s->flux += cap->flux[s->cap_idx++];
+    return 0;
+}
+
 static int flux_next_bit(struct stream *s)
 {
     int new_flux;
 
     while (s->flux < (s->clock/2))
-        if (s->type->next_flux(s) != 0)
+        if ((s->cap ? cap_next_flux(s) : s->type->next_flux(s)) != 0)
             return -1;
 
     s->latency += s->clock;
@@ -264,6 +717,381 @@ static int flux_next_bit(struct stream *s)
     return 1;
 }
 
+/*
+ * Revolution-parallel decode. A track's flux is captured once, and split
+ * into jobs at its index pulses. Each job clocks one revolution through its
+ * own PLL, which first settles over the REV_WARMUP_FLUX intervals preceding
+ * the revolution's index pulse. Jobs near the start of the capture instead
+ * mirror stream_reset() from its first interval. Jobs run in batches, one
+ * per thread, as the replay reaches the end of the bitcells decoded so far.
+ * Handlers see the bitcells exactly as the PLL would return them, except
+ * that a PLL which has not locked by a revolution's index pulse may differ
+ * from a sequential decode for the first few bitcells.
+ */
+
+struct rev_job {
+    int first, last; /* index pulses bounding the revolution, or -1 */
+    uint32_t nr, max;
+    struct rev_bitcell *bc;
+};
+
+struct rev_pool {
+    const struct stream *s;
+    pthread_mutex_t mutex;
+    struct rev_job *job;
+    unsigned int nr_jobs, next_job;
+};
+
+static void rev_capture(struct stream *s)
+{
+    struct flux_capture *cap = memalloc(sizeof(*cap));
+    void *p;
+
+    /* Capture through the index pulse which ends the final revolution. */
+    _stream_reset(s);
+    for (;;) {
+        s->flux = 0;
+        s->ns_to_index = INT_MAX;
+        if (s->type->next_flux(s) != 0)
+            break;
+        if (s->ns_to_index != INT_MAX) {
+            if (cap->nr_index > s->max_revolutions)
+                break;
+            if (cap->nr_index == cap->max_index) {
+                p = cap->index;
+                cap->max_index = cap->max_index ? cap->max_index * 2 : 8;
+                cap->index = memalloc(cap->max_index * sizeof(*cap->index));
+                if (p != NULL) {
+                    memcpy(cap->index, p, cap->nr_index*sizeof(*cap->index));
+                    memfree(p);
+                }
+            }
+            cap->index[cap->nr_index].pos = cap->nr;
+            cap->index[cap->nr_index].ns = s->ns_to_index;
+            cap->nr_index++;
+            /* Some streams select the revolution to read by index count. */
+            s->nr_index++;
+        }
+        if (cap->nr == cap->max) {
+            if (cap->nr == REV_MAX_FLUX)
+                break;
+            p = cap->flux;
+            cap->max = cap->max ? cap->max * 2 : 65536;
+            cap->flux = memalloc(cap->max * sizeof(*cap->flux));
+            if (p != NULL) {
+                memcpy(cap->flux, p, cap->nr * sizeof(*cap->flux));
+                memfree(p);
+            }
+        }
+        cap->flux[cap->nr++] = s->flux;
+    }
+
+    s->cap = cap;
+}
+
+static void rbc_free(struct rev_bitcells *rbc)
+{
+    if (rbc == NULL)
+        return;
+    memfree(rbc->bc);
+    memfree(rbc->index_pos);
+    memfree(rbc->index_ns);
+    memfree(rbc);
+}
+
+static void rev_free(struct stream *s)
+{
+    struct flux_capture *cap = s->cap;
+    unsigned int i;
+
+    s->cap = NULL;
+    s->cap_tracknr = -1;
+    s->rbc = NULL;
+    s->rbc_mode = RBC_live;
+
+    if (cap == NULL)
+        return;
+    for (i = 0; i < ARRAY_SIZE(cap->rbc); i++)
+        rbc_free(cap->rbc[i]);
+    memfree(cap->flux);
+    memfree(cap->index);
+    memfree(cap);
+}
+
+static void rev_job_run(const struct stream *s, struct rev_job *job)
+{
+    const struct flux_capture *cap = s->cap;
+    struct rev_bitcell *bc;
+    struct stream t;
+    bool_t recording = (job->first < 0), crossed;
+    uint64_t lat;
+    unsigned int i;
+    int b;
+
+    /* A private PLL, reading from the capture. */
+    memset(&t, 0, sizeof(t));
+    t.cap = s->cap;
+    t.pll_period_adj_pct = s->pll_period_adj_pct;
+    t.pll_phase_adj_pct = s->pll_phase_adj_pct;
+    t.clock = t.clock_centre = s->clock_centre;
+    t.ns_to_index = INT_MAX;
+
+    if ((job->first < 0) || (cap->index[job->first].pos < REV_WARMUP_FLUX)) {
+        /* Too close to the start of the capture for a separate warm-up (eg.
+         * an index-cued dump). As stream_reset(): 100 bit times for PLL
+         * lock, then rewind, and decode from the start. */
+        for (i = 0; i < 100; i++)
+            if (flux_next_bit(&t) == -1)
+                break;
+        t.flux = 0;
+        t.clocked_zeros = 0;
+        t.cap_idx = t.cap_event = 0;
+        t.ns_to_index = INT_MAX;
+    } else {
+        t.cap_event = job->first;
+        t.cap_idx = cap->index[job->first].pos;
+        t.cap_idx -= min_t(uint32_t, t.cap_idx, REV_WARMUP_FLUX);
+    }
+
+    for (;;) {
+        lat = t.latency;
+        if ((b = flux_next_bit(&t)) == -1)
+            break;
+        lat = t.latency - lat;
+        t.ns_to_index -= lat;
+        if ((crossed = (t.ns_to_index <= 0)))
+            t.ns_to_index = INT_MAX;
+        if (recording) {
+            if (job->nr == job->max) {
+                bc = job->bc;
+                job->max = job->max ? job->max * 2 : 131072;
+                job->bc = memalloc(job->max * sizeof(*bc));
+                if (bc != NULL) {
+                    memcpy(job->bc, bc, job->nr * sizeof(*bc));
+                    memfree(bc);
+                }
+            }
+            bc = &job->bc[job->nr++];
+            bc->lat = lat;
+            bc->bit = b;
+            bc->index = crossed;
+            bc->clock = t.clock;
+        }
+        if (crossed) {
+            if ((int)t.cap_event - 1 == job->last)
+                break;
+            if ((int)t.cap_event - 1 == job->first)
+                recording = 1;
+        }
+    }
+}
+
+static void *rev_worker(void *_pool)
+{
+    struct rev_pool *pool = _pool;
+    struct rev_job *job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        job = (pool->next_job < pool->nr_jobs)
+            ? &pool->job[pool->next_job++] : NULL;
+        pthread_mutex_unlock(&pool->mutex);
+        if (job == NULL)
+            return NULL;
+        rev_job_run(pool->s, job);
+    }
+}
+
+/* Select the decode to replay for the current PLL parameters. Revolutions are
+ * decoded on demand, by rev_decode_more(). */
+static void rev_decode(struct stream *s)
+{
+    struct flux_capture *cap = s->cap;
+    struct rev_bitcells *rbc;
+    unsigned int i;
+
+    /* Most recent decodes are kept, most recently used first. */
+    for (i = 0; i < ARRAY_SIZE(cap->rbc); i++) {
+        rbc = cap->rbc[i];
+        if ((rbc != NULL)
+            && (rbc->clock_centre == s->clock_centre)
+            && (rbc->period_adj_pct == s->pll_period_adj_pct)
+            && (rbc->phase_adj_pct == s->pll_phase_adj_pct))
+            break;
+    }
+    if (i == ARRAY_SIZE(cap->rbc)) {
+        rbc_free(cap->rbc[--i]);
+        rbc = memalloc(sizeof(*rbc));
+        rbc->clock_centre = s->clock_centre;
+        rbc->period_adj_pct = s->pll_period_adj_pct;
+        rbc->phase_adj_pct = s->pll_phase_adj_pct;
+        rbc->index_pos = memalloc(cap->nr_index * sizeof(*rbc->index_pos));
+        rbc->index_ns = memalloc(cap->nr_index * sizeof(*rbc->index_ns));
+        /* One job per revolution, bounded by the index pulses. */
+        rbc->nr_jobs = cap->nr_index + 1;
+    }
+    memmove(&cap->rbc[1], &cap->rbc[0], i * sizeof(rbc));
+    cap->rbc[0] = s->rbc = rbc;
+}
+
+/* Decode the next batch of revolutions, one per thread, and append them to
+ * the current decode. Returns -1 if the capture is exhausted. */
+static int rev_decode_more(struct stream *s)
+{
+    struct rev_bitcells *rbc = s->rbc;
+    struct rev_bitcell *bc;
+    struct rev_pool pool;
+    pthread_t *thread;
+    unsigned int i, j, nr, nr_threads;
+
+    if (rbc->next_job == rbc->nr_jobs)
+        return -1;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.s = s;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pool.nr_jobs = min(max(s->rev_threads, 1u), rbc->nr_jobs - rbc->next_job);
+    pool.job = memalloc(pool.nr_jobs * sizeof(*pool.job));
+    for (i = 0; i < pool.nr_jobs; i++) {
+        j = rbc->next_job++;
+        pool.job[i].first = (int)j - 1;
+        pool.job[i].last = (j < s->cap->nr_index) ? (int)j : -1;
+    }
+
+    /* This thread works through the jobs too. */
+    nr_threads = pool.nr_jobs;
+    thread = memalloc(nr_threads * sizeof(*thread));
+    for (i = 1; i < nr_threads; i++)
+        if (pthread_create(&thread[i], NULL, rev_worker, &pool))
+            break;
+    nr_threads = i;
+    rev_worker(&pool);
+    for (i = 1; i < nr_threads; i++)
+        pthread_join(thread[i], NULL);
+    memfree(thread);
+    pthread_mutex_destroy(&pool.mutex);
+
+    /* Append the revolutions, noting where each index pulse falls. */
+    for (i = nr = 0; i < pool.nr_jobs; i++)
+        nr += pool.job[i].nr;
+    if ((rbc->nr + nr) > rbc->max) {
+        bc = rbc->bc;
+        rbc->max = max(rbc->max * 2, rbc->nr + nr);
+        rbc->bc = memalloc(rbc->max * sizeof(*bc));
+        if (bc != NULL) {
+            memcpy(rbc->bc, bc, rbc->nr * sizeof(*bc));
+            memfree(bc);
+        }
+    }
+    for (i = 0; i < pool.nr_jobs; i++) {
+        bc = pool.job[i].bc;
+        for (j = 0; j < pool.job[i].nr; j++) {
+            rbc->ns += bc[j].lat;
+            rbc->bc[rbc->nr++] = bc[j];
+            if (bc[j].index && (rbc->nr_index < s->cap->nr_index)) {
+                rbc->index_pos[rbc->nr_index] = rbc->nr;
+                rbc->index_ns[rbc->nr_index] = rbc->ns;
+                rbc->nr_index++;
+            }
+        }
+        memfree(bc);
+    }
+    memfree(pool.job);
+
+    return 0;
+}
+
+static int rev_seek(struct stream *s, uint32_t rev, uint32_t index_offset_bc)
+{
+    struct rev_bitcells *rbc = s->rbc;
+    uint32_t pos, i;
+    uint64_t ns = 0;
+    unsigned int r;
+
+    /* Bitcell position of the target, which is no further than the next
+     * index pulse. Stop 32 bitcells short, to refill the data word. */
+    if ((rev == 0) || (rev > rbc->nr_index))
+        goto slow;
+    pos = rbc->index_pos[rev-1] + index_offset_bc;
+    if (rev < rbc->nr_index)
+        pos = min(pos, rbc->index_pos[rev]);
+    pos -= min_t(uint32_t, pos, 32);
+    if ((pos > rbc->nr) || (pos < rbc->index_pos[0]))
+        goto slow;
+
+    /* Already on the way? */
+    if ((s->rbc_pos >= pos)
+        && pos_before(s->nr_index, s->index_offset_bc, rev, index_offset_bc))
+        goto step;
+
+    /* Jump to the revolution containing pos, then within it. */
+    for (r = rev; rbc->index_pos[r-1] > pos; r--)
+        continue;
+    for (i = rbc->index_pos[r-1]; i < pos; i++)
+        ns += rbc->bc[i].lat;
+    s->rbc_pos = pos;
+    s->latency = rbc->index_ns[r-1] + ns;
+    s->nr_index = r;
+    s->index_offset_bc = pos - rbc->index_pos[r-1];
+    s->index_offset_ns = ns;
+    s->track_len_bc = rbc->index_pos[r-1];
+    s->track_len_ns = rbc->index_ns[r-1];
+    if (r >= 2) {
+        s->track_len_bc -= rbc->index_pos[r-2];
+        s->track_len_ns -= rbc->index_ns[r-2];
+    } else {
+        /* No earlier index pulse: offsets ran on from _stream_reset(). */
+        s->track_len_bc += (1u<<31)-1;
+        s->track_len_ns += (1u<<31)-1;
+    }
+    s->ns_to_index = INT_MAX;
+    s->clock = rbc->bc[pos-1].clock;
+    s->word = 0;
+    goto step;
+
+slow:
+    if (!pos_before(s->nr_index, s->index_offset_bc, rev, index_offset_bc))
+        stream_reset(s);
+step:
+    while (pos_before(s->nr_index, s->index_offset_bc, rev, index_offset_bc))
+        if (stream_next_bit(s) == -1)
+            return -1;
+
+    return 0;
+}
+
+/* The density has changed partway through a replay. Decode sequentially up to
+ * the current bitcell, at the replayed density, so that the live PLL can take
+ * over from there. The caller's view of the stream is left untouched. */
+static void rev_go_live(struct stream *s)
+{
+    uint32_t pos = s->rbc_pos, word = s->word, sync_index = s->sync_index;
+    uint64_t latency = s->latency;
+    uint16_t crc16_ccitt = s->crc16_ccitt;
+    uint8_t crc_bitoff = s->crc_bitoff, attempt = s->attempt;
+    int clock_centre = s->clock_centre;
+
+    s->rbc_mode = RBC_live;
+    s->attempt = 0;
+    s->clock = s->clock_centre = s->rbc->clock_centre;
+    _stream_reset(s);
+    stream_next_bits(s, 100);
+    _stream_reset(s);
+    while ((s->rbc_pos < pos) && (_stream_next_bit(s) != -1))
+        continue;
+
+    s->word = word;
+    s->sync_index = sync_index;
+    s->latency = latency;
+    s->crc16_ccitt = crc16_ccitt;
+    s->crc_bitoff = crc_bitoff;
+    s->attempt = attempt;
+    s->clock = s->clock_centre = clock_centre;
+
+    /* We are called from within the next bitcell's _stream_next_bit(). */
+    s->index_offset_bc++;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -111,11 +111,24 @@ static struct stream *scp_open(const char *name, unsigned int data_rpm)
 static void scp_close(struct stream *s)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
-    close(scss->fd);
+    if (scss->fd >= 0)
+        close(scss->fd);
     memfree(scss->dat);
     memfree(scss);
 }
 
+/* Track data is loaded: finish setting up for it to be streamed. */
+static int scp_track_ready(struct scp_stream *scss)
+{
+    /* Don't jitter ED tracks (average bitcell shorter than 2us). */
+    scss->apply_jitter = ((scss->revs == 1) && (scss->datsz != 0) &&
+                          ((scss->total_ticks / scss->datsz)
+                           > (2000 / SCK_NS_PER_TICK)));
+
+    scss->s.max_revolutions = scss->revs + 1;
+    return 0;
+}
+
 static int scp_select_track(struct stream *s, unsigned int tracknr)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
@@ -124,6 +137,10 @@ static int scp_select_track(struct stream *s, unsigned int tracknr)
     unsigned int rev, trkoffset[scss->revs];
     uint32_t hdr_offset, tdh_offset;
 
+    /* In-memory capture: holds only the one track. */
+    if (scss->fd < 0)
+        return (tracknr == scss->track) ? scp_track_ready(scss) : -1;
+
     if (scss->dat && (scss->track == tracknr))
         return 0;
 
@@ -176,14 +193,7 @@ static int scp_select_track(struct stream *s, unsigned int tracknr)
     }
 
     scss->track = tracknr;
-
-    /* Don't jitter ED tracks (average bitcell shorter than 2us). */
-    scss->apply_jitter = ((scss->revs == 1) &&
-                          ((scss->total_ticks / scss->datsz)
-                           > (2000 / SCK_NS_PER_TICK)));
-
-    s->max_revolutions = scss->revs + 1;
-    return 0;
+    return scp_track_ready(scss);
 }
 
 static void scp_reset(struct stream *s)
@@ -196,6 +206,26 @@ static void scp_reset(struct stream *s)
     scss->acc_ticks = 0;
 }
 
+static void scp_save_pos(struct stream *s, uint32_t *pos)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+
+    pos[0] = scss->dat_idx;
+    pos[1] = scss->index_pos;
+    pos[2] = scss->jitter;
+    pos[3] = scss->acc_ticks;
+}
+
+static void scp_restore_pos(struct stream *s, const uint32_t *pos)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+
+    scss->dat_idx = pos[0];
+    scss->index_pos = pos[1];
+    scss->jitter = pos[2];
+    scss->acc_ticks = pos[3];
+}
+
 static int scp_next_flux(struct stream *s)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
@@ -273,5 +303,45 @@ struct stream_type supercard_scp = {
     .select_track = scp_select_track,
     .reset = scp_reset,
     .next_flux = scp_next_flux,
+    .save_pos = scp_save_pos,
+    .restore_pos = scp_restore_pos,
     .suffix = { "scp", NULL }
 };
+
+struct stream *stream_scp_track_open(
+    unsigned int tracknr, unsigned int nr_revs, bool_t index_cued,
+    const uint32_t *rev_ticks, const uint32_t *rev_samples,
+    const uint16_t *flux, unsigned int drive_rpm, unsigned int data_rpm)
+{
+    struct scp_stream *scss;
+    unsigned int rev, first;
+
+    if (nr_revs == 0)
+        return NULL;
+
+    scss = memalloc(sizeof(*scss) + nr_revs*sizeof(unsigned int));
+    scss->fd = -1;
+    scss->track = tracknr;
+    scss->index_cued = index_cued || (nr_revs == 1);
+
+    /* As for an SCP file: skip first partial revolution if not index cued. */
+    first = scss->index_cued ? 0 : 1;
+    scss->revs = nr_revs - first;
+    for (rev = 0; rev < nr_revs; rev++)
+        scss->datsz += rev_samples[rev];
+    scss->dat = memalloc(scss->datsz * sizeof(scss->dat[0]));
+    scss->datsz = 0;
+    flux += rev_samples[0] * first;
+    for (rev = first; rev < nr_revs; rev++) {
+        memcpy(&scss->dat[scss->datsz], flux,
+               rev_samples[rev] * sizeof(scss->dat[0]));
+        flux += rev_samples[rev];
+        scss->datsz += rev_samples[rev];
+        scss->index_off[rev-first] = scss->datsz;
+        scss->total_ticks += rev_ticks[rev];
+    }
+
+    stream_setup(&scss->s, &supercard_scp, drive_rpm, data_rpm);
+
+    return &scss->s;
+}
@@ -26,15 +26,9 @@ void __assert_failed(
     errx(1, "Assertion failed at %s:%u", file, line);
 }
 
-static int amiga_read(uint32_t addr, uint32_t *val, unsigned int bytes,
-                      struct m68k_emulate_ctxt *ctxt)
+static int cia_io_read(struct amiga_state *s, uint32_t addr, uint32_t *val,
+                       unsigned int bytes)
 {
-    struct amiga_state *s = container_of(ctxt, struct amiga_state, ctxt);
-
-    if (addr & 0xff000000)
-        log_warn("32-bit address access %08x @ PC=%08x", addr, ctxt->regs->pc);
-    addr &= 0xffffff;
-
     if ((addr & 0xfff0ff) == CIAB_BASE) {
         *val = cia_read_reg(s, &s->ciab, (addr >> 8) & 15);
         return M68KEMUL_OKAY;
@@ -45,60 +39,121 @@ static int amiga_read(uint32_t addr, uint32_t *val, unsigned int bytes,
         return M68KEMUL_OKAY;
     }
 
-    if ((addr & 0xfff000) == CUSTOM_BASE) {
-        addr -= CUSTOM_BASE;
-        if (bytes == 4) {
-            *val = (custom_read_reg(s, addr) << 16)
-                | custom_read_reg(s, addr + 2);
-        } else if (bytes == 2) {
-            *val = custom_read_reg(s, addr);
-        } else {
-            *val = custom_read_reg(s, addr&~1);
-            if (!(addr & 1))
-                *val >>= 8;
-            *val = (uint8_t)*val;
-        }
+    return mem_read(addr, val, bytes, s);
+}
+
+static int cia_io_write(struct amiga_state *s, uint32_t addr, uint32_t val,
+                        unsigned int bytes)
+{
+    if ((addr & 0xfff0ff) == CIAB_BASE) {
+        cia_write_reg(s, &s->ciab, (addr >> 8) & 15, val);
         return M68KEMUL_OKAY;
     }
 
-    return mem_read(addr, val, bytes, s);
+    if ((addr & 0xfff0ff) == CIAA_BASE) {
+        cia_write_reg(s, &s->ciaa, (addr >> 8) & 15, val);
+        return M68KEMUL_OKAY;
+    }
+
+    return mem_write(addr, val, bytes, s);
 }
 
-static int amiga_write(uint32_t addr, uint32_t val, unsigned int bytes,
-                       struct m68k_emulate_ctxt *ctxt)
+static const struct mem_io cia_io = {
+    .read = cia_io_read,
+    .write = cia_io_write
+};
+
+static int custom_io_read(struct amiga_state *s, uint32_t addr,
+                          uint32_t *val, unsigned int bytes)
+{
+    if ((addr & 0xfff000) != CUSTOM_BASE)
+        return mem_read(addr, val, bytes, s);
+
+    addr -= CUSTOM_BASE;
+    if (bytes == 4) {
+        *val = (custom_read_reg(s, addr) << 16)
+            | custom_read_reg(s, addr + 2);
+    } else if (bytes == 2) {
+        *val = custom_read_reg(s, addr);
+    } else {
+        *val = custom_read_reg(s, addr&~1);
+        if (!(addr & 1))
+            *val >>= 8;
+        *val = (uint8_t)*val;
+    }
+    return M68KEMUL_OKAY;
+}
+
+static int custom_io_write(struct amiga_state *s, uint32_t addr,
+                           uint32_t val, unsigned int bytes)
+{
+    if ((addr & 0xfff000) != CUSTOM_BASE)
+        return mem_write(addr, val, bytes, s);
+
+    addr -= CUSTOM_BASE;
+    if (bytes == 4) {
+        custom_write_reg(s, addr, val >> 16);
+        custom_write_reg(s, addr+2, val);
+    } else if (bytes == 2) {
+        custom_write_reg(s, addr, val);
+    } else {
+        val = (uint8_t)val;
+        custom_write_reg(s, addr&~1, val << (!(addr&1)?8:0));
+    }
+    return M68KEMUL_OKAY;
+}
+
+static const struct mem_io custom_io = {
+    .read = custom_io_read,
+    .write = custom_io_write
+};
+
+static int amiga_read(uint32_t addr, uint32_t *val, unsigned int bytes,
+                      struct m68k_emulate_ctxt *ctxt)
 {
     struct amiga_state *s = container_of(ctxt, struct amiga_state, ctxt);
+    const struct mem_io *io;
+    uint8_t *p;
 
     if (addr & 0xff000000)
         log_warn("32-bit address access %08x @ PC=%08x", addr, ctxt->regs->pc);
     addr &= 0xffffff;
 
-    if ((addr & 0xfff0ff) == CIAB_BASE) {
-        cia_write_reg(s, &s->ciab, (addr >> 8) & 15, val);
-        return M68KEMUL_OKAY;
-    }
+    if ((addr < s->disk.lazy_end) && ((addr + bytes) > s->disk.lazy_start))
+        disk_sync(s);
 
-    if ((addr & 0xfff0ff) == CIAA_BASE) {
-        cia_write_reg(s, &s->ciaa, (addr >> 8) & 15, val);
+    if ((p = mem_ptr(s->mem_map, addr, bytes)) != NULL) {
+        *val = mem_get_be(p, bytes);
         return M68KEMUL_OKAY;
     }
 
-    if ((addr & 0xfff000) == CUSTOM_BASE) {
-        addr -= CUSTOM_BASE;
-        if (bytes == 4) {
-            custom_write_reg(s, addr, val >> 16);
-            custom_write_reg(s, addr+2, val);
-        } else if (bytes == 2) {
-            custom_write_reg(s, addr, val);
-        } else {
-            val = (uint8_t)val;
-            custom_write_reg(s, addr&~1, val << (!(addr&1)?8:0));
-        }
+    if ((io = s->mem_map[addr >> MEM_PAGE_SHIFT].io) != NULL)
+        return io->read(s, addr, val, bytes);
+
+    return mem_read(addr, val, bytes, s);
+}
+
+static int amiga_write(uint32_t addr, uint32_t val, unsigned int bytes,
+                       struct m68k_emulate_ctxt *ctxt)
+{
+    struct amiga_state *s = container_of(ctxt, struct amiga_state, ctxt);
+    const struct mem_io *io;
+    uint8_t *p;
+
+    if (addr & 0xff000000)
+        log_warn("32-bit address access %08x @ PC=%08x", addr, ctxt->regs->pc);
+    addr &= 0xffffff;
+
+    if ((addr < s->disk.lazy_end) && ((addr + bytes) > s->disk.lazy_start))
+        disk_sync(s);
+
+    if ((p = mem_ptr_write(s->mem_map, addr, bytes)) != NULL) {
+        mem_put_be(p, val, bytes);
         return M68KEMUL_OKAY;
     }
 
-    if ((addr & 0xff0000) == 0xff0000)
-        return mem_write(addr, val, bytes, s);
+    if ((io = s->mem_map[addr >> MEM_PAGE_SHIFT].io) != NULL)
+        return io->write(s, addr, val, bytes);
 
     return mem_write(addr, val, bytes, s);
 }
@@ -171,21 +226,38 @@ int amiga_emulate(struct amiga_state *s)
     return rc;
 }
 
-void amiga_init(struct amiga_state *s, unsigned int mem_size)
+int amiga_init(struct amiga_state *s, unsigned int mem_size,
+               const char *df0_filename, enum loglevel max_loglevel)
 {
     memset(s, 0, sizeof(*s));
+    if (disk_init(s, df0_filename) != 0)
+        return -1;
     s->ctxt.regs = memalloc(sizeof(*s->ctxt.regs));
     s->ctxt.ops = &amiga_m68k_ops;
+    s->ctxt.icache = &s->icache;
+    s->icache.end = mem_size;
     s->ram = mem_init(s, 0, mem_size);
     s->rom = mem_init(s, ROM_BASE, ROM_SIZE);
+    mem_map_io(s, CUSTOM_BASE, &custom_io);
+    mem_map_io(s, CIAA_BASE, &cia_io); /* same page as CIAB */
     exec_init(s);
     logging_init(s);
-    disk_init(s);
+    s->max_loglevel = max_loglevel;
 
     /* Reserve space for stacks. */
     mem_reserve(s, 0, 0x2000);
     s->ctxt.regs->a[7] = 0x2000; /* USP */
     s->ctxt.regs->xsp = 0x1000;  /* SSP */
+
+    return 0;
+}
+
+void amiga_destroy(struct amiga_state *s)
+{
+    disk_destroy(s);
+    event_base_destroy(&s->event_base);
+    mem_destroy(s);
+    memfree(s->ctxt.regs);
 }
 
 /*
@@ -21,6 +21,7 @@
 #include <amiga/event.h>
 #include <amiga/logging.h>
 #include <amiga/mem.h>
+#include <amiga/snapshot.h>
 
 /* PAL Amiga CPU runs at 1.709379 MHz */
 #define M68K_CYCLE_NS 141
@@ -31,6 +32,7 @@
 struct amiga_state {
     /* 68000 register state */
     struct m68k_emulate_ctxt ctxt;
+    struct m68k_icache icache;
 
     /* Temp buffer for m68k addr_name() callback */
     char addr_name[16];
@@ -39,6 +41,12 @@ struct amiga_state {
     struct memory *memory;
     struct memory *ram, *rom;
 
+    /* Emulated address space: 64kB pages of host memory or I/O. */
+    struct mem_page mem_map[MEM_NR_PAGES];
+
+    /* Snapshot last taken or restored; mem_map[] dirty bits are since. */
+    uint64_t snapshot_id;
+
     /* Emulated CIA chips */
     struct cia ciaa, ciab;
 
@@ -62,11 +70,15 @@ void __assert_failed(
         if (!(p)) __assert_failed(s, __FILE__, __LINE__);       \
 } while (0)
 
-void amiga_init(struct amiga_state *, unsigned int mem_size);
+/* Each amiga_state is a self-contained machine: several may be emulated
+ * concurrently, on separate threads. amiga_init() returns -1 if the disk
+ * image cannot be opened, leaving nothing to destroy. Messages below
+ * max_loglevel are suppressed, including those logged during init. */
+int amiga_init(struct amiga_state *, unsigned int mem_size,
+               const char *df0_filename, enum loglevel max_loglevel);
+void amiga_destroy(struct amiga_state *);
 int amiga_emulate(struct amiga_state *);
 
-void amiga_insert_df0(const char *filename);
-
 void exec_init(struct amiga_state *);
 
 #endif /* __AMIGA_H__ */
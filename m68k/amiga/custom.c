@@ -11,12 +11,33 @@
 
 #define SUBSYSTEM subsystem_main
 
+/* Registers which steer the disk controller's processing of bitcells. */
+static int is_disk_reg(uint16_t addr)
+{
+    switch (addr) {
+    case CUST_dsklen:
+    case CUST_dsksync:
+    case CUST_adkcon:
+    case CUST_dskpth:
+    case CUST_dskptl:
+        return 1;
+    }
+    return 0;
+}
+
 void custom_write_reg(struct amiga_state *s, uint16_t addr, uint16_t val)
 {
+    int disk_reg;
+
     addr >>= 1;
     if (addr >= ARRAY_SIZE(custom_reg_name))
         return;
 
+    /* Bitcells before now are processed with the old value, and those
+     * after are rescheduled against the new. */
+    if ((disk_reg = is_disk_reg(addr)))
+        disk_sync(s);
+
     switch (addr) {
     case CUST_dsklen:
         s->custom[addr] = val;
@@ -36,6 +57,9 @@ void custom_write_reg(struct amiga_state *s, uint16_t addr, uint16_t val)
         break;
     }
 
+    if (disk_reg)
+        disk_reschedule(s);
+
     log_info("Write %04x to custom register %s (%x) becomes %04x",
              val, custom_reg_name[addr], (addr<<1)+0xdff000,
              s->custom[addr]);
@@ -60,9 +84,11 @@ uint16_t custom_read_reg(struct amiga_state *s, uint16_t addr)
         val = s->custom[CUST_intena];
         break;
     case CUST_intreqr:
+        disk_sync(s);
         val = s->custom[CUST_intreq];
         break;
     case CUST_dskbytr:
+        disk_sync(s);
         val = s->custom[CUST_dskbytr];
         s->custom[CUST_dskbytr] &= 0x7fff;
         break;
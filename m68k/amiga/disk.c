@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <amiga/amiga.h>
 #include <amiga/custom.h>
@@ -20,9 +21,6 @@
 
 #define SUBSYSTEM subsystem_disk
 
-static const char *df0_filename =
-    "/home/keir/Amiga/raw_dumps/newzealandstory/nzs.dat";
-
 #define STEP_DELAY     MILLISECS(1)
 #define MOTORON_DELAY  MILLISECS(100)
 #define MOTOROFF_DELAY MILLISECS(1)
@@ -39,28 +37,113 @@ static void track_load_byte(struct amiga_state *s)
     }
 }
 
+/* Write buffered DMA words to emulated memory, and advance DSKPT. */
+static void disk_dma_flush(struct amiga_state *s)
+{
+    uint32_t dskpt = (s->custom[CUST_dskpth] << 16) | s->custom[CUST_dskptl];
+    unsigned int nr, done = 0;
+    uint32_t addr;
+    uint8_t *p;
+
+    while (done < s->disk.dma_nr) {
+        /* Copy directly into host memory, up to the next page boundary. */
+        addr = (dskpt + done*2) & 0xffffff;
+        nr = min_t(unsigned int, s->disk.dma_nr - done,
+                   (MEM_PAGE_SIZE - (addr & MEM_PAGE_MASK)) / 2);
+        if (!(addr & 1) && nr &&
+            ((p = mem_ptr_write(s->mem_map, addr, nr*2)) != NULL)) {
+            memcpy(p, &s->disk.dma_buf[done], nr*2);
+        } else {
+            nr = 1;
+            s->ctxt.ops->write(addr, be16toh(s->disk.dma_buf[done]),
+                               2, &s->ctxt);
+        }
+        done += nr;
+    }
+
+    m68k_icache_invalidate(&s->ctxt, dskpt, done*2);
+    dskpt += done*2;
+    s->custom[CUST_dskpth] = dskpt >> 16;
+    s->custom[CUST_dskptl] = dskpt;
+    s->disk.dma_nr = 0;
+}
+
 static void disk_dma_word(struct amiga_state *s, uint16_t w)
 {
     if (s->disk.dsklen & 0x3fff) {
-        uint32_t dskpt =
-            (s->custom[CUST_dskpth] << 16) | s->custom[CUST_dskptl];
-        s->ctxt.ops->write(dskpt, w, 2, &s->ctxt);
-        dskpt += 2;
-        s->custom[CUST_dskpth] = dskpt >> 16;
-        s->custom[CUST_dskptl] = dskpt;
+        s->disk.dma_buf[s->disk.dma_nr++] = htobe16(w);
         s->disk.dsklen--;
     }
 
     if (!(s->disk.dsklen & 0x3fff)) {
+        disk_dma_flush(s);
         log_info("Disk DMA finished");
         s->disk.dma = 0;
         intreq_set_bit(s, 1); /* disk block done */
     }
 }
 
-static void data_cb(void *_s)
+/* CPU accesses to [start,end) catch up with DMA first, and the CPU must not
+ * run cached insns from there meanwhile. */
+static void set_lazy_range(struct amiga_state *s, uint32_t start, uint32_t end)
+{
+    s->disk.lazy_start = s->icache.nocache_start = start;
+    s->disk.lazy_end = s->icache.nocache_end = end;
+    m68k_icache_invalidate(&s->ctxt, start, end - start);
+}
+
+/* While a DMA read runs, bitcells which affect only the DMA buffer, DSKPT and
+ * DSKBYTR are not processed one event at a time. We sleep until the next
+ * bitcell which raises an interrupt, sets the index flag, or must roll a
+ * weak bit, and catch up early via disk_sync() if the CPU looks at the
+ * controller or the DMA buffer first. Returns the time of that bitcell,
+ * given @t, the time of the next. */
+static time_ns_t dma_next_event(struct amiga_state *s, time_ns_t t)
+{
+    const struct track_raw *raw = s->disk.track_raw;
+    unsigned int pos = s->disk.input_pos, byte = s->disk.input_byte;
+    unsigned int bitpos = s->disk.data_word_bitpos;
+    unsigned int ns_per_cell = s->disk.ns_per_cell;
+    unsigned int left = s->disk.dsklen & 0x3fff;
+    int wordsync = !!(s->custom[CUST_adkcon] & (1u<<10));
+    uint16_t w = s->disk.data_word, speed;
+    time_ns_t next = t;
+    uint32_t dskpt;
+
+    for (;;) {
+        w <<= 1;
+        if (byte & 0x80)
+            w |= 1;
+        /* Index pulse, sync found, or disk block done? */
+        if (((pos + 1) == raw->bitlen)
+            || (wordsync && (w == s->custom[CUST_dsksync]))
+            || ((left <= 1) && ((bitpos & 15) == 15)))
+            break;
+        byte <<= 1;
+        if (!(++pos & 7)) {
+            if ((speed = raw->speed[pos]) == SPEED_WEAK)
+                break;
+            ns_per_cell = (s->disk.av_ns_per_cell * speed) / SPEED_AVG;
+            byte = raw->bits[pos/8];
+        }
+        if (!(++bitpos & 15))
+            left--;
+        t += ns_per_cell;
+    }
+
+    if (t != next) {
+        dskpt = (s->custom[CUST_dskpth] << 16) | s->custom[CUST_dskptl];
+        s->disk.lazy = 1;
+        set_lazy_range(s, dskpt & 0xffffff,
+                       (dskpt & 0xffffff) + (s->disk.dsklen & 0x3fff)*2);
+    }
+
+    return t;
+}
+
+/* Process bitcells up to the current time. Returns the time of the next. */
+static time_ns_t data_catch_up(struct amiga_state *s)
 {
-    struct amiga_state *s = _s;
     time_ns_t t = s->disk.last_bitcell_time;
     time_ns_t now = s->event_base.current_time;
     uint16_t w = s->disk.data_word;
@@ -103,14 +186,48 @@ static void data_cb(void *_s)
         }
     }
 
+    if (s->disk.dma_nr)
+        disk_dma_flush(s);
+
     s->disk.last_bitcell_time = t - s->disk.ns_per_cell;
     s->disk.data_word = w;
 
+    return t;
+}
+
+static void data_cb(void *_s)
+{
+    struct amiga_state *s = _s;
+    time_ns_t t;
+
+    s->disk.lazy = 0;
+    set_lazy_range(s, 0, 0);
+
+    t = data_catch_up(s);
+    if (s->disk.dma == 2)
+        t = dma_next_event(s, t);
     event_set(s->disk.data_delay, t);
 }
 
+void disk_sync(struct amiga_state *s)
+{
+    /* Not reentrant: a DMA flush may write through amiga_write(). */
+    if (!s->disk.lazy)
+        return;
+    s->disk.lazy = 0;
+    (void)data_catch_up(s);
+    s->disk.lazy = 1;
+}
+
+void disk_reschedule(struct amiga_state *s)
+{
+    if (s->disk.lazy)
+        data_cb(s);
+}
+
 static void track_load(struct amiga_state *s)
 {
+    disk_sync(s);
     log_info("Loading track %u", s->disk.tracknr);
     track_read_raw(s->disk.track_raw, s->disk.tracknr);
     s->disk.input_pos = s->disk.data_word_bitpos = s->disk.data_word = 0;
@@ -122,6 +239,9 @@ static void track_load(struct amiga_state *s)
 
 static void track_unload(struct amiga_state *s)
 {
+    disk_sync(s);
+    s->disk.lazy = 0;
+    set_lazy_range(s, 0, 0);
     track_purge_raw_buffer(s->disk.track_raw);
     event_unset(s->disk.data_delay);
 }
@@ -251,11 +371,11 @@ void disk_dsklen_changed(struct amiga_state *s)
     s->disk.dsklen = new_dsklen;
 }
 
-void disk_init(struct amiga_state *s)
+int disk_init(struct amiga_state *s, const char *df0_filename)
 {
     s->disk.df0_disk = disk_open(df0_filename, DISKFL_read_only);
     if (s->disk.df0_disk == NULL)
-        errx(1, "%s", df0_filename);
+        return -1;
     s->disk.track_raw = track_alloc_raw_buffer(s->disk.df0_disk);
 
     /* Set up CIA peripheral data registers. */
@@ -275,11 +395,17 @@ void disk_init(struct amiga_state *s)
     s->disk.tracknr = !(s->ciab.prb_o >> CIABPRB_DSKSIDE);
     if (s->ciaa.pra_i & CIAAPRA_DSKTRACK0)
         s->disk.tracknr += 2;
+
+    return 0;
 }
 
-void amiga_insert_df0(const char *filename)
+void disk_destroy(struct amiga_state *s)
 {
-    df0_filename = filename;
+    event_destroy(s->disk.motor_delay);
+    event_destroy(s->disk.step_delay);
+    event_destroy(s->disk.data_delay);
+    track_free_raw_buffer(s->disk.track_raw);
+    disk_close(s->disk.df0_disk);
 }
 
 /*
@@ -43,11 +43,24 @@ struct amiga_disk {
 
     uint8_t dma;
     uint16_t dsklen;
+
+    /* DMA words not yet written to memory (big endian). */
+    uint16_t dma_buf[0x3fff];
+    unsigned int dma_nr;
+    /* Bitcells since last_bitcell_time are pending (see dma_next_event()).
+     * disk_sync() must be called before the CPU reads the controller, or
+     * accesses [lazy_start,lazy_end), the rest of the DMA buffer. */
+    bool_t lazy;
+    uint32_t lazy_start, lazy_end;
 };
 
-void disk_init(struct amiga_state *);
+int disk_init(struct amiga_state *, const char *df0_filename);
+void disk_destroy(struct amiga_state *);
 void disk_cia_changed(struct amiga_state *);
 void disk_dsklen_changed(struct amiga_state *);
+/* Catch up with pending bitcells; reschedule after a register change. */
+void disk_sync(struct amiga_state *);
+void disk_reschedule(struct amiga_state *);
 
 #endif /* __DISK_H__ */
 
@@ -11,31 +11,89 @@
 
 struct event {
     time_ns_t time;
+    /* Orders events due at the same time: first armed, first run. */
+    uint64_t seq;
+    unsigned int idx; /* position in base->heap[] */
     void (*cb)(void *);
     void *cb_data;
-    struct event *next;
     struct event_base *base;
 };
 
-static void remove_from_list(struct event **pprev, struct event *e)
+/* Active events are kept in a binary min-heap ordered by (time, seq). */
+
+static int event_before(const struct event *a, const struct event *b)
+{
+    return (a->time < b->time) || ((a->time == b->time) && (a->seq < b->seq));
+}
+
+static void heap_place(struct event_base *base, struct event *e,
+                       unsigned int i)
 {
-    struct event *curr, **_pprev = pprev;
+    base->heap[i] = e;
+    e->idx = i;
+}
+
+static void heap_sift_up(struct event_base *base, struct event *e,
+                         unsigned int i)
+{
+    unsigned int parent;
+
+    while (i != 0) {
+        parent = (i - 1) / 2;
+        if (!event_before(e, base->heap[parent]))
+            break;
+        heap_place(base, base->heap[parent], i);
+        i = parent;
+    }
 
-    while ((curr = *_pprev) != e)
-        _pprev = &curr->next;
+    heap_place(base, e, i);
+}
+
+static void heap_sift_down(struct event_base *base, struct event *e,
+                           unsigned int i)
+{
+    unsigned int child;
+
+    while ((child = 2*i + 1) < base->nr_active) {
+        if (((child + 1) < base->nr_active)
+            && event_before(base->heap[child+1], base->heap[child]))
+            child++;
+        if (!event_before(base->heap[child], e))
+            break;
+        heap_place(base, base->heap[child], i);
+        i = child;
+    }
 
-    *_pprev = e->next;
+    heap_place(base, e, i);
 }
 
-static void add_to_list(struct event **pprev, struct event *e)
+static void heap_remove(struct event_base *base, struct event *e)
 {
-    struct event *curr, **_pprev = pprev;
+    struct event *last = base->heap[--base->nr_active];
+
+    if (last == e)
+        return;
+
+    /* Move the last event into the hole, and restore heap order. */
+    if ((e->idx != 0) && event_before(last, base->heap[(e->idx - 1) / 2]))
+        heap_sift_up(base, last, e->idx);
+    else
+        heap_sift_down(base, last, e->idx);
+}
 
-    while (((curr = *_pprev) != NULL) && (curr->time <= e->time))
-        _pprev = &curr->next;
+static void heap_insert(struct event_base *base, struct event *e)
+{
+    if (base->nr_active == base->max_active) {
+        struct event **heap = base->heap;
+        base->max_active = base->max_active ? base->max_active * 2 : 8;
+        base->heap = memalloc(base->max_active * sizeof(*heap));
+        if (heap != NULL) {
+            memcpy(base->heap, heap, base->nr_active * sizeof(*heap));
+            memfree(heap);
+        }
+    }
 
-    e->next = curr;
-    *_pprev = e;
+    heap_sift_up(base, e, base->nr_active++);
 }
 
 struct event *event_alloc(
@@ -45,7 +103,6 @@ struct event *event_alloc(
     event->cb = cb;
     event->cb_data = cb_data;
     event->time = 0;
-    event->next = NULL;
     event->base = base;
     return event;
 }
@@ -58,9 +115,20 @@ void event_destroy(struct event *event)
 
 void event_set(struct event *event, time_ns_t time)
 {
-    event_unset(event);
+    struct event_base *base = event->base;
+    int armed = !!event->time;
+
     event->time = time;
-    add_to_list(&event->base->active_events, event);
+    event->seq = base->seq++;
+
+    if (!armed) {
+        heap_insert(base, event);
+    } else if ((event->idx != 0)
+               && event_before(event, base->heap[(event->idx - 1) / 2])) {
+        heap_sift_up(base, event, event->idx);
+    } else {
+        heap_sift_down(base, event, event->idx);
+    }
 }
 
 void event_set_delta(struct event *event, time_ns_t delta)
@@ -72,18 +140,42 @@ void event_unset(struct event *event)
 {
     if (!event->time)
         return;
-    remove_from_list(&event->base->active_events, event);
+    heap_remove(event->base, event);
     event->time = 0;
 }
 
+void event_base_destroy(struct event_base *base)
+{
+    memfree(base->heap);
+    base->heap = NULL;
+    base->nr_active = base->max_active = 0;
+}
+
+void event_save(struct event *event, struct event_snapshot *snap)
+{
+    snap->time = event->time;
+    snap->seq = event->seq;
+}
+
+void event_restore(struct event *event, const struct event_snapshot *snap)
+{
+    event_unset(event);
+    if (!snap->time)
+        return;
+    event->time = snap->time;
+    event->seq = snap->seq;
+    heap_insert(event->base, event);
+}
+
 void fire_events(struct event_base *base)
 {
     struct event *event;
 
-    while (((event = base->active_events) != NULL) &&
-           (event->time <= base->current_time)) {
-        base->active_events = event->next;
+    while ((base->nr_active != 0) &&
+           ((event = base->heap[0])->time <= base->current_time)) {
+        heap_remove(base, event);
         event->time = 0;
+        base->nr_fired++;
         (*event->cb)(event->cb_data);
     }
 }
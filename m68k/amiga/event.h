@@ -22,8 +22,12 @@ struct event;
 struct event_base {
     /* Absolute time since simulation start. */
     time_ns_t current_time;
-    /* [Private] list of registered events. */
-    struct event *active_events;
+    /* Number of events fired so far. */
+    uint64_t nr_fired;
+    /* [Private] heap of registered events. */
+    struct event **heap;
+    unsigned int nr_active, max_active;
+    uint64_t seq;
 };
 
 struct event *event_alloc(
@@ -36,6 +40,17 @@ void event_unset(struct event *event);
 
 void fire_events(struct event_base *base);
 
+/* Free the event queue. Events themselves must be destroyed separately. */
+void event_base_destroy(struct event_base *base);
+
+/* Saved expiry time (0 if not armed) and arming order of an event. */
+struct event_snapshot {
+    time_ns_t time;
+    uint64_t seq;
+};
+void event_save(struct event *event, struct event_snapshot *snap);
+void event_restore(struct event *event, const struct event_snapshot *snap);
+
 #endif /* __EVENT_H__ */
 
 /*
@@ -22,73 +22,86 @@ static struct memory *find_memory(
     return (m && (m->start <= addr)) ? m : NULL;
 }
 
+/* Slow path: an access straddling two pages, which is valid only if both
+ * are backed by contiguous host memory. */
+static uint8_t *mem_ptr_straddle(
+    struct amiga_state *s, uint32_t addr, unsigned int bytes)
+{
+    struct mem_page *p;
+
+    if ((addr & 0xff000000) || (((addr + bytes - 1) >> MEM_PAGE_SHIFT)
+                                >= MEM_NR_PAGES))
+        return NULL;
+
+    p = &s->mem_map[addr >> MEM_PAGE_SHIFT];
+    if (!p[0].dat || (p[1].dat != (p[0].dat + MEM_PAGE_SIZE)))
+        return NULL;
+
+    return p[0].dat + (addr & MEM_PAGE_MASK);
+}
+
+void mem_mark_dirty(struct amiga_state *s, uint32_t addr, uint32_t bytes)
+{
+    uint32_t page;
+    for (page = addr >> MEM_PAGE_SHIFT;
+         (page < MEM_NR_PAGES) && (page <= ((addr+bytes-1) >> MEM_PAGE_SHIFT));
+         page++)
+        s->mem_map[page].dirty = 1;
+}
+
 int mem_read(uint32_t addr, uint32_t *val, unsigned int bytes,
              struct amiga_state *s)
 {
-    struct memory *m = find_memory(s, addr, bytes);
+    uint8_t *p;
 
-    if (m == NULL) {
-        log_warn("Read %u bytes non-RAM", bytes);
+    if ((bytes != 1) && (bytes != 2) && (bytes != 4))
         return M68KEMUL_UNHANDLEABLE;
-        *val = bytes == 1 ? 0xff : bytes == 2 ? 0xffff : 0xffffffff;
-        return M68KEMUL_OKAY;
-    }
 
-    addr -= m->start;
-    switch (bytes) {
-    case 1:
-        *val = *(uint8_t *)&m->dat[addr];
-        break;
-    case 2:
-        *val = be16toh(*(uint16_t *)&m->dat[addr]);
-        break;
-    case 4:
-        *val = be32toh(*(uint32_t *)&m->dat[addr]);
-        break;
-    default:
+    p = !(addr & 0xff000000) ? mem_ptr(s->mem_map, addr, bytes) : NULL;
+    if ((p == NULL) && ((p = mem_ptr_straddle(s, addr, bytes)) == NULL)) {
+        log_warn("Read %u bytes non-RAM", bytes);
         return M68KEMUL_UNHANDLEABLE;
     }
 
+    *val = mem_get_be(p, bytes);
     return M68KEMUL_OKAY;
 }
 
 int mem_write(uint32_t addr, uint32_t val, unsigned int bytes,
               struct amiga_state *s)
 {
-    struct memory *m = find_memory(s, addr, bytes);
+    uint8_t *p;
 
-    if (m == NULL) {
-        log_warn("Write %u bytes non-RAM", bytes);
+    if ((bytes != 1) && (bytes != 2) && (bytes != 4))
         return M68KEMUL_UNHANDLEABLE;
-        return M68KEMUL_OKAY;
-    }
 
-    addr -= m->start;
-    switch (bytes) {
-    case 1:
-        *(uint8_t *)&m->dat[addr] = val;
-        break;
-    case 2:
-        *(uint16_t *)&m->dat[addr] = htobe16(val);
-        break;
-    case 4:
-        *(uint32_t *)&m->dat[addr] = htobe32(val);
-        break;
-    default:
+    p = !(addr & 0xff000000) ? mem_ptr(s->mem_map, addr, bytes) : NULL;
+    if ((p == NULL) && ((p = mem_ptr_straddle(s, addr, bytes)) == NULL)) {
+        log_warn("Write %u bytes non-RAM", bytes);
         return M68KEMUL_UNHANDLEABLE;
     }
 
+    mem_put_be(p, val, bytes);
+    mem_mark_dirty(s, addr, bytes);
     return M68KEMUL_OKAY;
 }
 
-static void regions_dump(struct region *r)
+void mem_map_io(struct amiga_state *s, uint32_t addr, const struct mem_io *io)
 {
-    printf("Region list: ");
-    while (r) {
-        printf("%x-%x, ", r->start, r->end);
-        r = r->next;
-    }
-    printf("\n");
+    struct mem_page *p =
+        &s->mem_map[(addr >> MEM_PAGE_SHIFT) & (MEM_NR_PAGES - 1)];
+    ASSERT(p->dat == NULL);
+    p->io = io;
+}
+
+static void regions_dump(struct amiga_state *s, struct region *r)
+{
+    char buf[128];
+    int n = 0;
+
+    for (buf[0] = '\0'; r && (n < (sizeof(buf) - 24)); r = r->next)
+        n += snprintf(&buf[n], sizeof(buf) - n, "%x-%x, ", r->start, r->end);
+    log_info("Region list: %s", buf);
 }
 
 void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes)
@@ -99,7 +112,7 @@ void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes)
 
     ASSERT(m != NULL);
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     pprev = &m->free;
     while (((r = *pprev) != NULL) && (r->end < start))
@@ -125,7 +138,7 @@ void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes)
         memfree(r);
     }
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 }
 
 uint32_t mem_alloc(struct amiga_state *s, struct memory *m, uint32_t bytes)
@@ -133,7 +146,7 @@ uint32_t mem_alloc(struct amiga_state *s, struct memory *m, uint32_t bytes)
     uint32_t addr;
     struct region *r, **pprev;
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     pprev = &m->free;
     while (((r = *pprev) != NULL) && ((r->end - r->start + 1) < bytes))
@@ -150,7 +163,7 @@ uint32_t mem_alloc(struct amiga_state *s, struct memory *m, uint32_t bytes)
         memfree(r);
     }
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     return addr;
 }
@@ -162,7 +175,7 @@ void mem_free(struct amiga_state *s, uint32_t addr, uint32_t bytes)
 
     ASSERT(m != NULL);
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     pprev = &m->free;
     while (((r = *pprev) != NULL) && (r->end < addr))
@@ -187,13 +200,15 @@ void mem_free(struct amiga_state *s, uint32_t addr, uint32_t bytes)
     }
 
     memset(&m->dat[addr - m->start], 0xaa, bytes);
+    mem_mark_dirty(s, addr, bytes);
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 }
 
 struct memory *mem_init(struct amiga_state *s, uint32_t start, uint32_t bytes)
 {
     struct memory *m, *curr, **pprev;
+    uint32_t page;
 
     m = memalloc(sizeof(*m) + bytes);
 
@@ -206,6 +221,15 @@ struct memory *mem_init(struct amiga_state *s, uint32_t start, uint32_t bytes)
     m->free->start = m->start;
     m->free->end = m->end;
 
+    /* Map the pages it covers within the 24-bit address space. */
+    ASSERT(!(start & MEM_PAGE_MASK) && !(bytes & MEM_PAGE_MASK));
+    for (page = start >> MEM_PAGE_SHIFT;
+         (page < MEM_NR_PAGES) && (page <= (m->end >> MEM_PAGE_SHIFT));
+         page++) {
+        ASSERT(!s->mem_map[page].dat && !s->mem_map[page].io);
+        s->mem_map[page].dat = &m->dat[(page << MEM_PAGE_SHIFT) - start];
+    }
+
     pprev = &s->memory;
     while (((curr = *pprev) != NULL) && (curr->start < m->start))
         pprev = &curr->next;
@@ -215,6 +239,23 @@ struct memory *mem_init(struct amiga_state *s, uint32_t start, uint32_t bytes)
     return m;
 }
 
+void mem_destroy(struct amiga_state *s)
+{
+    struct memory *m;
+    struct region *r;
+
+    while ((m = s->memory) != NULL) {
+        s->memory = m->next;
+        while ((r = m->free) != NULL) {
+            m->free = r->next;
+            memfree(r);
+        }
+        memfree(m);
+    }
+
+    memset(s->mem_map, 0, sizeof(s->mem_map));
+}
+
 /*
  * Local variables:
  * mode: C
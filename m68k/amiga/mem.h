@@ -27,6 +27,73 @@ struct memory {
     struct watch *watch;
 };
 
+/* The 24-bit address space is mapped in 64kB pages. Each page is either
+ * backed directly by host memory, or is dispatched to I/O handlers. */
+#define MEM_PAGE_SHIFT 16
+#define MEM_PAGE_SIZE  (1u << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK  (MEM_PAGE_SIZE - 1)
+#define MEM_NR_PAGES   (1u << (24 - MEM_PAGE_SHIFT))
+
+struct amiga_state;
+
+struct mem_io {
+    int (*read)(struct amiga_state *, uint32_t addr, uint32_t *val,
+                unsigned int bytes);
+    int (*write)(struct amiga_state *, uint32_t addr, uint32_t val,
+                 unsigned int bytes);
+};
+
+struct mem_page {
+    uint8_t *dat;             /* host memory backing the page, or NULL */
+    const struct mem_io *io;  /* else I/O handlers, or NULL if unmapped */
+    bool_t dirty;             /* written since the last snapshot/restore */
+};
+
+/* Host pointer for an access wholly within one host-backed page, else NULL.
+ * @addr must already be truncated to 24 bits. */
+static inline uint8_t *mem_ptr(
+    const struct mem_page *map, uint32_t addr, unsigned int bytes)
+{
+    const struct mem_page *p = &map[addr >> MEM_PAGE_SHIFT];
+    uint32_t off = addr & MEM_PAGE_MASK;
+    return (p->dat && ((off + bytes) <= MEM_PAGE_SIZE)) ? p->dat + off : NULL;
+}
+
+/* As mem_ptr(), for an access which will write: marks the page dirty. */
+static inline uint8_t *mem_ptr_write(
+    struct mem_page *map, uint32_t addr, unsigned int bytes)
+{
+    uint8_t *p = mem_ptr(map, addr, bytes);
+    if (p != NULL)
+        map[addr >> MEM_PAGE_SHIFT].dirty = 1;
+    return p;
+}
+
+/* Big-endian accessors for host-backed emulated memory. */
+static inline uint32_t mem_get_be(const uint8_t *p, unsigned int bytes)
+{
+    switch (bytes) {
+    case 1: return *p;
+    case 2: return be16toh(*(const uint16_t *)p);
+    default: return be32toh(*(const uint32_t *)p);
+    }
+}
+
+static inline void mem_put_be(uint8_t *p, uint32_t val, unsigned int bytes)
+{
+    switch (bytes) {
+    case 1: *p = val; break;
+    case 2: *(uint16_t *)p = htobe16(val); break;
+    default: *(uint32_t *)p = htobe32(val); break;
+    }
+}
+
+/* Mark pages dirty after writing them other than via mem_ptr_write(). */
+void mem_mark_dirty(struct amiga_state *, uint32_t addr, uint32_t bytes);
+
+/* Direct the page containing @addr to the given I/O handlers. */
+void mem_map_io(struct amiga_state *, uint32_t addr, const struct mem_io *);
+
 void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes);
 uint32_t mem_alloc(struct amiga_state *, struct memory *, uint32_t bytes);
 void mem_free(struct amiga_state *, uint32_t addr, uint32_t bytes);
@@ -36,6 +103,7 @@ int mem_read(uint32_t addr, uint32_t *val, unsigned int bytes,
 int mem_write(uint32_t addr, uint32_t val, unsigned int bytes,
               struct amiga_state *);
 struct memory *mem_init(struct amiga_state *, uint32_t start, uint32_t bytes);
+void mem_destroy(struct amiga_state *);
 
 #endif /* __AMIGA_MEM_H__ */
 
@@ -0,0 +1,256 @@
+/*
+ * snapshot.c
+ * 
+ * Save and restore emulated Amiga machine state.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <amiga/amiga.h>
+
+#define SUBSYSTEM subsystem_main
+
+#define SNAPSHOT_MAGIC "AMSNAP01"
+
+struct snapshot_memory {
+    uint32_t start, end, nr_free;
+    struct region *free; /* array of nr_free regions */
+    uint8_t *dat;
+};
+
+struct amiga_snapshot {
+    /* Fixed-size state, serialised verbatim. */
+    struct snapshot_state {
+        struct m68k_regs regs;
+        uint32_t prefetch_addr, prefetch_valid;
+        uint16_t prefetch_dat[2];
+        uint16_t custom[256];
+        struct cia ciaa, ciab;
+        struct amiga_disk disk; /* pointer fields are not restored */
+        bool_t track_loaded;
+        struct event_snapshot motor_delay, step_delay, data_delay;
+        time_ns_t current_time;
+        uint64_t nr_fired, seq;
+        uint32_t nr_mem;
+    } st;
+    uint64_t id;
+    struct snapshot_memory *mem;
+};
+
+/* Snapshot IDs are unique across all machines and threads. */
+static uint64_t snapshot_id;
+
+static void clear_dirty(struct amiga_state *s)
+{
+    unsigned int i;
+    for (i = 0; i < MEM_NR_PAGES; i++)
+        s->mem_map[i].dirty = 0;
+}
+
+struct amiga_snapshot *amiga_snapshot_take(struct amiga_state *s)
+{
+    struct amiga_snapshot *snap = memalloc(sizeof(*snap));
+    struct snapshot_state *st = &snap->st;
+    struct snapshot_memory *sm;
+    struct memory *m;
+    struct region *r;
+
+    m68k_sync_sr(&s->ctxt);
+    st->regs = *s->ctxt.regs;
+    st->prefetch_addr = s->ctxt.prefetch_addr;
+    st->prefetch_valid = s->ctxt.prefetch_valid;
+    memcpy(st->prefetch_dat, s->ctxt.prefetch_dat, sizeof(st->prefetch_dat));
+    memcpy(st->custom, s->custom, sizeof(st->custom));
+    st->ciaa = s->ciaa;
+    st->ciab = s->ciab;
+    st->disk = s->disk;
+    st->track_loaded = (s->disk.track_raw->bits != NULL);
+    event_save(s->disk.motor_delay, &st->motor_delay);
+    event_save(s->disk.step_delay, &st->step_delay);
+    event_save(s->disk.data_delay, &st->data_delay);
+    st->current_time = s->event_base.current_time;
+    st->nr_fired = s->event_base.nr_fired;
+    st->seq = s->event_base.seq;
+
+    for (m = s->memory; m != NULL; m = m->next)
+        st->nr_mem++;
+    snap->mem = memalloc(st->nr_mem * sizeof(*snap->mem));
+    for (m = s->memory, sm = snap->mem; m != NULL; m = m->next, sm++) {
+        sm->start = m->start;
+        sm->end = m->end;
+        for (r = m->free; r != NULL; r = r->next)
+            sm->nr_free++;
+        sm->free = memalloc(sm->nr_free * sizeof(*sm->free));
+        for (r = m->free, sm->nr_free = 0; r != NULL; r = r->next)
+            sm->free[sm->nr_free++] = *r;
+        sm->dat = memalloc(m->end - m->start + 1);
+        memcpy(sm->dat, m->dat, m->end - m->start + 1);
+    }
+
+    snap->id = __sync_add_and_fetch(&snapshot_id, 1);
+    s->snapshot_id = snap->id;
+    clear_dirty(s);
+
+    return snap;
+}
+
+static void restore_memory(
+    struct amiga_state *s, struct memory *m,
+    const struct snapshot_memory *sm, bool_t full)
+{
+    struct region *r, **pprev;
+    uint32_t page, off;
+    unsigned int i;
+
+    ASSERT((m->start == sm->start) && (m->end == sm->end));
+
+    if (full) {
+        memcpy(m->dat, sm->dat, m->end - m->start + 1);
+    } else {
+        for (page = m->start >> MEM_PAGE_SHIFT;
+             (page < MEM_NR_PAGES) && (page <= (m->end >> MEM_PAGE_SHIFT));
+             page++) {
+            if (!s->mem_map[page].dirty)
+                continue;
+            off = (page << MEM_PAGE_SHIFT) - m->start;
+            memcpy(&m->dat[off], &sm->dat[off], MEM_PAGE_SIZE);
+        }
+    }
+
+    while ((r = m->free) != NULL) {
+        m->free = r->next;
+        memfree(r);
+    }
+    pprev = &m->free;
+    for (i = 0; i < sm->nr_free; i++) {
+        r = memalloc(sizeof(*r));
+        *r = sm->free[i];
+        r->next = NULL;
+        *pprev = r;
+        pprev = &r->next;
+    }
+}
+
+void amiga_snapshot_restore(
+    struct amiga_state *s, const struct amiga_snapshot *snap)
+{
+    const struct snapshot_state *st = &snap->st;
+    struct amiga_disk disk = s->disk;
+    bool_t full = (s->snapshot_id != snap->id);
+    struct memory *m;
+    unsigned int i;
+
+    m68k_sync_sr(&s->ctxt); /* retire pending flags before overwriting SR */
+    *s->ctxt.regs = st->regs;
+    s->ctxt.prefetch_addr = st->prefetch_addr;
+    s->ctxt.prefetch_valid = st->prefetch_valid;
+    memcpy(s->ctxt.prefetch_dat, st->prefetch_dat, sizeof(st->prefetch_dat));
+    m68k_icache_flush(&s->ctxt);
+    memcpy(s->custom, st->custom, sizeof(s->custom));
+    s->ciaa = st->ciaa;
+    s->ciab = st->ciab;
+
+    /* Disk state, keeping this machine's own disk, buffer and events. */
+    s->disk = st->disk;
+    s->disk.motor_delay = disk.motor_delay;
+    s->disk.step_delay = disk.step_delay;
+    s->disk.data_delay = disk.data_delay;
+    s->disk.df0_disk = disk.df0_disk;
+    s->disk.track_raw = disk.track_raw;
+    s->disk.dma_nr = 0;
+    if (!st->track_loaded) {
+        if (disk.track_raw->bits != NULL)
+            track_purge_raw_buffer(disk.track_raw);
+    } else if ((disk.track_raw->bits == NULL)
+               || (disk.tracknr != st->disk.tracknr)) {
+        track_read_raw(disk.track_raw, st->disk.tracknr);
+    }
+
+    s->event_base.current_time = st->current_time;
+    s->event_base.nr_fired = st->nr_fired;
+    s->event_base.seq = st->seq;
+    event_restore(s->disk.motor_delay, &st->motor_delay);
+    event_restore(s->disk.step_delay, &st->step_delay);
+    event_restore(s->disk.data_delay, &st->data_delay);
+
+    for (m = s->memory, i = 0; m != NULL; m = m->next, i++) {
+        ASSERT(i < st->nr_mem);
+        restore_memory(s, m, &snap->mem[i], full);
+    }
+    ASSERT(i == st->nr_mem);
+
+    s->snapshot_id = snap->id;
+    clear_dirty(s);
+}
+
+void amiga_snapshot_free(struct amiga_snapshot *snap)
+{
+    unsigned int i;
+
+    if (snap == NULL)
+        return;
+
+    for (i = 0; i < snap->st.nr_mem; i++) {
+        memfree(snap->mem[i].free);
+        memfree(snap->mem[i].dat);
+    }
+    memfree(snap->mem);
+    memfree(snap);
+}
+
+void amiga_snapshot_write(const struct amiga_snapshot *snap, int fd)
+{
+    const struct snapshot_memory *sm;
+    uint32_t sz = sizeof(snap->st);
+    unsigned int i;
+
+    write_exact(fd, SNAPSHOT_MAGIC, 8);
+    write_exact(fd, &sz, sizeof(sz));
+    write_exact(fd, &snap->st, sizeof(snap->st));
+    for (i = 0; i < snap->st.nr_mem; i++) {
+        sm = &snap->mem[i];
+        write_exact(fd, sm, 3 * sizeof(uint32_t));
+        write_exact(fd, sm->free, sm->nr_free * sizeof(*sm->free));
+        write_exact(fd, sm->dat, sm->end - sm->start + 1);
+    }
+}
+
+struct amiga_snapshot *amiga_snapshot_read(int fd)
+{
+    struct amiga_snapshot *snap;
+    struct snapshot_memory *sm;
+    char magic[8];
+    uint32_t sz;
+    unsigned int i;
+
+    read_exact(fd, magic, 8);
+    read_exact(fd, &sz, sizeof(sz));
+    if (memcmp(magic, SNAPSHOT_MAGIC, 8) || (sz != sizeof(snap->st)))
+        errx(1, "Bad or incompatible snapshot file");
+
+    snap = memalloc(sizeof(*snap));
+    read_exact(fd, &snap->st, sizeof(snap->st));
+    snap->mem = memalloc(snap->st.nr_mem * sizeof(*snap->mem));
+    for (i = 0; i < snap->st.nr_mem; i++) {
+        sm = &snap->mem[i];
+        read_exact(fd, sm, 3 * sizeof(uint32_t));
+        sm->free = memalloc(sm->nr_free * sizeof(*sm->free));
+        read_exact(fd, sm->free, sm->nr_free * sizeof(*sm->free));
+        sm->dat = memalloc(sm->end - sm->start + 1);
+        read_exact(fd, sm->dat, sm->end - sm->start + 1);
+    }
+
+    snap->id = __sync_add_and_fetch(&snapshot_id, 1);
+    return snap;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
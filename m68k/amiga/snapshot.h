@@ -0,0 +1,39 @@
+/*
+ * snapshot.h
+ * 
+ * Save and restore emulated Amiga machine state.
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+struct amiga_state;
+struct amiga_snapshot;
+
+/* Capture CPU, memory, custom, CIA, disk and event state. */
+struct amiga_snapshot *amiga_snapshot_take(struct amiga_state *);
+
+/* Return a machine to the state captured in a snapshot. The machine must
+ * have the same memory layout as the one the snapshot was taken from. If the
+ * machine was last snapshotted or restored from this same snapshot then only
+ * the memory pages dirtied since then are copied back. */
+void amiga_snapshot_restore(
+    struct amiga_state *, const struct amiga_snapshot *);
+
+void amiga_snapshot_free(struct amiga_snapshot *);
+
+/* Serialise a snapshot to/from a file. The format is host-specific. */
+void amiga_snapshot_write(const struct amiga_snapshot *, int fd);
+struct amiga_snapshot *amiga_snapshot_read(int fd);
+
+#endif /* __SNAPSHOT_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -18,6 +18,8 @@
 #include <unistd.h>
 #include <time.h>
 #include <utime.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include <amiga/amiga.h>
 #include <libdisk/util.h>
@@ -63,38 +65,100 @@ static void init_sigint_handler(void)
 #endif
 }
 
+/* Batch mode: suppress per-image chatter so that only the table is shown. */
+static int quiet;
+#define info(f, a...) do { if (!quiet) printf(f, ##a); } while (0)
+
+/* --verbose: also report simulator throughput after the run. */
+static int verbose;
+
+/* --check-snapshot: verify snapshot/restore before the run. */
+static int check_snapshot;
+
 static void usage(void)
 {
     fprintf(stderr, "Usage: copylock <df0_file> --load=... "
-            "[--dump=<name>:<pc>]\n");
+            "[--dump=<name>:<pc>] [--verbose] [--check-snapshot]\n");
+    fprintf(stderr, "       copylock --batch=<jobs_file> [--jobs=<n>]\n");
     fprintf(stderr, "Load raw: --load=<name>:<base>:<off>:<len>\n");
     fprintf(stderr, "Load exe: --load=<name>:<base>\n");
+    fprintf(stderr, "Jobs file: one '<df0_file> <name>:<base>[:<off>:<len>]' "
+            "per line\n");
     exit(1);
 }
 
-static void load_exe(void *input, uint32_t base, struct amiga_state *s)
+/* A file to load into emulated memory: --load=<name>:<base>[:<off>:<len>]. */
+struct load_spec {
+    char *name;
+    uint32_t base, off, len;
+    bool_t raw;
+};
+
+/* Parse a load spec. Returns -1 if it is malformed. */
+static int parse_load_spec(const char *spec, struct load_spec *ls)
+{
+    const char *p, *q = strchr(spec, ':');
+    char *end;
+
+    memset(ls, 0, sizeof(*ls));
+    if ((q == NULL) || (q == spec))
+        return -1;
+
+    p = q+1;
+    ls->base = strtoul(p, &end, 16);
+    if ((end == p) || ((*end != '\0') && (*end != ':')))
+        return -1;
+    if (*end == ':') {
+        /* name:base:off:len */
+        ls->raw = 1;
+        p = end+1;
+        ls->off = strtoul(p, &end, 16);
+        if ((end == p) || (*end != ':'))
+            return -1;
+        p = end+1;
+        ls->len = strtoul(p, &end, 16);
+        if ((end == p) || (*end != '\0'))
+            return -1;
+    }
+
+    ls->name = memalloc(q - spec + 1);
+    memcpy(ls->name, spec, q - spec);
+    return 0;
+}
+
+/* Treat file as a loadable executable. Perform LoadSeg on it. Returns -1 if
+ * the image is malformed. */
+static int load_exe(
+    void *input, uint32_t len, uint32_t base, struct amiga_state *s)
 {
-    /* Treat file as a loadable executable. Perform LoadSeg on it. */
     uint32_t *p = input;
     unsigned int i, j, k, nr_chunks, nr_longs, type, mem_off = base-4;
-    unsigned int bptr = 0;
-    if (be32toh(p[0]) != 0x3f3)
-        errx(1, "Unexpected image signature %08x", be32toh(p[0]));
-    printf("Loadable image: ");
-    for (i = 1; p[i] != 0; i++)
+    unsigned int bptr = 0, nr = len / 4;
+    if ((nr == 0) || (be32toh(p[0]) != 0x3f3)) {
+        warnx("Unexpected image signature %08x", nr ? be32toh(p[0]) : 0);
+        return -1;
+    }
+    info("Loadable image: ");
+    for (i = 1; (i < nr) && (p[i] != 0); i++)
         continue;
+    if ((i + 2) > nr)
+        goto truncated;
     nr_chunks = be32toh(p[i+1]);
-    printf("%u chunks\n", nr_chunks);
+    info("%u chunks\n", nr_chunks);
     i += 1 + 1 + 2 + nr_chunks;
     for (j = 0; j < nr_chunks; j++) {
+        if ((i + 2) > nr)
+            goto truncated;
         type = be32toh(p[i]);
         nr_longs = be32toh(p[i+1]) & 0x3fffffffu;
-        printf("Chunk %u: %08x, %u longwords\n", j, type, nr_longs);
+        info("Chunk %u: %08x, %u longwords\n", j, type, nr_longs);
         i += 2;
         bptr = mem_off;
         mem_off += 4;
         if ((type == 0x3e9) || (type == 0x3ea)) {
             /* code/data */
+            if ((i + nr_longs) > nr)
+                goto truncated;
             for (k = 0; k < nr_longs; k++) {
                 mem_write(mem_off, be32toh(p[i]), 4, s);
                 i++;
@@ -107,14 +171,24 @@ static void load_exe(void *input, uint32_t base, struct amiga_state *s)
                 mem_off += 4;
             }
         } else {
-            errx(1, "Unexpected chunk type %08x", type);
+            warnx("Unexpected chunk type %08x", type);
+            return -1;
+        }
+        if (i >= nr)
+            goto truncated;
+        if (be32toh(p[i]) != 0x3f2) {
+            warnx("Unexpected chunk end %08x", be32toh(p[i]));
+            return -1;
         }
-        if (be32toh(p[i]) != 0x3f2)
-            errx(1, "Unexpected chunk end %08x", be32toh(p[i]));
         i++;
         mem_write(bptr, mem_off/4, 4, s);
     }
     mem_write(bptr, 0, 4, s);
+    return 0;
+
+truncated:
+    warnx("Truncated image");
+    return -1;
 }
 
 static void load_raw(void *input, uint32_t base, uint32_t len,
@@ -127,13 +201,357 @@ static void load_raw(void *input, uint32_t base, uint32_t len,
         mem_write(base + i, p[i], 1, s);
 }
 
+/* Load the file described by @ls into emulated memory, using @buf (MEM_SIZE
+ * bytes) as scratch. Returns -1 on failure, having warned why. */
+static int load_image(
+    struct amiga_state *s, const struct load_spec *ls, char *buf)
+{
+    uint32_t len;
+    int fd, rc = -1;
+
+    fd = file_open(ls->name, O_RDONLY);
+    if (fd == -1) {
+        warn("%s", ls->name);
+        return -1;
+    }
+    len = lseek(fd, 0, SEEK_END);
+    info("File '%s', len %x\n", ls->name, len);
+    if (!ls->raw) {
+        if (len > MEM_SIZE) {
+            warnx("%s: Image cannot be loaded into %ukB RAM",
+                  ls->name, MEM_SIZE>>10);
+            goto out;
+        }
+        lseek(fd, 0, SEEK_SET);
+        read_exact(fd, buf, len);
+        info(" -> Exe @ %08x\n", ls->base);
+        rc = load_exe(buf, len, ls->base, s);
+    } else {
+        if ((ls->off > len) || ((len - ls->off) < ls->len)) {
+            warnx("%s: Range %x+%x is beyond end of file",
+                  ls->name, ls->off, ls->len);
+            goto out;
+        }
+        len = ls->len ?: len - ls->off;
+        if (len > MEM_SIZE) {
+            warnx("%s: Image cannot be loaded into %ukB RAM",
+                  ls->name, MEM_SIZE>>10);
+            goto out;
+        }
+        lseek(fd, ls->off, SEEK_SET);
+        read_exact(fd, buf, len);
+        info(" -> Raw @ %08x, off=%x, len=%x\n", ls->base, ls->off, len);
+        load_raw(buf, ls->base, len, s);
+        rc = 0;
+    }
+
+out:
+    close(fd);
+    return rc;
+}
+
+static int machine_init(
+    struct amiga_state *s, const char *df0_filename,
+    enum loglevel max_loglevel)
+{
+    int i;
+
+    if (amiga_init(s, MEM_SIZE, df0_filename, max_loglevel) != 0) {
+        warnx("%s: Cannot open disk image", df0_filename);
+        return -1;
+    }
+
+    /* Poison low-memory vectors. */
+    for (i = 0; i < 0x100; i += 4)
+        mem_write(i, 0xdeadbe00u | i, 4, s);
+
+    return 0;
+}
+
+static void machine_start(struct amiga_state *s, uint32_t base)
+{
+    s->ctxt.regs->pc = base;
+    s->ctxt.disassemble = 0;
+    s->ctxt.emulate = 1;
+
+    mem_write(s->ctxt.regs->a[7], 0xdeadbeee, 4, s);
+}
+
+static void disassemble_insn(struct amiga_state *s, uint32_t pc)
+{
+    struct m68k_regs regs = *s->ctxt.regs;
+    s->ctxt.regs->pc = pc;
+    s->ctxt.disassemble = 1;
+    s->ctxt.emulate = 0;
+    (void)m68k_emulate(&s->ctxt);
+    *s->ctxt.regs = regs;
+}
+
+static double wallclock(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Give up on a batch job after this much emulated time. */
+#define BATCH_TIMEOUT MILLISECS(60000)
+
+struct job {
+    char *df0_filename, *load;
+    struct load_spec load_spec;
+    /* Results. */
+    enum { job_pending, job_done, job_error,
+           job_failed, job_timeout } status;
+    struct m68k_regs regs;
+    uint64_t insns;
+    time_ns_t emulated;
+    double secs;
+};
+
+struct batch {
+    struct job *job;
+    unsigned int nr_jobs, next_job;
+    pthread_mutex_t lock;
+};
+
+static void run_job(struct job *job)
+{
+    struct amiga_state *s = memalloc(sizeof(*s));
+    char *buf = memalloc(MEM_SIZE);
+    double start = wallclock();
+
+    /* A job which cannot be set up fails alone: the batch carries on. */
+    if (machine_init(s, job->df0_filename, loglevel_none) != 0) {
+        job->status = job_error;
+        goto out;
+    }
+    if (load_image(s, &job->load_spec, buf) != 0) {
+        job->status = job_error;
+        amiga_destroy(s);
+        goto out;
+    }
+    machine_start(s, job->load_spec.base);
+
+    job->status = job_done;
+    while (s->ctxt.regs->pc != 0xdeadbeee) {
+        if (ctrl_c || (s->event_base.current_time > BATCH_TIMEOUT)) {
+            job->status = job_timeout;
+            break;
+        }
+        if (amiga_emulate(s) != M68KEMUL_OKAY) {
+            job->status = job_failed;
+            break;
+        }
+        job->insns++;
+    }
+
+    m68k_sync_sr(&s->ctxt);
+    job->regs = *s->ctxt.regs;
+    job->emulated = s->event_base.current_time;
+    amiga_destroy(s);
+
+out:
+    job->secs = wallclock() - start;
+    memfree(s);
+    memfree(buf);
+}
+
+static void *batch_worker(void *_b)
+{
+    struct batch *b = _b;
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next_job++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->nr_jobs)
+            break;
+        run_job(&b->job[i]);
+    }
+
+    return NULL;
+}
+
+static void run_batch(const char *jobs_filename, unsigned int nr_threads)
+{
+    static const char *status_name[] = {
+        [job_pending] = "pending", [job_done] = "ok", [job_error] = "error",
+        [job_failed] = "failed", [job_timeout] = "timeout" };
+    struct batch b = { 0 };
+    struct job *job;
+    pthread_t *threads;
+    char line[1024], *df0, *load;
+    unsigned int i, max_jobs = 0, lineno = 0;
+    double start = wallclock();
+    FILE *fp;
+
+    if ((fp = fopen(jobs_filename, "r")) == NULL)
+        err(1, "%s", jobs_filename);
+    /* Reject a bad jobs file here, before any worker thread is running. */
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        df0 = strtok(line, " \t\r\n");
+        if ((df0 == NULL) || (*df0 == '#'))
+            continue;
+        if ((load = strtok(NULL, " \t\r\n")) == NULL)
+            errx(1, "%s:%u: no loader given for '%s'",
+                 jobs_filename, lineno, df0);
+        if (access(df0, R_OK) != 0)
+            err(1, "%s:%u: %s", jobs_filename, lineno, df0);
+        if (b.nr_jobs == max_jobs) {
+            job = b.job;
+            max_jobs = max_jobs ? max_jobs * 2 : 16;
+            b.job = memalloc(max_jobs * sizeof(*job));
+            if (job != NULL) {
+                memcpy(b.job, job, b.nr_jobs * sizeof(*job));
+                memfree(job);
+            }
+        }
+        job = &b.job[b.nr_jobs];
+        if (parse_load_spec(load, &job->load_spec) != 0)
+            errx(1, "%s:%u: bad loader '%s'", jobs_filename, lineno, load);
+        if (access(job->load_spec.name, R_OK) != 0)
+            err(1, "%s:%u: %s", jobs_filename, lineno, job->load_spec.name);
+        job->df0_filename = strdup(df0);
+        job->load = strdup(load);
+        b.nr_jobs++;
+    }
+    fclose(fp);
+
+    quiet = 1;
+    init_sigint_handler();
+    pthread_mutex_init(&b.lock, NULL);
+    nr_threads = max_t(unsigned int, 1, min_t(unsigned int, nr_threads,
+                                              b.nr_jobs));
+    threads = memalloc(nr_threads * sizeof(*threads));
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, batch_worker, &b) != 0)
+            errx(1, "Failed to create worker thread");
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("%-4s %-8s %-8s %-8s %10s %10s %8s  %s\n", "Job", "Status",
+           "D0", "D1", "Insns", "Emulated", "Host", "Image / Loader");
+    for (i = 0; i < b.nr_jobs; i++) {
+        struct job *job = &b.job[i];
+        printf("%-4u %-8s %08x %08x %10llu %9.3fs %7.2fs  %s %s\n",
+               i, status_name[job->status], job->regs.d[0], job->regs.d[1],
+               (unsigned long long)job->insns, job->emulated / 1e9,
+               job->secs, job->df0_filename, job->load);
+    }
+    printf("%u jobs on %u threads in %.2fs\n",
+           b.nr_jobs, nr_threads, wallclock() - start);
+}
+
+/* Summary of machine state, for comparing runs. */
+struct machine_digest {
+    struct m68k_regs regs;
+    time_ns_t emulated;
+    uint32_t mem_crc;
+};
+
+static void machine_digest(struct amiga_state *s, struct machine_digest *md)
+{
+    struct memory *m;
+
+    m68k_sync_sr(&s->ctxt);
+    md->regs = *s->ctxt.regs;
+    md->emulated = s->event_base.current_time;
+    md->mem_crc = 0;
+    for (m = s->memory; m != NULL; m = m->next)
+        md->mem_crc = crc32_add(m->dat, m->end - m->start + 1, md->mem_crc);
+}
+
+static void check_digest(
+    struct amiga_state *s, struct machine_digest *ref, const char *what)
+{
+    struct machine_digest md;
+
+    machine_digest(s, &md);
+    if (memcmp(&ref->regs, &md.regs, sizeof(md.regs))
+        || (ref->emulated != md.emulated)
+        || (ref->mem_crc != md.mem_crc))
+        errx(1, "Snapshot check: state %s differs", what);
+}
+
+static void run_to_exit(struct amiga_state *s)
+{
+    while ((s->ctxt.regs->pc != 0xdeadbeee)
+           && (s->event_base.current_time <= BATCH_TIMEOUT)
+           && (amiga_emulate(s) == M68KEMUL_OKAY))
+        continue;
+}
+
+/* Run the loaded image to completion three times: from the current state,
+ * after restoring a snapshot of it in place (only dirtied pages are copied
+ * back), and after a round trip of the snapshot through a file (a full
+ * restore). Each restore must reproduce the starting state, and each run
+ * must end in the same state. The machine is then returned to its starting
+ * state. */
+static void snapshot_check(struct amiga_state *s)
+{
+    struct amiga_snapshot *snap, *snap2;
+    struct machine_digest start, end;
+    enum loglevel max_loglevel = s->max_loglevel;
+    FILE *fp;
+
+    s->max_loglevel = loglevel_none;
+    snap = amiga_snapshot_take(s);
+    machine_digest(s, &start);
+    run_to_exit(s);
+    machine_digest(s, &end);
+
+    amiga_snapshot_restore(s, snap);
+    check_digest(s, &start, "after in-place restore");
+    run_to_exit(s);
+    check_digest(s, &end, "at end of run after in-place restore");
+
+    if ((fp = tmpfile()) == NULL)
+        err(1, "tmpfile");
+    amiga_snapshot_write(snap, fileno(fp));
+    lseek(fileno(fp), 0, SEEK_SET);
+    snap2 = amiga_snapshot_read(fileno(fp));
+    fclose(fp);
+    amiga_snapshot_restore(s, snap2);
+    check_digest(s, &start, "after restore from file");
+    run_to_exit(s);
+    check_digest(s, &end, "at end of run after restore from file");
+
+    amiga_snapshot_restore(s, snap);
+    amiga_snapshot_free(snap2);
+    amiga_snapshot_free(snap);
+    s->max_loglevel = max_loglevel;
+
+    printf("Snapshot check: OK (%.3fs emulated, D0=%08x)\n",
+           end.emulated / 1e9, end.regs.d[0]);
+}
+
 int main(int argc, char **argv)
 {
     struct amiga_state s;
     struct m68k_regs *regs;
+    struct load_spec ls;
     char *p, *q, *shadow, *bmap, *dump_name = NULL;
-    int rc, i, fd, zeroes_run = 0;
-    uint32_t off, len, dump_pc = 0, base = 0;
+    int rc, i, zeroes_run = 0;
+    uint32_t pc = 0, dump_pc = 0, base = 0;
+    unsigned int nr_threads = 0;
+    clock_t start;
+    double secs;
+
+    if ((argc >= 2) && !strncmp(argv[1], "--batch=", 8)) {
+        for (i = 2; i < argc; i++) {
+            if (!strncmp(argv[i], "--jobs=", 7))
+                nr_threads = strtol(argv[i] + 7, NULL, 0);
+            else
+                usage();
+        }
+        if (nr_threads == 0)
+            nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        run_batch(argv[1] + 8, nr_threads);
+        return 0;
+    }
 
     if (argc < 3)
         usage();
@@ -141,55 +559,19 @@ int main(int argc, char **argv)
     shadow = memalloc(MEM_SIZE);
     bmap = memalloc(MEM_SIZE/8);
 
-    amiga_insert_df0(argv[1]);
-    amiga_init(&s, MEM_SIZE);
+    if (machine_init(&s, argv[1], loglevel_info) != 0)
+        exit(1);
     regs = s.ctxt.regs;
 
-    /* Poison low-memory vectors. */
-    for (i = 0; i < 0x100; i += 4)
-        mem_write(i, 0xdeadbe00u | i, 4, &s);
-
     for (i = 2; i < argc; i++) {
         if (!strncmp(argv[i], "--load=", 7)) {
             /* --load=name:base:off:len
              * --load=name:base */
-            if (base) usage();
-            p = argv[i] + 7;
-            q = strchr(p, ':');
-            if (!q) usage();
-            *q = '\0';
-            fd = file_open(p, O_RDONLY);
-            if (fd == -1)
-                err(1, "%s", p);
-            len = lseek(fd, 0, SEEK_END);
-            printf("File '%s', len %x\n", p, len);
-            p = q+1;
-            q = strchr(p, ':');
-            if (!q) {
-                base = strtol(p, NULL, 16);
-                lseek(fd, 0, SEEK_SET);
-                read_exact(fd, shadow, len);
-                printf(" -> Exe @ %08x\n", base);
-                load_exe(shadow, base, &s);
-            } else {
-                *q = '\0';
-                base = strtol(p, NULL, 16);
-                p = q+1;
-                q = strchr(p, ':');
-                if (!q) usage();
-                *q = '\0';
-                off = strtol(p, NULL, 16);
-                len = strtol(q+1, NULL, 16) ?: len;
-                lseek(fd, off, SEEK_SET);
-                if (len > MEM_SIZE)
-                    errx(1, "Image cannot be loaded into %ukB RAM",
-                         MEM_SIZE>>10);
-                read_exact(fd, shadow, len);
-                printf(" -> Raw @ %08x, off=%x, len=%x\n",
-                       base, off, len);
-                load_raw(shadow, base, len, &s);
-            }
-            close(fd);
+            if (base || (parse_load_spec(argv[i] + 7, &ls) != 0))
+                usage();
+            if (load_image(&s, &ls, shadow) != 0)
+                exit(1);
+            base = ls.base;
         } else if (!strncmp(argv[i], "--dump=", 7)) {
             p = argv[i] + 7;
             q = strchr(p, ':');
@@ -197,6 +579,10 @@ int main(int argc, char **argv)
             *q = '\0';
             dump_name = p;
             dump_pc = strtol(q+1, NULL, 16);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            verbose = 1;
+        } else if (!strcmp(argv[i], "--check-snapshot")) {
+            check_snapshot = 1;
         } else {
             warnx("Unrecognised option: %s", argv[i]);
             usage();
@@ -207,14 +593,14 @@ int main(int argc, char **argv)
 
     memset(shadow, 0, MEM_SIZE);
 
-    regs->pc = base;
-    s.ctxt.disassemble = 1;
-    s.ctxt.emulate = 1;
+    machine_start(&s, base);
 
-    mem_write(regs->a[7], 0xdeadbeee, 4, &s);
+    if (check_snapshot)
+        snapshot_check(&s);
 
+    start = clock();
     while (!ctrl_c && (regs->pc != 0xdeadbeee)) {
-        uint32_t pc = regs->pc;
+        pc = regs->pc;
 
         if (pc == dump_pc) {
             /* Dump out registers and memory state */
@@ -238,8 +624,20 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Report simulator throughput: events fired per second of host time. */
+    if (verbose) {
+        secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("%llu events in %.3fs emulated time: %.0f events/sec\n",
+               (unsigned long long)s.event_base.nr_fired,
+               s.event_base.current_time / 1e9,
+               secs ? s.event_base.nr_fired / secs : 0);
+    }
+
+    /* Emulation runs without disassembly: decode the final insn again. */
+    disassemble_insn(&s, pc);
     printf("%08x %04x %04x %04x %s\n", regs->pc,
            s.ctxt.op[0], s.ctxt.op[1],s.ctxt.op[2],s.ctxt.dis);
+    m68k_sync_sr(&s.ctxt);
     m68k_dump_regs(regs, dump);
     m68k_dump_stack(&s.ctxt, stack_current, dump);
 
@@ -14,43 +14,55 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <time.h>
-#include <utime.h>
 
 #include <amiga/amiga.h>
 #include <amiga/custom.h>
 
-#define MEM_SIZE (512*1024) /* our system has 512kB RAM */
-
+/* The image is disassembled in place: a linear sweep over [base,base+len)
+ * with emulation disabled, so there is no RAM limit and no execution side
+ * effects (exceptions, register updates, memory writes). */
 struct m68k_state {
     struct m68k_emulate_ctxt ctxt;
-    char addr_name[16];
-    char *mem;
+    uint8_t *mem;
+    uint32_t base, len;
 };
 
+/* The image is followed by zeroes, enough to complete the longest (10-byte)
+ * instruction starting in its final word, as in a larger zeroed RAM. */
+#define MEM_PAD 16
+
+/* CIA register names, formatted once rather than on every lookup. */
+static char cia_name[2][ARRAY_SIZE(cia_reg_name)][16];
+
+static void cia_name_init(void)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(cia_reg_name); i++) {
+        sprintf(cia_name[0][i], "ciaa%s", cia_reg_name[i]);
+        sprintf(cia_name[1][i], "ciab%s", cia_reg_name[i]);
+    }
+}
+
 static int emul_read(uint32_t addr, uint32_t *val, unsigned int bytes,
                      struct m68k_emulate_ctxt *ctxt)
 {
     struct m68k_state *s = container_of(ctxt, struct m68k_state, ctxt);
+    uint8_t *p;
 
-    if (((addr >= 0xdff000) && (addr <= 0xdff200)) ||
-        ((addr >= 0xbfd000) && (addr <= 0xbfef01))) {
-        *val = 0xdeadbeef;
-        return M68KEMUL_OKAY;
-    }
-
-    if ((addr > MEM_SIZE) || ((addr+bytes) > MEM_SIZE))
+    addr -= s->base;
+    if ((addr >= (s->len + MEM_PAD)) || ((s->len + MEM_PAD - addr) < bytes))
         return M68KEMUL_UNHANDLEABLE;
 
+    p = &s->mem[addr];
     switch (bytes) {
     case 1:
-        *val = *(uint8_t *)&s->mem[addr];
+        *val = p[0];
         break;
     case 2:
-        *val = be16toh(*(uint16_t *)&s->mem[addr]);
+        *val = (p[0] << 8) | p[1];
         break;
     case 4:
-        *val = be32toh(*(uint32_t *)&s->mem[addr]);
+        *val = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
         break;
     default:
         return M68KEMUL_UNHANDLEABLE;
@@ -59,17 +71,10 @@ static int emul_read(uint32_t addr, uint32_t *val, unsigned int bytes,
     return M68KEMUL_OKAY;
 }
 
-static int emul_write(uint32_t addr, uint32_t val, unsigned int bytes,
-                      struct m68k_emulate_ctxt *ctxt)
-{
-    return M68KEMUL_OKAY;
-}
-
 static const char *emul_addr_name(
     uint32_t addr, struct m68k_emulate_ctxt *ctxt)
 {
-    struct m68k_state *s = container_of(ctxt, struct m68k_state, ctxt);
-    char ciax;
+    unsigned int cia;
 
     if (addr > 0xdff000) { /* skip dff000 itself */
         if (addr & 1)
@@ -81,32 +86,66 @@ static const char *emul_addr_name(
 
     if (addr >= 0xbfe001) {
         addr -= 0xbfe001;
-        ciax = 'a';
-    cia:
-        if (addr & 0xff)
-            return NULL;
-        addr >>= 8;
-        if (addr >= ARRAY_SIZE(cia_reg_name))
-            return NULL;
-        sprintf(s->addr_name, "cia%c%s", ciax, cia_reg_name[addr]);
-        return s->addr_name;
-    }
-
-    if (addr >= 0xbfd000) {
+        cia = 0;
+    } else if (addr >= 0xbfd000) {
         addr -= 0xbfd000;
-        ciax = 'b';
-        goto cia;
+        cia = 1;
+    } else {
+        return NULL;
     }
 
-    return NULL;
+    if (addr & 0xff)
+        return NULL;
+    addr >>= 8;
+    return (addr < ARRAY_SIZE(cia_reg_name)) ? cia_name[cia][addr] : NULL;
 }
 
 static struct m68k_emulate_ops emul_ops = {
     .read = emul_read,
-    .write = emul_write,
     .addr_name = emul_addr_name
 };
 
+/* Output is assembled in a large buffer and written out in big chunks. */
+static char obuf[1u << 16];
+static unsigned int olen;
+
+static void out_flush(void)
+{
+    if (fwrite(obuf, 1, olen, stdout) != olen)
+        err(1, NULL);
+    olen = 0;
+}
+
+static void out_str(const char *str)
+{
+    while (*str) {
+        if (olen == sizeof(obuf))
+            out_flush();
+        obuf[olen++] = *str++;
+    }
+}
+
+static void out_spaces(int n)
+{
+    while (n-- > 0) {
+        if (olen == sizeof(obuf))
+            out_flush();
+        obuf[olen++] = ' ';
+    }
+}
+
+static void out_hex(uint32_t x, unsigned int digits)
+{
+    static const char hex[] = "0123456789abcdef";
+    char str[9];
+    str[digits] = '\0';
+    while (digits--) {
+        str[digits] = hex[x & 15];
+        x >>= 4;
+    }
+    out_str(str);
+}
+
 /* read_exact */
 #include "../libdisk/util.c"
 
@@ -114,7 +153,7 @@ int main(int argc, char **argv)
 {
     struct m68k_state s = { { 0 } };
     struct m68k_regs regs = { { 0 } };
-    char *p;
+    char *p, str[32];
     int i, j, fd, zeroes_run = 0;
     uint32_t off, len, base;
 
@@ -135,30 +174,34 @@ int main(int argc, char **argv)
         len = sz - off;
     }
 
-    if ((base+len) > MEM_SIZE)
-        errx(1, "Image cannot be loaded into %ukB RAM\n", MEM_SIZE>>10);
+    if ((base+len) < base)
+        errx(1, "Image does not fit in the 32-bit address space");
 
-    s.mem = memalloc(MEM_SIZE);
+    s.mem = memalloc(len + MEM_PAD);
+    s.base = base;
+    s.len = len;
 
     if (lseek(fd, off, SEEK_SET) != off)
         err(1, NULL);
-    read_exact(fd, &s.mem[base], len);
+    read_exact(fd, s.mem, len);
     close(fd);
 
-    for (i = 0; i < argc; i++)
-        printf("%s ", argv[i]);
-    printf("\n");
+    cia_name_init();
+
+    for (i = 0; i < argc; i++) {
+        out_str(argv[i]);
+        out_str(" ");
+    }
+    out_str("\n");
 
     regs.pc = base;
-    regs.a[7] = 0x2000;
-    regs.xsp = MEM_SIZE;
 
     s.ctxt.regs = &regs;
     s.ctxt.ops = &emul_ops;
     s.ctxt.disassemble = 1;
-    s.ctxt.emulate = 1;
+    s.ctxt.emulate = 0;
 
-    while (regs.pc < (base + len)) {
+    while ((regs.pc - base) < len) {
         uint32_t pc = regs.pc;
 
         (void)m68k_emulate(&s.ctxt);
@@ -170,46 +213,56 @@ int main(int argc, char **argv)
                 goto skip;
         } else {
             if (zeroes_run >= 2) {
-                printf("      [%u more]\n", zeroes_run-1);
-                printf("-------------------------------\n");
+                sprintf(str, "      [%u more]\n", zeroes_run-1);
+                out_str(str);
+                out_str("-------------------------------\n");
             }
             zeroes_run = 0;
         }
 
-        printf("%08x  ", pc);
+        out_hex(pc, 8);
+        out_str("  ");
 
         if (zeroes_run == 2) {
-            printf(".... .... ");
+            out_str(".... .... ");
             goto skip;
         }
 
         for (j = 0; j < 3; j++) {
-            if (j < s.ctxt.op_words)
-                printf("%04x ", s.ctxt.op[j]);
-            else
-                printf("     ");
+            if (j < s.ctxt.op_words) {
+                out_hex(s.ctxt.op[j], 4);
+                out_str(" ");
+            } else {
+                out_str("     ");
+            }
         }
         if ((p = strchr(s.ctxt.dis, '\t')) != NULL)
             *p = '\0';
-        printf(" %s", s.ctxt.dis);
+        out_str(" ");
+        out_str(s.ctxt.dis);
         if (p) {
             int spaces = 8-(p-s.ctxt.dis);
             if (spaces < 1)
                 spaces = 1;
-            printf("%*s%s", spaces, "", p+1);
+            out_spaces(spaces);
+            out_str(p+1);
         }
-        printf("\n");
+        out_str("\n");
         if (j < s.ctxt.op_words) {
-            printf("%08x  ", pc + 2*j);
-            while (j < s.ctxt.op_words)
-                printf("%04x ", s.ctxt.op[j++]);
-            printf("\n");
+            out_hex(pc + 2*j, 8);
+            out_str("  ");
+            while (j < s.ctxt.op_words) {
+                out_hex(s.ctxt.op[j++], 4);
+                out_str(" ");
+            }
+            out_str("\n");
         }
 
     skip:
         regs.pc = pc + s.ctxt.op_words*2;
     }
 
+    out_flush();
     return 0;
 }
 
@@ -0,0 +1,555 @@
+/*
+ * m68k/lockstep.c
+ * 
+ * Check the M68000 emulator for equivalence against a reference. Random
+ * instruction streams run on two emulated CPUs in lockstep, and all emulator
+ * state is compared after every instruction: registers, pending flags,
+ * opcode words, operation size, cycle count, prefetch queue, exceptions, and
+ * every data access in order. Memory is compared after every program.
+ * 
+ * The CPU under test uses the decoded-instruction cache. The reference CPU
+ * runs the same emulator without it or, in lockstep-ref, another revision
+ * of the emulator.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libdisk/util.h>
+#include <m68k/m68k_emulate.h>
+
+/* PAL Amiga CPU clock, as in TIMING. */
+#define CPU_HZ 7093790
+
+#define MEM_SIZE  0x10000
+#define CODE_BASE 0x4000
+#define CODE_END  0x4400
+#define DATA_BASE 0x8000
+#define HALT      0xfff0 /* all exception vectors */
+
+#define MAX_STEPS 4000   /* per program */
+#define MAX_LOG   64     /* data accesses per insn */
+
+struct access {
+    uint32_t addr, val;
+    uint8_t bytes, write;
+};
+
+struct cpu {
+    struct m68k_emulate_ctxt ctxt;
+    struct m68k_regs regs;
+    uint8_t mem[MEM_SIZE];
+    /* Instruction-stream accesses in [fetch_lo,fetch_hi) are not logged:
+     * only the full decoder makes them. */
+    uint32_t fetch_lo, fetch_hi;
+    struct access log[MAX_LOG];
+    unsigned int nr_log;
+};
+
+#ifdef REF_EMULATOR
+/* The reference emulator, with its entry points renamed ref_*. */
+int ref_m68k_emulate(struct m68k_emulate_ctxt *);
+void ref_m68k_sync_sr(struct m68k_emulate_ctxt *);
+#else
+#define ref_m68k_emulate m68k_emulate
+#define ref_m68k_sync_sr m68k_sync_sr
+#endif
+
+static struct cpu ref, dut;
+static struct m68k_icache icache;
+
+static uint32_t prng;
+static unsigned int seed = 1, prog, step;
+static uint32_t insn_pc;
+
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    prng ^= prng << 13;
+    prng ^= prng >> 17;
+    prng ^= prng << 5;
+    return prng;
+}
+
+static void log_access(struct cpu *s, uint32_t addr, uint32_t val,
+                       unsigned int bytes, int write)
+{
+    struct access *a;
+    if (!write && (addr >= s->fetch_lo) && (addr < s->fetch_hi))
+        return;
+    if (s->nr_log == MAX_LOG)
+        return;
+    a = &s->log[s->nr_log++];
+    a->addr = addr;
+    a->val = val;
+    a->bytes = bytes;
+    a->write = write;
+}
+
+static int emul_read(uint32_t addr, uint32_t *val, unsigned int bytes,
+                     struct m68k_emulate_ctxt *ctxt)
+{
+    struct cpu *s = container_of(ctxt, struct cpu, ctxt);
+    unsigned int i;
+
+    if ((addr >= MEM_SIZE) || ((MEM_SIZE - addr) < bytes))
+        return M68KEMUL_UNHANDLEABLE;
+
+    for (i = 0, *val = 0; i < bytes; i++)
+        *val = (*val << 8) | s->mem[addr + i];
+    log_access(s, addr, *val, bytes, 0);
+    return M68KEMUL_OKAY;
+}
+
+static int emul_write(uint32_t addr, uint32_t val, unsigned int bytes,
+                      struct m68k_emulate_ctxt *ctxt)
+{
+    struct cpu *s = container_of(ctxt, struct cpu, ctxt);
+    unsigned int i;
+
+    if ((addr >= MEM_SIZE) || ((MEM_SIZE - addr) < bytes))
+        return M68KEMUL_UNHANDLEABLE;
+
+    for (i = bytes; i--; val >>= 8)
+        s->mem[addr + i] = val;
+    log_access(s, addr, val, bytes, 1);
+    return M68KEMUL_OKAY;
+}
+
+static struct m68k_emulate_ops emul_ops = {
+    .read = emul_read,
+    .write = emul_write,
+};
+
+/*
+ * Random code generation. Most instructions are drawn from the forms the
+ * cache handles, with operands biased towards valid memory, so that loops
+ * form and cached instructions are executed repeatedly.
+ */
+
+static uint16_t code[(CODE_END - CODE_BASE) / 2];
+static unsigned int code_words;
+
+static void emit(uint16_t w)
+{
+    if (code_words < ARRAY_SIZE(code))
+        code[code_words++] = w;
+}
+
+/* Branch displacement to a random nearby word (occasionally odd). */
+static int16_t branch_disp(void)
+{
+    int16_t disp = (int16_t)(rnd() % 96) - 48;
+    return (rnd() % 32) ? disp & ~1 : disp | 1;
+}
+
+/* A random 6-bit EA field. Its extension words are emitted by emit_ea(). */
+static uint16_t ea(int alterable)
+{
+    unsigned int mode = rnd() % 8, reg = rnd() % 8;
+
+    if (mode == 7)
+        reg = alterable ? rnd() % 2 : (rnd() % 16) ? rnd() % 5 : 5;
+    return (mode << 3) | reg;
+}
+
+static void emit_ea(uint16_t ea, unsigned int sz)
+{
+    unsigned int mode = (ea >> 3) & 7, reg = ea & 7;
+    uint32_t v;
+
+    switch (mode) {
+    case 5:
+        emit((rnd() % 64) - 32);
+        break;
+    case 6:
+    brief:
+        /* Brief extension word: index register, size, scale, and d8.
+         * Bit 8 (68020 full format) is occasionally set. */
+        v = rnd() & 0xfe00;
+        v |= (rnd() % 32) ? 0 : 0x100;
+        v |= (rnd() % 32) - 16;
+        emit(v & 0xffff);
+        break;
+    case 7:
+        switch (reg) {
+        case 0:
+            emit(0x1000 + (rnd() % 0x6000)); /* includes the code */
+            break;
+        case 1:
+            v = (rnd() % 16) ? CODE_BASE + (rnd() % 0x9000) : rnd();
+            emit(v >> 16);
+            emit(v);
+            break;
+        case 2:
+            emit(branch_disp());
+            break;
+        case 3:
+            goto brief;
+        case 4:
+            if (sz == OPSZ_L)
+                emit(rnd());
+            emit(rnd());
+            break;
+        }
+        break;
+    }
+}
+
+static void gen_insn(void)
+{
+    unsigned int sz = rnd() % 3, reg = rnd() % 8, i;
+    uint16_t op, src, dst;
+
+    switch (rnd() % 19) {
+    case 0: case 1: case 2: /* move/movea */
+        src = ea(0);
+        dst = ea(1);
+        dst = (rnd() % 8) ? dst : (1u << 3) | reg; /* movea */
+        op = ((sz == OPSZ_B) ? 0x1000 : (sz == OPSZ_W) ? 0x3000 : 0x2000)
+            | ((dst & 7) << 9) | ((dst >> 3) << 6) | src;
+        emit(op);
+        emit_ea(src, sz);
+        emit_ea(dst, sz);
+        break;
+    case 3: /* moveq */
+        emit(0x7000 | (reg << 9) | (rnd() & 0xff));
+        break;
+    case 4: /* addq/subq */
+        op = 0x5000 | ((rnd() & 15) << 8) | (sz << 6) | ea(1);
+        emit(op);
+        emit_ea(op, sz);
+        break;
+    case 5: case 6: { /* or/sub/cmp/eor/and/add, incl. suba/cmpa/adda */
+        static const uint16_t alu[] = { 0x8000, 0x9000, 0xb000, 0xc000,
+                                        0xd000 };
+        op = alu[rnd() % 5] | (reg << 9) | ((rnd() % 8) << 6);
+        op |= ea(0);
+        emit(op);
+        emit_ea(op, ((op >> 6) & 3) == 3 ? ((op >> 8) & 1) + 1
+                : (op >> 6) & 3);
+        break;
+    }
+    case 7: { /* immediate ALU, incl. to ccr/sr */
+        static const uint8_t alu[] = { 0, 1, 2, 3, 5, 6 };
+        op = (alu[rnd() % 6] << 9) | (sz << 6);
+        op |= (rnd() % 16) ? ea(1) : 0x3c;
+        emit(op);
+        emit_ea(0x3c, sz); /* the immediate */
+        if ((op & 0x3f) != 0x3c)
+            emit_ea(op, sz);
+        break;
+    }
+    case 8: /* bchg/bclr/bset/btst */
+        if (rnd() & 1) {
+            op = 0x0100 | (reg << 9) | ((rnd() % 4) << 6) | ea(0);
+            emit(op);
+        } else {
+            op = 0x0800 | ((rnd() % 4) << 6) | ea(1);
+            emit(op);
+            emit(rnd() % 40);
+        }
+        emit_ea(op, OPSZ_B);
+        break;
+    case 9: { /* tst/clr/not/neg/negx, nbcd */
+        static const uint16_t misc[] = { 0x4a00, 0x4200, 0x4600, 0x4400,
+                                         0x4000 };
+        op = misc[rnd() % 5] | (sz << 6) | ea(1);
+        emit(op);
+        emit_ea(op, sz);
+        break;
+    }
+    case 10: /* lea/pea/jmp/jsr */
+        switch (rnd() % 4) {
+        case 0: op = 0x41c0 | (reg << 9); break;
+        case 1: op = 0x4840; break;
+        case 2: op = 0x4ec0; break;
+        default: op = 0x4e80; break;
+        }
+        /* Jump targets are kept near the code. */
+        dst = (op & 0x0f00) == 0x0e00
+            ? ((rnd() & 1) ? 0x3a : 0x28 | reg) : ea(0);
+        op |= dst;
+        emit(op);
+        emit_ea(dst, OPSZ_L);
+        break;
+    case 11: /* swap/ext/exg/nop/rts */
+        switch (rnd() % 6) {
+        case 0: emit(0x4840 | reg); break;
+        case 1: emit(0x4880 | ((rnd() & 1) << 6) | reg); break;
+        case 2: emit(0xc100 | (reg << 9) | (0x40 + (rnd() % 3) * 8)
+                     | (rnd() % 8)); break;
+        case 3: emit(0x4e71); break;
+        default: emit(0x4e75); break;
+        }
+        break;
+    case 12: case 13: /* shifts and rotates */
+        if (rnd() % 4) {
+            emit(0xe000 | (reg << 9) | ((rnd() & 1) << 8) | (sz << 6)
+                 | ((rnd() & 1) << 5) | ((rnd() % 4) << 3) | (rnd() % 8));
+        } else {
+            op = 0xe0c0 | ((rnd() % 4) << 9) | ((rnd() & 1) << 8)
+                | ea(1);
+            op |= (op & 0x38) ? 0 : 0x10; /* no Dn/An form */
+            emit(op);
+            emit_ea(op, OPSZ_W);
+        }
+        break;
+    case 14: case 15: /* bcc/bra/bsr */
+        op = 0x6000 | ((rnd() & 15) << 8);
+        if (rnd() % 4) {
+            emit(op | (uint8_t)(branch_disp() ?: 2));
+        } else {
+            emit(op);
+            emit(branch_disp());
+        }
+        break;
+    case 16: /* dbcc */
+        emit(0x50c8 | ((rnd() & 15) << 8) | reg);
+        emit(branch_disp());
+        break;
+    case 17: /* scc */
+        op = 0x50c0 | ((rnd() & 15) << 8) | ea(1);
+        if ((op & 0x38) == 0x08)
+            op &= ~0x38;
+        emit(op);
+        emit_ea(op, OPSZ_B);
+        break;
+    default: /* anything: uncached forms, exceptions, junk */
+        for (i = rnd() % 4; i < 5; i++)
+            emit(rnd());
+        break;
+    }
+}
+
+static void random_regs(struct m68k_regs *r)
+{
+    unsigned int i;
+
+    memset(r, 0, sizeof(*r));
+    for (i = 0; i < 8; i++) {
+        r->d[i] = (rnd() & 1) ? rnd() % 64 : rnd();
+        r->a[i] = (rnd() % 8) ? DATA_BASE + (rnd() % 0x7000)
+            : (rnd() % 2) ? CODE_BASE + (rnd() % 0x400) : rnd();
+        if (rnd() % 8)
+            r->a[i] &= ~1;
+    }
+    r->d[7] = 20;
+    r->a[7] = DATA_BASE + 0x6000;
+    r->xsp = DATA_BASE + 0x7000;
+    r->pc = CODE_BASE + ((rnd() % (CODE_END - CODE_BASE)) & ~1);
+    r->sr = 0x2700 | (rnd() & 0x1f);
+    if (!(rnd() % 16))
+        r->sr &= ~0x2000;
+    if (!(rnd() % 32))
+        r->sr |= 0x8000;
+}
+
+static void gen_program(void)
+{
+    struct m68k_regs *r = &ref.regs;
+    unsigned int i;
+
+    code_words = 0;
+    while (code_words < (ARRAY_SIZE(code) - 16))
+        gen_insn();
+    /* dbf d7,CODE_BASE */
+    emit(0x51cf);
+    emit(-code_words*2);
+
+    for (i = 0; i < MEM_SIZE; i++)
+        ref.mem[i] = rnd();
+    for (i = 0; i < 256; i++) {
+        ref.mem[i*4+0] = ref.mem[i*4+1] = 0;
+        ref.mem[i*4+2] = HALT >> 8;
+        ref.mem[i*4+3] = HALT & 0xff;
+    }
+    for (i = 0; i < code_words; i++) {
+        ref.mem[CODE_BASE + i*2] = code[i] >> 8;
+        ref.mem[CODE_BASE + i*2 + 1] = code[i];
+    }
+
+    random_regs(r);
+    r->pc = CODE_BASE;
+
+    memset(&ref.ctxt.cc, 0, sizeof(ref.ctxt.cc));
+    ref.ctxt.prefetch_addr = ref.ctxt.prefetch_valid = 0;
+
+    memcpy(dut.mem, ref.mem, MEM_SIZE);
+    dut.regs = ref.regs;
+    dut.ctxt.cc = ref.ctxt.cc;
+    dut.ctxt.prefetch_addr = dut.ctxt.prefetch_valid = 0;
+    m68k_icache_flush(&dut.ctxt);
+}
+
+static void dump(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+static void fail(const char *fmt, ...)
+{
+    va_list args;
+    unsigned int i;
+
+    printf("MISMATCH: program %u, step %u, pc %06x: ", prog, step, insn_pc);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\nInsn:");
+    for (i = 0; i < ref.ctxt.op_words; i++)
+        printf(" %04x", ref.ctxt.op[i]);
+    printf("\nFull decoder:\n");
+    m68k_dump_regs(&ref.regs, dump);
+    printf("Cache:\n");
+    m68k_dump_regs(&dut.regs, dump);
+    printf("Reproduce with: lockstep 1 %u\n", seed + prog);
+    exit(1);
+}
+
+#define check(f) do {                                   \
+    if (ref.f != dut.f)                                 \
+        fail("%s: %x != %x", #f, ref.f, dut.f);         \
+} while (0)
+
+static void compare(int ref_rc, int dut_rc)
+{
+    unsigned int i;
+
+    if (ref_rc != dut_rc)
+        fail("rc: %d != %d", ref_rc, dut_rc);
+    for (i = 0; i < 8; i++) {
+        check(regs.d[i]);
+        check(regs.a[i]);
+    }
+    check(regs.pc);
+    check(regs.xsp);
+    check(regs.sr);
+    check(ctxt.cc.op);
+    if (ref.ctxt.cc.op) {
+        check(ctxt.cc.sz);
+        check(ctxt.cc.src);
+        check(ctxt.cc.dst);
+        check(ctxt.cc.res);
+    }
+    check(ctxt.op_sz);
+    check(ctxt.op_words);
+    for (i = 0; i < ref.ctxt.op_words; i++)
+        check(ctxt.op[i]);
+    check(ctxt.cycles);
+    check(ctxt.prefetch_addr);
+    check(ctxt.prefetch_valid);
+    for (i = 0; i < ref.ctxt.prefetch_valid; i++)
+        check(ctxt.prefetch_dat[i]);
+    check(nr_log);
+    for (i = 0; i < ref.nr_log; i++) {
+        check(log[i].addr);
+        check(log[i].val);
+        check(log[i].bytes);
+        check(log[i].write);
+    }
+}
+
+/* Modify code in both memories, as DMA would, and tell the cache. */
+static void dma_write(void)
+{
+    uint32_t addr = CODE_BASE + (rnd() % (CODE_END - CODE_BASE));
+    unsigned int i, bytes = 1 + rnd() % 16;
+    uint8_t v;
+
+    for (i = 0; (i < bytes) && (addr + i < MEM_SIZE); i++) {
+        v = rnd();
+        ref.mem[addr + i] = dut.mem[addr + i] = v;
+    }
+    m68k_icache_invalidate(&dut.ctxt, addr, i);
+}
+
+static void run_program(uint64_t *cycles)
+{
+    int ref_rc, dut_rc;
+
+    for (step = 0; step < MAX_STEPS; step++) {
+        if (!(rnd() % 256))
+            dma_write();
+
+        insn_pc = ref.regs.pc;
+        ref.fetch_lo = dut.fetch_lo = insn_pc;
+        ref.fetch_hi = dut.fetch_hi = insn_pc + 14;
+        ref.nr_log = dut.nr_log = 0;
+
+        ref_rc = ref_m68k_emulate(&ref.ctxt);
+        dut_rc = m68k_emulate(&dut.ctxt);
+        compare(ref_rc, dut_rc);
+        *cycles += ref.ctxt.cycles;
+
+        /* After an exception or an unhandleable insn, carry on at a random
+         * point in the same code, with the cache still warm. A vector
+         * overwritten by the program may deliver to an odd PC, from which
+         * the emulator cannot fetch. */
+        if ((ref_rc != M68KEMUL_OKAY) || (ref.regs.pc == HALT)
+            || (ref.regs.pc & 1)) {
+            ref_m68k_sync_sr(&ref.ctxt);
+            m68k_sync_sr(&dut.ctxt);
+            random_regs(&ref.regs);
+            dut.regs = ref.regs;
+        }
+    }
+
+    if (memcmp(ref.mem, dut.mem, MEM_SIZE))
+        fail("memory differs");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_progs = 2000;
+    uint64_t insns, cycles = 0;
+
+    if (argc > 3)
+        errx(1, "Usage: lockstep [<nr_programs> [<seed>]]");
+    if (argc > 1)
+        nr_progs = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        seed = strtoul(argv[2], NULL, 0);
+
+    ref.ctxt.regs = &ref.regs;
+    ref.ctxt.ops = &emul_ops;
+    ref.ctxt.emulate = 1;
+
+    dut.ctxt.regs = &dut.regs;
+    dut.ctxt.ops = &emul_ops;
+    dut.ctxt.emulate = 1;
+    dut.ctxt.icache = &icache;
+    icache.end = MEM_SIZE;
+
+    for (prog = 0; prog < nr_progs; prog++) {
+        prng = (seed + prog) * 2654435761u ?: 1;
+        gen_program();
+        run_program(&cycles);
+    }
+
+    insns = (uint64_t)nr_progs * MAX_STEPS;
+    printf("%u programs, %llu insns (%llu%% from cache), "
+           "%llu cycles (%.3fs at %.5f MHz): OK\n",
+           nr_progs, (unsigned long long)insns,
+           (unsigned long long)(icache.nr_hit * 100 / (insns ?: 1)),
+           (unsigned long long)cycles, (double)cycles / CPU_HZ,
+           CPU_HZ / 1e6);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
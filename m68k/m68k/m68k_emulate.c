@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "m68k_emulate.h"
 
 /* Type, address-of, and value of an instruction's operand. */
@@ -28,9 +29,20 @@ struct m68k_emulate_priv_ctxt {
     char *dis_p; /* ptr into dis[] char buffer */
     struct m68k_regs sh_regs; /* shadow copy of regs before writeback */
     struct operand operand;
+    struct operand src; /* move: source, decoded before the destination */
     struct m68k_exception exception;
+    /* Execute stage and decoded operands, for the decoded-insn cache. */
+    int (*execute)(struct m68k_emulate_ctxt *, uint16_t op, uint32_t imm);
+    uint8_t execute_sz, nr_ea;
+    uint32_t imm;
+    struct m68k_icache_ea ea[2];
 };
 
+/* m68k_icache_ea.mode: EA modes 0-6, then the mode-7 forms. */
+#define ICACHE_EA_ABS     7 /* abs.w, abs.l, d16(pc): address in val */
+#define ICACHE_EA_PCINDEX 8 /* d8(pc,Xn): base address in val */
+#define ICACHE_EA_IMM     9
+
 /* SR flags */
 #define SR_T (1u<<15)
 #define SR_S (1u<<13)
@@ -45,12 +57,17 @@ struct m68k_emulate_priv_ctxt {
 /* Internal return codes */
 #define M68KEMUL_SKIP_EMULATION 16
 
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
 /* Helper macro to avoid cumbersome if() stmts everywhere. */
 #define bail_if(_op) do { if ((_op) != 0) goto bail; } while (0)
 
 /* Helper macro to pick a shadow register value. */
 #define sh_reg(c,n) ((c)->p->sh_regs.n)
 
+/* Shadow SR, with any lazily-evaluated condition codes brought up to date. */
+#define sh_sr(c) (*cc_sync(c))
+
 #define raise_exception(vec) do {               \
     c->p->exception.vector = vec;               \
     rc = M68KEMUL_EXCEPTION;                    \
@@ -62,6 +79,33 @@ struct m68k_emulate_priv_ctxt {
 } while (0)
 
 static const char op_sz_ch[] = { 'b', 'w', 'l', '?' };
+
+/* Force inlining of the sized EA and ALU helpers into the per-size execute
+ * stages, where a constant size folds them down to a single path. */
+#define always_inline inline __attribute__((always_inline))
+
+/* Operand-size parameters. OPSZ_X cannot be read or written, but (An)+ and
+ * -(An) step by a longword, and flags treat it as long. */
+static always_inline unsigned int sz_bytes(unsigned int sz)
+{
+    return (sz == OPSZ_X) ? 0 : 1u << sz;
+}
+
+static always_inline unsigned int sz_step(unsigned int sz)
+{
+    return (sz == OPSZ_X) ? 4 : 1u << sz;
+}
+
+static always_inline uint32_t sz_mask(unsigned int sz)
+{
+    return (sz == OPSZ_B) ? 0xffu : (sz == OPSZ_W) ? 0xffffu : ~0u;
+}
+
+static always_inline uint32_t sz_msb(unsigned int sz)
+{
+    return (sz == OPSZ_B) ? 1u<<7 : (sz == OPSZ_W) ? 1u<<15 : 1u<<31;
+}
+
 static const char *dreg[] = {
     "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7" };
 static const char *areg[] = {
@@ -102,6 +146,70 @@ static void acct_cycles_for_mem_access(
     c->cycles += (bytes == 4) ? 8 : 4;
 }
 
+static struct m68k_icache_entry *icache_entry(
+    struct m68k_icache *ic, uint32_t pc)
+{
+    return &ic->entry[(pc >> 1) & (M68K_ICACHE_ENTRIES - 1)];
+}
+
+/* The code-page bitmap marks pages which have ever held a cached insn, so
+ * that most data writes need not probe the cache. Addresses are as seen on
+ * the 68000's 24-bit bus. */
+static int icache_code_page(struct m68k_icache *ic, uint32_t addr)
+{
+    addr = (addr & 0xffffff) >> M68K_ICACHE_PAGE_SHIFT;
+    return (ic->code_page[addr / 8] >> (addr & 7)) & 1;
+}
+
+static void icache_set_code_page(struct m68k_icache *ic, uint32_t addr)
+{
+    addr = (addr & 0xffffff) >> M68K_ICACHE_PAGE_SHIFT;
+    ic->code_page[addr / 8] |= 1u << (addr & 7);
+}
+
+static void icache_invalidate(
+    struct m68k_icache *ic, uint32_t addr, unsigned int bytes)
+{
+    struct m68k_icache_entry *e;
+    uint32_t pc, end;
+
+    /* An entry covers an insn of at most ten bytes and the two words
+     * prefetched after it: only those starting at or after addr-12 can
+     * overlap. */
+    addr &= 0xffffff;
+    end = addr + bytes;
+    for (pc = (addr < 12) ? 0 : (addr - 12) & ~1u; pc < end; pc += 2) {
+        e = icache_entry(ic, pc);
+        if (e->execute && (e->pc == pc) && ((pc + e->op_words*2 + 4) > addr))
+            e->execute = NULL;
+    }
+}
+
+static void icache_write(
+    struct m68k_icache *ic, uint32_t addr, unsigned int bytes)
+{
+    if (icache_code_page(ic, addr) || icache_code_page(ic, addr + bytes - 1))
+        icache_invalidate(ic, addr, bytes);
+}
+
+void m68k_icache_invalidate(
+    struct m68k_emulate_ctxt *c, uint32_t addr, unsigned int bytes)
+{
+    if (c->icache)
+        icache_invalidate(c->icache, addr, bytes);
+}
+
+void m68k_icache_flush(struct m68k_emulate_ctxt *c)
+{
+    struct m68k_icache *ic = c->icache;
+    unsigned int i;
+    if (!ic)
+        return;
+    for (i = 0; i < M68K_ICACHE_ENTRIES; i++)
+        ic->entry[i].execute = NULL;
+    memset(ic->code_page, 0, sizeof(ic->code_page));
+}
+
 static int fetch(
     uint32_t *val, unsigned int bytes,
     struct m68k_emulate_ctxt *c)
@@ -169,6 +277,8 @@ static int write(
         return M68KEMUL_SKIP_EMULATION;
     bail_if(rc = check_addr_align(c, addr, bytes, access_write));
     bail_if(rc = c->ops->write(addr, val, bytes, c));
+    if (c->icache)
+        icache_write(c->icache, addr, bytes);
     acct_cycles_for_mem_access(c, bytes);
 bail:
     return rc;
@@ -240,33 +350,100 @@ static int deliver_exception(struct m68k_emulate_ctxt *c)
     return m68k_deliver_exception(c, &c->p->exception);
 }
 
+/* Condition codes are evaluated lazily: flag-setting ALU ops record their
+ * operands in c->cc, and the CCR bits are computed only when SR is next read
+ * or modified. cc_op_flags[] lists the CCR bits each op defines. */
+enum { CC_OP_NONE, CC_OP_MOV, CC_OP_CMP, CC_OP_SUB, CC_OP_ADD };
+static const uint16_t cc_op_flags[] = {
+    [CC_OP_NONE] = 0,
+    [CC_OP_MOV]  = CC_N|CC_Z|CC_V|CC_C,
+    [CC_OP_CMP]  = CC_N|CC_Z|CC_V|CC_C,
+    [CC_OP_SUB]  = CC_X|CC_N|CC_Z|CC_V|CC_C,
+    [CC_OP_ADD]  = CC_X|CC_N|CC_Z|CC_V|CC_C
+};
+
+static void cc_eval(struct m68k_emulate_ctxt *c, uint16_t *psr)
+{
+    struct m68k_lazy_cc *cc = &c->cc;
+    uint32_t msb, s = cc->src, d = cc->dst, r = cc->res;
+    uint16_t sr;
+
+    if (cc->op == CC_OP_NONE)
+        return;
+
+    msb = sz_msb(cc->sz);
+    sr = *psr & ~cc_op_flags[cc->op];
+    if (r & msb)
+        sr |= CC_N;
+    if ((r & sz_mask(cc->sz)) == 0)
+        sr |= CC_Z;
+
+    switch (cc->op) {
+    case CC_OP_CMP:
+    case CC_OP_SUB:
+        if (((s ^ d) & msb) && ((d ^ r) & msb))
+            sr |= CC_V;
+        if ((s & ~d & msb) || (r & ~d & msb) || (s & r & msb))
+            sr |= (cc->op == CC_OP_SUB) ? CC_X|CC_C : CC_C;
+        break;
+    case CC_OP_ADD:
+        if (!((s ^ d) & msb) && ((d ^ r) & msb))
+            sr |= CC_V;
+        if ((s & d & msb) || (s & ~r & msb) || (d & ~r & msb))
+            sr |= CC_X|CC_C;
+        break;
+    }
+
+    *psr = sr;
+    cc->op = CC_OP_NONE;
+}
+
+static uint16_t *cc_sync(struct m68k_emulate_ctxt *c)
+{
+    cc_eval(c, &sh_reg(c, sr));
+    return &sh_reg(c, sr);
+}
+
+static always_inline void cc_set(
+    struct m68k_emulate_ctxt *c, uint8_t op,
+    uint32_t s, uint32_t d, uint32_t r, const unsigned int sz)
+{
+    /* Flags the pending op defines and this one does not (i.e., X) must be
+     * materialised now, before the record is overwritten. */
+    if (cc_op_flags[c->cc.op] & ~cc_op_flags[op])
+        cc_eval(c, &sh_reg(c, sr));
+    c->cc.op = op;
+    c->cc.sz = sz;
+    c->cc.src = s;
+    c->cc.dst = d;
+    c->cc.res = r;
+}
+
 static void update_sr(struct m68k_emulate_ctxt *c, uint16_t new_sr)
 {
-    uint16_t old_sr = sh_reg(c, sr);
+    uint16_t old_sr = sh_sr(c);
     if ((old_sr ^ new_sr) & SR_S) {
         uint32_t xsp = sh_reg(c, a[7]);
         sh_reg(c, a[7]) = sh_reg(c, xsp);
         sh_reg(c, xsp) = xsp;
     }
-    sh_reg(c, sr) = new_sr;
+    sh_sr(c) = new_sr;
+}
+
+static always_inline void cc_mov_sz(
+    struct m68k_emulate_ctxt *c, uint32_t result, const unsigned int sz)
+{
+    cc_set(c, CC_OP_MOV, 0, 0, result, sz);
 }
 
 static void cc_mov(struct m68k_emulate_ctxt *c, uint32_t result)
 {
-    uint16_t sr = sh_reg(c, sr);
-    sr &= ~(CC_N|CC_Z|CC_V|CC_C);
-    if (c->op_sz == OPSZ_W)
-        result = (int16_t)result;
-    else if (c->op_sz == OPSZ_B)
-        result = (int8_t)result;
-    sr |= result & (1u<<31) ? CC_N : 0;
-    sr |= result == 0 ? CC_Z : 0;
-    sh_reg(c, sr) = sr;
+    cc_mov_sz(c, result, c->op_sz);
 }
 
 static int cc_eval_condition(struct m68k_emulate_ctxt *c, uint8_t cond)
 {
-    uint8_t cc = c->regs->sr;
+    uint8_t cc = ((cond >> 1) & 7) ? sh_sr(c) : 0;
     int r = 0;
 
     switch ((cond >> 1) & 7) {
@@ -288,9 +465,19 @@ static int cc_eval_condition(struct m68k_emulate_ctxt *c, uint8_t cond)
     return (cond & 1) ? !r : r;
 }
 
+/* Index register contribution of a brief extension word. */
+static int32_t ea_index(struct m68k_emulate_ctxt *c, uint16_t ext)
+{
+    int32_t idx = (ext & (1u<<15) ? sh_reg(c,a) : sh_reg(c,d))[(ext>>12)&7];
+    if (!(ext & (1u<<11)))
+        idx = (int16_t)idx;
+    return idx << ((ext>>9)&3);
+}
+
 static int decode_ea(struct m68k_emulate_ctxt *c)
 {
     struct operand *op = &c->p->operand;
+    struct m68k_icache_ea ea;
     const char *name;
     uint8_t mode, reg;
     int rc = 0;
@@ -298,6 +485,9 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
     op->type = OP_MEM; /* most common */
     mode = (c->op[0] >> 3) & 7;
     reg = c->op[0] & 7;
+    ea.mode = mode;
+    ea.reg = reg;
+    ea.step = ea.ext = ea.val = 0;
 
     switch (mode) {
     case 0:
@@ -318,25 +508,27 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
         dump(c, "(%s)", areg[reg]);
         break;
     case 3:
+        ea.step = sz_step(c->op_sz);
+        if ((reg == 7) && (c->op_sz == OPSZ_B))
+            ea.step++; /* keep sp word-aligned */
         op->reg = &sh_reg(c, a[reg]);
         op->mem = *op->reg;
-        *op->reg += (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
-        if ((reg == 7) && (c->op_sz == OPSZ_B))
-            (*op->reg)++; /* keep sp word-aligned */
+        *op->reg += ea.step;
         dump(c, "(%s)+", areg[reg]);
         break;
     case 4:
-        op->reg = &sh_reg(c, a[reg]);
-        op->mem = *op->reg -=
-            (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
+        ea.step = sz_step(c->op_sz);
         if ((reg == 7) && (c->op_sz == OPSZ_B))
-            op->mem = --(*op->reg); /* keep sp word-aligned */
+            ea.step++; /* keep sp word-aligned */
+        op->reg = &sh_reg(c, a[reg]);
+        op->mem = *op->reg -= ea.step;
         dump(c, "-(%s)", areg[reg]);
         break;
     case 5: {
         int32_t disp;
         bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_W));
         op->mem = sh_reg(c, a[reg]) + disp;
+        ea.val = disp;
         if ((name = addr_name(c, op->mem)) != NULL)
             dump(c, "%s", name);
         else if (disp < 0)
@@ -350,13 +542,10 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
         uint16_t ext;
         bail_if(rc = fetch_insn_word(c, &ext));
         if (!(ext & (1u << 8))) {
-            int32_t idx = (ext & (1u<<15) ? sh_reg(c,a) : sh_reg(c,d))[
-                (ext>>12)&7];
             int8_t disp = (int8_t)ext;
-            if (!(ext & (1u<<11)))
-                idx = (int16_t)idx;
-            idx <<= (ext>>9)&3;
-            op->mem = sh_reg(c, a[reg]) + disp + idx;
+            op->mem = sh_reg(c, a[reg]) + disp + ea_index(c, ext);
+            ea.ext = ext;
+            ea.val = disp;
             if (disp < 0) {
                 dump(c, "-");
                 disp = -disp;
@@ -371,6 +560,7 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
         break;
     }
     case 7: {
+        ea.mode = ICACHE_EA_ABS;
         switch (reg) {
         case 0:
             bail_if(rc = fetch_insn_sbytes(c, (int32_t *)&op->mem, OPSZ_W));
@@ -397,12 +587,10 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
             bail_if(rc = fetch_insn_word(c, &ext));
             target += (int8_t)ext;
             if (!(ext & (1u << 8))) {
-                int32_t idx = (ext & (1u<<15) ? sh_reg(c,a) : sh_reg(c,d))[
-                    (ext>>12)&7];
-                if (!(ext & (1u<<11)))
-                    idx = (int16_t)idx;
-                idx <<= (ext>>9)&3;
-                op->mem = target + idx;
+                op->mem = target + ea_index(c, ext);
+                ea.mode = ICACHE_EA_PCINDEX;
+                ea.ext = ext;
+                ea.val = target;
                 dump(c, "%04x(pc,%s.%c*%u)", target,
                      (ext & (1u<<15) ? areg : dreg)[(ext>>12)&7],
                      ext & (1u<<11) ? 'l' : 'w', 1u << ((ext>>9)&3));
@@ -415,6 +603,7 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
         case 4:
             op->type = OP_IMM;
             bail_if(rc = fetch_insn_ubytes(c, &op->val, c->op_sz));
+            ea.mode = ICACHE_EA_IMM;
             dump(c, "#%x", op->val);
             break;
         default:
@@ -422,9 +611,17 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
             raise_exception(M68KVEC_illegal_insn);
             break;
         }
+        if (ea.mode == ICACHE_EA_ABS)
+            ea.val = op->mem;
+        else if (ea.mode == ICACHE_EA_IMM)
+            ea.val = op->val;
     }
     }
 
+    /* Record the operand in case the insn is cached. */
+    if ((rc == 0) && (c->p->nr_ea < 2))
+        c->p->ea[c->p->nr_ea++] = ea;
+
 bail:
     return rc;
 }
@@ -437,35 +634,32 @@ static int decode_mem_ea(struct m68k_emulate_ctxt *c)
     return rc;
 }
 
-static int read_ea(struct m68k_emulate_ctxt *c)
+/* The EA and ALU helpers below are generic in the operand size @sz. They
+ * are inlined into the per-size execute stages with a constant @sz, and into
+ * out-of-line wrappers, taking c->op_sz, for everything else. */
+
+static always_inline int read_ea_sz(
+    struct m68k_emulate_ctxt *c, const unsigned int sz)
 {
     struct operand *op = &c->p->operand;
-    unsigned int bytes;
     int rc = 0;
 
-    bytes = ((c->op_sz == OPSZ_B) ? 1 :
-             (c->op_sz == OPSZ_W) ? 2 :
-             (c->op_sz == OPSZ_L) ? 4 : 0);
-    if (!bytes)
+    if (sz == OPSZ_X)
         return M68KEMUL_UNHANDLEABLE;
 
     switch (op->type) {
     case OP_MEM:
-        rc = read(op->mem, &op->val, bytes, c);
+        rc = read(op->mem, &op->val, sz_bytes(sz), c);
         break;
     case OP_REG:
-        op->val = *op->reg;
-        if (bytes == 1)
-            op->val = (uint8_t)op->val;
-        else if (bytes == 2)
-            op->val = (uint16_t)op->val;
+        op->val = *op->reg & sz_mask(sz);
         break;
     case OP_IMM:
         /* already in op->val */
         break;
     case OP_SR:
-        op->val = sh_reg(c, sr);
-        if (bytes == 1)
+        op->val = sh_sr(c);
+        if (sz == OPSZ_B)
             op->val = (uint8_t)op->val;
         break;
     }
@@ -473,30 +667,25 @@ static int read_ea(struct m68k_emulate_ctxt *c)
     return rc;
 }
 
-static int write_ea(struct m68k_emulate_ctxt *c)
+static always_inline int write_ea_sz(
+    struct m68k_emulate_ctxt *c, const unsigned int sz)
 {
     struct operand *op = &c->p->operand;
-    unsigned int bytes;
     int rc = 0;
 
-    bytes = ((c->op_sz == OPSZ_B) ? 1 :
-             (c->op_sz == OPSZ_W) ? 2 :
-             (c->op_sz == OPSZ_L) ? 4 : 0);
-    if (!bytes)
+    if (sz == OPSZ_X)
         return M68KEMUL_UNHANDLEABLE;
 
     switch (op->type) {
     case OP_MEM:
-        rc = write(op->mem, op->val, bytes, c);
+        rc = write(op->mem, op->val, sz_bytes(sz), c);
         break;
     case OP_REG:
-        *op->reg = (bytes == 1 ? (*op->reg & ~0xffu) | (uint8_t)op->val :
-                    bytes == 2 ? (*op->reg & ~0xffffu) | (uint16_t)op->val :
-                    op->val);
+        *op->reg = (*op->reg & ~sz_mask(sz)) | (op->val & sz_mask(sz));
         break;
     case OP_SR:
-        if (bytes == 1)
-            sh_reg(c, sr) = (sh_reg(c, sr) & ~0xffu) | (uint8_t)op->val;
+        if (sz == OPSZ_B)
+            sh_sr(c) = (sh_sr(c) & ~0xffu) | (uint8_t)op->val;
         else
             update_sr(c, op->val);
         break;
@@ -508,65 +697,627 @@ static int write_ea(struct m68k_emulate_ctxt *c)
     return rc;
 }
 
-static uint32_t _op_sub(struct m68k_emulate_ctxt *c, uint32_t s, uint32_t d)
+static always_inline void op_cmp_sz(
+    struct m68k_emulate_ctxt *c, uint32_t s, uint32_t d,
+    const unsigned int sz)
 {
-    uint32_t msb, r;
-    uint16_t sr;
+    cc_set(c, CC_OP_CMP, s, d, d - s, sz);
+}
 
-    msb = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
-    r = d - s;
+static always_inline int op_sub_sz(
+    struct m68k_emulate_ctxt *c, uint32_t s, const unsigned int sz)
+{
+    uint32_t d = c->p->operand.val;
+    c->p->operand.val = d - s;
+    cc_set(c, CC_OP_SUB, s, d, d - s, sz);
+    return write_ea_sz(c, sz);
+}
 
-    sr = sh_reg(c, sr) & ~(CC_N|CC_Z|CC_V|CC_C);
-    if (r & msb)
-        sr |= CC_N;
-    if ((r & ((msb<<1)-1)) == 0)
-        sr |= CC_Z;
-    if (((s ^ d) & msb) && ((d ^ r) & msb))
-        sr |= CC_V;
-    if ((s & ~d & msb) || (r & ~d & msb) || (s & r & msb))
-        sr |= CC_C;
-    sh_reg(c, sr) = sr;
+static always_inline int op_add_sz(
+    struct m68k_emulate_ctxt *c, uint32_t s, const unsigned int sz)
+{
+    uint32_t d = c->p->operand.val;
+    c->p->operand.val = d + s;
+    cc_set(c, CC_OP_ADD, s, d, d + s, sz);
+    return write_ea_sz(c, sz);
+}
 
-    return r;
+static int read_ea(struct m68k_emulate_ctxt *c)
+{
+    return read_ea_sz(c, c->op_sz);
 }
 
-static void op_cmp(struct m68k_emulate_ctxt *c, uint32_t s, uint32_t d)
+static int write_ea(struct m68k_emulate_ctxt *c)
 {
-    (void)_op_sub(c, s, d);
+    return write_ea_sz(c, c->op_sz);
 }
 
 static int op_sub(struct m68k_emulate_ctxt *c, uint32_t s)
 {
-    c->p->operand.val = _op_sub(c, s, c->p->operand.val);
-    sh_reg(c, sr) &= ~CC_X;
-    if (sh_reg(c, sr) & CC_C)
-        sh_reg(c, sr) |= CC_X;
-    return write_ea(c);
+    return op_sub_sz(c, s, c->op_sz);
 }
 
 static int op_add(struct m68k_emulate_ctxt *c, uint32_t s)
 {
-    uint32_t msb, d, r;
-    uint16_t sr;
+    return op_add_sz(c, s, c->op_sz);
+}
 
-    msb = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
-    d = c->p->operand.val;
-    r = d + s;
+/* Execute stages: each completes an insn whose operands decode_ea() (or a
+ * decoded-insn cache hit) has left in c->p. Those run via execute() may be
+ * cached, so they must depend on nothing else that decode computed. */
 
-    sr = sh_reg(c, sr) & ~(CC_X|CC_N|CC_Z|CC_V|CC_C);
-    if (r & msb)
-        sr |= CC_N;
-    if ((r & ((msb<<1)-1)) == 0)
-        sr |= CC_Z;
-    if (!((s ^ d) & msb) && ((d ^ r) & msb))
-        sr |= CC_V;
-    if ((s & d & msb) || (s & ~r & msb) || (d & ~r & msb))
-        sr |= CC_C | CC_X;
-    sh_reg(c, sr) = sr;
+/* Run an execute stage, noting it for the decoded-instruction cache. */
+static int execute(
+    struct m68k_emulate_ctxt *c,
+    int (*fn)(struct m68k_emulate_ctxt *, uint16_t op, uint32_t imm),
+    uint16_t op, uint32_t imm)
+{
+    c->p->execute = fn;
+    c->p->execute_sz = c->op_sz;
+    c->p->imm = imm;
+    return fn(c, op, imm);
+}
+
+static int exec_unsized(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    return M68KEMUL_UNHANDLEABLE;
+}
+
+/* Sized execute stages take the operand size as a constant @sz. Generate a
+ * variant for each size, and a table by which decode selects one from
+ * op_sz, so that an executing insn never dispatches on its size. */
+#define _exec_sized(name)                                               \
+static int name##_b(struct m68k_emulate_ctxt *c, uint16_t op,           \
+                    uint32_t imm)                                       \
+{                                                                       \
+    return name(c, op, imm, OPSZ_B);                                    \
+}                                                                       \
+static int name##_w(struct m68k_emulate_ctxt *c, uint16_t op,           \
+                    uint32_t imm)                                       \
+{                                                                       \
+    return name(c, op, imm, OPSZ_W);                                    \
+}                                                                       \
+static int name##_l(struct m68k_emulate_ctxt *c, uint16_t op,           \
+                    uint32_t imm)                                       \
+{                                                                       \
+    return name(c, op, imm, OPSZ_L);                                    \
+}                                                                       \
+static int (*const name##_sz[])(                                        \
+    struct m68k_emulate_ctxt *, uint16_t op, uint32_t imm) = {          \
+    name##_b, name##_w, name##_l, exec_unsized }
+
+/* addi/andi/cmpi/eori/ori/subi */
+static always_inline int exec_imm_alu(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
 
+    bail_if(rc = read_ea_sz(c, sz));
+    switch ((op >> 9) & 7) {
+    case 0: /* or */
+        c->p->operand.val |= imm;
+        cc_mov_sz(c, c->p->operand.val, sz);
+        bail_if(rc = write_ea_sz(c, sz));
+        break;
+    case 1: /* and */
+        c->p->operand.val &= imm;
+        cc_mov_sz(c, c->p->operand.val, sz);
+        bail_if(rc = write_ea_sz(c, sz));
+        break;
+    case 2: /* sub */
+        bail_if(rc = op_sub_sz(c, imm, sz));
+        break;
+    case 3: /* add */
+        bail_if(rc = op_add_sz(c, imm, sz));
+        break;
+    case 5: /* eor */
+        c->p->operand.val ^= imm;
+        cc_mov_sz(c, c->p->operand.val, sz);
+        bail_if(rc = write_ea_sz(c, sz));
+        break;
+    case 6: /* cmp */
+        op_cmp_sz(c, imm, c->p->operand.val, sz);
+        break;
+    default:
+        rc = M68KEMUL_UNHANDLEABLE;
+        break;
+    }
+
+bail:
+    return rc;
+}
+_exec_sized(exec_imm_alu);
+
+/* bchg/bclr/bset/btst: bit number in Dn, else in @imm. */
+static always_inline int exec_bitop(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    uint32_t idx = (op & (1u<<8)) ? sh_reg(c, d[(op>>9)&7]) : imm;
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    idx &= sz == OPSZ_B ? 7 : 31;
+    sh_sr(c) &= ~CC_Z;
+    if (!(c->p->operand.val & (1u<<idx)))
+        sh_sr(c) |= CC_Z;
+    switch ((op >> 6 ) & 3) {
+    case 1: c->p->operand.val ^= 1u << idx; break;
+    case 2: c->p->operand.val &= ~(1u << idx); break;
+    case 3: c->p->operand.val |= 1u << idx; break;
+    }
+    bail_if(((op >> 6) & 3) && (rc = write_ea_sz(c, sz)));
+
+bail:
+    return rc;
+}
+_exec_sized(exec_bitop);
+
+/* Most move instructions perform the second prefetch after writeback.
+ * We simulate this by discarding our second word of prefetch. */
+static void move_prefetch(struct m68k_emulate_ctxt *c)
+{
+    if (c->prefetch_valid > 1)
+        c->prefetch_valid = 1;
+}
+
+/* move: source operand in c->p->src. */
+static always_inline int exec_move(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    struct operand dst = c->p->operand;
+    int rc;
+
+    c->p->operand = c->p->src;
+    bail_if(rc = read_ea_sz(c, sz));
+    dst.val = c->p->operand.val;
+    c->p->operand = dst;
+    bail_if(rc = write_ea_sz(c, sz));
+    cc_mov_sz(c, dst.val, sz);
+    move_prefetch(c);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_move);
+
+static always_inline int exec_movea(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    if (sz == OPSZ_W) {
+        c->p->operand.val = (int16_t)c->p->operand.val;
+        c->op_sz = OPSZ_L;
+    }
+    sh_reg(c, a[(op>>9)&7]) = c->p->operand.val;
+    move_prefetch(c);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_movea);
+
+static int exec_nop(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    return 0;
+}
+
+static int exec_rts(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    int rc;
+
+    bail_if(rc = read(sh_reg(c,a[7]), &sh_reg(c, pc), 4, c));
+    sh_reg(c, a[7]) += 4;
+
+bail:
+    return rc;
+}
+
+static int exec_swap(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    uint32_t *reg = &sh_reg(c, d[op&7]);
+    *reg = (*reg << 16) | (uint16_t)(*reg >> 16);
+    cc_mov(c, *reg);
+    return 0;
+}
+
+static int exec_ext(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    uint32_t *reg = &sh_reg(c, d[op&7]);
+    *reg = (c->op_sz == OPSZ_W
+            ? (*reg & ~0xffffu) | (uint16_t)(int8_t)*reg
+            : (int16_t)*reg);
+    cc_mov(c, *reg);
+    return 0;
+}
+
+static always_inline int exec_clr(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    c->p->operand.val = 0;
+    bail_if(rc = write_ea_sz(c, sz));
+    sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
+    sh_sr(c) |= CC_Z;
+
+bail:
+    return rc;
+}
+_exec_sized(exec_clr);
+
+/* jmp/jsr */
+static int exec_jmp(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    int rc = 0;
+
+    if (!(op & (1u<<6))) {
+        /* push return address (current pc) */
+        sh_reg(c, a[7]) -= 4;
+        bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
+    }
+    /* update pc to jump target */
+    sh_reg(c, pc) = c->p->operand.mem;
+
+bail:
+    return rc;
+}
+
+static int exec_lea(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    sh_reg(c, a[(op>>9)&7]) = c->p->operand.mem;
+    return 0;
+}
+
+static int exec_pea(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    sh_reg(c, a[7]) -= 4;
+    return write(sh_reg(c, a[7]), c->p->operand.mem, 4, c);
+}
+
+static always_inline int exec_neg(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    uint32_t s;
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    s = c->p->operand.val;
+    c->p->operand.val = 0;
+    rc = op_sub_sz(c, s, sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_neg);
+
+static always_inline int exec_not(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    c->p->operand.val = ~c->p->operand.val;
+    cc_mov_sz(c, c->p->operand.val, sz);
+    rc = write_ea_sz(c, sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_not);
+
+static always_inline int exec_tst(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    cc_mov_sz(c, c->p->operand.val, sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_tst);
+
+/* addq/subq #@imm */
+static always_inline int exec_addq(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    if (((op >> 3) & 7) == 1) {
+        /* adda/suba semantics */
+        uint32_t *reg = c->p->operand.reg;
+        c->op_sz = OPSZ_L;
+        *reg = op & (1u<<8) ? *reg - imm : *reg + imm;
+    } else {
+        bail_if(rc = ((op & (1u<<8))
+                      ? op_sub_sz(c, imm, sz) : op_add_sz(c, imm, sz)));
+    }
+
+bail:
+    return rc;
+}
+_exec_sized(exec_addq);
+
+/* dbcc: branch target in @imm */
+static int exec_dbcc(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    if (!cc_eval_condition(c, (op >> 8) & 0xf)) {
+        uint32_t *reg = &sh_reg(c, d[op&7]);
+        *reg = (*reg & ~0xffffu) | (uint16_t)(*reg - 1);
+        if ((int16_t)*reg != -1)
+            sh_reg(c, pc) = imm;
+    }
+    return 0;
+}
+
+static int exec_scc(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    c->p->operand.val = cc_eval_condition(c, (op >> 8) & 0xf) ? ~0 : 0;
+    return write_ea_sz(c, OPSZ_B);
+}
+
+/* bcc/bra/bsr: branch target in @imm */
+static int exec_bcc(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    uint8_t cond = (op >> 8) & 0xf;
+    int rc = 0;
+
+    if (cond == 1) {
+        /* bsr: push return address (current pc) onto stack */
+        sh_reg(c, a[7]) -= 4;
+        bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
+    } else if (!cc_eval_condition(c, cond))
+        goto bail; /* bcc condition is false: no branch */
+    sh_reg(c, pc) = imm;
+
+bail:
+    return rc;
+}
+
+static int exec_moveq(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    uint32_t *reg = &sh_reg(c, d[(op>>9)&7]);
+    *reg = (int8_t)op;
+    cc_mov(c, *reg);
+    return 0;
+}
+
+static always_inline int exec_cmpa(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    if (sz == OPSZ_W) {
+        c->p->operand.val = (int16_t)c->p->operand.val;
+        c->op_sz = OPSZ_L;
+    }
+    op_cmp_sz(c, c->p->operand.val, sh_reg(c, a[(op>>9)&7]),
+              (sz == OPSZ_W) ? OPSZ_L : sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_cmpa);
+
+static always_inline int exec_cmp(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    op_cmp_sz(c, c->p->operand.val, sh_reg(c, d[(op>>9)&7]), sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_cmp);
+
+static always_inline int exec_eor(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    c->p->operand.val ^= sh_reg(c, d[(op>>9)&7]);
+    cc_mov_sz(c, c->p->operand.val, sz);
+    rc = write_ea_sz(c, sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_eor);
+
+static int exec_exg(struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm)
+{
+    uint32_t *r1, *r2, t;
+    r1 = ((op & 0xf8u) == 0x48u ? sh_reg(c,a) : sh_reg(c,d));
+    r2 = ((op & 0xf8u) == 0x40u ? sh_reg(c,d) : sh_reg(c,a));
+    r1 += (op >> 9) & 7;
+    r2 += op & 7;
+    t = *r1;
+    *r1 = *r2;
+    *r2 = t;
+    return 0;
+}
+
+/* and/or: <ea> is the destination iff op[8] */
+static always_inline int exec_andor(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    uint32_t r, *reg = &sh_reg(c, d[(op>>9)&7]);
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    r = op & (1u<<14) ?
+        c->p->operand.val & *reg : c->p->operand.val | *reg;
+    cc_mov_sz(c, r, sz);
+    if (!(op & (1u<<8))) {
+        c->p->operand.type = OP_REG;
+        c->p->operand.reg = reg;
+    }
     c->p->operand.val = r;
-    return write_ea(c);
+    rc = write_ea_sz(c, sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_andor);
+
+/* adda/suba */
+static always_inline int exec_adda(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    uint32_t r, *reg = &sh_reg(c, a[(op>>9)&7]);
+    int rc;
+
+    bail_if(rc = read_ea_sz(c, sz));
+    r = c->p->operand.val;
+    if (sz == OPSZ_W) {
+        r = (int16_t)r;
+        c->op_sz = OPSZ_L;
+    }
+    *reg = op & (1u<<14) ? *reg + r : *reg - r;
+
+bail:
+    return rc;
+}
+_exec_sized(exec_adda);
+
+/* add/sub: <ea> is the destination iff op[8] */
+static always_inline int exec_addsub(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    uint32_t op1, *reg = &sh_reg(c, d[(op>>9)&7]);
+    int rc;
+
+    op1 = *reg;
+    bail_if(rc = read_ea_sz(c, sz));
+    if (!(op & (1u<<8))) {
+        op1 = c->p->operand.val;
+        c->p->operand.type = OP_REG;
+        c->p->operand.reg = reg;
+        c->p->operand.val = *reg;
+    }
+    rc = ((op & (1u<<14))
+          ? op_add_sz(c, op1, sz) : op_sub_sz(c, op1, sz));
+
+bail:
+    return rc;
 }
+_exec_sized(exec_addsub);
+
+/* asl/asr/lsl/lsr/rol/ror/roxl/roxr */
+static always_inline int exec_shift(
+    struct m68k_emulate_ctxt *c, uint16_t op, uint32_t imm,
+    const unsigned int sz)
+{
+    uint32_t m, v;
+    uint8_t x, typ, cnt;
+    int rc;
+
+    if ((op & 0xc0u) == 0xc0u) {
+        /* shift/rotate <ea> */
+        typ = (op >> 9) & 3;
+        cnt = 1;
+    } else {
+        /* shift/rotate <dn> */
+        typ = (op >> 3) & 3;
+        if (op & (1u<<5))
+            cnt = sh_reg(c, d[(op>>9)&7]) & 63;
+        else
+            cnt = (op >> 9) & 7 ?: 8;
+        c->p->operand.type = OP_REG;
+        c->p->operand.reg = &sh_reg(c, d[op&7]);
+    }
+    bail_if(rc = read_ea_sz(c, sz));
+    v = c->p->operand.val;
+    m = sz_msb(sz);
+    sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
+    while (cnt--) {
+        switch ((typ << 1) | ((op >> 8) & 1)) {
+        case 0: /* asr */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & 1)
+                sh_sr(c) |= CC_X|CC_C;
+            v = (v >> 1) | (v & m);
+            break;
+        case 1: /* asl */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & m)
+                sh_sr(c) |= CC_X|CC_C;
+            if ((v ^ (v << 1)) & m)
+                sh_sr(c) |= CC_V;
+            v = (v << 1);
+            break;
+        case 2: /* lsr */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & 1)
+                sh_sr(c) |= CC_X|CC_C;
+            v = (v >> 1);
+            break;
+        case 3: /* lsl */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & m)
+                sh_sr(c) |= CC_X|CC_C;
+            v = (v << 1);
+            break;
+        case 4: /* roxr */
+            x = !!(v & 1);
+            v = (v >> 1) | (sh_sr(c) & CC_X ? m : 0);
+            sh_sr(c) &= ~CC_X;
+            sh_sr(c) |= x ? CC_X : 0;
+            break;
+        case 5: /* roxl */
+            x = !!(v & m);
+            v = (v << 1) | (sh_sr(c) & CC_X ? 1 : 0);
+            sh_sr(c) &= ~CC_X;
+            sh_sr(c) |= x ? CC_X : 0;
+            break;
+        case 6: /* ror */
+            sh_sr(c) &= ~CC_C;
+            if (v & 1)
+                sh_sr(c) |= CC_C;
+            v = (v >> 1) | (sh_sr(c) & CC_C ? m : 0);
+            break;
+        case 7: /* rol */
+            sh_sr(c) &= ~CC_C;
+            if (v & m)
+                sh_sr(c) |= CC_C;
+            v = (v << 1) | (sh_sr(c) & CC_C ? 1 : 0);
+            break;
+        }
+    }
+    if (typ == 2) /* roxl/roxr */
+        sh_sr(c) |= sh_sr(c) & CC_X ? CC_C : 0;
+    v &= (m << 1) - 1;
+    sh_sr(c) |= (v == 0 ? CC_Z : 0) | (v & m ? CC_N : 0);
+    c->p->operand.val = v;
+    rc = write_ea_sz(c, sz);
+
+bail:
+    return rc;
+}
+_exec_sized(exec_shift);
 
 static int misc_insn(struct m68k_emulate_ctxt *c)
 {
@@ -592,19 +1343,20 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
     } else if (op == 0x4e71u) {
         /* nop */
         dump(c, "nop");
+        rc = execute(c, exec_nop, op, 0);
     } else if (op == 0x4e72u) {
         /* stop */
         uint16_t data;
         bail_if(rc = fetch_insn_word(c, &data));
         dump(c, "stop\t#%x", data);
-        raise_exception_if(!(sh_reg(c, sr) & SR_S), M68KVEC_priv_violation);
+        raise_exception_if(!(sh_sr(c) & SR_S), M68KVEC_priv_violation);
         update_sr(c, data);
         /* should wait for an interrupt/exception... */
     } else if (op == 0x4e73u) {
         /* rte */
         uint32_t new_pc, new_sr;
         dump(c, "rte");
-        raise_exception_if(!(sh_reg(c, sr) & SR_S), M68KVEC_priv_violation);
+        raise_exception_if(!(sh_sr(c) & SR_S), M68KVEC_priv_violation);
         bail_if(rc = read(sh_reg(c, a[7]) + 2, &new_pc, 4, c));
         bail_if(rc = read(sh_reg(c, a[7]) + 0, &new_sr, 2, c));
         sh_reg(c, a[7]) += 6;
@@ -624,12 +1376,11 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
     } else if (op == 0x4e75u) {
         /* rts */
         dump(c, "rts");
-        bail_if(rc = read(sh_reg(c,a[7]), &sh_reg(c, pc), 4, c));
-        sh_reg(c, a[7]) += 4;
+        rc = execute(c, exec_rts, op, 0);
     } else if (op == 0x4e76u) {
         /* trapv */
         dump(c, "trapv");
-        raise_exception_if(sh_reg(c, sr) & CC_V, M68KVEC_trapcc_trapv);
+        raise_exception_if(sh_sr(c) & CC_V, M68KVEC_trapcc_trapv);
     } else if (op == 0x4e77u) {
         /* rtr */
         uint32_t new_pc, new_sr;
@@ -637,19 +1388,17 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         bail_if(rc = read(sh_reg(c, a[7]) + 2, &new_pc, 4, c));
         bail_if(rc = read(sh_reg(c, a[7]) + 0, &new_sr, 2, c));
         sh_reg(c, a[7]) += 6;
-        sh_reg(c, sr) &= ~0xffu;
-        sh_reg(c, sr) |= (uint8_t)new_sr;
+        sh_sr(c) &= ~0xffu;
+        sh_sr(c) |= (uint8_t)new_sr;
         sh_reg(c, pc) = new_pc;
     }
 
     /* 2. Exact matches with no invalid cases. */
     else if ((op & 0xfff8u) == 0x4840u) {
         /* swap */
-        uint32_t *reg = &sh_reg(c, d[op&7]);
         c->op_sz = OPSZ_L;
         dump(c, "swap\t%s", dreg[op&7]);
-        *reg = (*reg << 16) | (uint16_t)(*reg >> 16);
-        cc_mov(c, *reg);
+        rc = execute(c, exec_swap, op, 0);
     } else if ((op & 0xfff8u) == 0x4848u) {
         /* bkpt */
         dump(c, "bkpt\t#%x", op&7);
@@ -700,10 +1449,7 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         /* clr */
         dump(c, "clr.%c\t", op_sz_ch[c->op_sz]);
         bail_if(rc = decode_ea(c));
-        c->p->operand.val = 0;
-        bail_if(rc = write_ea(c));
-        sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
-        sh_reg(c, sr) |= CC_Z;
+        rc = execute(c, exec_clr_sz[c->op_sz], op, 0);
     } else if ((op & 0xffc0u) == 0x4c40u) {
         /* divs/divu.l */
         uint16_t ext, dr, dq, sz;
@@ -722,37 +1468,27 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         rc = M68KEMUL_UNHANDLEABLE;
     } else if ((op & 0xffb8u) == 0x4880u) {
         /* ext */
-        uint32_t *reg = &sh_reg(c, d[op&7]);
         c->op_sz = (op & (1u<<6)) ? OPSZ_L : OPSZ_W;
         dump(c, "ext.%c\t%s", op_sz_ch[c->op_sz], dreg[op&7]);
-        *reg = (c->op_sz == OPSZ_W
-                ? (*reg & ~0xffffu) | (uint16_t)(int8_t)*reg
-                : (int16_t)*reg);
-        cc_mov(c, *reg);
+        rc = execute(c, exec_ext, op, 0);
     } else if ((op & 0xff80u) == 0x4e80u) {
         /* jmp/jsr */
         dump(c, "j%s\t", (op & (1u<<6)) ? "mp" : "sr");
         bail_if(rc = decode_mem_ea(c));
-        if (!(op & (1u<<6))) {
-            /* push return address (current pc) */
-            sh_reg(c, a[7]) -= 4;
-            bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
-        }
-        /* update pc to jump target */
-        sh_reg(c, pc) = c->p->operand.mem;
+        rc = execute(c, exec_jmp, op, 0);
     } else if ((op & 0xf1c0u) == 0x41c0u) {
         /* lea */
         c->op_sz = OPSZ_L;
         dump(c, "lea.l\t");
         bail_if(rc = decode_mem_ea(c));
         dump(c, ",%s", areg[(op>>9)&7]);
-        sh_reg(c, a[(op>>9)&7]) = c->p->operand.mem;
+        rc = execute(c, exec_lea, op, 0);
     } else if ((op & 0xfdc0u) == 0x40c0u) {
         /* move from ccr/sr */
         c->op_sz = OPSZ_W;
         dump(c, "move.w\t%s,", op & (1u<<9) ? "ccr" : "sr");
         bail_if(rc = decode_ea(c));
-        c->p->operand.val = sh_reg(c, sr);
+        c->p->operand.val = sh_sr(c);
         if (op & (1u<<9))
             c->p->operand.val = (uint8_t)c->p->operand.val;
         bail_if(rc = write_ea(c));
@@ -764,19 +1500,19 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         dump(c, ",%s", op & (1u<<9) ? "sr" : "ccr");
         bail_if(rc = read_ea(c));
         if (op & (1u<<9)) {
-            raise_exception_if(!(sh_reg(c, sr) & SR_S),
+            raise_exception_if(!(sh_sr(c) & SR_S),
                                M68KVEC_priv_violation);
             update_sr(c, c->p->operand.val);
         } else {
-            sh_reg(c, sr) &= ~0xffu;
-            sh_reg(c, sr) |= (uint8_t)c->p->operand.val;
+            sh_sr(c) &= ~0xffu;
+            sh_sr(c) |= (uint8_t)c->p->operand.val;
         }
     } else if ((op & 0xfff0u) == 0x4e60u) {
         /* move to/from usp */
         c->op_sz = OPSZ_L;
         dump(c, "move.l\t");
         dump(c, op&(1u<<3) ? "usp,%s" : "%s,usp", areg[op&7]);
-        raise_exception_if(!(sh_reg(c, sr) & SR_S), M68KVEC_priv_violation);
+        raise_exception_if(!(sh_sr(c) & SR_S), M68KVEC_priv_violation);
         if (op & (1u<<3))
             sh_reg(c, a[op&7]) = sh_reg(c, xsp);
         else
@@ -883,13 +1619,9 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
     } else if (((op & 0xff00u) == 0x4400u) &&
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* neg */
-        uint32_t s;
         dump(c, "neg.%c\t", op_sz_ch[c->op_sz]);
         bail_if(rc = decode_ea(c));
-        bail_if(rc = read_ea(c));
-        s = c->p->operand.val;
-        c->p->operand.val = 0;
-        rc = op_sub(c, s);
+        rc = execute(c, exec_neg_sz[c->op_sz], op, 0);
     } else if (((op & 0xff00u) == 0x4000u) &&
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* negx */
@@ -900,44 +1632,40 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         bail_if(rc = read_ea(c));
         s = c->p->operand.val;
         c->p->operand.val = 0;
-        sr = sh_reg(c, sr);
+        sr = sh_sr(c);
         bail_if(rc = op_sub(c, s));
         if (sr & CC_X) {
-            uint16_t sr2 = sh_reg(c, sr);
+            uint16_t sr2 = sh_sr(c);
             bail_if(rc = op_sub(c, 1));
             /* overflow and carry accumulate across the two subtracts */
-            sh_reg(c, sr) |= sr2 & (CC_X|CC_V|CC_C);
+            sh_sr(c) |= sr2 & (CC_X|CC_V|CC_C);
         }
         /* CC.Z is never set by this instruction, only cleared */
-        if ((sh_reg(c, sr) & CC_Z) && !(sr & CC_Z))
-            sh_reg(c, sr) &= ~CC_Z;
+        if ((sh_sr(c) & CC_Z) && !(sr & CC_Z))
+            sh_sr(c) &= ~CC_Z;
     } else if (((op & 0xff00u) == 0x4600u) &&
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* not */
         dump(c, "not.%c\t", op_sz_ch[c->op_sz]);
         bail_if(rc = decode_ea(c));
-        bail_if(rc = read_ea(c));
-        c->p->operand.val = ~c->p->operand.val;
-        cc_mov(c, c->p->operand.val);
-        rc = write_ea(c);
+        rc = execute(c, exec_not_sz[c->op_sz], op, 0);
     } else if ((op & 0xffc0u) == 0x4840u) {
         /* pea */
         c->op_sz = OPSZ_L;
         dump(c, "pea.l\t");
         bail_if(rc = decode_mem_ea(c));
-        sh_reg(c, a[7]) -= 4;
-        bail_if(rc = write(sh_reg(c, a[7]), c->p->operand.mem, 4, c));
+        rc = execute(c, exec_pea, op, 0);
     } else if ((op & 0xffc0u) == 0x4ac0u) {
         /* tas */
         c->op_sz = OPSZ_B;
         dump(c, "tas.b\t");
         bail_if(rc = decode_ea(c));
         bail_if(rc = read_ea(c));
-        sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
+        sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
         if (c->p->operand.val & 0x80)
-            sh_reg(c, sr) |= CC_N;
+            sh_sr(c) |= CC_N;
         if (!(c->p->operand.val & 0xff))
-            sh_reg(c, sr) |= CC_Z;
+            sh_sr(c) |= CC_Z;
         c->p->operand.val |= 0x80;
         bail_if(rc = write_ea(c));
     } else if ((op & 0xfff0u) == 0x4e40u) {
@@ -950,8 +1678,7 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         /* tst */
         dump(c, "tst.%c\t", op_sz_ch[c->op_sz]);
         bail_if(rc = decode_ea(c));
-        bail_if(rc = read_ea(c));
-        cc_mov(c, c->p->operand.val);
+        rc = execute(c, exec_tst_sz[c->op_sz], op, 0);
     } else {
     unknown:
         dump(c, "???");
@@ -962,12 +1689,161 @@ bail:
     return rc;
 }
 
+/* Resolve a cached operand, as decode_ea() did when the insn was decoded. */
+static void icache_ea(
+    struct m68k_emulate_ctxt *c, const struct m68k_icache_ea *ea)
+{
+    struct operand *op = &c->p->operand;
+
+    op->type = OP_MEM;
+    switch (ea->mode) {
+    case 0:
+        op->type = OP_REG;
+        op->reg = &sh_reg(c, d[ea->reg]);
+        break;
+    case 1:
+        op->type = OP_REG;
+        op->reg = &sh_reg(c, a[ea->reg]);
+        break;
+    case 2:
+        op->reg = &sh_reg(c, a[ea->reg]);
+        op->mem = *op->reg;
+        break;
+    case 3:
+        op->reg = &sh_reg(c, a[ea->reg]);
+        op->mem = *op->reg;
+        *op->reg += ea->step;
+        break;
+    case 4:
+        op->reg = &sh_reg(c, a[ea->reg]);
+        op->mem = *op->reg -= ea->step;
+        break;
+    case 5:
+        op->mem = sh_reg(c, a[ea->reg]) + ea->val;
+        break;
+    case 6:
+        op->mem = sh_reg(c, a[ea->reg]) + ea->val + ea_index(c, ea->ext);
+        break;
+    case ICACHE_EA_ABS:
+        op->mem = ea->val;
+        break;
+    case ICACHE_EA_PCINDEX:
+        op->mem = ea->val + ea_index(c, ea->ext);
+        break;
+    case ICACHE_EA_IMM:
+        op->type = OP_IMM;
+        op->val = ea->val;
+        break;
+    }
+}
+
+static const struct m68k_icache_entry *icache_lookup(
+    struct m68k_emulate_ctxt *c)
+{
+    const struct m68k_icache_entry *e;
+    uint32_t pc = c->regs->pc;
+    unsigned int i;
+
+    e = icache_entry(c->icache, pc);
+    if (!e->execute || (e->pc != pc))
+        return NULL;
+
+    /* The prefetch queue may hold a stale copy of modified code, and the
+     * CPU executes what it holds. */
+    if (c->prefetch_addr == pc)
+        for (i = 0; (i < c->prefetch_valid) && (i < e->op_words); i++)
+            if (c->prefetch_dat[i] != e->op[i])
+                return NULL;
+
+    return e;
+}
+
+/* Execute a cached insn, leaving all state as if it had been fetched and
+ * decoded in full. */
+static int icache_execute(
+    struct m68k_emulate_ctxt *c, const struct m68k_icache_entry *e)
+{
+    uint32_t pc = sh_reg(c, pc) + e->op_words*2;
+
+    /* A one-word insn, fetched from a full prefetch queue, leaves the second
+     * queued word at the head. Any other fetch refills the queue from
+     * memory before the insn executes. */
+    if ((e->op_words != 1) || (c->prefetch_addr != sh_reg(c, pc))
+        || (c->prefetch_valid != 2))
+        c->prefetch_dat[0] = e->next[0];
+    else
+        c->prefetch_dat[0] = c->prefetch_dat[1];
+    c->prefetch_dat[1] = e->next[1];
+    c->prefetch_addr = pc;
+    c->prefetch_valid = 2;
+
+    c->op_sz = e->op_sz;
+    c->op_words = e->op_words;
+    memcpy(c->op, e->op, e->op_words * 2);
+    c->cycles = e->op_words * 4;
+    sh_reg(c, pc) = pc;
+
+    if (e->nr_ea == 2) {
+        icache_ea(c, &e->ea[0]);
+        c->p->src = c->p->operand;
+    }
+    if (e->nr_ea != 0)
+        icache_ea(c, &e->ea[e->nr_ea - 1]);
+
+    return e->execute(c, e->op[0], e->imm);
+}
+
+/* Cache the insn at @pc, just decoded and executed in full. */
+static void icache_fill(struct m68k_emulate_ctxt *c, uint32_t pc)
+{
+    struct m68k_icache *ic = c->icache;
+    struct m68k_icache_entry *e;
+    uint32_t end = pc + c->op_words*2, w;
+    uint16_t next[2];
+    unsigned int i;
+
+    /* The insn and the two words of prefetch which follow it must lie in
+     * the cacheable range, and in the 24-bit address space. */
+    if ((pc & 1) || (pc < ic->start) || (end > ic->end)
+        || ((ic->end - end) < 4) || ((end + 4) > (1u << 24))
+        || (c->op_words > ARRAY_SIZE(e->op))
+        || ((pc < ic->nocache_end) && ((end + 4) > ic->nocache_start)))
+        return;
+
+    /* Words taken from a stale prefetch queue, or overwritten by the insn
+     * itself, must not be cached. */
+    for (i = 0; i < c->op_words; i++)
+        if (c->ops->read(pc + i*2, &w, 2, c) || ((uint16_t)w != c->op[i]))
+            return;
+    for (i = 0; i < 2; i++)
+        if (c->ops->read(end + i*2, &w, 2, c))
+            return;
+        else
+            next[i] = w;
+
+    e = icache_entry(ic, pc);
+    e->next[0] = next[0];
+    e->next[1] = next[1];
+    e->pc = pc;
+    e->execute = c->p->execute;
+    e->op_sz = c->p->execute_sz;
+    e->op_words = c->op_words;
+    memcpy(e->op, c->op, c->op_words * 2);
+    e->imm = c->p->imm;
+    e->nr_ea = c->p->nr_ea;
+    memcpy(e->ea, c->p->ea, sizeof(e->ea));
+    icache_set_code_page(ic, pc);
+    icache_set_code_page(ic, end + 3);
+}
+
 int m68k_emulate(struct m68k_emulate_ctxt *c)
 {
     struct m68k_emulate_priv_ctxt priv = {
         .sh_regs = *c->regs,
         .dis_p = c->dis
     };
+    struct m68k_lazy_cc cc = c->cc;
+    const struct m68k_icache_entry *e;
     uint16_t op;
     int rc, trace = !!(c->regs->sr & SR_T);
 
@@ -977,6 +1853,17 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
     c->op_sz = OPSZ_X;
     c->op_words = 0;
     c->cycles = 0;
+
+    /* Cached insns skip fetch and decode. */
+    if (c->icache && c->emulate && !c->disassemble) {
+        if ((e = icache_lookup(c)) != NULL) {
+            c->icache->nr_hit++;
+            rc = icache_execute(c, e);
+            goto bail;
+        }
+        c->icache->nr_miss++;
+    }
+
     bail_if(rc = fetch_insn_word(c, &op));
 
     switch ((op >> 12) & 0xf) {
@@ -995,41 +1882,12 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 dump(c, "%s", (c->op_sz==OPSZ_B) ? "ccr" : "sr");
                 c->p->operand.type = OP_SR;
                 raise_exception_if(
-                    (c->op_sz != OPSZ_B) && !(sh_reg(c, sr) & SR_S),
+                    (c->op_sz != OPSZ_B) && !(sh_sr(c) & SR_S),
                     M68KVEC_priv_violation);
+                rc = exec_imm_alu_sz[c->op_sz](c, op, imm);
             } else {
                 bail_if(rc = decode_ea(c));
-            }
-
-            bail_if(rc = read_ea(c));
-            switch ((op >> 9) & 7) {
-            case 0: /* or */
-                c->p->operand.val |= imm;
-                cc_mov(c, c->p->operand.val);
-                bail_if(rc = write_ea(c));
-                break;
-            case 1: /* and */
-                c->p->operand.val &= imm;
-                cc_mov(c, c->p->operand.val);
-                bail_if(rc = write_ea(c));
-                break;
-            case 2: /* sub */
-                bail_if(rc = op_sub(c, imm));
-                break;
-            case 3: /* add */
-                bail_if(rc = op_add(c, imm));
-                break;
-            case 5: /* eor */
-                c->p->operand.val ^= imm;
-                cc_mov(c, c->p->operand.val);
-                bail_if(rc = write_ea(c));
-                break;
-            case 6: /* cmp */
-                op_cmp(c, imm, c->p->operand.val);
-                break;
-            default:
-                rc = M68KEMUL_UNHANDLEABLE;
-                break;
+                rc = execute(c, exec_imm_alu_sz[c->op_sz], op, imm);
             }
         } else if ((op & 0xf138u) == 0x0108u) {
             /* movep */
@@ -1065,7 +1923,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             c->op_sz = !(op & 0x38u) ? OPSZ_L: OPSZ_B;
             dump(c, "%s.%c\t", bitop[(op>>6)&3], op_sz_ch[c->op_sz]);
             if (op & (1u<<8)) {
-                idx = sh_reg(c, d[(op>>9)&7]);
+                idx = 0; /* exec_bitop() reads the register */
                 dump(c, "%s,", dreg[(op>>9)&7]);
             } else if ((op & 0x0f00u) == 0x0800u) {
                 bail_if(rc = fetch_insn_word(c, &idx));
@@ -1075,17 +1933,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 goto unknown;
             }
             bail_if(rc = decode_ea(c));
-            bail_if(rc = read_ea(c));
-            idx &= c->op_sz == OPSZ_B ? 7 : 31;
-            sh_reg(c, sr) &= ~CC_Z;
-            if (!(c->p->operand.val & (1u<<idx)))
-                sh_reg(c, sr) |= CC_Z;
-            switch ((op >> 6 ) & 3) {
-            case 1: c->p->operand.val ^= 1u << idx; break;
-            case 2: c->p->operand.val &= ~(1u << idx); break;
-            case 3: c->p->operand.val |= 1u << idx; break;
-            }
-            bail_if(((op >> 6) & 3) && (rc = write_ea(c)));
+            rc = execute(c, exec_bitop_sz[c->op_sz], op, idx);
         }
         break;
     }
@@ -1095,8 +1943,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
     case 0x2: /* COMPLETE */
         c->op_sz = OPSZ_L;
         goto move;
-    case 0x3: { /* COMPLETE */
-        struct operand src, dst;
+    case 0x3: /* COMPLETE */
         c->op_sz = OPSZ_W;
     move:
         if (((op >> 6) & 7) == 1) {
@@ -1105,35 +1952,19 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "movea.%c\t", op_sz_ch[c->op_sz]);
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", areg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            if (c->op_sz == OPSZ_W) {
-                c->p->operand.val = (int16_t)c->p->operand.val;
-                c->op_sz = OPSZ_L;
-            }
-            sh_reg(c, a[(op>>9)&7]) = c->p->operand.val;
+            rc = execute(c, exec_movea_sz[c->op_sz], op, 0);
         } else {
             dump(c, "move.%c\t", op_sz_ch[c->op_sz]);
             bail_if(rc = decode_ea(c));
-            src = c->p->operand;
+            c->p->src = c->p->operand;
             dump(c, ",");
             /* Swizzle the opcode to shift dst ea to the right place */
             c->op[0] = ((op >> 9) & 0x07) | ((op >> 3) & 0x38);
             bail_if(rc = decode_ea(c));
-            dst = c->p->operand;
             c->op[0] = op; /* restore */
-            c->p->operand = src;
-            bail_if(rc = read_ea(c));
-            dst.val = c->p->operand.val;
-            c->p->operand = dst;
-            bail_if(rc = write_ea(c));
-            cc_mov(c, dst.val);
+            rc = execute(c, exec_move_sz[c->op_sz], op, 0);
         }
-        /* Most move instructions perform the second prefetch after writeback.
-         * We simulate this by discarding our second word of prefetch. */
-        if (c->prefetch_valid > 1)
-            c->prefetch_valid = 1;
         break;
-    }
     case 0x4: { /* COMPLETE */
         rc = misc_insn(c);
         break;
@@ -1151,27 +1982,14 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                  op & (1u<<8) ? "sub" : "add",
                  op_sz_ch[c->op_sz], val);
             bail_if(rc = decode_ea(c));
-            bail_if(rc = read_ea(c));
-            if (((op >> 3) & 7) == 1) {
-                /* adda/suba semantics */
-                uint32_t *reg = c->p->operand.reg;
-                c->op_sz = OPSZ_L;
-                *reg = op & (1u<<8) ? *reg - val : *reg + val;
-            } else {
-                bail_if(rc = ((op & (1u<<8)) ? op_sub : op_add)(c, val));
-            }
+            rc = execute(c, exec_addq_sz[c->op_sz], op, val);
         } else if ((op & 0x0038u) == 0x0008u) {
             /* dbcc */
             uint32_t pc = sh_reg(c,pc);
             int32_t disp;
             bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_W));
             dump(c, "db%s.w\t%s,%04x", cc[cond], dreg[op&7], pc + disp);
-            if (!cc_eval_condition(c, cond)) {
-                uint32_t *reg = &sh_reg(c, d[op&7]);
-                *reg = (*reg & ~0xffffu) | (uint16_t)(*reg - 1);
-                if ((int16_t)*reg != -1)
-                    sh_reg(c, pc) = pc + disp;
-            }
+            rc = execute(c, exec_dbcc, op, pc + disp);
         } else if ((op & 0x003fu) >= 0x003au) {
             /* trapcc */
             uint32_t imm;
@@ -1188,8 +2006,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             c->op_sz = OPSZ_B;
             dump(c, "s%s.b\t", cc[cond]);
             bail_if(rc = decode_ea(c));
-            c->p->operand.val = cc_eval_condition(c, cond) ? ~0 : 0;
-            bail_if(rc = write_ea(c));
+            rc = execute(c, exec_scc, op, 0);
         }
         break;
     }
@@ -1207,19 +2024,11 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
         else if (disp == -1)
             bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_L));
         dump(c, "\t%04x", target + disp);
-        if (cond == 1) {
-            /* bsr: push return address (current pc) onto stack */
-            sh_reg(c, a[7]) -= 4;
-            bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
-        } else if (!cc_eval_condition(c, cond))
-            break; /* bcc condition is false: no branch */
-        sh_reg(c, pc) = target + disp;
+        rc = execute(c, exec_bcc, op, target + disp);
         break;
     }
     case 0x7: { /* COMPLETE */
-        uint32_t *reg = &sh_reg(c, d[(op>>9)&7]);
         int8_t val = (int8_t)op;
-        *reg = val;
         c->op_sz = OPSZ_L;
         dump(c, "moveq\t#");
         if (val < 0) {
@@ -1227,7 +2036,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             val = -val;
         }
         dump(c, "%x,%s", val, dreg[(op>>9)&7]);
-        cc_mov(c, *reg);
+        rc = execute(c, exec_moveq, op, 0);
         break;
     }
     case 0x8: /* COMPLETE */
@@ -1247,19 +2056,13 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "cmpa.%c\t", op_sz_ch[c->op_sz]);
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", areg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            if (c->op_sz == OPSZ_W) {
-                c->p->operand.val = (int16_t)c->p->operand.val;
-                c->op_sz = OPSZ_L;
-            }
-            op_cmp(c, c->p->operand.val, sh_reg(c, a[(op>>9)&7]));
+            rc = execute(c, exec_cmpa_sz[c->op_sz], op, 0);
         } else if ((op & 0xf100u) == 0xb000u) {
             /* cmp */
             dump(c, "cmp.%c\t", op_sz_ch[c->op_sz]);
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", dreg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            op_cmp(c, c->p->operand.val, sh_reg(c, d[(op>>9)&7]));
+            rc = execute(c, exec_cmp_sz[c->op_sz], op, 0);
         } else if ((op & 0xf138u) == 0xb108u) {
             /* cmpm */
             dump(c, "cmpm.%c\t(%s)+,(%s)+", op_sz_ch[c->op_sz],
@@ -1270,10 +2073,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "eor.%c\t%s,", op_sz_ch[c->op_sz],
                            dreg[(op>>9)&7]);
             bail_if(rc = decode_ea(c));
-            bail_if(rc = read_ea(c));
-            c->p->operand.val ^= sh_reg(c, d[(op>>9)&7]);
-            cc_mov(c, c->p->operand.val);
-            bail_if(rc = write_ea(c));
+            rc = execute(c, exec_eor_sz[c->op_sz], op, 0);
         }
         break;
     }
@@ -1301,7 +2101,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 c->p->operand.val = *c->p->operand.reg;
             }
             op2 = c->p->operand.val;
-            x = !!(sh_reg(c, sr) & CC_X);
+            x = !!(sh_sr(c) & CC_X);
             if (op & (1u<<14)) {
                 /* abcd */
                 digit[0] = (op2&15) + (op1&15) + x;
@@ -1321,11 +2121,11 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             }
             c->p->operand.val = (uint8_t)(digit[1]<<4 | digit[0]);
             bail_if(rc = write_ea(c));
-            sh_reg(c, sr) &= ~(CC_X|CC_C);
+            sh_sr(c) &= ~(CC_X|CC_C);
             if (x)
-                sh_reg(c, sr) |= CC_X|CC_C;
+                sh_sr(c) |= CC_X|CC_C;
             if (c->p->operand.val)
-                sh_reg(c, sr) &= ~CC_Z;
+                sh_sr(c) &= ~CC_Z;
         } else if ((op & 0xf0c0u) == 0x80c0u) {
             /* divs.w/divu.w */
             uint32_t q, r, *reg = &sh_reg(c, d[(op>>9)&7]);
@@ -1333,7 +2133,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "div%c.w\t", op & (1u<<8) ? 's' : 'u');
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", dreg[(op>>9)&7]);
-            sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
+            sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
             bail_if(rc = read_ea(c));
             raise_exception_if((uint16_t)c->p->operand.val == 0,
                                M68KVEC_zero_divide);
@@ -1341,19 +2141,19 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 q = (int32_t)*reg / (int16_t)c->p->operand.val;
                 r = (int32_t)*reg % (int16_t)c->p->operand.val;
                 if (((int32_t)q > 0x7fff) || ((int32_t)q < -0x8000))
-                    sh_reg(c, sr) |= CC_V;
+                    sh_sr(c) |= CC_V;
             } else {
                 q = (uint32_t)*reg / (uint16_t)c->p->operand.val;
                 r = (uint32_t)*reg % (uint16_t)c->p->operand.val;
                 if (q > 0xffff)
-                    sh_reg(c, sr) |= CC_V;
+                    sh_sr(c) |= CC_V;
             }
-            if (!(sh_reg(c, sr) & CC_V))
+            if (!(sh_sr(c) & CC_V))
                 *reg = (r << 16) | (uint16_t)q;
             if ((uint16_t)q == 0)
-                sh_reg(c, sr) |= CC_Z;
+                sh_sr(c) |= CC_Z;
             if ((int16_t)q < 0)
-                sh_reg(c, sr) |= CC_N;
+                sh_sr(c) |= CC_N;
         } else if ((op & 0xf0c0u) == 0xc0c0u) {
             /* muls.w/mulu.w */
             uint32_t *reg = &sh_reg(c, d[(op>>9)&7]);
@@ -1361,32 +2161,24 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "mul%c.w\t", op & (1u<<8) ? 's' : 'u');
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", dreg[(op>>9)&7]);
-            sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
+            sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
             bail_if(rc = read_ea(c));
             if (op & (1u<<8))
                 *reg = (int16_t)*reg * (int16_t)c->p->operand.val;
             else
                 *reg = (uint16_t)*reg * (uint16_t)c->p->operand.val;
             if ((uint32_t)*reg == 0)
-                sh_reg(c, sr) |= CC_Z;
+                sh_sr(c) |= CC_Z;
             if ((int32_t)*reg < 0)
-                sh_reg(c, sr) |= CC_N;
+                sh_sr(c) |= CC_N;
         } else if ((op & 0xf130u) == 0xc100u) {
             /* exg */
-            uint32_t *r1, *r2, t;
-            r1 = ((op & 0xf8u) == 0x48u ? sh_reg(c,a) : sh_reg(c,d));
-            r2 = ((op & 0xf8u) == 0x40u ? sh_reg(c,d) : sh_reg(c,a));
-            r1 += (op >> 9) & 7;
-            r2 += op & 7;
             dump(c, "exg.l\t%s,%s",
                  ((op & 0xf8u) == 0x48u ? areg : dreg)[(op>>9)&7],
                  ((op & 0xf8u) == 0x40u ? dreg : areg)[op&7]);
-            t = *r1;
-            *r1 = *r2;
-            *r2 = t;
+            rc = execute(c, exec_exg, op, 0);
         } else {
             /* and/or */
-            uint32_t r, *reg = &sh_reg(c, d[(op>>9)&7]);
             c->op_sz = (op>>6) & 3;
             dump(c, "%s.%c\t",
                  op & (1u<<14) ? "and" : "or",
@@ -1396,16 +2188,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             bail_if(rc = decode_ea(c));
             if (!(op & (1u<<8)))
                 dump(c, ",%s", dreg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            r = op & (1u<<14) ?
-                c->p->operand.val & *reg : c->p->operand.val | *reg;
-            cc_mov(c, r);
-            if (!(op & (1u<<8))) {
-                c->p->operand.type = OP_REG;
-                c->p->operand.reg = reg;
-            }
-            c->p->operand.val = r;
-            bail_if(rc = write_ea(c));
+            rc = execute(c, exec_andor_sz[c->op_sz], op, 0);
         }
         break;
     }
@@ -1415,18 +2198,11 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
         c->op_sz = (op>>6)&3;
         if ((op & 0xc0u) == 0xc0u) {
             /* adda/suba */
-            uint32_t r, *reg = &sh_reg(c, a[(op>>9)&7]);
             c->op_sz = op & (1u<<8) ? OPSZ_L : OPSZ_W;
             dump(c, "a.%c\t", op_sz_ch[c->op_sz]);
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", areg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            r = c->p->operand.val;
-            if (c->op_sz == OPSZ_W) {
-                r = (int16_t)r;
-                c->op_sz = OPSZ_L;
-            }
-            *reg = op & (1u<<14) ? *reg + r : *reg - r;
+            rc = execute(c, exec_adda_sz[c->op_sz], op, 0);
         } else if ((op & 0x130u) == 0x100u) {
             /* addx/subx */
             uint32_t op1;
@@ -1437,12 +2213,12 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 c->p->operand.type = OP_MEM;
                 c->p->operand.reg = &sh_reg(c, a[op&7]);
                 c->p->operand.mem = *c->p->operand.reg -=
-                    (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
+                    sz_step(c->op_sz);
                 bail_if(rc = read_ea(c));
                 op1 = c->p->operand.val;
                 c->p->operand.reg = &sh_reg(c, a[(op>>9)&7]);
                 c->p->operand.mem = *c->p->operand.reg -=
-                    (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
+                    sz_step(c->op_sz);
                 bail_if(rc = read_ea(c));
             } else {
                 dump(c, "%s,%s", dreg[op&7], dreg[(op>>9)&7]);
@@ -1451,135 +2227,53 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 c->p->operand.reg = &sh_reg(c, d[(op>>9)&7]);
                 c->p->operand.val = *c->p->operand.reg;
             }
-            sr = sh_reg(c, sr);
+            sr = sh_sr(c);
             bail_if(rc = ((op & (1u<<14)) ? op_add : op_sub)(c, op1));
             if (sr & CC_X) {
-                uint16_t sr2 = sh_reg(c, sr);
+                uint16_t sr2 = sh_sr(c);
                 bail_if(rc = ((op & (1u<<14)) ? op_add : op_sub)(c, 1));
                 /* overflow and carry accumulate */
-                sh_reg(c, sr) |= sr2 & (CC_X|CC_V|CC_C);
+                sh_sr(c) |= sr2 & (CC_X|CC_V|CC_C);
             }
             /* CC.Z is never set by this instruction, only cleared */
-            if ((sh_reg(c, sr) & CC_Z) && !(sr & CC_Z))
-                sh_reg(c, sr) &= ~CC_Z;
+            if ((sh_sr(c) & CC_Z) && !(sr & CC_Z))
+                sh_sr(c) &= ~CC_Z;
         } else {
             /* add/sub */
-            uint32_t op1, *reg = &sh_reg(c, d[(op>>9)&7]);
-            op1 = *reg;
             dump(c, ".%c\t", op_sz_ch[c->op_sz]);
             if (op & (1u<<8))
                 dump(c, "%s,", dreg[(op>>9)&7]);
             bail_if(rc = decode_ea(c));
             if (!(op & (1u<<8)))
                 dump(c, ",%s", dreg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            if (!(op & (1u<<8))) {
-                op1 = c->p->operand.val;
-                c->p->operand.type = OP_REG;
-                c->p->operand.reg = reg;
-                c->p->operand.val = *reg;
-            }
-            bail_if(rc = ((op & (1u<<14)) ? op_add : op_sub)(c, op1));
+            rc = execute(c, exec_addsub_sz[c->op_sz], op, 0);
         }
         break;
     }
     case 0xe: { /* COMPLETE */
         static const char *sr[] = {
             "as", "ls", "rox", "ro" };
-        uint32_t m, v;
-        uint8_t x, typ, cnt;
         if ((op & 0xf8c0u) == 0xe8c0u) {
             /* bitfield access */
             goto unknown;
         } else if ((op & 0xc0u) == 0xc0u) {
             /* shift/rotate <ea> */
             c->op_sz = OPSZ_W;
-            typ = (op >> 9) & 3;
-            cnt = 1;
-            dump(c, "%s%c.%c\t", sr[typ],
+            dump(c, "%s%c.%c\t", sr[(op >> 9) & 3],
                  op&(1u<<8) ? 'l' : 'r', op_sz_ch[c->op_sz]);
             bail_if(rc = decode_ea(c));
         } else {
             /* shift/rotate <dn> */
             c->op_sz = (op >> 6) & 3;
-            typ = (op >> 3) & 3;
-            dump(c, "%s%c.%c\t", sr[typ],
+            dump(c, "%s%c.%c\t", sr[(op >> 3) & 3],
                  op&(1u<<8) ? 'l' : 'r', op_sz_ch[c->op_sz]);
-            if (op & (1u<<5)) {
-                cnt = sh_reg(c, d[(op>>9)&7]) & 63;
+            if (op & (1u<<5))
                 dump(c, "%s", dreg[(op>>9)&7]);
-            } else {
-                cnt = (op >> 9) & 7 ?: 8;
-                dump(c, "#%x", cnt);
-            }
+            else
+                dump(c, "#%x", (op >> 9) & 7 ?: 8);
             dump(c, ",%s", dreg[op&7]);
-            c->p->operand.type = OP_REG;
-            c->p->operand.reg = &sh_reg(c, d[op&7]);
         }
-        bail_if(rc = read_ea(c));
-        v = c->p->operand.val;
-        m = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
-        sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
-        while (cnt--) {
-            switch ((typ << 1) | ((op >> 8) & 1)) {
-            case 0: /* asr */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & 1)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                v = (v >> 1) | (v & m);
-                break;
-            case 1: /* asl */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & m)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                if ((v ^ (v << 1)) & m)
-                    sh_reg(c, sr) |= CC_V;
-                v = (v << 1);
-                break;
-            case 2: /* lsr */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & 1)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                v = (v >> 1);
-                break;
-            case 3: /* lsl */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & m)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                v = (v << 1);
-                break;
-            case 4: /* roxr */
-                x = !!(v & 1);
-                v = (v >> 1) | (sh_reg(c, sr) & CC_X ? m : 0);
-                sh_reg(c, sr) &= ~CC_X;
-                sh_reg(c, sr) |= x ? CC_X : 0;
-                break;
-            case 5: /* roxl */
-                x = !!(v & m);
-                v = (v << 1) | (sh_reg(c, sr) & CC_X ? 1 : 0);
-                sh_reg(c, sr) &= ~CC_X;
-                sh_reg(c, sr) |= x ? CC_X : 0;
-                break;
-            case 6: /* ror */
-                sh_reg(c, sr) &= ~CC_C;
-                if (v & 1)
-                    sh_reg(c, sr) |= CC_C;
-                v = (v >> 1) | (sh_reg(c, sr) & CC_C ? m : 0);
-                break;
-            case 7: /* rol */
-                sh_reg(c, sr) &= ~CC_C;
-                if (v & m)
-                    sh_reg(c, sr) |= CC_C;
-                v = (v << 1) | (sh_reg(c, sr) & CC_C ? 1 : 0);
-                break;
-            }
-        }
-        if (typ == 2) /* roxl/roxr */
-            sh_reg(c, sr) |= sh_reg(c, sr) & CC_X ? CC_C : 0;
-        v &= (m << 1) - 1;
-        sh_reg(c, sr) |= (v == 0 ? CC_Z : 0) | (v & m ? CC_N : 0);
-        c->p->operand.val = v;
-        rc = write_ea(c);
+        rc = execute(c, exec_shift_sz[c->op_sz], op, 0);
         break;
     }
     case 0xf: /* COMPLETE */
@@ -1593,8 +2287,16 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
     }
 
 bail:
-    if (!c->emulate || (rc == M68KEMUL_UNHANDLEABLE))
+    /* Cache the insn if its execute stage completed normally. */
+    if ((rc == M68KEMUL_OKAY) && priv.execute && c->icache && c->emulate
+        && !c->disassemble)
+        icache_fill(c, c->regs->pc);
+
+    if (!c->emulate || (rc == M68KEMUL_UNHANDLEABLE)) {
+        /* Register state is discarded, so discard flag updates too. */
+        c->cc = cc;
         goto out;
+    }
 
     /* Check for unaligned instruction prefetch. */
     rc = check_addr_align(c, sh_reg(c, pc), 2, access_fetch) ? : rc;
@@ -1609,6 +2311,7 @@ bail:
         *c->regs = c->p->sh_regs;
     } else {
         /* Instruction was aborted. Discard register state; no trace. */
+        c->cc = cc;
         trace = 0;
 
         /* Address/bus errors have PC "in the vicinity of" the instruction.
@@ -1679,13 +2382,21 @@ void m68k_dump_stack(
     }
 }
 
+void m68k_sync_sr(struct m68k_emulate_ctxt *c)
+{
+    cc_eval(c, &c->regs->sr);
+}
+
 int m68k_deliver_exception(
     struct m68k_emulate_ctxt *c, struct m68k_exception *e)
 {
-    uint16_t old_sr = c->regs->sr;
+    uint16_t old_sr;
     uint32_t old_pc = c->regs->pc;
     int rc;
 
+    m68k_sync_sr(c);
+    old_sr = c->regs->sr;
+
     c->p->sh_regs = *c->regs;
 
     update_sr(c, (old_sr | SR_S) & ~SR_T);
@@ -76,6 +76,50 @@ struct m68k_regs {
 #define OPSZ_L 2 /* long/4 */
 #define OPSZ_X 3 /* none/unknown */
 
+/* Decoded-instruction cache: a direct-mapped cache of instructions recently
+ * executed from the cacheable address range, keyed by PC. An entry holds the
+ * opcode words and the two words prefetched after them, the handler for the
+ * instruction's execute stage, and its pre-extracted operands, so that a
+ * cache hit skips fetch and decode entirely. Writes made by the emulated CPU
+ * invalidate overlapping entries. Other agents modifying memory (DMA,
+ * loaders) must call m68k_icache_invalidate(). */
+#define M68K_ICACHE_ENTRIES   4096
+#define M68K_ICACHE_PAGE_SHIFT 8 /* granularity of the code-page bitmap */
+struct m68k_icache_ea {
+    uint8_t mode;  /* PRIVATE: addressing mode */
+    uint8_t reg;   /* register number */
+    uint8_t step;  /* (An)+/-(An) increment */
+    uint16_t ext;  /* brief extension word of indexed modes */
+    uint32_t val;  /* displacement, absolute address, or immediate */
+};
+struct m68k_icache_entry {
+    uint32_t pc;
+    int (*execute)(struct m68k_emulate_ctxt *, uint16_t op, uint32_t imm);
+    uint8_t op_sz, op_words, nr_ea;
+    uint16_t op[5], next[2]; /* opcode words, then two words of prefetch */
+    uint32_t imm;
+    struct m68k_icache_ea ea[2];
+};
+struct m68k_icache {
+    /* IN: Cacheable address range [start,end). Must hold RAM/ROM only, and
+     * lie within the 68000's 24-bit address space. */
+    uint32_t start, end;
+    /* IN: Never cache code in [nocache_start,nocache_end): memory which may
+     * change before its writer calls m68k_icache_invalidate(). */
+    uint32_t nocache_start, nocache_end;
+    /* OUT: Instructions executed from the cache, and decoded in full. */
+    uint64_t nr_hit, nr_miss;
+    /* PRIVATE */
+    uint8_t code_page[(1u << (24 - M68K_ICACHE_PAGE_SHIFT)) / 8];
+    struct m68k_icache_entry entry[M68K_ICACHE_ENTRIES];
+};
+
+/* Lazily-evaluated condition codes: the last flag-setting ALU operation. */
+struct m68k_lazy_cc {
+    uint8_t op, sz;
+    uint32_t src, dst, res;
+};
+
 struct m68k_emulate_priv_ctxt;
 
 struct m68k_emulate_ctxt
@@ -89,6 +133,10 @@ struct m68k_emulate_ctxt
     uint8_t disassemble:1;
     uint8_t emulate:1;
 
+    /* IN: Optional decoded-instruction cache, used only if emulate = 1 and
+     * disassemble = 0. */
+    struct m68k_icache *icache;
+
     /* OUT: Disassembly of the emulated instruction. */
     char dis[128];
 
@@ -106,6 +154,9 @@ struct m68k_emulate_ctxt
     uint32_t prefetch_addr, prefetch_valid;
     uint16_t prefetch_dat[2];
 
+    /* PRIVATE: Condition codes not yet folded into regs->sr. */
+    struct m68k_lazy_cc cc;
+
     /* PRIVATE */
     struct m68k_emulate_priv_ctxt *p;
 };
@@ -114,6 +165,18 @@ struct m68k_emulate_ctxt
  * Returns M68KEMUL_OKAY or M68KEMUL_UNHANDLEABLE. */
 int m68k_emulate(struct m68k_emulate_ctxt *);
 
+/* m68k_icache_invalidate: Discard cached instructions overlapping
+ * [addr,addr+bytes). */
+void m68k_icache_invalidate(
+    struct m68k_emulate_ctxt *, uint32_t addr, unsigned int bytes);
+
+/* m68k_icache_flush: Discard all cached instructions. */
+void m68k_icache_flush(struct m68k_emulate_ctxt *);
+
+/* m68k_sync_sr: Fold lazily-evaluated condition codes into regs->sr.
+ * Must be called before regs->sr is read or modified outside the emulator. */
+void m68k_sync_sr(struct m68k_emulate_ctxt *);
+
 /* m68k_dump_regs: Print register dump to stdout. */
 void m68k_dump_regs(struct m68k_regs *, void (*print)(const char *, ...));
 
@@ -47,6 +47,7 @@ static uint32_t mem_size;
 
 struct m68k_state {
     struct m68k_emulate_ctxt ctxt;
+    struct m68k_icache icache;
     char addr_name[16];
     char *mem;
 };
@@ -149,7 +150,9 @@ int main(int argc, char **argv)
 
     s.ctxt.regs = &regs;
     s.ctxt.ops = &emul_ops;
-    s.ctxt.disassemble = 1;
+    s.ctxt.icache = &s.icache;
+    s.icache.end = mem_size;
+    s.ctxt.disassemble = 0;
     s.ctxt.emulate = 1;
 
     while (!ctrl_c && (regs.pc < mem_size)) {
@@ -158,6 +161,8 @@ int main(int argc, char **argv)
             break;
     }
 
+    m68k_sync_sr(&s.ctxt);
+
     fd = fopen(argv[2], "wb");
     if (fd == NULL)
         err(1, "%s", argv[2]);
@@ -17,8 +17,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <libdisk/stream.h>
 #include <time.h>
 #include "scp.h"
 
@@ -32,11 +35,17 @@
 #define DEFAULT_UNIT       0
 #define DEFAULT_STARTTRK   0
 #define DEFAULT_ENDTRK     163
+/* Tracks beyond an 80-cylinder drive's last are dumped, as protections may
+ * live there, but are not decoded: most hold nothing, and would only be
+ * reported bad and re-read. */
+#define DECODE_ENDTRK      159
 #define DEFAULT_REVS       2
+#define DEFAULT_RETRIES    3
 static int double_step = 0;
 
 static struct scp_params scp_params;
 
+static int quiet = 0;
 #define log(_f, _a...) do { if (!quiet) printf(_f, ##_a); } while (0)
 
 static void usage(int rc)
@@ -62,6 +71,11 @@ static void usage(int rc)
            default_scp_params.step_delay_ms);
     printf("  -K, --settle-delay  Settle time after seek, millisecs (%u)\n",
            default_scp_params.seek_settle_delay_ms);
+    printf("  -f, --format=FMT[,FMT...] Decode each track as it is read, and\n"
+           "                    report bad tracks\n");
+    printf("  -o, --decoded=FILE  Save decoded tracks to FILE (needs -f)\n");
+    printf("  -x, --retries     Re-reads of each bad track (%d)\n",
+           DEFAULT_RETRIES);
 
     exit(rc);
 }
@@ -87,24 +101,278 @@ static void checksum_and_write(
     *p_csum = csum;
 }
 
+/* The device thread fills one capture buffer while the writer thread saves
+ * (and optionally decodes) the one before. */
+#define NR_CAPTURES 3
+
+struct capture {
+    struct capture *next;
+    unsigned int tracknr;
+    struct scp_flux flux;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct capture *free, *full, **full_tail;
+    unsigned int busy; /* captures queued or being written */
+    int done;
+} q = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .full_tail = &q.full
+};
+
+static struct capture *capture_get_free(void)
+{
+    struct capture *c;
+    pthread_mutex_lock(&q.mutex);
+    while ((c = q.free) == NULL)
+        pthread_cond_wait(&q.cond, &q.mutex);
+    q.free = c->next;
+    q.busy++;
+    pthread_mutex_unlock(&q.mutex);
+    return c;
+}
+
+static void capture_put_free(struct capture *c)
+{
+    pthread_mutex_lock(&q.mutex);
+    c->next = q.free;
+    q.free = c;
+    q.busy--;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.mutex);
+}
+
+static void capture_queue(struct capture *c)
+{
+    pthread_mutex_lock(&q.mutex);
+    c->next = NULL;
+    *q.full_tail = c;
+    q.full_tail = &c->next;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.mutex);
+}
+
+/* Returns NULL once the device thread is finished and the queue is empty. */
+static struct capture *capture_dequeue(void)
+{
+    struct capture *c;
+    pthread_mutex_lock(&q.mutex);
+    while (((c = q.full) == NULL) && !q.done)
+        pthread_cond_wait(&q.cond, &q.mutex);
+    if (c && ((q.full = c->next) == NULL))
+        q.full_tail = &q.full;
+    pthread_mutex_unlock(&q.mutex);
+    return c;
+}
+
+/* Wait for every queued capture to be written and decoded. */
+static void capture_wait_idle(void)
+{
+    pthread_mutex_lock(&q.mutex);
+    while (q.busy)
+        pthread_cond_wait(&q.cond, &q.mutex);
+    pthread_mutex_unlock(&q.mutex);
+}
+
+static void capture_finish(void)
+{
+    pthread_mutex_lock(&q.mutex);
+    q.done = 1;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.mutex);
+}
+
+/* SCP output file, owned by the writer thread. */
+static int fd, nr_revs = DEFAULT_REVS;
+static uint32_t *th_offs, file_off, csum;
+
+/* Live decode: formats to try, and the best result so far for each track.
+ * The flux of a partly-decoded track is kept so that a worse re-read can be
+ * undone. It is freed once the track reads cleanly, or re-reads end. */
+static struct disk *decoded;
+static unsigned int nr_formats, decode_end_trk;
+static enum track_type formats[16];
+static struct track_result {
+    unsigned int nr_reads;
+    int score; /* valid sectors, or -1 if unrecognised */
+    int ok;
+    struct scp_flux *best;
+} result[SCP_MAX_TRACKS];
+
+static void write_track(struct capture *c)
+{
+    struct track_header thdr;
+    unsigned int rev, sizeof_thdr = 4 + 12*nr_revs;
+    uint32_t dat_off;
+
+    th_offs[c->tracknr] = htole32(file_off);
+
+    memset(&thdr, 0, sizeof_thdr);
+    memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
+    thdr.tracknr = c->tracknr;
+
+    dat_off = sizeof_thdr;
+    for (rev = 0; rev < nr_revs; rev++) {
+        thdr.rev[rev].duration = htole32(c->flux.info[rev].index_time);
+        thdr.rev[rev].nr_samples = htole32(c->flux.info[rev].nr_bitcells);
+        thdr.rev[rev].offset = htole32(dat_off);
+        dat_off += c->flux.info[rev].nr_bitcells * sizeof(uint16_t);
+    }
+    checksum_and_write(fd, &csum, &thdr, sizeof_thdr);
+    checksum_and_write(fd, &csum, c->flux.flux, dat_off - sizeof_thdr);
+    file_off += dat_off;
+}
+
+/* Decode a capture into the output disk. Returns nr valid sectors, or -1 if
+ * no format matched. */
+static int decode_track(
+    unsigned int tracknr, struct scp_flux *flux, int *pok)
+{
+    struct track_info *ti = &disk_get_info(decoded)->track[tracknr];
+    uint32_t ticks[ARRAY_SIZE(flux->info)], samples[ARRAY_SIZE(flux->info)];
+    struct stream *s;
+    unsigned int i, rev, sec;
+    int score = -1;
+
+    for (rev = 0; rev < nr_revs; rev++) {
+        ticks[rev] = flux->info[rev].index_time;
+        samples[rev] = flux->info[rev].nr_bitcells;
+    }
+
+    /* Our SCP header is not index cued, so decode exactly as from the file. */
+    s = stream_scp_track_open(tracknr, nr_revs, 0, ticks, samples,
+                              flux->flux, 0, 0);
+    *pok = 0;
+    for (i = 0; (s != NULL) && (i < nr_formats); i++) {
+        if (track_write_raw_from_stream(decoded, tracknr, formats[i], s))
+            continue;
+        for (score = sec = 0; sec < ti->nr_sectors; sec++)
+            if (is_valid_sector(ti, sec))
+                score++;
+        *pok = (score == ti->nr_sectors);
+        break;
+    }
+    if (score < 0)
+        track_write_raw_from_stream(decoded, tracknr, TRKTYP_unformatted, s);
+    if (s != NULL)
+        stream_close(s);
+
+    return score;
+}
+
+static void process_capture(struct capture *c)
+{
+    struct track_result *r = &result[c->tracknr];
+    struct track_info *ti;
+    int ok, score, retry = (r->nr_reads++ != 0);
+
+    if (!nr_formats) {
+        write_track(c);
+        log("\b\b\b\b\b\b\b%-4u...", c->tracknr);
+        fflush(stdout);
+        return;
+    }
+
+    if (c->tracknr > decode_end_trk) {
+        write_track(c);
+        return;
+    }
+
+    score = decode_track(c->tracknr, &c->flux, &ok);
+    if (retry && (score <= r->score)) {
+        /* No better than before: restore the earlier decode. */
+        if (r->best != NULL)
+            decode_track(c->tracknr, r->best, &ok);
+        else
+            track_mark_unformatted(decoded, c->tracknr);
+        log("Track %3u: re-read no better\n", c->tracknr);
+        return;
+    }
+
+    write_track(c);
+    r->score = score;
+    r->ok = ok;
+    if (ok || (score < 0)) {
+        /* Nothing worth restoring. */
+        memfree(r->best);
+        r->best = NULL;
+    } else {
+        if (r->best == NULL)
+            r->best = memalloc(sizeof(*r->best));
+        memcpy(r->best, &c->flux, sizeof(c->flux));
+    }
+
+    ti = &disk_get_info(decoded)->track[c->tracknr];
+    if (ok)
+        log("Track %3u: %s%s\n", c->tracknr, ti->typename,
+            retry ? " (re-read)" : "");
+    else if (score < 0)
+        printf("Track %3u: BAD: unrecognised\n", c->tracknr);
+    else
+        printf("Track %3u: BAD: %s, %d/%u sectors\n", c->tracknr,
+               ti->typename, score, ti->nr_sectors);
+    fflush(stdout);
+}
+
+static void *writer_thread(void *unused)
+{
+    struct capture *c;
+
+    while ((c = capture_dequeue()) != NULL) {
+        process_capture(c);
+        capture_put_free(c);
+    }
+
+    return NULL;
+}
+
+static void capture_track(
+    struct scp_handle *scp, unsigned int tracknr)
+{
+    struct capture *c = capture_get_free();
+    c->tracknr = tracknr;
+    scp_seek_track(scp, tracknr, double_step);
+    scp_read_flux(scp, nr_revs, &c->flux);
+    capture_queue(c);
+}
+
+static void parse_formats(char *list)
+{
+    const char *name;
+    char *p;
+    int i;
+
+    for (p = strtok(list, ","); p != NULL; p = strtok(NULL, ",")) {
+        for (i = 0; (name = disk_get_format_id_name(i)) != NULL; i++)
+            if (!strcmp(name, p))
+                break;
+        if (name == NULL)
+            errx(1, "Unknown track format '%s'", p);
+        if (nr_formats == ARRAY_SIZE(formats))
+            errx(1, "Too many track formats");
+        formats[nr_formats++] = i;
+    }
+}
+
 int main(int argc, char **argv)
 {
     struct scp_handle *scp;
-    struct scp_flux flux;
     struct disk_header dhdr;
-    struct track_header thdr;
-    int rev, nr_revs = DEFAULT_REVS;
-    int trk, start_trk = -1, end_trk = -1;
-    unsigned int sizeof_thdr, unit = DEFAULT_UNIT;
-    uint32_t *th_offs, file_off, dat_off, csum = 0;
-    int ch, fd, quiet = 0, ramtest = 0;
-    char *sername = DEFAULT_SERDEVICE;
+    int trk, start_trk = -1, end_trk = -1, retries = DEFAULT_RETRIES;
+    unsigned int i, unit = DEFAULT_UNIT;
+    int ch, ramtest = 0, nr_bad;
+    char *sername = DEFAULT_SERDEVICE, *decoded_name = NULL;
+    char tmpname[] = "/tmp/scp_dump_XXXXXX.dsk";
     struct footer ftr;
     uint8_t hwinfo[2];
     uint16_t app_name_len;
+    pthread_t writer;
     const static char app_name[] = "scp_dump (keirf)";
 
-    const static char sopts[] = "hqd:u:r:Rs:e:Dk:K:";
+    const static char sopts[] = "hqd:u:r:Rs:e:Dk:K:f:o:x:";
     const static struct option lopts[] = {
         { "help", 0, NULL, 'h' },
         { "quiet", 0, NULL, 'q' },
@@ -117,6 +385,9 @@ int main(int argc, char **argv)
         { "double-step", 0, NULL, 'D' },
         { "step-delay", 1, NULL, 'k' },
         { "settle-delay", 1, NULL, 'K' },
+        { "format", 1, NULL, 'f' },
+        { "decoded", 1, NULL, 'o' },
+        { "retries", 1, NULL, 'x' },
         { 0, 0, 0, 0 }
     };
 
@@ -165,6 +436,15 @@ int main(int argc, char **argv)
         case 'K':
             scp_params.seek_settle_delay_ms = atoi(optarg);
             break;
+        case 'f':
+            parse_formats(optarg);
+            break;
+        case 'o':
+            decoded_name = optarg;
+            break;
+        case 'x':
+            retries = atoi(optarg);
+            break;
         default:
             usage(1);
             break;
@@ -175,6 +455,7 @@ int main(int argc, char **argv)
         start_trk = default_tracknr(DEFAULT_STARTTRK);
     if (end_trk < 0)
         end_trk = default_tracknr(DEFAULT_ENDTRK);
+    decode_end_trk = default_tracknr(DECODE_ENDTRK);
 
     if (argc != (optind + 1))
         usage(1);
@@ -184,15 +465,32 @@ int main(int argc, char **argv)
         usage(1);
     }
 
-    if (nr_revs > ARRAY_SIZE(flux.info)) {
-        warnx("Too many revolutions specified (%u, max %u)",
-              nr_revs, (unsigned int)ARRAY_SIZE(flux.info));
+    if ((nr_revs < 1) || (nr_revs > ARRAY_SIZE(result[0].best->info))) {
+        warnx("Bad number of revolutions specified (%d, max %u)",
+              nr_revs, (unsigned int)ARRAY_SIZE(result[0].best->info));
+        usage(1);
+    }
+
+    if (decoded_name && !nr_formats) {
+        warnx("Decoded image requires track formats (-f)");
         usage(1);
     }
 
     if ((fd = file_open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
         err(1, "Error creating %s", argv[optind]);
 
+    if (nr_formats) {
+        if (decoded_name == NULL) {
+            int tmpfd = mkstemps(tmpname, 4);
+            if (tmpfd == -1)
+                err(1, "%s", tmpname);
+            close(tmpfd);
+        }
+        decoded = disk_create(decoded_name ?: tmpname, 0);
+        if (decoded == NULL)
+            errx(1, "Unable to create %s", decoded_name ?: tmpname);
+    }
+
     memset(&dhdr, 0, sizeof(dhdr));
     memcpy(dhdr.sig, "SCP", sizeof(dhdr.sig));
     dhdr.disk_type = DISKTYPE_amiga;
@@ -215,39 +513,58 @@ int main(int argc, char **argv)
     scp_selectdrive(scp, unit);
     scp_getinfo(scp, &hwinfo);
 
-    log("Reading track %7s", "");
-
-    sizeof_thdr = 4 + 12*nr_revs;
-    for (trk = start_trk; trk <= end_trk; trk++) {
-        log("\b\b\b\b\b\b\b%-4u...", trk);
-        fflush(stdout);
-
-        scp_seek_track(scp, trk, double_step);
-        scp_read_flux(scp, nr_revs, &flux);
-
-        th_offs[trk] = htole32(file_off);
+    for (i = 0; i < NR_CAPTURES; i++) {
+        struct capture *c = memalloc(sizeof(*c));
+        c->next = q.free;
+        q.free = c;
+    }
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0)
+        errx(1, "Failed to create writer thread");
+
+    if (!nr_formats)
+        log("Reading track %7s", "");
+
+    for (trk = start_trk; trk <= end_trk; trk++)
+        capture_track(scp, trk);
+
+    /* Re-read bad tracks while the disk is still in the drive. */
+    for (;;) {
+        capture_wait_idle();
+        for (trk = start_trk, nr_bad = 0;
+             (trk <= end_trk) && (trk <= decode_end_trk); trk++)
+            if (nr_formats && !result[trk].ok)
+                nr_bad++;
+        if (!nr_bad || (retries-- <= 0))
+            break;
+        log("Re-reading %d bad track%s\n", nr_bad, (nr_bad > 1) ? "s" : "");
+        for (trk = start_trk;
+             (trk <= end_trk) && (trk <= decode_end_trk); trk++)
+            if (!result[trk].ok)
+                capture_track(scp, trk);
+    }
 
-        memset(&thdr, 0, sizeof_thdr);
-        memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
-        thdr.tracknr = trk;
+    capture_finish();
+    pthread_join(writer, NULL);
 
-        dat_off = sizeof_thdr;
-        for (rev = 0; rev < nr_revs; rev++) {
-            thdr.rev[rev].duration = htole32(flux.info[rev].index_time);
-            thdr.rev[rev].nr_samples = htole32(flux.info[rev].nr_bitcells);
-            thdr.rev[rev].offset = htole32(dat_off);
-            dat_off += flux.info[rev].nr_bitcells * sizeof(uint16_t);
-        }
-        checksum_and_write(fd, &csum, &thdr, sizeof_thdr);
-        checksum_and_write(fd, &csum, flux.flux, dat_off - sizeof_thdr);
-        file_off += dat_off;
+    for (trk = start_trk; trk <= end_trk; trk++) {
+        memfree(result[trk].best);
+        result[trk].best = NULL;
     }
 
-    log("\n");
+    if (!nr_formats)
+        log("\n");
+    else if (nr_bad)
+        printf("%d bad track%s\n", nr_bad, (nr_bad > 1) ? "s" : "");
 
     scp_deselectdrive(scp, unit);
     scp_close(scp);
 
+    if (decoded != NULL) {
+        disk_close(decoded);
+        if (decoded_name == NULL)
+            unlink(tmpname);
+    }
+
     memset(&ftr, 0, sizeof(ftr));
     memcpy(ftr.sig, "FPCS", sizeof(ftr.sig));
     ftr.application_offset = htole32(lseek(fd, 0, SEEK_CUR));
@@ -271,3 +588,4 @@ int main(int argc, char **argv)
 
     return 0;
 }
+
@@ -0,0 +1,292 @@
+/*
+ * scp_sim.c
+ *
+ * Simulate Supercard Pro hardware on a pseudo-terminal, replaying the flux
+ * of an existing .scp image. Lets scp_dump be exercised without a drive.
+ */
+
+#define _GNU_SOURCE /* posix_openpt, ptsname */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include <libdisk/util.h>
+#include "scp.h"
+
+#define RAM_BYTES (512*1024)
+
+/* Ticks in one simulated revolution of noise (200ms at 25ns/tick). */
+#define NOISE_TICKS_PER_REV 8000000u
+
+static int verbose;
+static uint8_t *image;
+static off_t image_sz;
+static unsigned int image_revs;
+
+static uint16_t ram[RAM_BYTES/2];
+static struct {
+    uint32_t index_time, nr_bitcells;
+} flux_info[5];
+
+static unsigned int cyl, side;
+static uint8_t nr_reads[SCP_MAX_TRACKS], flaky[SCP_MAX_TRACKS];
+
+static void usage(int rc)
+{
+    printf("Usage: scp_sim [options] in_file\n");
+    printf("Options:\n");
+    printf("  -h, --help        Display this information\n");
+    printf("  -v, --verbose     Log each command received\n");
+    printf("  -f, --flaky=TRK[,TRK...]  Return noise on first read of "
+           "each listed track\n");
+
+    exit(rc);
+}
+
+static uint32_t image_le32(uint32_t off)
+{
+    uint32_t x;
+    if ((off + 4) > image_sz)
+        return 0;
+    memcpy(&x, &image[off], 4);
+    return le32toh(x);
+}
+
+/* Fill RAM with random flux, as from a damaged or unformatted track. */
+static int read_noise(unsigned int nr_revs)
+{
+    unsigned int rev, nr = 0;
+    uint32_t ticks;
+
+    for (rev = 0; rev < nr_revs; rev++) {
+        flux_info[rev].nr_bitcells = 0;
+        for (ticks = 0; ticks < NOISE_TICKS_PER_REV; ) {
+            uint16_t t = 80 + (rand() % 120);
+            if (nr == ARRAY_SIZE(ram))
+                return 11; /* ReadTooLong */
+            ram[nr++] = htobe16(t);
+            ticks += t;
+            flux_info[rev].nr_bitcells++;
+        }
+        flux_info[rev].index_time = ticks;
+    }
+
+    return 0;
+}
+
+/* Copy a track's revolutions from the image into RAM. Revolutions are
+ * replayed cyclically if the image holds fewer than requested. */
+static int read_flux(unsigned int tracknr, unsigned int nr_revs)
+{
+    unsigned int rev, nr = 0;
+    uint32_t thdr, rhdr, off, samples;
+
+    if ((nr_revs == 0) || (nr_revs > ARRAY_SIZE(flux_info)))
+        return 10; /* ZeroRevs */
+
+    memset(flux_info, 0, sizeof(flux_info));
+
+    if ((tracknr >= SCP_MAX_TRACKS)
+        || (flaky[tracknr] && !nr_reads[tracknr]++))
+        return read_noise(nr_revs);
+
+    thdr = image_le32(0x10 + tracknr*4);
+    if ((thdr == 0) || ((thdr + 4) > image_sz)
+        || memcmp(&image[thdr], "TRK", 3) || (image[thdr+3] != tracknr))
+        return read_noise(nr_revs);
+
+    for (rev = 0; rev < nr_revs; rev++) {
+        rhdr = thdr + 4 + (rev % image_revs) * 12;
+        samples = image_le32(rhdr + 4);
+        off = thdr + image_le32(rhdr + 8);
+        if ((off + samples*2) > image_sz)
+            return 13; /* BadData */
+        if ((nr + samples) > ARRAY_SIZE(ram))
+            return 11; /* ReadTooLong */
+        memcpy(&ram[nr], &image[off], samples*2);
+        nr += samples;
+        flux_info[rev].index_time = image_le32(rhdr);
+        flux_info[rev].nr_bitcells = samples;
+    }
+
+    return 0;
+}
+
+static void respond(int fd, uint8_t cmd, uint8_t rc)
+{
+    uint8_t buf[2] = { cmd, rc ?: 0x4f };
+    write_exact(fd, buf, 2);
+}
+
+static void serve(int fd)
+{
+    uint8_t buf[258], csum, rc;
+    unsigned int i, len;
+    uint32_t ramcmd[2];
+
+    for (;;) {
+        read_exact(fd, buf, 2);
+        len = buf[1];
+        read_exact(fd, &buf[2], len + 1);
+        for (i = 0, csum = 0x4a; i < len + 2; i++)
+            csum += buf[i];
+
+        if (verbose)
+            printf("%02x (%s), %u bytes\n", buf[0], scp_cmdstr(buf[0]), len);
+
+        if (csum != buf[len+2]) {
+            respond(fd, buf[0], 3); /* Checksum */
+            continue;
+        }
+
+        rc = 0;
+        switch (buf[0]) {
+        case SCPCMD_SCPINFO: {
+            uint8_t info[2] = { 0x10, 0x13 };
+            respond(fd, buf[0], 0);
+            write_exact(fd, info, 2);
+            continue;
+        }
+        case SCPCMD_SEEK0:
+            cyl = 0;
+            break;
+        case SCPCMD_STEPTO:
+            if (len != 1)
+                rc = 12; /* BadLength */
+            else
+                cyl = buf[2];
+            break;
+        case SCPCMD_SIDE:
+            if (len != 1)
+                rc = 12; /* BadLength */
+            else
+                side = buf[2] & 1;
+            break;
+        case SCPCMD_READFLUX:
+            rc = (len != 2) ? 12 : read_flux(cyl*2 + side, buf[2]);
+            if (verbose && !rc)
+                printf(" track %u, %u revs\n", cyl*2 + side, buf[2]);
+            break;
+        case SCPCMD_GETFLUXINFO: {
+            uint32_t info[2*ARRAY_SIZE(flux_info)];
+            for (i = 0; i < ARRAY_SIZE(flux_info); i++) {
+                info[2*i] = htobe32(flux_info[i].index_time);
+                info[2*i+1] = htobe32(flux_info[i].nr_bitcells);
+            }
+            respond(fd, buf[0], 0);
+            write_exact(fd, info, sizeof(info));
+            continue;
+        }
+        case SCPCMD_SENDRAM_USB:
+            /* The host always reads the full RAM, then the response. */
+            write_exact(fd, ram, sizeof(ram));
+            break;
+        case SCPCMD_LOADRAM_USB:
+            if (len != 8) {
+                rc = 12; /* BadLength */
+                break;
+            }
+            memcpy(ramcmd, &buf[2], 8);
+            ramcmd[0] = be32toh(ramcmd[0]);
+            ramcmd[1] = be32toh(ramcmd[1]);
+            if ((ramcmd[0] + ramcmd[1]) > sizeof(ram))
+                errx(1, "LOADRAM out of range (%u+%u)",
+                     ramcmd[0], ramcmd[1]);
+            read_exact(fd, (uint8_t *)ram + ramcmd[0], ramcmd[1]);
+            break;
+        default:
+            /* Drive select, motor, parameters, etc: nothing to simulate. */
+            break;
+        }
+
+        respond(fd, buf[0], rc);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct termios tio;
+    struct disk_header dhdr;
+    int ch, fd, mfd, sfd;
+    char *p;
+
+    const static char sopts[] = "hvf:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "verbose", 0, NULL, 'v' },
+        { "flaky", 1, NULL, 'f' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'f':
+            for (p = strtok(optarg, ","); p; p = strtok(NULL, ",")) {
+                unsigned int trk = atoi(p);
+                if (trk >= SCP_MAX_TRACKS)
+                    errx(1, "Bad track number '%s'", p);
+                flaky[trk] = 1;
+            }
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (argc != (optind + 1))
+        usage(1);
+
+    if ((fd = file_open(argv[optind], O_RDONLY)) == -1)
+        err(1, "%s", argv[optind]);
+    if ((image_sz = lseek(fd, 0, SEEK_END)) < sizeof(dhdr) + 4*SCP_MAX_TRACKS)
+        errx(1, "%s is too short", argv[optind]);
+    image = memalloc(image_sz);
+    lseek(fd, 0, SEEK_SET);
+    read_exact(fd, image, image_sz);
+    close(fd);
+
+    memcpy(&dhdr, image, sizeof(dhdr));
+    if (memcmp(dhdr.sig, "SCP", 3))
+        errx(1, "%s is not a SCP file", argv[optind]);
+    if ((image_revs = dhdr.nr_revolutions) == 0)
+        errx(1, "%s has no revolutions", argv[optind]);
+    if (image_revs > ARRAY_SIZE(flux_info))
+        image_revs = ARRAY_SIZE(flux_info);
+
+    if (((mfd = posix_openpt(O_RDWR | O_NOCTTY)) == -1)
+        || grantpt(mfd) || unlockpt(mfd) || ((p = ptsname(mfd)) == NULL))
+        err(1, "Unable to create pseudo-terminal");
+
+    /* Hold the slave open ourselves, in raw mode, so that the master stays
+     * usable while no host is connected. */
+    if ((sfd = open(p, O_RDWR | O_NOCTTY)) == -1)
+        err(1, "%s", p);
+    if (tcgetattr(sfd, &tio))
+        err(1, "%s", p);
+    cfmakeraw(&tio);
+    if (tcsetattr(sfd, TCSANOW, &tio))
+        err(1, "%s", p);
+
+    printf("%s\n", p);
+    fflush(stdout);
+
+    serve(mfd);
+
+    return 0;
+}